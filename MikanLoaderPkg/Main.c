@@ -9,6 +9,7 @@
 #include <Protocol/DiskIo2.h>
 #include <Protocol/BlockIo.h>
 #include <Guid/FileInfo.h>
+#include <Guid/Acpi.h>
 #include "frame_buffer_config.hpp"
 #include "memory_map.hpp"
 #include "elf.hpp"
@@ -369,6 +370,22 @@ EFI_STATUS EFIAPI UefiMain(
         Halt();
     }
 
+    VOID *acpi_table = NULL;
+    for (UINTN i = 0; i < system_table->NumberOfTableEntries; ++i)
+    {
+        if (CompareGuid(&gEfiAcpiTableGuid,
+                        &system_table->ConfigurationTable[i].VendorGuid))
+        {
+            acpi_table = system_table->ConfigurationTable[i].VendorTable;
+            break;
+        }
+    }
+    if (acpi_table == NULL)
+    {
+        Print(L"ACPI 2.0 table not found\n");
+        Halt();
+    }
+
     status = gBS->ExitBootServices(image_handle, memmap.map_key);
     if (EFI_ERROR(status))
     {
@@ -408,9 +425,10 @@ EFI_STATUS EFIAPI UefiMain(
     }
 
     typedef void EntryPointType(const struct FrameBufferConfig *,
-                                const struct MemoryMap *);
+                                const struct MemoryMap *,
+                                const VOID *);
     EntryPointType *entry_point = (EntryPointType *)entry_addr;
-    entry_point(&config, &memmap);
+    entry_point(&config, &memmap, acpi_table);
 
     Print(L"All done\n");
 
@@ -0,0 +1,315 @@
+/**
+ * @file acpi.cpp
+ *
+ * ACPI テーブル定義や操作用プログラムを集めたファイル．
+ */
+
+#include "acpi.hpp"
+
+#include <cstddef>
+#include <cstring>
+
+#include "asmfunc.h"
+#include "logger.hpp"
+
+namespace
+{
+    template <typename T>
+    uint8_t SumBytes(const T *data, size_t bytes)
+    {
+        return SumBytes(reinterpret_cast<const uint8_t *>(data), bytes);
+    }
+
+    template <>
+    uint8_t SumBytes<uint8_t>(const uint8_t *data, size_t bytes)
+    {
+        uint8_t sum = 0;
+        for (size_t i = 0; i < bytes; ++i)
+        {
+            sum += data[i];
+        }
+        return sum;
+    }
+
+    static_assert(offsetof(acpi::FADT, pm_tmr_blk) == 76);
+    static_assert(offsetof(acpi::FADT, flags) == 112);
+    static_assert(offsetof(acpi::FADT, x_pm_tmr_blk) == 208);
+
+    /** @brief Interrupt Controller Structure の種別 */
+    enum MADTEntryType : uint8_t
+    {
+        kProcessorLocalAPIC = 0,
+        kIOAPIC = 1,
+        kInterruptSourceOverride = 2,
+    };
+
+    /** @brief MADT の Processor Local APIC Structure */
+    struct MADTLocalAPIC
+    {
+        uint8_t type;
+        uint8_t length;
+        uint8_t processor_uid;
+        uint8_t apic_id;
+        uint32_t flags; // bit 0: Enabled, bit 1: Online Capable
+    } __attribute__((packed));
+
+    /** @brief MADT の I/O APIC Structure */
+    struct MADTIOAPIC
+    {
+        uint8_t type;
+        uint8_t length;
+        uint8_t io_apic_id;
+        uint8_t reserved;
+        uint32_t io_apic_address;
+        uint32_t gsi_base;
+    } __attribute__((packed));
+
+    /** @brief MADT の Interrupt Source Override Structure */
+    struct MADTInterruptSourceOverride
+    {
+        uint8_t type;
+        uint8_t length;
+        uint8_t bus; // 常に 0 (ISA)
+        uint8_t source;
+        uint32_t gsi;
+        uint16_t flags;
+    } __attribute__((packed));
+
+    void ParseMADT(const acpi::MADT &madt)
+    {
+        acpi::num_local_apic = 0;
+        acpi::num_io_apic = 0;
+        acpi::num_interrupt_override = 0;
+
+        auto p = reinterpret_cast<const uint8_t *>(&madt) + sizeof(acpi::MADT);
+        const auto end = reinterpret_cast<const uint8_t *>(&madt) + madt.header.length;
+        while (p + 2 <= end && p[1] >= 2)
+        {
+            if (p[0] == kProcessorLocalAPIC)
+            {
+                auto lapic = reinterpret_cast<const MADTLocalAPIC *>(p);
+                if ((lapic->flags & 1u) &&
+                    acpi::num_local_apic < static_cast<int>(acpi::local_apics.size()))
+                {
+                    acpi::local_apics[acpi::num_local_apic] =
+                        acpi::LocalAPICInfo{lapic->processor_uid, lapic->apic_id};
+                    ++acpi::num_local_apic;
+                }
+            }
+            else if (p[0] == kIOAPIC)
+            {
+                auto ioapic = reinterpret_cast<const MADTIOAPIC *>(p);
+                if (acpi::num_io_apic < static_cast<int>(acpi::io_apics.size()))
+                {
+                    acpi::io_apics[acpi::num_io_apic] = acpi::IOAPICInfo{
+                        ioapic->io_apic_id, ioapic->io_apic_address, ioapic->gsi_base};
+                    ++acpi::num_io_apic;
+                }
+            }
+            else if (p[0] == kInterruptSourceOverride)
+            {
+                auto iso = reinterpret_cast<const MADTInterruptSourceOverride *>(p);
+                if (acpi::num_interrupt_override < static_cast<int>(acpi::interrupt_overrides.size()))
+                {
+                    acpi::interrupt_overrides[acpi::num_interrupt_override] =
+                        acpi::InterruptOverride{iso->source, iso->gsi, iso->flags};
+                    ++acpi::num_interrupt_override;
+                }
+            }
+            p += p[1];
+        }
+    }
+
+    void ParseMCFG(const acpi::MCFG &mcfg)
+    {
+        acpi::num_ecam_region = 0;
+
+        auto alloc = reinterpret_cast<const acpi::MCFGAllocation *>(&mcfg + 1);
+        const size_t count = (mcfg.header.length - sizeof(acpi::MCFG)) /
+                             sizeof(acpi::MCFGAllocation);
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (acpi::num_ecam_region == static_cast<int>(acpi::ecam_regions.size()))
+            {
+                Log(kWarn, "too many ECAM regions in MCFG\n");
+                break;
+            }
+            acpi::ecam_regions[acpi::num_ecam_region] = acpi::ECAMRegion{
+                alloc[i].base_address, alloc[i].segment_group,
+                alloc[i].start_bus, alloc[i].end_bus};
+            ++acpi::num_ecam_region;
+        }
+    }
+
+    /** @brief PM タイマの I/O ポート．使えなければ 0． */
+    uint16_t pm_timer_port = 0;
+    /** @brief PM タイマのカウンタが 32 ビットなら true，24 ビットなら false */
+    bool pm_timer_32bit = false;
+
+    void SetupPMTimer(const acpi::FADT &fadt)
+    {
+        pm_timer_port = fadt.pm_tmr_blk;
+        if (fadt.header.length >= offsetof(acpi::FADT, x_pm_tmr_blk) + sizeof(acpi::GenericAddress) &&
+            fadt.x_pm_tmr_blk.address_space_id == 1 /* System I/O */ &&
+            fadt.x_pm_tmr_blk.address != 0)
+        {
+            pm_timer_port = fadt.x_pm_tmr_blk.address;
+        }
+        pm_timer_32bit = (fadt.flags >> 8) & 1;
+    }
+
+    template <typename T>
+    const T *FindTable(const acpi::XSDT &xsdt, const char *signature)
+    {
+        for (size_t i = 0; i < xsdt.Count(); ++i)
+        {
+            const auto &entry = xsdt[i];
+            if (strncmp(entry.signature, signature, 4) == 0 && entry.IsValid(signature))
+            {
+                return reinterpret_cast<const T *>(&entry);
+            }
+        }
+        return nullptr;
+    }
+}
+
+namespace acpi
+{
+    bool RSDP::IsValid() const
+    {
+        if (strncmp(this->signature, "RSD PTR ", 8) != 0)
+        {
+            Log(kDebug, "invalid signature: %.8s\n", this->signature);
+            return false;
+        }
+        if (this->revision != 2)
+        {
+            Log(kDebug, "ACPI revision must be 2: %d\n", this->revision);
+            return false;
+        }
+        if (auto sum = SumBytes(this, 20); sum != 0)
+        {
+            Log(kDebug, "sum of 20 bytes must be 0: %d\n", sum);
+            return false;
+        }
+        if (auto sum = SumBytes(this, 36); sum != 0)
+        {
+            Log(kDebug, "sum of 36 bytes must be 0: %d\n", sum);
+            return false;
+        }
+        return true;
+    }
+
+    bool DescriptionHeader::IsValid(const char *expected_signature) const
+    {
+        if (strncmp(this->signature, expected_signature, 4) != 0)
+        {
+            Log(kDebug, "invalid signature: %.4s\n", this->signature);
+            return false;
+        }
+        if (auto sum = SumBytes(this, this->length); sum != 0)
+        {
+            Log(kDebug, "sum of %u bytes must be 0: %d\n", this->length, sum);
+            return false;
+        }
+        return true;
+    }
+
+    const DescriptionHeader &XSDT::operator[](size_t i) const
+    {
+        auto entries = reinterpret_cast<const uint64_t *>(&this->header + 1);
+        return *reinterpret_cast<const DescriptionHeader *>(entries[i]);
+    }
+
+    size_t XSDT::Count() const
+    {
+        return (this->header.length - sizeof(DescriptionHeader)) / sizeof(uint64_t);
+    }
+
+    bool HasPMTimer()
+    {
+        return pm_timer_port != 0;
+    }
+
+    uint32_t ReadPMTimer()
+    {
+        return IoIn32(pm_timer_port);
+    }
+
+    uint32_t PMTimerDelta(uint32_t start, uint32_t end)
+    {
+        const uint32_t mask = pm_timer_32bit ? 0xffffffffu : 0x00ffffffu;
+        return (end - start) & mask;
+    }
+
+    void WaitMilliseconds(unsigned long msec)
+    {
+        const uint32_t start = ReadPMTimer();
+        uint64_t remaining = static_cast<uint64_t>(kPMTimerFrequency) * msec / 1000;
+
+        // カウンタは 24/32 ビットで折り返すので，差分を積算して待つ
+        uint32_t prev = start;
+        while (remaining > 0)
+        {
+            const uint32_t now = ReadPMTimer();
+            const uint32_t delta = PMTimerDelta(prev, now);
+            prev = now;
+            remaining = delta < remaining ? remaining - delta : 0;
+        }
+    }
+
+    bool Initialize(const RSDP &rsdp)
+    {
+        if (!rsdp.IsValid())
+        {
+            Log(kError, "RSDP is not valid\n");
+            return false;
+        }
+
+        const XSDT &xsdt = *reinterpret_cast<const XSDT *>(rsdp.xsdt_address);
+        if (!xsdt.header.IsValid("XSDT"))
+        {
+            Log(kError, "XSDT is not valid\n");
+            return false;
+        }
+
+        if (auto madt = FindTable<MADT>(xsdt, "APIC"))
+        {
+            ParseMADT(*madt);
+        }
+        else
+        {
+            Log(kWarn, "MADT not found\n");
+        }
+
+        if (auto mcfg = FindTable<MCFG>(xsdt, "MCFG"))
+        {
+            ParseMCFG(*mcfg);
+        }
+
+        fadt = FindTable<FADT>(xsdt, "FACP");
+        if (fadt)
+        {
+            SetupPMTimer(*fadt);
+        }
+
+        hpet = FindTable<HPET>(xsdt, "HPET");
+
+        Log(kDebug, "MADT: %d local APIC(s), %d I/O APIC(s), %d override(s)\n",
+            num_local_apic, num_io_apic, num_interrupt_override);
+        for (int i = 0; i < num_ecam_region; ++i)
+        {
+            const auto &r = ecam_regions[i];
+            Log(kDebug, "MCFG: segment %u bus %u-%u at %016lx\n",
+                r.segment_group, r.start_bus, r.end_bus, r.base_address);
+        }
+        Log(kDebug, "FADT: PM timer port %04x (%d bit)\n",
+            pm_timer_port, pm_timer_32bit ? 32 : 24);
+        if (hpet)
+        {
+            Log(kDebug, "HPET: base %016lx, min tick %u\n",
+                hpet->base_address.address, hpet->minimum_clock_tick);
+        }
+        return true;
+    }
+}
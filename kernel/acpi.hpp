@@ -0,0 +1,198 @@
+/**
+ * @file acpi.hpp
+ *
+ * ACPI テーブル定義や操作用プログラムを集めたファイル．
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace acpi
+{
+    /** @brief Root System Description Pointer */
+    struct RSDP
+    {
+        char signature[8];
+        uint8_t checksum;
+        char oem_id[6];
+        uint8_t revision;
+        uint32_t rsdt_address;
+        uint32_t length;
+        uint64_t xsdt_address;
+        uint8_t extended_checksum;
+        char reserved[3];
+
+        bool IsValid() const;
+    } __attribute__((packed));
+
+    /** @brief 各 System Description Table に共通のヘッダ */
+    struct DescriptionHeader
+    {
+        char signature[4];
+        uint32_t length;
+        uint8_t revision;
+        uint8_t checksum;
+        char oem_id[6];
+        char oem_table_id[8];
+        uint32_t oem_revision;
+        uint32_t creator_id;
+        uint32_t creator_revision;
+
+        bool IsValid(const char *expected_signature) const;
+    } __attribute__((packed));
+
+    /** @brief Extended System Description Table */
+    struct XSDT
+    {
+        DescriptionHeader header;
+
+        const DescriptionHeader &operator[](size_t i) const;
+        size_t Count() const;
+    } __attribute__((packed));
+
+    /** @brief Multiple APIC Description Table
+     *
+     * ヘッダの後ろに可変長の Interrupt Controller Structure が続く．
+     */
+    struct MADT
+    {
+        DescriptionHeader header;
+        uint32_t lapic_address;
+        uint32_t flags;
+    } __attribute__((packed));
+
+    /** @brief Generic Address Structure */
+    struct GenericAddress
+    {
+        uint8_t address_space_id; // 0: System Memory, 1: System I/O
+        uint8_t register_bit_width;
+        uint8_t register_bit_offset;
+        uint8_t access_size;
+        uint64_t address;
+    } __attribute__((packed));
+
+    /** @brief Fixed ACPI Description Table
+     *
+     * 使わないフィールドは予約領域としてまとめている．
+     */
+    struct FADT
+    {
+        DescriptionHeader header;
+
+        char reserved1[76 - sizeof(header)];
+        uint32_t pm_tmr_blk;
+        char reserved2[112 - 80];
+        uint32_t flags; // bit 8: TMR_VAL_EXT（PM タイマが 32 ビット）
+        char reserved3[208 - 116];
+        GenericAddress x_pm_tmr_blk; // ACPI 2.0 以降
+    } __attribute__((packed));
+
+    /** @brief PCI Express Memory Mapped Configuration Space Base Address Description Table
+     *
+     * ヘッダの後ろに MCFGAllocation の配列が続く．
+     */
+    struct MCFG
+    {
+        DescriptionHeader header;
+        uint64_t reserved;
+    } __attribute__((packed));
+
+    /** @brief MCFG の Configuration Space Base Address Allocation Structure */
+    struct MCFGAllocation
+    {
+        uint64_t base_address;
+        uint16_t segment_group;
+        uint8_t start_bus;
+        uint8_t end_bus;
+        uint32_t reserved;
+    } __attribute__((packed));
+
+    /** @brief IA-PC High Precision Event Timer Table */
+    struct HPET
+    {
+        DescriptionHeader header;
+        uint32_t event_timer_block_id;
+        GenericAddress base_address;
+        uint8_t hpet_number;
+        uint16_t minimum_clock_tick;
+        uint8_t page_protection;
+    } __attribute__((packed));
+
+    /** @brief MADT から取り出した Local APIC の情報 */
+    struct LocalAPICInfo
+    {
+        uint8_t processor_uid;
+        uint8_t apic_id;
+    };
+
+    /** @brief MADT に記載された有効な Local APIC の一覧 */
+    inline std::array<LocalAPICInfo, 64> local_apics;
+    /** @brief local_apics の有効な要素の数 */
+    inline int num_local_apic;
+
+    /** @brief MADT から取り出した I/O APIC の情報 */
+    struct IOAPICInfo
+    {
+        uint8_t apic_id;
+        uint32_t address;  // MMIO レジスタのベースアドレス
+        uint32_t gsi_base; // 最初の入力ピンに対応する Global System Interrupt 番号
+    };
+
+    inline std::array<IOAPICInfo, 8> io_apics;
+    inline int num_io_apic;
+
+    /** @brief MADT の Interrupt Source Override（ISA IRQ から GSI への付け替え） */
+    struct InterruptOverride
+    {
+        uint8_t source;  // ISA IRQ 番号
+        uint32_t gsi;
+        uint16_t flags;  // bit 0-1: 極性，bit 2-3: トリガモード
+    };
+
+    inline std::array<InterruptOverride, 16> interrupt_overrides;
+    inline int num_interrupt_override;
+
+    /** @brief MCFG から取り出した ECAM 領域 */
+    struct ECAMRegion
+    {
+        uint64_t base_address; // バス 0 に対応するアドレス
+        uint16_t segment_group;
+        uint8_t start_bus;
+        uint8_t end_bus;
+    };
+
+    inline std::array<ECAMRegion, 8> ecam_regions;
+    inline int num_ecam_region;
+
+    /** @brief 見つかった FADT．無ければ nullptr． */
+    inline const FADT *fadt;
+    /** @brief 見つかった HPET テーブル．無ければ nullptr． */
+    inline const HPET *hpet;
+
+    /** @brief ACPI PM タイマの周波数 (Hz) */
+    const uint32_t kPMTimerFrequency = 3579545;
+
+    /** @brief ACPI PM タイマが使えるか */
+    bool HasPMTimer();
+
+    /** @brief ACPI PM タイマのカウンタを読む．HasPMTimer() のときだけ使える． */
+    uint32_t ReadPMTimer();
+
+    /** @brief ReadPMTimer() で得た 2 つの値の差を，カウンタの折り返しを考慮して求める */
+    uint32_t PMTimerDelta(uint32_t start, uint32_t end);
+
+    /** @brief ACPI PM タイマで指定時間だけビジーウェイトする．HasPMTimer() のときだけ使える． */
+    void WaitMilliseconds(unsigned long msec);
+
+    /** @brief ACPI テーブルを読み込み，必要な情報を取り出す
+     *
+     * MADT，MCFG，FADT，HPET はチェックサムを検証したうえで解析する．
+     * いずれかが見つからなくても失敗にはしない．
+     *
+     * @return RSDP や XSDT が不正なら false
+     */
+    bool Initialize(const RSDP &rsdp);
+}
@@ -36,3 +36,220 @@ LoadIDT:
     mov rsp, rbp
     pop rbp
     ret
+
+global IoOut8 ; void IoOut8(uint16_t addr, uint8_t data)
+IoOut8:
+    mov dx, di ; dx = addr
+    mov al, sil ; al = data
+    out dx, al
+    ret
+
+global IoIn8 ; uint8_t IoIn8(uint16_t addr)
+IoIn8:
+    mov dx, di ; dx = addr
+    xor eax, eax
+    in al, dx
+    ret
+
+global GetSS  ; uint16_t GetSS(void);
+GetSS:
+    xor eax, eax
+    mov ax, ss
+    ret
+
+global GetCR0 ; uint64_t GetCR0(void);
+GetCR0:
+    mov rax, cr0
+    ret
+
+global SetCR0 ; void SetCR0(uint64_t value);
+SetCR0:
+    mov cr0, rdi
+    ret
+
+global GetCR3 ; uint64_t GetCR3(void);
+GetCR3:
+    mov rax, cr3
+    ret
+
+global SetCR3 ; void SetCR3(uint64_t value);
+SetCR3:
+    mov cr3, rdi
+    ret
+
+global GetCR4 ; uint64_t GetCR4(void);
+GetCR4:
+    mov rax, cr4
+    ret
+
+global ReadMSR ; uint64_t ReadMSR(uint32_t msr);
+ReadMSR:
+    mov ecx, edi
+    rdmsr
+    shl rdx, 32
+    or rax, rdx
+    ret
+
+global WriteMSR ; void WriteMSR(uint32_t msr, uint64_t value);
+WriteMSR:
+    mov ecx, edi
+    mov eax, esi
+    mov rdx, rsi
+    shr rdx, 32
+    wrmsr
+    ret
+
+global StoreGDTR ; void StoreGDTR(void* buf);  buf: 10 bytes
+StoreGDTR:
+    sgdt [rdi]
+    ret
+
+; Application Processor 起動用トランポリン．
+;
+; BSP が 1MiB 未満の 4KiB 境界にコピーし，そのページ番号を SIPI で通知する．
+; リアルモードで開始し，プロテクトモードを経由してロングモードへ移行した後，
+; BSP と同じ GDT，ページテーブル，セグメントに切り替えて ApTrampolineParams
+; の entry を呼ぶ．ApTrampolineParams のレイアウトは smp.cpp の
+; APBootParams と一致させること．
+AP_PARAMS equ ap_params - ApTrampolineStart
+
+align 16
+global ApTrampolineStart
+global ApTrampolineEnd
+global ApTrampolineParams
+bits 16
+ApTrampolineStart:
+    cli
+    mov ax, cs
+    mov ds, ax
+    xor ebx, ebx
+    mov bx, ax
+    shl ebx, 4      ; ebx = トランポリンの物理アドレス
+
+    ; 配置先に合わせて GDTR とジャンプ先を書き換える
+    lea eax, [ebx + ap_gdt - ApTrampolineStart]
+    mov [ap_gdtr - ApTrampolineStart + 2], eax
+    lea eax, [ebx + ap_pm32 - ApTrampolineStart]
+    mov [ap_pm32_ptr - ApTrampolineStart], eax
+    lea eax, [ebx + ap_lm64 - ApTrampolineStart]
+    mov [ap_lm64_ptr - ApTrampolineStart], eax
+
+    lgdt [ap_gdtr - ApTrampolineStart]
+    mov eax, cr0
+    or eax, 1       ; PE
+    mov cr0, eax
+    jmp far dword [ap_pm32_ptr - ApTrampolineStart]
+
+bits 32
+ap_pm32:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    mov eax, [ebx + AP_PARAMS + 16] ; cr4
+    and eax, ~(1 << 17)             ; PCIDE は IA-32e モード移行後でないと立てられない
+    or eax, 1 << 5                  ; PAE
+    mov cr4, eax
+    mov eax, [ebx + AP_PARAMS + 70] ; boot_cr3（1MiB 未満に複製した PML4）
+    mov cr3, eax
+
+    mov ecx, 0xc0000080             ; IA32_EFER
+    mov eax, [ebx + AP_PARAMS + 24]
+    and eax, ~(1 << 10)             ; LMA は読み出し専用
+    or eax, 1 << 8                  ; LME
+    xor edx, edx
+    wrmsr
+
+    mov eax, [ebx + AP_PARAMS + 0]  ; cr0 (PG を含む)
+    mov cr0, eax
+    jmp far [ebx + ap_lm64_ptr - ApTrampolineStart]
+
+bits 64
+ap_lm64:
+    mov ebx, ebx                    ; 上位 32 ビットをクリア
+    mov rax, [rbx + AP_PARAMS + 8]  ; cr3（4GiB 以上でもよい）
+    mov cr3, rax
+    lgdt [rbx + AP_PARAMS + 60]
+    mov ax, [rbx + AP_PARAMS + 58]  ; kernel_ss
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+    mov rsp, [rbx + AP_PARAMS + 32] ; stack_top
+
+    movzx rax, word [rbx + AP_PARAMS + 56] ; kernel_cs
+    push rax
+    lea rax, [rel ap_lm64_kernel_cs]
+    push rax
+    o64 retf
+ap_lm64_kernel_cs:
+    mov ecx, 0xc0000101             ; IA32_GS_BASE
+    mov rax, [rbx + AP_PARAMS + 40] ; per_cpu
+    mov rdx, rax
+    shr rdx, 32
+    wrmsr
+
+    mov rdi, [rbx + AP_PARAMS + 40] ; per_cpu
+    mov rax, [rbx + AP_PARAMS + 48] ; entry
+    call rax
+.halt:
+    hlt
+    jmp .halt
+
+align 8
+ap_gdt:
+    dq 0x0000000000000000 ; null
+    dq 0x00cf9a000000ffff ; 0x08: 32 ビットコード
+    dq 0x00cf92000000ffff ; 0x10: データ
+    dq 0x00209a0000000000 ; 0x18: 64 ビットコード
+ap_gdtr:
+    dw 4 * 8 - 1
+    dd 0
+ap_pm32_ptr:
+    dd 0
+    dw 0x08
+ap_lm64_ptr:
+    dd 0
+    dw 0x18
+
+align 8
+ApTrampolineParams:
+ap_params:
+    times 74 db 0
+ApTrampolineEnd:
+
+bits 64
+section .text
+global SwitchContext ; void SwitchContext(uint64_t* current_rsp, uint64_t next_rsp);
+SwitchContext:
+    ; System V ABI の callee-saved レジスタだけを退避する．
+    ; caller-saved レジスタと SSE レジスタは呼び出し側（通常の関数呼び出し
+    ; または割り込みハンドラのプロローグ）が退避済み．
+    push rbx
+    push rbp
+    push r12
+    push r13
+    push r14
+    push r15
+    mov [rdi], rsp
+    mov rsp, rsi
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbp
+    pop rbx
+    ret
+
+global ThreadEntry ; 新規スレッドが最初に SwitchContext から ret してくる先
+ThreadEntry:
+    ; r12 = エントリ関数，r13 = 引数，r14 = 終了時に呼ぶ関数
+    sti
+    mov rdi, r13
+    call r12
+    call r14
+.halt:
+    hlt
+    jmp .halt
@@ -6,6 +6,26 @@ extern "C"
     // IO access functions defined in asmfunc.asm
     void IoOut32(uint16_t addr, uint32_t data);
     uint32_t IoIn32(uint16_t addr);
+    void IoOut8(uint16_t addr, uint8_t data);
+    uint8_t IoIn8(uint16_t addr);
     uint16_t GetCS(void);
+    uint16_t GetSS(void);
     void LoadIDT(uint16_t limit, uint64_t offset);
-}
\ No newline at end of file
+    void StoreGDTR(void *buf);
+    uint64_t GetCR0(void);
+    void SetCR0(uint64_t value);
+    uint64_t GetCR3(void);
+    void SetCR3(uint64_t value);
+    uint64_t GetCR4(void);
+    uint64_t ReadMSR(uint32_t msr);
+    void WriteMSR(uint32_t msr, uint64_t value);
+
+    // kernel thread context switch defined in asmfunc.asm
+    void SwitchContext(uint64_t *current_rsp, uint64_t next_rsp);
+    void ThreadEntry(void);
+
+    // AP startup trampoline defined in asmfunc.asm
+    extern const uint8_t ApTrampolineStart[];
+    extern const uint8_t ApTrampolineEnd[];
+    extern const uint8_t ApTrampolineParams[];
+}
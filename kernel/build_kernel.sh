@@ -1,5 +1,5 @@
 #!/bin/bash
 
-clang++ $CPPFLAGS -O2 -g -Wall --target=x86_64-elf -ffreestanding -mno-red-zone -fno-exceptions -fno-rtti -std=c++17 -c main.cpp
+clang++ $CPPFLAGS -O2 -g -Wall --target=x86_64-elf -ffreestanding -mno-red-zone -fno-exceptions -fno-rtti -std=c++20 -c main.cpp
 
 ld.lld $LDFLAGS --entry KernelMain -z norelro --image-base 0x100000 --static -o kernel.elf main.o
@@ -8,6 +8,7 @@ Console::Console(PixelWriter &writer, const PixelColor &fg_color, const PixelCol
 
 void Console::PutString(const char *string)
 {
+    IRQSaveLockGuard guard{lock_};
     while (*string)
     {
         if (*string == '\n')
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "graphics.hpp"
+#include "lock.hpp"
 
 class Console
 {
@@ -17,4 +18,5 @@ private:
     const PixelColor fg_color_, bg_color_;
     char buf[kRows][kColumns + 1];
     int cursor_row_, cursor_column_;
+    SpinLock lock_;
 };
\ No newline at end of file
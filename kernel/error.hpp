@@ -29,6 +29,9 @@ public:
         kUnknownXHCISpeedID,
         kNoWaiter,
         kNoPCIMSI,
+        kCommandFailed,
+        kUnknownCommand,
+        kTimeout,
         kLastOfCode, // この列挙子は常に最後に配置する
     };
 
@@ -55,6 +58,9 @@ private:
         "kUnknownXHCISpeedID",
         "kNoWaiter",
         "kNoPCIMSI",
+        "kCommandFailed",
+        "kUnknownCommand",
+        "kTimeout",
     };
     static_assert(Error::Code::kLastOfCode == code_names_.size());
 
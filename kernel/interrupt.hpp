@@ -73,6 +73,10 @@ class InterruptVector {
  public:
   enum Number {
     kXHCI = 0x40,
+    kLAPICTimer = 0x41,
+    kTaskWakeup = 0x42,
+    kXHCIInterrupter = 0x43,
+    kTLBShootdown = 0x44,
   };
 };
 // #@@range_end(vector_numbers)
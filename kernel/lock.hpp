@@ -0,0 +1,321 @@
+/**
+ * @file lock.hpp
+ *
+ * マルチプロセッサ用の排他制御プリミティブ．
+ *
+ * - SpinLock   : test-and-test-and-set スピンロック．非競合時に最も軽い．
+ * - TicketLock : 到着順（FIFO）を保証するスピンロック．
+ * - MCSLock    : 待ち手が各自のノードをスピンするキューロック．
+ *                競合が多くてもキャッシュラインの取り合いが起きにくい．
+ *
+ * いずれも割り込みハンドラと共有するデータ向けに，RFLAGS.IF を保存して
+ * 割り込みを禁止する IRQSave 版を持つ．
+ * EnableStats() で LockStats を登録すると，保持中に統計を更新する．
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+/** @brief RFLAGS を保存して割り込みを禁止する */
+inline uint64_t SaveAndDisableInterrupts()
+{
+    uint64_t rflags;
+    __asm__ volatile("pushfq\n\tpop %0\n\tcli"
+                     : "=r"(rflags)
+                     :
+                     : "memory");
+    return rflags;
+}
+
+/** @brief SaveAndDisableInterrupts() で保存した割り込み許可状態に戻す */
+inline void RestoreInterrupts(uint64_t rflags)
+{
+    if (rflags & (1u << 9)) // IF
+    {
+        __asm__ volatile("sti" ::
+                             : "memory");
+    }
+}
+
+inline void CPURelax()
+{
+    __asm__ volatile("pause" ::
+                         : "memory");
+}
+
+/** @brief ロックの競合統計．更新はロック保持中に行うため排他は不要． */
+struct LockStats
+{
+    uint64_t acquisitions;   // 獲得回数
+    uint64_t contended;      // 獲得時に待たされた回数
+    uint64_t spins;          // 待ちループの累積回数
+    uint64_t max_hold_ticks; // 最長保持時間（TSC）
+    uint64_t hold_start;     // 現在の保持開始時刻（TSC）
+};
+
+namespace lock_detail
+{
+    inline void OnAcquired(LockStats *stats, uint64_t spins)
+    {
+        if (stats == nullptr)
+        {
+            return;
+        }
+        ++stats->acquisitions;
+        if (spins > 0)
+        {
+            ++stats->contended;
+            stats->spins += spins;
+        }
+        stats->hold_start = __builtin_ia32_rdtsc();
+    }
+
+    inline void OnReleasing(LockStats *stats)
+    {
+        if (stats == nullptr)
+        {
+            return;
+        }
+        const uint64_t hold = __builtin_ia32_rdtsc() - stats->hold_start;
+        if (stats->max_hold_ticks < hold)
+        {
+            stats->max_hold_ticks = hold;
+        }
+    }
+}
+
+/** @brief test-and-test-and-set スピンロック */
+class SpinLock
+{
+public:
+    void Lock()
+    {
+        uint64_t spins = 0;
+        while (locked_.exchange(true, std::memory_order_acquire))
+        {
+            while (locked_.load(std::memory_order_relaxed))
+            {
+                CPURelax();
+                ++spins;
+            }
+        }
+        lock_detail::OnAcquired(stats_, spins);
+    }
+
+    bool TryLock()
+    {
+        if (locked_.load(std::memory_order_relaxed) ||
+            locked_.exchange(true, std::memory_order_acquire))
+        {
+            return false;
+        }
+        lock_detail::OnAcquired(stats_, 0);
+        return true;
+    }
+
+    void Unlock()
+    {
+        lock_detail::OnReleasing(stats_);
+        locked_.store(false, std::memory_order_release);
+    }
+
+    uint64_t LockIRQSave()
+    {
+        const auto rflags = SaveAndDisableInterrupts();
+        Lock();
+        return rflags;
+    }
+
+    void UnlockIRQRestore(uint64_t rflags)
+    {
+        Unlock();
+        RestoreInterrupts(rflags);
+    }
+
+    void EnableStats(LockStats *stats) { stats_ = stats; }
+
+private:
+    std::atomic<bool> locked_{false};
+    LockStats *stats_ = nullptr;
+};
+
+/** @brief チケットロック．到着順に獲得させる． */
+class TicketLock
+{
+public:
+    void Lock()
+    {
+        const uint32_t ticket = next_ticket_.fetch_add(1, std::memory_order_relaxed);
+        uint64_t spins = 0;
+        while (now_serving_.load(std::memory_order_acquire) != ticket)
+        {
+            CPURelax();
+            ++spins;
+        }
+        lock_detail::OnAcquired(stats_, spins);
+    }
+
+    void Unlock()
+    {
+        lock_detail::OnReleasing(stats_);
+        const uint32_t next = now_serving_.load(std::memory_order_relaxed) + 1;
+        now_serving_.store(next, std::memory_order_release);
+    }
+
+    uint64_t LockIRQSave()
+    {
+        const auto rflags = SaveAndDisableInterrupts();
+        Lock();
+        return rflags;
+    }
+
+    void UnlockIRQRestore(uint64_t rflags)
+    {
+        Unlock();
+        RestoreInterrupts(rflags);
+    }
+
+    void EnableStats(LockStats *stats) { stats_ = stats; }
+
+private:
+    std::atomic<uint32_t> next_ticket_{0};
+    std::atomic<uint32_t> now_serving_{0};
+    LockStats *stats_ = nullptr;
+};
+
+/** @brief MCS キューロック
+ *
+ * 獲得する側はロックを保持している間 Node を生存させ，
+ * 解放時に同じ Node を渡さなければならない．Node は通常スタックに置く．
+ */
+class MCSLock
+{
+public:
+    struct Node
+    {
+        std::atomic<Node *> next{nullptr};
+        std::atomic<bool> locked{false};
+    };
+
+    void Lock(Node &node)
+    {
+        node.next.store(nullptr, std::memory_order_relaxed);
+        node.locked.store(true, std::memory_order_relaxed);
+
+        uint64_t spins = 0;
+        Node *prev = tail_.exchange(&node, std::memory_order_acq_rel);
+        if (prev != nullptr)
+        {
+            prev->next.store(&node, std::memory_order_release);
+            while (node.locked.load(std::memory_order_acquire))
+            {
+                CPURelax();
+                ++spins;
+            }
+        }
+        lock_detail::OnAcquired(stats_, spins);
+    }
+
+    void Unlock(Node &node)
+    {
+        lock_detail::OnReleasing(stats_);
+
+        Node *next = node.next.load(std::memory_order_acquire);
+        if (next == nullptr)
+        {
+            Node *expected = &node;
+            if (tail_.compare_exchange_strong(expected, nullptr,
+                                              std::memory_order_acq_rel))
+            {
+                return;
+            }
+            // 後続がキューに繋がるまで待つ
+            while ((next = node.next.load(std::memory_order_acquire)) == nullptr)
+            {
+                CPURelax();
+            }
+        }
+        next->locked.store(false, std::memory_order_release);
+    }
+
+    uint64_t LockIRQSave(Node &node)
+    {
+        const auto rflags = SaveAndDisableInterrupts();
+        Lock(node);
+        return rflags;
+    }
+
+    void UnlockIRQRestore(Node &node, uint64_t rflags)
+    {
+        Unlock(node);
+        RestoreInterrupts(rflags);
+    }
+
+    void EnableStats(LockStats *stats) { stats_ = stats; }
+
+private:
+    std::atomic<Node *> tail_{nullptr};
+    LockStats *stats_ = nullptr;
+};
+
+/** @brief スコープの間ロックを保持する（SpinLock，TicketLock 用） */
+template <typename L>
+class LockGuard
+{
+public:
+    explicit LockGuard(L &lock) : lock_{lock} { lock_.Lock(); }
+    ~LockGuard() { lock_.Unlock(); }
+    LockGuard(const LockGuard &) = delete;
+    LockGuard &operator=(const LockGuard &) = delete;
+
+private:
+    L &lock_;
+};
+
+/** @brief スコープの間，割り込みを禁止してロックを保持する（SpinLock，TicketLock 用） */
+template <typename L>
+class IRQSaveLockGuard
+{
+public:
+    explicit IRQSaveLockGuard(L &lock) : lock_{lock}, rflags_{lock_.LockIRQSave()} {}
+    ~IRQSaveLockGuard() { lock_.UnlockIRQRestore(rflags_); }
+    IRQSaveLockGuard(const IRQSaveLockGuard &) = delete;
+    IRQSaveLockGuard &operator=(const IRQSaveLockGuard &) = delete;
+
+private:
+    L &lock_;
+    const uint64_t rflags_;
+};
+
+/** @brief スコープの間 MCSLock を保持する．キューノードはガード自身が持つ． */
+template <>
+class LockGuard<MCSLock>
+{
+public:
+    explicit LockGuard(MCSLock &lock) : lock_{lock} { lock_.Lock(node_); }
+    ~LockGuard() { lock_.Unlock(node_); }
+    LockGuard(const LockGuard &) = delete;
+    LockGuard &operator=(const LockGuard &) = delete;
+
+private:
+    MCSLock &lock_;
+    MCSLock::Node node_;
+};
+
+template <>
+class IRQSaveLockGuard<MCSLock>
+{
+public:
+    explicit IRQSaveLockGuard(MCSLock &lock)
+        : lock_{lock}, rflags_{lock_.LockIRQSave(node_)} {}
+    ~IRQSaveLockGuard() { lock_.UnlockIRQRestore(node_, rflags_); }
+    IRQSaveLockGuard(const IRQSaveLockGuard &) = delete;
+    IRQSaveLockGuard &operator=(const IRQSaveLockGuard &) = delete;
+
+private:
+    MCSLock &lock_;
+    MCSLock::Node node_;
+    const uint64_t rflags_;
+};
@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cstdint>
 #include <cstddef>
 #include <cstdio>
@@ -14,12 +17,22 @@
 #include "usb/memory.hpp"
 #include "usb/device.hpp"
 #include "usb/classdriver/mouse.hpp"
+#include "usb/classdriver/block.hpp"
+#include "usb/classdriver/hub.hpp"
 #include "usb/xhci/xhci.hpp"
 #include "usb/xhci/trb.hpp"
+#include "usb/xhci/poller.hpp"
 #include "interrupt.hpp"
 #include "queue.hpp"
 #include "asmfunc.h"
 #include "memory_map.hpp"
+#include "paging.hpp"
+#include "memstat.hpp"
+#include "acpi.hpp"
+#include "smp.hpp"
+#include "task.hpp"
+#include "thread.hpp"
+#include "timer.hpp"
 
 const PixelColor kDesktopBGColor{45, 118, 237};
 const PixelColor kDesktopFGColor{255, 255, 255};
@@ -58,10 +71,9 @@ void MouseObserver(int8_t displacement_x, int8_t displacement_y)
 void SwitchEhci2Xhci(const pci::Device &xhc_dev)
 {
     bool intel_ehc_exist = false;
-    for (int i = 0; i < pci::num_device; ++i)
+    for (int i = 0; auto ehc = pci::FindByClass(0x0cu, 0x03u, 0x20u /* EHCI */, i); ++i)
     {
-        if (pci::devices[i].class_code.Match(0x0cu, 0x03u, 0x20u) /* EHCI */ &&
-            0x8086 == pci::ReadVendorId(pci::devices[i]))
+        if (0x8086 == ehc->vendor_id)
         {
             intel_ehc_exist = true;
             break;
@@ -82,25 +94,301 @@ void SwitchEhci2Xhci(const pci::Device &xhc_dev)
 
 usb::xhci::Controller *xhc;
 
+pci::Device *xhc_dev = nullptr;
+
+/** @brief xHC の MSI-X．使っていなければ table_size が 0． */
+pci::MSIX xhc_msix{};
+/** @brief インタラプタごとの，イベントを処理する CPU の番号 */
+std::array<int, usb::xhci::Controller::kMaxInterrupters> xhc_interrupter_cpu{};
+
+/** @brief xHC に用意するインタラプタの数を決める．
+ *
+ * インタラプタごとに別のベクタが要るので，MSI-X が使えなければ 1 つだけにする．
+ */
+size_t NumXHCInterrupters()
+{
+    if (xhc_dev->msix_cap_addr == 0 || pci::InitializeMSIX(*xhc_dev, xhc_msix))
+    {
+        xhc_msix.table_size = 0;
+        return 1;
+    }
+    return std::min<size_t>(xhc_msix.table_size, usb::xhci::Controller::kMaxInterrupters);
+}
+
+/** @brief xHC の割り込みを設定する
+ *
+ * MSI-X が使えれば，インタラプタ i にエントリ i を対応させる．0 番（コマンド，ポート，
+ * コントロール転送，HID などのインタラプト転送）は BSP のメインループで，残りは AP に
+ * 1 つずつ割り当てて割り込みを受けた CPU でそのまま処理する．AP が無ければすべて BSP で処理する．
+ */
+void SetupXHCInterrupts(const usb::xhci::Controller &xhc)
+{
+    const uint8_t bsp_local_apic_id = smp::CPU(0).apic_id;
+    if (xhc_msix.table_size == 0)
+    {
+        pci::ConfigureMSIFixedDestination(
+            *xhc_dev, bsp_local_apic_id,
+            pci::MSITriggerMode::kLevel, pci::MSIDeliveryMode::kFixed,
+            InterruptVector::kXHCI, 0);
+        return;
+    }
+
+    const int num_cpus = smp::NumCPUs();
+    for (size_t i = 0; i < xhc.NumInterrupters(); ++i)
+    {
+        const int cpu = (i == 0 || num_cpus == 1) ? 0 : 1 + (i - 1) % (num_cpus - 1);
+        const uint8_t vector = cpu == 0 ? InterruptVector::kXHCI : InterruptVector::kXHCIInterrupter;
+        xhc_interrupter_cpu[i] = cpu;
+        pci::SetMSIXVector(xhc_msix, i, smp::CPU(cpu).apic_id,
+                           pci::MSITriggerMode::kLevel, pci::MSIDeliveryMode::kFixed, vector);
+        pci::UnmaskMSIXVector(xhc_msix, i);
+        Log(kInfo, "xHC interrupter %lu -> CPU %d (vector 0x%02x)\n", i, cpu, vector);
+    }
+    pci::EnableMSIX(xhc_msix);
+}
+
+#ifndef XHCI_POLICY
+#define XHCI_POLICY kInterrupt
+#endif
+/** @brief xHCI イベントの処理方針．make XHCI_POLICY=kHybrid などで選ぶ． */
+const usb::xhci::EventPolicy kXHCIEventPolicy = usb::xhci::EventPolicy::XHCI_POLICY;
+
+std::array<usb::xhci::EventPoller, usb::xhci::Controller::kMaxInterrupters> xhc_pollers;
+
+task::Group xhc_busy_poll_group;
+task::Job xhc_busy_poll_job;
+volatile bool xhc_busy_poll_started = false;
+
+/** @brief kBusyPoll の二次インタラプタをポーリングし続ける．AP に盗ませて専用コアにする．
+ *
+ * 0 番は BSP のメインループで処理するので対象にしない．
+ */
+[[noreturn]] void BusyPollXHC(void *arg)
+{
+    xhc_busy_poll_started = true;
+    Log(kInfo, "xHC busy-poll on CPU %d\n", smp::CurrentCPU()->cpu_index);
+    while (true)
+    {
+        for (size_t i = 1; i < xhc_pollers.size(); ++i)
+        {
+            if (xhc_pollers[i].Policy() == usb::xhci::EventPolicy::kBusyPoll)
+            {
+                xhc_pollers[i].BusyPoll();
+            }
+        }
+        // ジョブは割り込み禁止で動くので，TLB シュートダウンの IPI を受けられるよう窓を開ける
+        __asm__ volatile("sti\n\tnop\n\tcli");
+    }
+}
+
+/** @brief インタラプタごとに EventPoller を用意し，kBusyPoll なら専用コアでポーリングを始める
+ *
+ * 0 番は HID の描画やコマンドの完了を BSP で処理するため，kBusyPoll でも
+ * BSP のメインループで kHybrid として処理する．
+ */
+void SetupXHCPollers(usb::xhci::Controller &xhc)
+{
+    auto policy = kXHCIEventPolicy;
+    if (policy == usb::xhci::EventPolicy::kBusyPoll &&
+        (smp::NumCPUs() == 1 || xhc.NumInterrupters() == 1))
+    {
+        Log(kWarn, "xHC busy-poll needs a spare CPU and a secondary interrupter; "
+                   "falling back to hybrid\n");
+        policy = usb::xhci::EventPolicy::kHybrid;
+    }
+
+    for (uint16_t i = 0; i < xhc.NumInterrupters(); ++i)
+    {
+        auto config = usb::xhci::kDefaultPollerConfig;
+        config.policy = policy;
+        if (i == usb::xhci::Controller::kPrimaryInterrupter &&
+            policy == usb::xhci::EventPolicy::kBusyPoll)
+        {
+            config.policy = usb::xhci::EventPolicy::kHybrid;
+        }
+        xhc_pollers[i].Initialize(xhc, i, config);
+    }
+    Log(kInfo, "xHC event policy: %s\n", usb::xhci::PolicyName(policy));
+
+    if (policy == usb::xhci::EventPolicy::kBusyPoll)
+    {
+        task::Spawn(xhc_busy_poll_group, xhc_busy_poll_job, BusyPollXHC, nullptr);
+        // BSP が自分の deque から取り出して実行してしまわないよう，AP が盗むまで待つ
+        while (!xhc_busy_poll_started)
+        {
+            __asm__("pause");
+        }
+    }
+}
+
+task::Group xhc_poll_group;
+std::array<task::Job, usb::xhci::Controller::kMaxInterrupters> xhc_poll_jobs;
+/** @brief AP の kHybrid のインタラプタが受けた，まだポーリングで拾っていない割り込みの数 */
+std::array<std::atomic<int>, usb::xhci::Controller::kMaxInterrupters> xhc_poll_requests{};
+
+/** @brief AP の kHybrid のインタラプタを，割り込みの外（ジョブ）でポーリングする */
+void PollXHCInterrupter(void *arg)
+{
+    const auto i = reinterpret_cast<uintptr_t>(arg);
+    while (true)
+    {
+        int requests = xhc_poll_requests[i].load(std::memory_order_acquire);
+        xhc_pollers[i].RunPolling();
+        // ポーリング中に届いた割り込みがあれば，マスクし直してもう一度拾う
+        if (xhc_poll_requests[i].compare_exchange_strong(requests, 0, std::memory_order_acq_rel))
+        {
+            return;
+        }
+        xhc_pollers[i].DeferInterrupt(__builtin_ia32_rdtsc());
+    }
+}
+
+/** @brief cpu に割り当てたインタラプタの割り込みを処理する
+ *
+ * @return ポーリングを続けるインタラプタがあれば true
+ */
+bool ProcessXHCEvents(int cpu, uint64_t irq_tsc)
+{
+    bool more = false;
+    for (uint16_t i = 0; i < xhc->NumInterrupters(); ++i)
+    {
+        if (xhc_interrupter_cpu[i] == cpu)
+        {
+            more |= xhc_pollers[i].OnInterrupt(irq_tsc);
+        }
+    }
+    return more;
+}
+
+/** @brief cpu に割り当てたインタラプタのうち，ポーリング中のものを続けて処理する */
+bool PollXHCEvents(int cpu)
+{
+    bool more = false;
+    for (uint16_t i = 0; i < xhc->NumInterrupters(); ++i)
+    {
+        if (xhc_interrupter_cpu[i] == cpu && xhc_pollers[i].IsPolling())
+        {
+            more |= xhc_pollers[i].Poll();
+        }
+    }
+    return more;
+}
+
+void LogXHCStats(LogLevel level)
+{
+    LogInterrupterStats(*xhc, level);
+    LogDoorbellStats(*xhc, level);
+    for (uint16_t i = 0; i < xhc->NumInterrupters(); ++i)
+    {
+        xhc_pollers[i].LogLatency(level);
+    }
+}
+
+Error ProbeXHC(pci::Device &dev)
+{
+    if (xhc_dev)
+    {
+        return MAKE_ERROR(Error::kAlreadyAllocated);
+    }
+    xhc_dev = &dev;
+    return MAKE_ERROR(Error::kSuccess);
+}
+
 // #@@range_begin(queue_message)
 struct Message
 {
     enum Type
     {
         kInterruptXHCI,
+        kPollXHCI,
+        kLogStats,
+        kCheckXHCCommands,
+        kCheckHubTimers,
     } type;
+    /** @brief 割り込みを受けた時刻（TSC） */
+    uint64_t timestamp;
 };
 
 ArrayQueue<Message> *main_queue;
 __attribute__((interrupt)) void IntHandlerXHCI(InterruptFrame *frame)
 {
-    main_queue->Push(Message{Message::kInterruptXHCI});
+    main_queue->Push(Message{Message::kInterruptXHCI, __builtin_ia32_rdtsc()});
+    NotifyEndOfInterrupt();
+}
+
+__attribute__((interrupt)) void IntHandlerXHCIInterrupter(InterruptFrame *frame)
+{
+    // AP に割り当てた二次インタラプタは，メインループを介さずこの CPU で処理する．
+    // kHybrid のポーリングは割り込みの中で待たないよう，マスクしてからジョブに任せる．
+    // AP は hlt 中かジョブの sti の窓でしか割り込みを受けないので，ここから deque に積んでよい．
+    const uint64_t irq_tsc = __builtin_ia32_rdtsc();
+    if (xhc)
+    {
+        const int cpu = smp::CurrentCPU()->cpu_index;
+        for (uint16_t i = 0; i < xhc->NumInterrupters(); ++i)
+        {
+            if (xhc_interrupter_cpu[i] != cpu)
+            {
+                continue;
+            }
+            if (xhc_pollers[i].Policy() != usb::xhci::EventPolicy::kHybrid)
+            {
+                xhc_pollers[i].OnInterrupt(irq_tsc);
+            }
+            else if (xhc_poll_requests[i].fetch_add(1, std::memory_order_acq_rel) == 0)
+            {
+                xhc_pollers[i].DeferInterrupt(irq_tsc);
+                task::Spawn(xhc_poll_group, xhc_poll_jobs[i], PollXHCInterrupter,
+                            reinterpret_cast<void *>(uintptr_t{i}));
+            }
+        }
+    }
+    NotifyEndOfInterrupt();
+}
+
+/** @brief 割り込みモデレーションと遅延の統計をログに出す間隔（tick） */
+const uint64_t kStatInterval = 10 * kTimerFrequency;
+/** @brief xHC のコマンドのタイムアウトを調べる間隔（tick） */
+const uint64_t kCommandCheckInterval = 10;
+
+__attribute__((interrupt)) void IntHandlerLAPICTimer(InterruptFrame *frame)
+{
+    LAPICTimerOnInterrupt();
+    if (CurrentTick() % kStatInterval == 0)
+    {
+        main_queue->Push(Message{Message::kLogStats, 0});
+    }
+    if (CurrentTick() % kCommandCheckInterval == 0 && xhc &&
+        (xhc->Commands()->InFlight() > 0 || xhc->Commands()->IsAborting()))
+    {
+        main_queue->Push(Message{Message::kCheckXHCCommands, 0});
+    }
+    if (xhc && usb::HubDriver::NumWaitingPowerGood() > 0)
+    {
+        main_queue->Push(Message{Message::kCheckHubTimers, 0});
+    }
     NotifyEndOfInterrupt();
+    thread_manager->OnTimerInterrupt();
 }
 
-extern "C" void KernelMain(const FrameBufferConfig &frame_buffer_config, const MemoryMap &memmap)
+__attribute__((interrupt)) void IntHandlerTaskWakeup(InterruptFrame *frame)
+{
+    // hlt している AP を起こすだけなので EOI 以外は何もしない
+    NotifyEndOfInterrupt();
+}
+
+__attribute__((interrupt)) void IntHandlerTLBShootdown(InterruptFrame *frame)
+{
+    smp::OnTLBShootdown();
+    NotifyEndOfInterrupt();
+}
+
+extern "C" void KernelMain(const FrameBufferConfig &frame_buffer_config,
+                           const MemoryMap &memmap,
+                           const acpi::RSDP &acpi_table)
 {
     SetLogLevel(kError);
+    smp::InitializeBSP();
 
     switch (frame_buffer_config.pixel_format)
     {
@@ -139,6 +427,11 @@ extern "C" void KernelMain(const FrameBufferConfig &frame_buffer_config, const M
     // allocate global console for printk
     console = new (console_buf) Console(*pixel_writer, kDesktopFGColor, kDesktopBGColor);
 
+    // 静的に確保している領域もサブシステムごとの使用量に含める
+    memstat::OnAlloc(memstat::Tag::kGraphics, pixel_writer_buf, sizeof(pixel_writer_buf), 0);
+    memstat::OnAlloc(memstat::Tag::kConsole, console_buf, sizeof(console_buf), 0);
+    memstat::OnAlloc(memstat::Tag::kGraphics, mouse_cursor_buf, sizeof(mouse_cursor_buf), 0);
+
     printk("Welcome to KFOS!\n");
 
     mouse_cursor = new (mouse_cursor_buf) MouseCursor{
@@ -148,41 +441,73 @@ extern "C" void KernelMain(const FrameBufferConfig &frame_buffer_config, const M
     ArrayQueue<Message> main_queue{main_queue_data};
     ::main_queue = &main_queue;
 
+    // MMIO を Write Combining でマップできるよう PAT を設定しておく
+    InitializePAT();
+
+    // PCI の ECAM やタイマの較正に使う ACPI PM タイマの情報を先に読み込む
+    const bool acpi_available = acpi::Initialize(acpi_table);
+    pci::InitializeConfigAccess();
+
+    const uint16_t cs = GetCS();
+    SetIDTEntry(idt[InterruptVector::kXHCI], MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+                reinterpret_cast<uint64_t>(IntHandlerXHCI), cs);
+    SetIDTEntry(idt[InterruptVector::kXHCIInterrupter], MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+                reinterpret_cast<uint64_t>(IntHandlerXHCIInterrupter), cs);
+    SetIDTEntry(idt[InterruptVector::kLAPICTimer], MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+                reinterpret_cast<uint64_t>(IntHandlerLAPICTimer), cs);
+    SetIDTEntry(idt[InterruptVector::kTaskWakeup], MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+                reinterpret_cast<uint64_t>(IntHandlerTaskWakeup), cs);
+    SetIDTEntry(idt[InterruptVector::kTLBShootdown], MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+                reinterpret_cast<uint64_t>(IntHandlerTLBShootdown), cs);
+    LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
+
+    InitializeThread(1);
+    InitializeLAPICTimer(InterruptVector::kLAPICTimer);
+
+    if (acpi_available)
+    {
+        if (auto err = smp::StartApplicationProcessors(memmap))
+        {
+            Log(kError, "failed to start APs: %s at %s:%d\n",
+                err.Name(), err.File(), err.Line());
+        }
+    }
+    printk("CPUs online: %d\n", smp::NumCPUs());
+    task::Initialize(InterruptVector::kTaskWakeup);
+#ifdef TASK_BENCH
+    task::RunBenchmark(kError);
+#endif
+
     // List all pci devices
+    // BAR などの読み取りは AP にも手伝わせるので，task::Initialize() の後に行う
     auto err = pci::ScanAllBus();
     printk("ScanAllBus: %s\n", err.Name());
+    pci::LogResources(kDebug);
 
-    // search for xhc device
-    pci::Device *xhc_dev = nullptr;
-    for (int i = 0; i < pci::num_device; i++)
+    // Intel 製の xHC を優先して 1 つだけ使う
+    pci::RegisterDriver({"xhci-intel", 0x8086, pci::kAnyID, 0x0cu, 0x03u, 0x30u, ProbeXHC});
+    pci::RegisterDriver({"xhci", pci::kAnyID, pci::kAnyID, 0x0cu, 0x03u, 0x30u, ProbeXHC});
+    pci::ProbeDrivers();
+    if (xhc_dev == nullptr)
     {
-        if (pci::devices[i].class_code.Match(0x0cu, 0x3u, 0x30u))
-        {
-            xhc_dev = &pci::devices[i];
-            if (0x8086 == pci::ReadVendorId(*xhc_dev))
-            {
-                break;
-            }
-        }
+        printk("xHC device not found\n");
+        while (1)
+            __asm__("hlt");
     }
     printk("xHC device found. %d.%d.%d\n",
            xhc_dev->bus, xhc_dev->device, xhc_dev->function);
 
-    const uint16_t cs = GetCS();
-    SetIDTEntry(idt[InterruptVector::kXHCI], MakeIDTAttr(DescriptorType::kInterruptGate, 0),
-                reinterpret_cast<uint64_t>(IntHandlerXHCI), cs);
-    LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
-
-    const uint8_t bsp_local_apic_id =
-        *reinterpret_cast<const uint32_t *>(0xfee00020) >> 24;
-    pci::ConfigureMSIFixedDestination(
-        *xhc_dev, bsp_local_apic_id,
-        pci::MSITriggerMode::kLevel, pci::MSIDeliveryMode::kFixed,
-        InterruptVector::kXHCI, 0);
-
-    const WithError<uint64_t> xhc_bar = pci::ReadBar(*xhc_dev, 0);
-    Log(kDebug, "ReadBar: %s\n", xhc_bar.error.Name());
-    const uint64_t xhc_mmio_base = xhc_bar.value & ~static_cast<uint64_t>(0xf);
+    const WithError<uintptr_t> xhc_bar = pci::MapBar(*xhc_dev, 0);
+    if (xhc_bar.error)
+    {
+        // 失敗時の value は 0 なので，このまま進むと物理ページ 0 をレジスタとして書き換える
+        Log(kError, "failed to map xHC BAR0: %s at %s:%d\n",
+            xhc_bar.error.Name(), xhc_bar.error.File(), xhc_bar.error.Line());
+        printk("xHC BAR0 is not usable\n");
+        while (1)
+            __asm__("hlt");
+    }
+    const uint64_t xhc_mmio_base = xhc_bar.value;
     Log(kDebug, "xHC mmio_base = %08lx\n", xhc_mmio_base);
 
     usb::xhci::Controller xhc{xhc_mmio_base};
@@ -192,33 +517,52 @@ extern "C" void KernelMain(const FrameBufferConfig &frame_buffer_config, const M
         SwitchEhci2Xhci(*xhc_dev);
     }
     {
-        auto err = xhc.Initialize();
+        auto err = xhc.Initialize(NumXHCInterrupters());
         Log(kDebug, "xhc.Initialize() : %s\n", err.Name());
     }
+    SetupXHCInterrupts(xhc);
+    SetupXHCPollers(xhc);
+
+    // AP の割り込みハンドラが参照するので，xHC を動かす前に公開する
+    ::xhc = &xhc;
 
     Log(kDebug, "xHC starting\n");
     xhc.Run();
 
-    ::xhc = &xhc;
-
     usb::HIDMouseDriver::default_observer = MouseObserver;
-
-    for (int i = 1; i <= xhc.MaxPorts(); ++i)
+#ifdef USB_STORAGE_BENCH
+    usb::BlockDevice::default_ready_handler = [](usb::BlockDevice &dev)
     {
-        auto port = xhc.PortAt(i);
-        Log(kDebug, "Port %d: IsConnected=%d\n", i, port.IsConnected());
+        if (auto err = usb::StartBlockBenchmark(dev, kInfo))
+        {
+            Log(kError, "failed to start block bench: %s\n", err.Name());
+        }
+    };
+    usb::BlockDevice::default_removed_handler = usb::StopBlockBenchmark;
+#endif
 
-        if (port.IsConnected())
+    {
+        // AP は既に二次インタラプタのイベントを処理しているので，デバイス管理の状態に触る前にロックを取る
+        IRQSaveLockGuard guard{xhc.StateLock()};
+        for (int i = 1; i <= xhc.MaxPorts(); ++i)
         {
-            if (auto err = ConfigurePort(xhc, port))
+            auto port = xhc.PortAt(i);
+            Log(kDebug, "Port %d: IsConnected=%d\n", i, port.IsConnected());
+
+            if (port.IsConnected())
             {
-                Log(kError, "failed to configure port: %s at %s:%d\n",
-                    err.Name(), err.File(), err.Line());
-                continue;
+                if (auto err = ConfigurePort(xhc, port))
+                {
+                    Log(kError, "failed to configure port: %s at %s:%d\n",
+                        err.Name(), err.File(), err.Line());
+                    continue;
+                }
             }
         }
     }
 
+    memstat::Dump(kDebug);
+
     while (1)
     {
         // #@@range_begin(get_front_message)
@@ -237,13 +581,36 @@ extern "C" void KernelMain(const FrameBufferConfig &frame_buffer_config, const M
         switch (msg.type)
         {
         case Message::kInterruptXHCI:
-            while (xhc.PrimaryEventRing()->HasFront())
+        case Message::kPollXHCI:
+        {
+            const bool more = msg.type == Message::kInterruptXHCI
+                                  ? ProcessXHCEvents(0, msg.timestamp)
+                                  : PollXHCEvents(0);
+            if (more)
             {
-                if (auto err = ProcessEvent(xhc))
-                {
-                    Log(kError, "Error while ProcessEvent: %s at %s:%d\n",
-                        err.Name(), err.File(), err.Line());
-                }
+                // 予算を使い切ったので，他のメッセージを処理してからポーリングを続ける
+                __asm__("cli");
+                main_queue.Push(Message{Message::kPollXHCI, 0});
+                __asm__("sti");
+            }
+            break;
+        }
+        case Message::kLogStats:
+            // 割り込みモデレーションとイベント処理方針の効果を確かめられるよう，定期的に出す
+            LogXHCStats(kDebug);
+            break;
+        case Message::kCheckXHCCommands:
+            if (auto err = usb::xhci::CheckCommandTimeouts(xhc, CurrentTick()))
+            {
+                Log(kError, "failed to recover xHC: %s at %s:%d\n",
+                    err.Name(), err.File(), err.Line());
+            }
+            break;
+        case Message::kCheckHubTimers:
+            if (auto err = usb::xhci::ProcessHubTimers(xhc, CurrentTick()))
+            {
+                Log(kError, "failed to start hub: %s at %s:%d\n",
+                    err.Name(), err.File(), err.Line());
             }
             break;
         default:
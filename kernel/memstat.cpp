@@ -0,0 +1,154 @@
+/**
+ * @file memstat.cpp
+ *
+ * メモリ使用量のサブシステム別集計と割り当てトレース．
+ */
+
+#include "memstat.hpp"
+
+#include <array>
+
+namespace
+{
+    using namespace memstat;
+
+    const std::array<const char *, static_cast<size_t>(Tag::kLastOfTag)> kTagNames{
+        "unknown",
+        "heap",
+        "usb-ring",
+        "usb-ctx",
+        "usb-dev",
+        "usb-drv",
+        "usb-misc",
+        "usb-coro",
+        "console",
+        "graphics",
+        "smp",
+    };
+
+    std::array<TagStat, static_cast<size_t>(Tag::kLastOfTag)> tag_stats{};
+
+    std::array<TraceEntry, kTraceSize> trace{};
+    /** trace 上で次に書き込む位置 */
+    size_t trace_write_pos = 0;
+    /** trace の有効なエントリ数 */
+    size_t trace_count = 0;
+    bool trace_enabled = false;
+
+    void Record(Tag tag, const void *addr, size_t size, uintptr_t rip, bool is_free)
+    {
+        if (!trace_enabled)
+        {
+            return;
+        }
+
+        trace[trace_write_pos] = TraceEntry{
+            rip, reinterpret_cast<uintptr_t>(addr),
+            static_cast<uint32_t>(size), tag, is_free};
+        ++trace_write_pos;
+        if (trace_write_pos == trace.size())
+        {
+            trace_write_pos = 0;
+        }
+        if (trace_count < trace.size())
+        {
+            ++trace_count;
+        }
+    }
+
+    size_t Index(Tag tag)
+    {
+        auto i = static_cast<size_t>(tag);
+        return i < tag_stats.size() ? i : 0;
+    }
+}
+
+namespace memstat
+{
+    const char *TagName(Tag tag)
+    {
+        return kTagNames[Index(tag)];
+    }
+
+    void OnAlloc(Tag tag, const void *addr, size_t size, uintptr_t rip)
+    {
+        auto &s = tag_stats[Index(tag)];
+        s.live_bytes += size;
+        ++s.num_allocs;
+        if (s.peak_bytes < s.live_bytes)
+        {
+            s.peak_bytes = s.live_bytes;
+        }
+        Record(tag, addr, size, rip, false);
+    }
+
+    void OnFree(Tag tag, const void *addr, size_t size, uintptr_t rip)
+    {
+        auto &s = tag_stats[Index(tag)];
+        s.live_bytes -= size;
+        ++s.num_frees;
+        Record(tag, addr, size, rip, true);
+    }
+
+    const TagStat &Stat(Tag tag)
+    {
+        return tag_stats[Index(tag)];
+    }
+
+    void EnableTrace(bool enable)
+    {
+        trace_enabled = enable;
+    }
+
+    size_t NumTraceEntries()
+    {
+        return trace_count;
+    }
+
+    const TraceEntry &TraceAt(size_t i)
+    {
+        const size_t oldest = (trace_write_pos + trace.size() - trace_count) % trace.size();
+        return trace[(oldest + i) % trace.size()];
+    }
+
+    void Dump(LogLevel level, size_t num_trace)
+    {
+        Log(level, "%-10s %10s %10s %8s %8s\n", "tag", "live", "peak", "alloc", "free");
+        for (size_t i = 0; i < tag_stats.size(); ++i)
+        {
+            const auto &s = tag_stats[i];
+            if (s.num_allocs == 0)
+            {
+                continue;
+            }
+            Log(level, "%-10s %10lu %10lu %8lu %8lu\n", kTagNames[i],
+                s.live_bytes, s.peak_bytes, s.num_allocs, s.num_frees);
+        }
+
+        if (num_trace > trace_count)
+        {
+            num_trace = trace_count;
+        }
+        for (size_t i = trace_count - num_trace; i < trace_count; ++i)
+        {
+            const auto &e = TraceAt(i);
+            Log(level, "%s %-10s %08lx %6u rip=%08lx\n",
+                e.is_free ? "free " : "alloc", TagName(e.tag),
+                e.addr, e.size, e.rip);
+        }
+    }
+}
+
+/** @brief newlib_support.c の sbrk から呼ばれ，ヒープの伸縮を kHeap に計上する */
+extern "C" void MemstatOnHeapChange(const void *prev_break, long incr, uintptr_t rip)
+{
+    if (incr > 0)
+    {
+        memstat::OnAlloc(memstat::Tag::kHeap, prev_break, incr, rip);
+    }
+    else if (incr < 0)
+    {
+        memstat::OnFree(memstat::Tag::kHeap,
+                        static_cast<const char *>(prev_break) + incr, -incr, rip);
+    }
+}
@@ -0,0 +1,81 @@
+/**
+ * @file memstat.hpp
+ *
+ * メモリ使用量のサブシステム別集計と割り当てトレース．
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "logger.hpp"
+
+namespace memstat
+{
+    /** @brief 割り当て元のサブシステムを表すタグ */
+    enum class Tag : uint8_t
+    {
+        kUnknown,
+        kHeap,         // newlib の malloc 経由
+        kUSBRing,      // Command/Transfer/Event Ring と ERST
+        kUSBContext,   // DCBAA，デバイスコンテキスト，スクラッチパッド
+        kUSBDevice,    // usb::xhci::Device 本体
+        kUSBDriver,    // クラスドライバ
+        kUSBMisc,      // その他 USB ドライバ内部の管理領域
+        kUSBCoroutine, // 非同期 USB 処理のコルーチンフレーム
+        kConsole,
+        kGraphics,
+        kSMP,          // AP 起動用トランポリンなど，1MiB 未満に確保したページ
+        kLastOfTag, // この列挙子は常に最後に配置する
+    };
+
+    /** @brief タグの表示名を返す */
+    const char *TagName(Tag tag);
+
+    /** @brief タグごとの集計値 */
+    struct TagStat
+    {
+        size_t live_bytes;   // 現在割り当て中のバイト数
+        size_t peak_bytes;   // live_bytes の最大値
+        uint64_t num_allocs; // 累積の割り当て回数
+        uint64_t num_frees;  // 累積の解放回数
+    };
+
+    /** @brief 割り当てトレースの 1 エントリ */
+    struct TraceEntry
+    {
+        uintptr_t rip;  // 割り当て／解放を呼び出した命令のアドレス
+        uintptr_t addr; // 対象メモリ領域の先頭アドレス
+        uint32_t size;  // 対象メモリ領域のバイト数
+        Tag tag;
+        bool is_free;
+    };
+
+    /** @brief 割り当てトレースを保持するリングの要素数 */
+    const size_t kTraceSize = 256;
+
+    /** @brief 割り当てを記録する
+     *
+     * @param tag  割り当て元のサブシステム
+     * @param addr  割り当てたメモリ領域
+     * @param size  割り当てたバイト数（アロケータの内部単位に切り上げた値）
+     * @param rip  割り当てを要求した呼び出し元のアドレス．不明なら 0．
+     */
+    void OnAlloc(Tag tag, const void *addr, size_t size, uintptr_t rip);
+    /** @brief 解放を記録する．引数の意味は OnAlloc と同じ． */
+    void OnFree(Tag tag, const void *addr, size_t size, uintptr_t rip);
+
+    /** @brief 指定されたタグの集計値を返す */
+    const TagStat &Stat(Tag tag);
+
+    /** @brief 割り当てトレースの記録を有効／無効にする．初期状態は無効． */
+    void EnableTrace(bool enable);
+    /** @brief 割り当てトレースに保持されているエントリ数 */
+    size_t NumTraceEntries();
+    /** @brief 割り当てトレースの i 番目のエントリ．0 が最も古い． */
+    const TraceEntry &TraceAt(size_t i);
+
+    /** @brief タグごとの集計値と（有効なら）直近のトレースをログに出力する */
+    void Dump(LogLevel level, size_t num_trace = 16);
+}
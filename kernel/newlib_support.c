@@ -1,16 +1,34 @@
 #include <errno.h>
+#include <stdint.h>
 #include <sys/types.h>
 
+/* memstat.cpp で定義 */
+void MemstatOnHeapChange(const void *prev_break, long incr, uintptr_t rip);
+
 void _exit(void)
 {
     while (1)
         __asm__("hlt");
 }
 
+/* malloc が使うヒープ領域．カーネルのメモリ管理ができるまでは静的に確保しておく． */
+static char heap[1024 * 1024] __attribute__((aligned(16)));
+static size_t heap_used = 0;
+
 caddr_t sbrk(int incr)
 {
-    errno = ENOMEM;
-    return (caddr_t)-1;
+    if (incr < 0 ? (size_t)-incr > heap_used
+                 : (size_t)incr > sizeof(heap) - heap_used)
+    {
+        errno = ENOMEM;
+        return (caddr_t)-1;
+    }
+
+    caddr_t prev_break = heap + heap_used;
+    heap_used += incr;
+    MemstatOnHeapChange(prev_break, incr,
+                        (uintptr_t)__builtin_return_address(0));
+    return prev_break;
 }
 
 int getpid(void)
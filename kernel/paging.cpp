@@ -0,0 +1,198 @@
+/**
+ * @file paging.cpp
+ *
+ * ページテーブルのキャッシュ属性を操作するプログラムを集めたファイル．
+ */
+
+#include "paging.hpp"
+
+#include <array>
+
+#include "asmfunc.h"
+#include "lock.hpp"
+#include "smp.hpp"
+
+namespace
+{
+    const uint32_t kIA32PAT = 0x277;
+    /** @brief PA0-7 = WB, WC, UC-, UC, WB, WC, UC-, UC */
+    const uint64_t kPATValue = 0x0007010600070106;
+
+    const uint64_t kPresent = 1u << 0;
+    const uint64_t kWritable = 1u << 1;
+    const uint64_t kUser = 1u << 2;
+    const uint64_t kPWT = 1u << 3;
+    const uint64_t kPCD = 1u << 4;
+    const uint64_t kPageSize = 1u << 7;   // PDPTE / PDE: 大きなページ
+    const uint64_t kPAT4K = 1u << 7;      // PTE: PAT ビット
+    const uint64_t kPATLarge = 1u << 12;  // 大きなページの PAT ビット
+    const uint64_t kNoExecute = 1ull << 63;
+    const uint64_t kAddressMask = 0x000ffffffffff000ull;
+
+    const uint64_t kCR0WriteProtect = 1u << 16;
+
+    const uint64_t k4KiB = 4096;
+    const uint64_t k2MiB = 512 * k4KiB;
+    const uint64_t k1GiB = 512 * k2MiB;
+
+    /** @brief 大きなページの分割に使うページテーブル */
+    const int kNumSplitTables = 32;
+    alignas(4096) std::array<std::array<uint64_t, 512>, kNumSplitTables> split_tables;
+    int num_split_table = 0;
+
+    SpinLock paging_lock;
+
+    uint64_t *TableOf(uint64_t entry)
+    {
+        return reinterpret_cast<uint64_t *>(entry & kAddressMask);
+    }
+
+    int IndexOf(uint64_t addr, int level)
+    {
+        return (addr >> (12 + 9 * (level - 1))) & 0x1ffu;
+    }
+
+    /** @brief 指定されたキャッシュ属性に対応する PWT/PCD/PAT ビット */
+    uint64_t CacheBits(CacheType type)
+    {
+        switch (type)
+        {
+        case CacheType::kWriteCombining:
+            return kPWT; // PAT エントリ 1
+        case CacheType::kUncached:
+            return kPCD | kPWT; // PAT エントリ 3
+        default:
+            return 0; // PAT エントリ 0
+        }
+    }
+
+    void SetLeafCacheBits(uint64_t &entry, CacheType type, uint64_t pat_bit)
+    {
+        entry = (entry & ~(kPWT | kPCD | pat_bit)) | CacheBits(type);
+    }
+
+    /** @brief 大きなページのエントリを，同じ範囲を覆う 512 個の小さなページに分割する
+     *
+     * @param child_size  分割後の 1 エントリが覆う大きさ
+     */
+    Error SplitLargePage(uint64_t &entry, uint64_t child_size)
+    {
+        if (num_split_table == kNumSplitTables)
+        {
+            return MAKE_ERROR(Error::kNoEnoughMemory);
+        }
+        auto &table = split_tables[num_split_table];
+        ++num_split_table;
+
+        // 大きなページの PAT ビットは bit 12 にある．4KiB ページでは bit 7（大きなページの PS の位置）に移る．
+        const bool pat = entry & kPATLarge;
+        const uint64_t base = entry & kAddressMask & ~kPATLarge;
+        uint64_t flags = entry & ~kAddressMask;
+        if (child_size == k4KiB)
+        {
+            flags = (flags & ~kPageSize) | (pat ? kPAT4K : 0);
+        }
+        else
+        {
+            flags |= pat ? kPATLarge : 0;
+        }
+
+        for (int i = 0; i < 512; ++i)
+        {
+            table[i] = (base + i * child_size) | flags;
+        }
+
+        entry = reinterpret_cast<uint64_t>(table.data()) |
+                (entry & (kPresent | kWritable | kUser | kNoExecute));
+        return MAKE_ERROR(Error::kSuccess);
+    }
+}
+
+void InitializePAT()
+{
+    WriteMSR(kIA32PAT, kPATValue);
+}
+
+Error SetCacheType(uintptr_t addr, size_t size, CacheType type)
+{
+    const uint64_t start = addr & ~(k4KiB - 1);
+    const uint64_t end = (addr + size + k4KiB - 1) & ~(k4KiB - 1);
+    Error err = MAKE_ERROR(Error::kSuccess);
+
+    // 他の CPU の TLB を捨てさせる前に割り込みを戻すので，ガードではなく明示的に解放する
+    const uint64_t rflags = paging_lock.LockIRQSave();
+
+    // UEFI がページテーブルを読み込み専用にしている場合に備え，書き換え中は WP を外す
+    const uint64_t cr0 = GetCR0();
+    SetCR0(cr0 & ~kCR0WriteProtect);
+
+    auto pml4 = reinterpret_cast<uint64_t *>(GetCR3() & kAddressMask);
+    for (uint64_t a = start; a < end && !err;)
+    {
+        const uint64_t pml4e = pml4[IndexOf(a, 4)];
+        if ((pml4e & kPresent) == 0)
+        {
+            err = MAKE_ERROR(Error::kIndexOutOfRange);
+            break;
+        }
+
+        uint64_t &pdpte = TableOf(pml4e)[IndexOf(a, 3)];
+        if ((pdpte & kPresent) == 0)
+        {
+            err = MAKE_ERROR(Error::kIndexOutOfRange);
+            break;
+        }
+        if (pdpte & kPageSize)
+        {
+            if (a % k1GiB == 0 && end - a >= k1GiB)
+            {
+                SetLeafCacheBits(pdpte, type, kPATLarge);
+                a += k1GiB;
+                continue;
+            }
+            if ((err = SplitLargePage(pdpte, k2MiB)))
+            {
+                break;
+            }
+        }
+
+        uint64_t &pde = TableOf(pdpte)[IndexOf(a, 2)];
+        if ((pde & kPresent) == 0)
+        {
+            err = MAKE_ERROR(Error::kIndexOutOfRange);
+            break;
+        }
+        if (pde & kPageSize)
+        {
+            if (a % k2MiB == 0 && end - a >= k2MiB)
+            {
+                SetLeafCacheBits(pde, type, kPATLarge);
+                a += k2MiB;
+                continue;
+            }
+            if ((err = SplitLargePage(pde, k4KiB)))
+            {
+                break;
+            }
+        }
+
+        uint64_t &pte = TableOf(pde)[IndexOf(a, 1)];
+        if ((pte & kPresent) == 0)
+        {
+            err = MAKE_ERROR(Error::kIndexOutOfRange);
+            break;
+        }
+        SetLeafCacheBits(pte, type, kPAT4K);
+        a += k4KiB;
+    }
+
+    SetCR0(cr0);
+    // TLB と，古い属性でキャッシュされた内容を捨てる
+    SetCR3(GetCR3());
+    __asm__ volatile("wbinvd");
+    paging_lock.UnlockIRQRestore(rflags);
+
+    // 他の CPU も同じページテーブルを使っているので，古い属性の TLB エントリを捨てさせる
+    smp::ShootdownTLB();
+    return err;
+}
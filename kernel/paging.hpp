@@ -0,0 +1,38 @@
+/**
+ * @file paging.hpp
+ *
+ * ページテーブルのキャッシュ属性を操作するプログラムを集めたファイル．
+ *
+ * カーネルは UEFI が作ったアイデンティティマップのページテーブルをそのまま使っている．
+ * ここではそのエントリの PAT/PCD/PWT ビットを書き換えてメモリ領域ごとのキャッシュ属性を変える．
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+
+/** @brief ページに設定するキャッシュ属性 */
+enum class CacheType
+{
+    kWriteBack,      // 通常のメモリ
+    kWriteCombining, // フレームバッファなどのプリフェッチ可能な MMIO
+    kUncached,       // 制御レジスタの MMIO
+};
+
+/** @brief PAT を設定し，PAT エントリ 1 を Write Combining にする
+ *
+ * 各 CPU で 1 回ずつ呼ぶ．
+ */
+void InitializePAT();
+
+/** @brief [addr, addr + size) のページのキャッシュ属性を変更する
+ *
+ * 領域が大きなページ（2MiB / 1GiB）の一部だけを覆う場合は 4KiB ページに分割する．
+ * 変更後は smp::ShootdownTLB() で他の CPU の TLB も捨てさせるので，割り込みを禁止するロックを持たずに呼ぶこと．
+ *
+ * @return 分割用のページテーブルが足りなければ kNoEnoughMemory
+ */
+Error SetCacheType(uintptr_t addr, size_t size, CacheType type);
@@ -6,12 +6,37 @@
 
 #include "pci.hpp"
 
+#include <algorithm>
+#include <cstdlib>
+
+#include "acpi.hpp"
 #include "asmfunc.h"
+#include "lock.hpp"
+#include "logger.hpp"
+#include "paging.hpp"
+#include "smp.hpp"
+#include "task.hpp"
 
 namespace
 {
     using namespace pci;
 
+    /** @brief バス番号ごとの ECAM 領域の先頭アドレス．ECAM が無いバスは 0． */
+    std::array<uintptr_t, 256> ecam_bus_base{};
+
+    /** @brief CONFIG_ADDRESS と CONFIG_DATA の組を CPU 間で排他する */
+    SpinLock config_port_lock;
+
+    volatile uint32_t &ECAMRegister(uint8_t bus, uint8_t device,
+                                    uint8_t function, uint16_t reg_addr)
+    {
+        const uintptr_t addr = ecam_bus_base[bus] |
+                               (static_cast<uintptr_t>(device) << 15) |
+                               (static_cast<uintptr_t>(function) << 12) |
+                               (reg_addr & 0xffcu);
+        return *reinterpret_cast<volatile uint32_t *>(addr);
+    }
+
     /** @brief CONFIG_ADDRESS 用の 32 ビット整数を生成する */
     uint32_t MakeAddress(uint8_t bus, uint8_t device,
                          uint8_t function, uint8_t reg_addr)
@@ -25,12 +50,26 @@ namespace
                | shl(bus, 16) | shl(device, 11) | shl(function, 8) | (reg_addr & 0xfcu);
     }
 
-    /** @brief devices[num_device] に情報を書き込み num_device をインクリメントする． */
+    /** @brief devices の確保済み要素数 */
+    int device_capacity = 0;
+
+    /** @brief devices[num_device] に情報を書き込み num_device をインクリメントする．
+     *
+     * 領域が足りなければ倍に伸ばす．
+     */
     Error AddDevice(const Device &device)
     {
-        if (num_device == devices.size())
+        if (num_device == device_capacity)
         {
-            return MAKE_ERROR(Error::kFull);
+            const int new_capacity = device_capacity ? device_capacity * 2 : 32;
+            auto new_devices = reinterpret_cast<Device *>(
+                realloc(devices, sizeof(Device) * new_capacity));
+            if (new_devices == nullptr)
+            {
+                return MAKE_ERROR(Error::kNoEnoughMemory);
+            }
+            devices = new_devices;
+            device_capacity = new_capacity;
         }
 
         devices[num_device] = device;
@@ -38,16 +77,236 @@ namespace
         return MAKE_ERROR(Error::kSuccess);
     }
 
-    Error ScanBus(uint8_t bus);
+    /** @brief 設定空間から BAR の値を読み取る */
+    WithError<uint64_t> ReadBarFromConfig(const Device &device, unsigned int bar_index)
+    {
+        const auto addr = CalcBarAddress(bar_index);
+        const auto bar = ReadConfReg(device, addr);
+
+        // 32 bit address
+        if ((bar & 4u) == 0)
+        {
+            return {bar, MAKE_ERROR(Error::kSuccess)};
+        }
+
+        // 64 bit address
+        if (bar_index >= 5)
+        {
+            return {0, MAKE_ERROR(Error::kIndexOutOfRange)};
+        }
+
+        const auto bar_upper = ReadConfReg(device, addr + 4);
+        return {
+            bar | (static_cast<uint64_t>(bar_upper) << 32),
+            MAKE_ERROR(Error::kSuccess)};
+    }
+
+    /** @brief BAR に全ビット 1 を書いて読み戻し，要求される領域の大きさを求める
+     *
+     * 呼び出し側でメモリ／IO デコードを止めておくこと．
+     */
+    uint64_t SizeBar(const Device &dev, unsigned int bar_index, uint64_t bar)
+    {
+        const auto addr = CalcBarAddress(bar_index);
+        const bool is_64bit = (bar & 1u) == 0 && (bar & 4u);
+
+        WriteConfReg(dev, addr, 0xffffffffu);
+        uint64_t mask = ReadConfReg(dev, addr);
+        WriteConfReg(dev, addr, bar & 0xffffffffu);
+        if (is_64bit)
+        {
+            WriteConfReg(dev, addr + 4, 0xffffffffu);
+            mask |= static_cast<uint64_t>(ReadConfReg(dev, addr + 4)) << 32;
+            WriteConfReg(dev, addr + 4, bar >> 32);
+        }
+        else
+        {
+            mask |= 0xffffffff00000000ull;
+        }
+
+        if (bar & 1u)
+        {
+            // IO 空間は上位 16 ビットが実装されていないことがある
+            mask &= ~static_cast<uint64_t>(0x3);
+            if ((mask & 0xffff0000u) == 0)
+            {
+                mask |= 0xffff0000u;
+            }
+        }
+        else
+        {
+            mask &= ~static_cast<uint64_t>(0xf);
+        }
+
+        if ((mask & 0xffffffffu) == 0 && !is_64bit)
+        {
+            return 0; // 未実装
+        }
+        return ~mask + 1;
+    }
+
+    /** @brief BAR，ケーパビリティの位置を読み取って dev にキャッシュする */
+    void CacheDeviceInfo(Device &dev)
+    {
+        // ヘッダタイプ 0 は BAR が 6 個，1（PCI-PCI ブリッジ）は 2 個
+        const unsigned int layout = dev.header_type & 0x7fu;
+        const unsigned int num_bars = layout == 0 ? 6 : (layout == 1 ? 2 : 0);
+        dev.bars.fill(0);
+        dev.bar_sizes.fill(0);
+
+        // ブリッジの BAR を書き換えると下流やメモリコントローラへのアクセスが乱れ，
+        // ディスプレイはブート時のフレームバッファを BSP が描画中なので，大きさは測らない
+        const bool can_size = layout == 0 &&
+                              !dev.class_code.Match(0x06u) && !dev.class_code.Match(0x03u);
+        const uint32_t command = ReadConfReg(dev, 0x04) & 0xffffu;
+        for (unsigned int i = 0; i < num_bars; ++i)
+        {
+            auto bar = ReadBarFromConfig(dev, i);
+            if (bar.error)
+            {
+                break;
+            }
+            dev.bars[i] = bar.value;
+            if (can_size)
+            {
+                // 測る間だけデコードを止める（上位の Status は書き込みでクリアされるので 0 を書く）
+                WriteConfReg(dev, 0x04, command & ~0x3u);
+                dev.bar_sizes[i] = SizeBar(dev, i, bar.value);
+                WriteConfReg(dev, 0x04, command);
+            }
+            if ((bar.value & 1u) == 0 && (bar.value & 4u))
+            {
+                ++i; // 64 ビット BAR は 2 つ分を使う
+            }
+        }
+
+        dev.msi_cap_addr = 0;
+        dev.msix_cap_addr = 0;
+        dev.pcie_cap_addr = 0;
+        const uint16_t status = ReadConfReg(dev, 0x04) >> 16;
+        if ((status & (1u << 4)) == 0) // Capabilities List
+        {
+            return;
+        }
+        uint8_t cap_addr = ReadConfReg(dev, 0x34) & 0xfcu;
+        for (int n = 0; cap_addr != 0 && n < 48; ++n)
+        {
+            auto header = ReadCapabilityHeader(dev, cap_addr);
+            switch (header.bits.cap_id)
+            {
+            case kCapabilityMSI:
+                dev.msi_cap_addr = cap_addr;
+                break;
+            case kCapabilityMSIX:
+                dev.msix_cap_addr = cap_addr;
+                break;
+            case kCapabilityPCIExpress:
+                dev.pcie_cap_addr = cap_addr;
+                break;
+            }
+            cap_addr = header.bits.next_ptr & 0xfcu;
+        }
+    }
+
+    /** @brief 探索中に読み取る，ファンクションのヘッダの先頭部分 */
+    struct FunctionHeader
+    {
+        uint32_t id;        // 0x00: Device ID / Vendor ID
+        uint32_t class_rev; // 0x08: Class Code / Revision ID
+        uint32_t misc;      // 0x0c: BIST / Header Type / Latency Timer / Cache Line Size
+    };
+
+    /** @brief ヘッダの先頭部分を 1 度だけ読み取る．ファンクションが無ければ false． */
+    bool ReadFunctionHeader(uint8_t bus, uint8_t device, uint8_t function,
+                            FunctionHeader &header)
+    {
+        header.id = ReadConfReg(bus, device, function, 0x00);
+        if ((header.id & 0xffffu) == 0xffffu)
+        {
+            return false;
+        }
+        header.class_rev = ReadConfReg(bus, device, function, 0x08);
+        header.misc = ReadConfReg(bus, device, function, 0x0c);
+        return true;
+    }
+
+    /** @brief 幅優先で探索するバスの待ち行列．
+     *
+     * 探索順に devices へ追加するので，bus_queue[q] のバスのデバイスは
+     * devices[bus_first_device[q]] から devices[bus_first_device[q + 1] - 1] に並ぶ．
+     */
+    std::array<uint8_t, 256> bus_queue;
+    std::array<int, 257> bus_first_device;
+    int num_bus_queued;
+    /** @brief PCIe のポートの先でデバイス番号 0 しか存在し得ないバス */
+    std::array<bool, 256> bus_single_device;
+    std::array<bool, 256> bus_queued;
+
+    ScanStats scan_stats;
+
+    void EnqueueBus(uint8_t bus, bool single_device)
+    {
+        if (bus_queued[bus])
+        {
+            return; // ブリッジの設定が重なっていても同じバスは 1 度だけ見る
+        }
+        bus_queued[bus] = true;
+        bus_single_device[bus] = single_device;
+        bus_queue[num_bus_queued] = bus;
+        ++num_bus_queued;
+    }
+
+    /** @brief ブリッジの先のバスを待ち行列に入れる．リンクが落ちているポートの先は飛ばす． */
+    void EnqueueSecondaryBus(const Device &bridge)
+    {
+        const uint32_t bus_numbers = ReadBusNumbers(bridge.bus, bridge.device, bridge.function);
+        const uint8_t secondary_bus = (bus_numbers >> 8) & 0xffu;
+        const uint8_t subordinate_bus = (bus_numbers >> 16) & 0xffu;
+        if (secondary_bus <= bridge.bus || subordinate_bus < secondary_bus)
+        {
+            ++scan_stats.buses_skipped; // ファームウェアが番号を割り当てていない
+            return;
+        }
+
+        bool single_device = false;
+        if (const uint8_t cap = FindCapability(bridge, kCapabilityPCIExpress))
+        {
+            const uint32_t pcie_caps = ReadConfReg(bridge, cap) >> 16;
+            const unsigned int port_type = (pcie_caps >> 4) & 0xfu;
+            if (port_type == 0x4 || port_type == 0x6) // Root Port / Downstream Port
+            {
+                // ARI が有効ならデバイス番号の部分もファンクション番号として使われる
+                const bool ari = (ReadConfReg(bridge, cap + 0x28) >> 5) & 1u;
+                single_device = !ari;
+
+                const uint32_t link_caps = ReadConfReg(bridge, cap + 0x0c);
+                const uint16_t link_status = ReadConfReg(bridge, cap + 0x10) >> 16;
+                if (((link_caps >> 20) & 1u) && ((link_status >> 13) & 1u) == 0)
+                {
+                    ++scan_stats.buses_skipped; // Data Link Layer Link Active が 0
+                    return;
+                }
+            }
+        }
+        EnqueueBus(secondary_bus, single_device);
+    }
 
     /** @brief 指定のファンクションを devices に追加する．
-   * もし PCI-PCI ブリッジなら，セカンダリバスに対し ScanBus を実行する
-   */
-    Error ScanFunction(uint8_t bus, uint8_t device, uint8_t function)
+     * もし PCI-PCI ブリッジなら，セカンダリバスを待ち行列に入れる．
+     */
+    Error ScanFunction(uint8_t bus, uint8_t device, uint8_t function,
+                       const FunctionHeader &header)
     {
-        auto class_code = ReadClassCode(bus, device, function);
-        auto header_type = ReadHeaderType(bus, device, function);
+        ClassCode class_code;
+        class_code.base = (header.class_rev >> 24) & 0xffu;
+        class_code.sub = (header.class_rev >> 16) & 0xffu;
+        class_code.interface = (header.class_rev >> 8) & 0xffu;
+        const uint8_t header_type = (header.misc >> 16) & 0xffu;
+
         Device dev{bus, device, function, header_type, class_code};
+        dev.vendor_id = header.id & 0xffffu;
+        dev.device_id = header.id >> 16;
+        dev.driver = nullptr;
         if (auto err = AddDevice(dev))
         {
             return err;
@@ -56,59 +315,180 @@ namespace
         if (class_code.Match(0x06u, 0x04u))
         {
             // standard PCI-PCI bridge
-            auto bus_numbers = ReadBusNumbers(bus, device, function);
-            uint8_t secondary_bus = (bus_numbers >> 8) & 0xffu;
-            return ScanBus(secondary_bus);
+            EnqueueSecondaryBus(dev);
         }
-
         return MAKE_ERROR(Error::kSuccess);
     }
 
-    /** @brief 指定のデバイス番号の各ファンクションをスキャンする．
-   * 有効なファンクションを見つけたら ScanFunction を実行する．
-   */
-    Error ScanDevice(uint8_t bus, uint8_t device)
+    /** @brief 指定のバス番号の各デバイス，各ファンクションをスキャンする */
+    Error ScanBus(uint8_t bus)
     {
-        if (auto err = ScanFunction(bus, device, 0))
+        const uint8_t num_slots = bus_single_device[bus] ? 1 : 32;
+        const int first = num_device;
+        for (uint8_t device = 0; device < num_slots; ++device)
         {
-            return err;
+            FunctionHeader header;
+            if (!ReadFunctionHeader(bus, device, 0, header))
+            {
+                continue;
+            }
+            if (auto err = ScanFunction(bus, device, 0, header))
+            {
+                return err;
+            }
+            if (IsSingleFunctionDevice((header.misc >> 16) & 0xffu))
+            {
+                continue;
+            }
+
+            for (uint8_t function = 1; function < 8; ++function)
+            {
+                if (!ReadFunctionHeader(bus, device, function, header))
+                {
+                    continue;
+                }
+                if (auto err = ScanFunction(bus, device, function, header))
+                {
+                    return err;
+                }
+            }
         }
-        if (IsSingleFunctionDevice(ReadHeaderType(bus, device, 0)))
+
+        ++scan_stats.buses_scanned;
+        if (num_device == first)
         {
-            return MAKE_ERROR(Error::kSuccess);
+            ++scan_stats.buses_empty;
         }
+        return MAKE_ERROR(Error::kSuccess);
+    }
 
-        for (uint8_t function = 1; function < 8; ++function)
+    /** @brief バス 0 から幅優先で全バスを探索する */
+    Error ScanFromHostBridge()
+    {
+        num_bus_queued = 0;
+        bus_queued.fill(false);
+
+        FunctionHeader header;
+        if (!ReadFunctionHeader(0, 0, 0, header) ||
+            IsSingleFunctionDevice((header.misc >> 16) & 0xffu))
         {
-            if (ReadVendorId(bus, device, function) == 0xffffu)
+            EnqueueBus(0, false);
+        }
+        else
+        {
+            // ホストブリッジのファンクション番号がそのまま担当するバス番号
+            for (uint8_t function = 0; function < 8; ++function)
             {
-                continue;
+                if (ReadVendorId(0, 0, function) != 0xffffu)
+                {
+                    EnqueueBus(function, false);
+                }
             }
-            if (auto err = ScanFunction(bus, device, function))
+        }
+
+        for (int q = 0; q < num_bus_queued; ++q)
+        {
+            bus_first_device[q] = num_device;
+            if (auto err = ScanBus(bus_queue[q]))
             {
+                bus_first_device[q + 1] = num_device;
+                num_bus_queued = q + 1;
                 return err;
             }
         }
+        bus_first_device[num_bus_queued] = num_device;
         return MAKE_ERROR(Error::kSuccess);
     }
 
-    /** @brief 指定のバス番号の各デバイスをスキャンする．
-   * 有効なデバイスを見つけたら ScanDevice を実行する．
-   */
-    Error ScanBus(uint8_t bus)
+    /** @brief bus_queue[begin, end) のバス上のデバイスについて BAR やケーパビリティを読み取る */
+    void CacheBusDevices(size_t begin, size_t end, void *)
     {
-        for (uint8_t device = 0; device < 32; ++device)
+        for (size_t q = begin; q < end; ++q)
         {
-            if (ReadVendorId(bus, device, 0) == 0xffffu)
+            for (int i = bus_first_device[q]; i < bus_first_device[q + 1]; ++i)
             {
-                continue;
+                CacheDeviceInfo(devices[i]);
             }
-            if (auto err = ScanDevice(bus, device))
+        }
+    }
+
+    uint32_t MakeKey(uint8_t base, uint8_t sub, uint8_t interface)
+    {
+        return (static_cast<uint32_t>(base) << 16) | (static_cast<uint32_t>(sub) << 8) | interface;
+    }
+
+    uint32_t ClassKey(const Device &dev)
+    {
+        return MakeKey(dev.class_code.base, dev.class_code.sub, dev.class_code.interface);
+    }
+
+    uint32_t IDKey(const Device &dev)
+    {
+        return (static_cast<uint32_t>(dev.vendor_id) << 16) | dev.device_id;
+    }
+
+    /** @brief devices の添字をクラスコード順，ID 順に並べた索引 */
+    int *class_index = nullptr;
+    int *id_index = nullptr;
+
+    Error BuildIndex(int *&index, uint32_t (*key)(const Device &))
+    {
+        auto new_index = reinterpret_cast<int *>(realloc(index, sizeof(int) * (num_device ? num_device : 1)));
+        if (new_index == nullptr)
+        {
+            return MAKE_ERROR(Error::kNoEnoughMemory);
+        }
+        index = new_index;
+        for (int i = 0; i < num_device; ++i)
+        {
+            index[i] = i;
+        }
+        // 同じキーのデバイスはバス番号順（発見順）に並べる
+        std::stable_sort(index, index + num_device, [key](int a, int b)
+                         { return key(devices[a]) < key(devices[b]); });
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    Error BuildIndexes()
+    {
+        if (auto err = BuildIndex(class_index, ClassKey))
+        {
+            return err;
+        }
+        return BuildIndex(id_index, IDKey);
+    }
+
+    /** @brief 索引からキーが [lo, hi] にあり pred を満たす n 番目のデバイスを二分探索で探す */
+    template <class Pred>
+    Device *FindInIndex(const int *index, uint32_t (*key)(const Device &),
+                        uint32_t lo, uint32_t hi, int n, Pred pred)
+    {
+        if (index == nullptr)
+        {
+            return nullptr;
+        }
+        auto it = std::lower_bound(index, index + num_device, lo, [key](int i, uint32_t k)
+                                   { return key(devices[i]) < k; });
+        for (; it != index + num_device && key(devices[*it]) <= hi; ++it)
+        {
+            if (pred(devices[*it]) && n-- == 0)
             {
-                return err;
+                return &devices[*it];
             }
         }
-        return MAKE_ERROR(Error::kSuccess);
+        return nullptr;
+    }
+
+    std::array<Driver, 16> drivers;
+    int num_driver = 0;
+
+    bool DriverMatches(const Driver &driver, const Device &dev)
+    {
+        return (driver.vendor_id == kAnyID || driver.vendor_id == dev.vendor_id) &&
+               (driver.device_id == kAnyID || driver.device_id == dev.device_id) &&
+               (driver.base == kAnyClass || driver.base == dev.class_code.base) &&
+               (driver.sub == kAnyClass || driver.sub == dev.class_code.sub) &&
+               (driver.interface == kAnyClass || driver.interface == dev.class_code.interface);
     }
 
     /** @brief 指定された MSI ケーパビリティ構造を読み取る
@@ -194,12 +574,69 @@ namespace
         return MAKE_ERROR(Error::kSuccess);
     }
 
-    /** @brief 指定された MSI レジスタを設定する */
-    Error ConfigureMSIXRegister(const Device &dev, uint8_t cap_addr,
-                                uint32_t msg_addr, uint32_t msg_data,
+    /** @brief 指定された MSI-X レジスタを設定する
+     *
+     * 先頭の 2^num_vector_exponent 個（テーブルの大きさまで）のエントリに
+     * msg_data から連番のベクタを割り当て，マスクを解除して有効にする．
+     * ケーパビリティの位置は InitializeMSIX() が dev.msix_cap_addr から得る．
+     */
+    Error ConfigureMSIXRegister(const Device &dev, uint32_t msg_addr, uint32_t msg_data,
                                 unsigned int num_vector_exponent)
     {
-        return MAKE_ERROR(Error::kNotImplemented);
+        MSIX msix;
+        if (auto err = InitializeMSIX(dev, msix))
+        {
+            return err;
+        }
+
+        unsigned int num_vectors = 1u << num_vector_exponent;
+        if (num_vectors > msix.table_size)
+        {
+            num_vectors = msix.table_size;
+        }
+        for (unsigned int i = 0; i < num_vectors; ++i)
+        {
+            msix.table[i].msg_addr = msg_addr;
+            msix.table[i].msg_upper_addr = 0;
+            msix.table[i].msg_data = msg_data + i;
+            UnmaskMSIXVector(msix, i);
+        }
+
+        EnableMSIX(msix);
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    /** @brief MSI / MSI-X のメッセージアドレスを作る */
+    uint32_t MakeMSIAddress(uint8_t apic_id)
+    {
+        return 0xfee00000u | (apic_id << 12);
+    }
+
+    /** @brief MSI / MSI-X のメッセージデータを作る */
+    uint32_t MakeMSIData(MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
+                         uint8_t vector)
+    {
+        uint32_t msg_data = (static_cast<uint32_t>(delivery_mode) << 8) | vector;
+        if (trigger_mode == MSITriggerMode::kLevel)
+        {
+            msg_data |= 0xc000;
+        }
+        return msg_data;
+    }
+
+    const uint32_t kMSIXEnable = 1u << 31;       // Message Control bit 15
+    const uint32_t kMSIXFunctionMask = 1u << 30; // Message Control bit 14
+    const uint32_t kMSIXVectorMask = 1u;
+
+    /** @brief BIR で指定された BAR の MMIO ベースアドレスを返す．I/O 空間なら 0． */
+    uintptr_t MSIXBarBase(const Device &dev, unsigned int bir)
+    {
+        auto bar = ReadBar(dev, bir);
+        if (bar.error || (bar.value & 1u))
+        {
+            return 0;
+        }
+        return bar.value & ~static_cast<uint64_t>(0xf);
     }
 }
 
@@ -220,28 +657,81 @@ namespace pci
         return IoIn32(kConfigData);
     }
 
+    void InitializeConfigAccess()
+    {
+        ecam_bus_base.fill(0);
+        for (int i = 0; i < acpi::num_ecam_region; ++i)
+        {
+            const auto &region = acpi::ecam_regions[i];
+            if (region.segment_group != 0)
+            {
+                continue; // セグメント 0 以外は扱わない
+            }
+            for (int bus = region.start_bus; bus <= region.end_bus; ++bus)
+            {
+                // UEFI が MMIO 領域もアイデンティティマップしているので，物理アドレスをそのまま使う
+                ecam_bus_base[bus] = region.base_address + (static_cast<uintptr_t>(bus) << 20);
+            }
+        }
+    }
+
+    bool IsECAMAvailable(uint8_t bus)
+    {
+        return ecam_bus_base[bus] != 0;
+    }
+
+    uint32_t ReadConfReg(uint8_t bus, uint8_t device, uint8_t function, uint16_t reg_addr)
+    {
+        if (IsECAMAvailable(bus))
+        {
+            return ECAMRegister(bus, device, function, reg_addr);
+        }
+        if (reg_addr >= 0x100)
+        {
+            return 0xffffffffu;
+        }
+
+        IRQSaveLockGuard guard{config_port_lock};
+        WriteAddress(MakeAddress(bus, device, function, reg_addr));
+        return ReadData();
+    }
+
+    void WriteConfReg(uint8_t bus, uint8_t device, uint8_t function,
+                      uint16_t reg_addr, uint32_t value)
+    {
+        if (IsECAMAvailable(bus))
+        {
+            ECAMRegister(bus, device, function, reg_addr) = value;
+            return;
+        }
+        if (reg_addr >= 0x100)
+        {
+            return;
+        }
+
+        IRQSaveLockGuard guard{config_port_lock};
+        WriteAddress(MakeAddress(bus, device, function, reg_addr));
+        WriteData(value);
+    }
+
     uint16_t ReadVendorId(uint8_t bus, uint8_t device, uint8_t function)
     {
-        WriteAddress(MakeAddress(bus, device, function, 0x00));
-        return ReadData() & 0xffffu;
+        return ReadConfReg(bus, device, function, 0x00) & 0xffffu;
     }
 
     uint16_t ReadDeviceId(uint8_t bus, uint8_t device, uint8_t function)
     {
-        WriteAddress(MakeAddress(bus, device, function, 0x00));
-        return ReadData() >> 16;
+        return ReadConfReg(bus, device, function, 0x00) >> 16;
     }
 
     uint8_t ReadHeaderType(uint8_t bus, uint8_t device, uint8_t function)
     {
-        WriteAddress(MakeAddress(bus, device, function, 0x0c));
-        return (ReadData() >> 16) & 0xffu;
+        return (ReadConfReg(bus, device, function, 0x0c) >> 16) & 0xffu;
     }
 
     ClassCode ReadClassCode(uint8_t bus, uint8_t device, uint8_t function)
     {
-        WriteAddress(MakeAddress(bus, device, function, 0x08));
-        auto reg = ReadData();
+        auto reg = ReadConfReg(bus, device, function, 0x08);
         ClassCode cc;
         cc.base = (reg >> 24) & 0xffu;
         cc.sub = (reg >> 16) & 0xffu;
@@ -251,8 +741,7 @@ namespace pci
 
     uint32_t ReadBusNumbers(uint8_t bus, uint8_t device, uint8_t function)
     {
-        WriteAddress(MakeAddress(bus, device, function, 0x18));
-        return ReadData();
+        return ReadConfReg(bus, device, function, 0x18);
     }
 
     bool IsSingleFunctionDevice(uint8_t header_type)
@@ -262,66 +751,182 @@ namespace pci
 
     Error ScanAllBus()
     {
+        const uint32_t start_pm = acpi::HasPMTimer() ? acpi::ReadPMTimer() : 0;
+        const uint64_t start_tsc = __builtin_ia32_rdtsc();
+
         num_device = 0;
+        scan_stats = ScanStats{};
+        auto err = ScanFromHostBridge();
 
-        auto header_type = ReadHeaderType(0, 0, 0);
-        if (IsSingleFunctionDevice(header_type))
+        // BAR の大きさの測定などで 1 デバイスあたり数十回アクセスするので，
+        // ECAM でロックなしにアクセスできるならバスごとに CPU に振り分ける
+        scan_stats.num_cpus = IsECAMAvailable(0) ? smp::NumCPUs() : 1;
+        if (scan_stats.num_cpus > 1)
+        {
+            task::ParallelFor(0, num_bus_queued, 1, CacheBusDevices, nullptr);
+        }
+        else
         {
-            return ScanBus(0);
+            CacheBusDevices(0, num_bus_queued, nullptr);
         }
 
-        for (uint8_t function = 0; function < 8; ++function)
+        scan_stats.num_functions = num_device;
+        scan_stats.tsc_cycles = __builtin_ia32_rdtsc() - start_tsc;
+        if (acpi::HasPMTimer())
         {
-            if (ReadVendorId(0, 0, function) == 0xffffu)
-            {
-                continue;
-            }
-            if (auto err = ScanBus(function))
-            {
-                return err;
-            }
+            scan_stats.elapsed_us = static_cast<uint64_t>(
+                acpi::PMTimerDelta(start_pm, acpi::ReadPMTimer())) * 1000000 / acpi::kPMTimerFrequency;
         }
-        return MAKE_ERROR(Error::kSuccess);
+        Log(kInfo, "pci: %d functions on %d buses (%d empty, %d skipped) in %lu us, %lu cycles, %d CPUs\n",
+            scan_stats.num_functions, scan_stats.buses_scanned, scan_stats.buses_empty,
+            scan_stats.buses_skipped, scan_stats.elapsed_us, scan_stats.tsc_cycles,
+            scan_stats.num_cpus);
+
+        if (auto index_err = BuildIndexes())
+        {
+            return index_err;
+        }
+        return err;
     }
 
-    uint32_t ReadConfReg(const Device &dev, uint8_t reg_addr)
+    const ScanStats &LastScanStats()
     {
-        WriteAddress(MakeAddress(dev.bus, dev.device, dev.function, reg_addr));
-        return ReadData();
+        return scan_stats;
     }
 
-    void WriteConfReg(const Device &dev, uint8_t reg_addr, uint32_t value)
+    Device *FindByClass(uint8_t base, uint8_t sub, uint8_t interface, int index)
     {
-        WriteAddress(MakeAddress(dev.bus, dev.device, dev.function, reg_addr));
-        WriteData(value);
+        const uint32_t lo = MakeKey(base, sub == kAnyClass ? 0 : sub,
+                                    interface == kAnyClass ? 0 : interface);
+        const uint32_t hi = MakeKey(base, sub == kAnyClass ? 0xff : sub,
+                                    interface == kAnyClass ? 0xff : interface);
+        return FindInIndex(class_index, ClassKey, lo, hi, index,
+                           [=](const Device &dev)
+                           {
+                               return (sub == kAnyClass || dev.class_code.sub == sub) &&
+                                      (interface == kAnyClass || dev.class_code.interface == interface);
+                           });
+    }
+
+    Device *FindByID(uint16_t vendor_id, uint16_t device_id, int index)
+    {
+        const uint32_t lo = (static_cast<uint32_t>(vendor_id) << 16) |
+                            (device_id == kAnyID ? 0 : device_id);
+        const uint32_t hi = (static_cast<uint32_t>(vendor_id) << 16) |
+                            (device_id == kAnyID ? 0xffffu : device_id);
+        return FindInIndex(id_index, IDKey, lo, hi, index,
+                           [](const Device &) { return true; });
+    }
+
+    Error RegisterDriver(const Driver &driver)
+    {
+        if (num_driver == static_cast<int>(drivers.size()))
+        {
+            return MAKE_ERROR(Error::kFull);
+        }
+        drivers[num_driver] = driver;
+        ++num_driver;
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    int ProbeDrivers()
+    {
+        int num_bound = 0;
+        for (int d = 0; d < num_driver; ++d)
+        {
+            const auto &driver = drivers[d];
+            for (int i = 0; i < num_device; ++i)
+            {
+                auto &dev = devices[i];
+                if (dev.driver || !DriverMatches(driver, dev))
+                {
+                    continue;
+                }
+                if (auto err = driver.probe(dev))
+                {
+                    Log(kDebug, "pci: %s rejected %d.%d.%d: %s\n", driver.name,
+                        dev.bus, dev.device, dev.function, err.Name());
+                    continue;
+                }
+                dev.driver = &driver;
+                ++num_bound;
+                Log(kInfo, "pci: %s bound to %d.%d.%d (%04x:%04x)\n", driver.name,
+                    dev.bus, dev.device, dev.function, dev.vendor_id, dev.device_id);
+            }
+        }
+        return num_bound;
     }
 
-    WithError<uint64_t> ReadBar(Device &device, unsigned int bar_index)
+    WithError<uint64_t> ReadBar(const Device &device, unsigned int bar_index)
     {
         if (bar_index >= 6)
         {
             return {0, MAKE_ERROR(Error::kIndexOutOfRange)};
         }
+        return {device.bars[bar_index], MAKE_ERROR(Error::kSuccess)};
+    }
 
-        const auto addr = CalcBarAddress(bar_index);
-        const auto bar = ReadConfReg(device, addr);
+    BarInfo GetBarInfo(const Device &device, unsigned int bar_index)
+    {
+        BarInfo info{BarType::kNone, false, 0, 0};
+        if (bar_index >= 6 || device.bar_sizes[bar_index] == 0)
+        {
+            return info;
+        }
 
-        // 32 bit address
-        if ((bar & 4u) == 0)
+        const uint64_t bar = device.bars[bar_index];
+        info.size = device.bar_sizes[bar_index];
+        if (bar & 1u)
         {
-            return {bar, MAKE_ERROR(Error::kSuccess)};
+            info.type = BarType::kIO;
+            info.base = bar & ~static_cast<uint64_t>(0x3);
+            return info;
         }
 
-        // 64 bit address
-        if (bar_index >= 5)
+        info.type = (bar & 4u) ? BarType::kMemory64 : BarType::kMemory32;
+        info.prefetchable = bar & 8u;
+        info.base = bar & ~static_cast<uint64_t>(0xf);
+        return info;
+    }
+
+    WithError<uintptr_t> MapBar(const Device &device, unsigned int bar_index)
+    {
+        const auto info = GetBarInfo(device, bar_index);
+        if (info.type != BarType::kMemory32 && info.type != BarType::kMemory64)
         {
             return {0, MAKE_ERROR(Error::kIndexOutOfRange)};
         }
 
-        const auto bar_upper = ReadConfReg(device, addr + 4);
-        return {
-            bar | (static_cast<uint64_t>(bar_upper) << 32),
-            MAKE_ERROR(Error::kSuccess)};
+        const auto type = info.prefetchable ? CacheType::kWriteCombining : CacheType::kUncached;
+        if (auto err = SetCacheType(info.base, info.size, type))
+        {
+            return {0, err};
+        }
+        return {info.base, MAKE_ERROR(Error::kSuccess)};
+    }
+
+    void LogResources(LogLevel level)
+    {
+        static const char *const kTypeNames[] = {"none", "io", "mem32", "mem64"};
+        for (int i = 0; i < num_device; ++i)
+        {
+            const auto &dev = devices[i];
+            Log(level, "%02x:%02x.%d %04x:%04x class %02x%02x%02x\n",
+                dev.bus, dev.device, dev.function, dev.vendor_id, dev.device_id,
+                dev.class_code.base, dev.class_code.sub, dev.class_code.interface);
+            for (unsigned int b = 0; b < 6; ++b)
+            {
+                const auto info = GetBarInfo(dev, b);
+                if (info.type == BarType::kNone)
+                {
+                    continue;
+                }
+                Log(level, "  BAR%u %-5s%s %016lx-%016lx (%lu KiB)\n",
+                    b, kTypeNames[static_cast<int>(info.type)],
+                    info.prefetchable ? " pref" : "     ",
+                    info.base, info.base + info.size - 1, info.size / 1024);
+            }
+        }
     }
 
     CapabilityHeader ReadCapabilityHeader(const Device &dev, uint8_t addr)
@@ -331,24 +936,52 @@ namespace pci
         return header;
     }
 
-    Error ConfigureMSI(const Device &dev, uint32_t msg_addr, uint32_t msg_data,
-                       unsigned int num_vector_exponent)
+    uint8_t FindCapability(const Device &dev, uint8_t cap_id)
     {
         uint8_t cap_addr = ReadConfReg(dev, 0x34) & 0xffu;
-        uint8_t msi_cap_addr = 0, msix_cap_addr = 0;
         while (cap_addr != 0)
         {
             auto header = ReadCapabilityHeader(dev, cap_addr);
-            if (header.bits.cap_id == kCapabilityMSI)
+            if (header.bits.cap_id == cap_id)
             {
-                msi_cap_addr = cap_addr;
+                return cap_addr;
             }
-            else if (header.bits.cap_id == kCapabilityMSIX)
+            cap_addr = header.bits.next_ptr;
+        }
+        return 0;
+    }
+
+    uint16_t FindExtendedCapability(const Device &dev, uint16_t cap_id)
+    {
+        if (!IsECAMAvailable(dev.bus))
+        {
+            return 0;
+        }
+
+        uint16_t cap_addr = 0x100;
+        // リストが壊れていても止まるよう，辿る数を拡張空間に収まる最大数で制限する
+        for (int i = 0; cap_addr >= 0x100 && i < (4096 - 0x100) / 4; ++i)
+        {
+            ExtendedCapabilityHeader header;
+            header.data = ReadConfReg(dev, cap_addr);
+            if (header.data == 0 || header.data == 0xffffffffu)
+            {
+                return 0;
+            }
+            if (header.bits.cap_id == cap_id)
             {
-                msix_cap_addr = cap_addr;
+                return cap_addr;
             }
             cap_addr = header.bits.next_ptr;
         }
+        return 0;
+    }
+
+    Error ConfigureMSI(const Device &dev, uint32_t msg_addr, uint32_t msg_data,
+                       unsigned int num_vector_exponent)
+    {
+        const uint8_t msi_cap_addr = dev.msi_cap_addr;
+        const uint8_t msix_cap_addr = dev.msix_cap_addr;
 
         if (msi_cap_addr)
         {
@@ -356,7 +989,7 @@ namespace pci
         }
         else if (msix_cap_addr)
         {
-            return ConfigureMSIXRegister(dev, msix_cap_addr, msg_addr, msg_data, num_vector_exponent);
+            return ConfigureMSIXRegister(dev, msg_addr, msg_data, num_vector_exponent);
         }
         return MAKE_ERROR(Error::kNoPCIMSI);
     }
@@ -366,12 +999,101 @@ namespace pci
         MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
         uint8_t vector, unsigned int num_vector_exponent)
     {
-        uint32_t msg_addr = 0xfee00000u | (apic_id << 12);
-        uint32_t msg_data = (static_cast<uint32_t>(delivery_mode) << 8) | vector;
-        if (trigger_mode == MSITriggerMode::kLevel)
+        uint32_t msg_addr = MakeMSIAddress(apic_id);
+        uint32_t msg_data = MakeMSIData(trigger_mode, delivery_mode, vector);
+        return ConfigureMSI(dev, msg_addr, msg_data, num_vector_exponent);
+    }
+
+    Error InitializeMSIX(const Device &dev, MSIX &msix)
+    {
+        const uint8_t cap_addr = dev.msix_cap_addr;
+        if (cap_addr == 0)
         {
-            msg_data |= 0xc000;
+            return MAKE_ERROR(Error::kNoPCIMSI);
         }
-        return ConfigureMSI(dev, msg_addr, msg_data, num_vector_exponent);
+
+        const uint32_t control = ReadConfReg(dev, cap_addr);
+        const uint32_t table_reg = ReadConfReg(dev, cap_addr + 4);
+        const uint32_t pba_reg = ReadConfReg(dev, cap_addr + 8);
+
+        const uintptr_t table_base = MSIXBarBase(dev, table_reg & 0x7u);
+        const uintptr_t pba_base = MSIXBarBase(dev, pba_reg & 0x7u);
+        if (table_base == 0 || pba_base == 0)
+        {
+            return MAKE_ERROR(Error::kIndexOutOfRange);
+        }
+
+        msix.dev = dev;
+        msix.cap_addr = cap_addr;
+        msix.table_size = ((control >> 16) & 0x7ffu) + 1;
+        msix.table = reinterpret_cast<volatile MSIXTableEntry *>(
+            table_base + (table_reg & ~0x7u));
+        msix.pba = reinterpret_cast<volatile uint64_t *>(
+            pba_base + (pba_reg & ~0x7u));
+
+        // 設定が終わるまで割り込みが飛ばないよう，無効化して全エントリをマスクしておく
+        WriteConfReg(dev, cap_addr, (control & ~kMSIXEnable) | kMSIXFunctionMask);
+        for (unsigned int i = 0; i < msix.table_size; ++i)
+        {
+            msix.table[i].vector_control = msix.table[i].vector_control | kMSIXVectorMask;
+        }
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    Error SetMSIXVector(MSIX &msix, unsigned int index, uint8_t apic_id,
+                        MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
+                        uint8_t vector)
+    {
+        if (index >= msix.table_size)
+        {
+            return MAKE_ERROR(Error::kIndexOutOfRange);
+        }
+
+        // 書き換え途中のアドレスとデータの組で割り込みが飛ばないよう，マスクしてから書く
+        auto &entry = msix.table[index];
+        const uint32_t vector_control = entry.vector_control;
+        entry.vector_control = vector_control | kMSIXVectorMask;
+        entry.msg_addr = MakeMSIAddress(apic_id);
+        entry.msg_upper_addr = 0;
+        entry.msg_data = MakeMSIData(trigger_mode, delivery_mode, vector);
+        entry.vector_control = vector_control;
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    void MaskMSIXVector(MSIX &msix, unsigned int index)
+    {
+        auto &entry = msix.table[index];
+        entry.vector_control = entry.vector_control | kMSIXVectorMask;
+        (void)entry.vector_control; // ポステッドライトを追い出す
+    }
+
+    void UnmaskMSIXVector(MSIX &msix, unsigned int index)
+    {
+        auto &entry = msix.table[index];
+        entry.vector_control = entry.vector_control & ~kMSIXVectorMask;
+        (void)entry.vector_control;
+    }
+
+    bool IsMSIXVectorPending(const MSIX &msix, unsigned int index)
+    {
+        return (msix.pba[index / 64] >> (index % 64)) & 1u;
+    }
+
+    void EnableMSIX(MSIX &msix)
+    {
+        // Command レジスタの Interrupt Disable (bit 10) で INTx を止める
+        // 上位 16 ビットの Status レジスタは書き込みでクリアされるビットがあるので 0 を書く
+        const uint32_t command = ReadConfReg(msix.dev, 0x04) & 0xffffu;
+        WriteConfReg(msix.dev, 0x04, command | (1u << 10));
+
+        const uint32_t control = ReadConfReg(msix.dev, msix.cap_addr);
+        WriteConfReg(msix.dev, msix.cap_addr,
+                     (control | kMSIXEnable) & ~kMSIXFunctionMask);
+    }
+
+    void DisableMSIX(MSIX &msix)
+    {
+        const uint32_t control = ReadConfReg(msix.dev, msix.cap_addr);
+        WriteConfReg(msix.dev, msix.cap_addr, control & ~kMSIXEnable);
     }
 }
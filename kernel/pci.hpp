@@ -10,6 +10,7 @@
 #include <array>
 
 #include "error.hpp"
+#include "logger.hpp"
 
 namespace pci
 {
@@ -34,23 +35,52 @@ namespace pci
         }
     };
 
+    struct Driver;
+
     /** @brief PCI デバイスを操作するための基礎データを格納する
    *
    * バス番号，デバイス番号，ファンクション番号はデバイスを特定するのに必須．
-   * その他の情報は単に利便性のために加えてある．
+   * その他の情報は ScanAllBus() の時点で読み取ってキャッシュしたもので，
+   * 以降コンフィグレーション空間を読み直さずに参照できる．
    * */
     struct Device
     {
         uint8_t bus, device, function, header_type;
         ClassCode class_code;
+        uint16_t vendor_id, device_id;
+        /** @brief ReadBar() と同じ形式の BAR の値．64 ビット BAR の上位側の要素は 0． */
+        std::array<uint64_t, 6> bars;
+        /** @brief 各 BAR が要求する領域の大きさ（バイト）．未実装なら 0． */
+        std::array<uint64_t, 6> bar_sizes;
+        /** @brief 各ケーパビリティのオフセット．無ければ 0． */
+        uint8_t msi_cap_addr, msix_cap_addr, pcie_cap_addr;
+        /** @brief 結び付けられたドライバ．無ければ nullptr． */
+        const Driver *driver;
     };
 
-    /** @brief CONFIG_ADDRESS に指定された整数を書き込む */
-    void WriteAddress(uint32_t address);
-    /** @brief CONFIG_DATA に指定された整数を書き込む */
-    void WriteData(uint32_t value);
-    /** @brief CONFIG_DATA から 32 ビット整数を読み込む */
-    uint32_t ReadData();
+    /** @brief コンフィグレーション空間のアクセス方法を決める
+     *
+     * ACPI MCFG に ECAM 領域があれば，その範囲のバスはメモリマップドアクセスを使う．
+     * それ以外のバスは CONFIG_ADDRESS / CONFIG_DATA の IO ポート経由でアクセスする．
+     * acpi::Initialize() の後に呼ぶこと．
+     */
+    void InitializeConfigAccess();
+
+    /** @brief 指定されたバスに ECAM でアクセスできる場合に真を返す
+     *
+     * ECAM が使えない場合，オフセット 0x100 以降の拡張コンフィグレーション空間にはアクセスできない．
+     */
+    bool IsECAMAvailable(uint8_t bus);
+
+    /** @brief 指定されたファンクションの 32 ビットレジスタを読み取る
+     *
+     * @param reg_addr  レジスタのオフセット（4 バイト境界，0 - 0xffc）
+     * @return 読めないオフセットなら 0xffffffff
+     */
+    uint32_t ReadConfReg(uint8_t bus, uint8_t device, uint8_t function, uint16_t reg_addr);
+    /** @brief 指定されたファンクションの 32 ビットレジスタに書き込む．書けないオフセットは無視する． */
+    void WriteConfReg(uint8_t bus, uint8_t device, uint8_t function,
+                      uint16_t reg_addr, uint32_t value);
 
     /** @brief ベンダ ID レジスタを読み取る（全ヘッダタイプ共通） */
     uint16_t ReadVendorId(uint8_t bus, uint8_t device, uint8_t function);
@@ -61,15 +91,22 @@ namespace pci
     /** @brief クラスコードレジスタを読み取る（全ヘッダタイプ共通） */
     ClassCode ReadClassCode(uint8_t bus, uint8_t device, uint8_t function);
 
+    /** @brief キャッシュ済みのベンダ ID を返す */
     inline uint16_t ReadVendorId(const Device &dev)
     {
-        return ReadVendorId(dev.bus, dev.device, dev.function);
+        return dev.vendor_id;
     }
 
     /** @brief 指定された PCI デバイスの 32 ビットレジスタを読み取る */
-    uint32_t ReadConfReg(const Device &dev, uint8_t reg_addr);
+    inline uint32_t ReadConfReg(const Device &dev, uint16_t reg_addr)
+    {
+        return ReadConfReg(dev.bus, dev.device, dev.function, reg_addr);
+    }
     /** @brief 指定された PCI デバイスの 32 ビットレジスタに書き込む */
-    void WriteConfReg(const Device &dev, uint8_t reg_addr, uint32_t value);
+    inline void WriteConfReg(const Device &dev, uint16_t reg_addr, uint32_t value)
+    {
+        WriteConfReg(dev.bus, dev.device, dev.function, reg_addr, value);
+    }
 
     /** @brief バス番号レジスタを読み取る（ヘッダタイプ 1 用）
    *
@@ -83,23 +120,113 @@ namespace pci
     /** @brief 単一ファンクションの場合に真を返す． */
     bool IsSingleFunctionDevice(uint8_t header_type);
 
-    /** @brief ScanAllBus() により発見された PCI デバイスの一覧 */
-    inline std::array<Device, 32> devices;
+    /** @brief ScanAllBus() により発見された PCI デバイスの一覧
+     *
+     * 要素数に合わせて伸長する．ScanAllBus() を呼び直すと要素の位置が変わり得る．
+     */
+    inline Device *devices;
     /** @brief devices の有効な要素の数 */
     inline int num_device;
     /** @brief PCI デバイスをすべて探索し devices に格納する
    *
-   * バス 0 から再帰的に PCI デバイスを探索し，devices の先頭から詰めて書き込む．
-   * 発見したデバイスの数を num_devices に設定する．
+   * バス 0 からブリッジをたどって幅優先で PCI デバイスを探索し，devices の先頭から詰めて書き込む．
+   * 発見したデバイスの数を num_devices に設定し，クラスコードと ID の索引を作り直す．
+   * ECAM が使えて複数の CPU が動いていれば，BAR などの読み取りはバスごとに並列に行う．
+   * task::Initialize() の後に呼ぶこと．
    */
     Error ScanAllBus();
 
+    /** @brief 直前の ScanAllBus() の統計 */
+    struct ScanStats
+    {
+        int num_functions;
+        int buses_scanned;
+        /** @brief 探索したがデバイスが無かったバスの数 */
+        int buses_empty;
+        /** @brief 番号が未割り当て，またはリンクが落ちているため探索しなかったバスの数 */
+        int buses_skipped;
+        /** @brief デバイス情報の読み取りに使った CPU の数 */
+        int num_cpus;
+        /** @brief 所要時間．ACPI PM タイマが無ければ 0． */
+        uint64_t elapsed_us;
+        uint64_t tsc_cycles;
+    };
+
+    const ScanStats &LastScanStats();
+
+    /** @brief ワイルドカードとして使う ID やクラスコードの値 */
+    const uint16_t kAnyID = 0xffffu;
+    const uint8_t kAnyClass = 0xffu;
+
+    /** @brief クラスコードが一致する index 番目（0 始まり）のデバイス．無ければ nullptr．
+     *
+     * sub と interface には kAnyClass を指定できる．
+     */
+    Device *FindByClass(uint8_t base, uint8_t sub, uint8_t interface, int index = 0);
+    /** @brief ベンダ ID とデバイス ID が一致する index 番目のデバイス．device_id には kAnyID を指定できる． */
+    Device *FindByID(uint16_t vendor_id, uint16_t device_id, int index = 0);
+
+    /** @brief PCI デバイスドライバの登録情報
+     *
+     * ID とクラスコードがすべて一致したデバイスに対して probe を呼ぶ．
+     * 各フィールドは kAnyID / kAnyClass で任意の値に一致する．
+     */
+    struct Driver
+    {
+        const char *name;
+        uint16_t vendor_id, device_id;
+        uint8_t base, sub, interface;
+        /** @brief デバイスを受け持つなら kSuccess を返す */
+        Error (*probe)(Device &dev);
+    };
+
+    /** @brief ドライバを登録する．先に登録したものほど優先される． */
+    Error RegisterDriver(const Driver &driver);
+    /** @brief ドライバの無い各デバイスについて，一致するドライバの probe を呼ぶ
+     *
+     * @return 新たにドライバが結び付いたデバイスの数
+     */
+    int ProbeDrivers();
+
     constexpr uint8_t CalcBarAddress(unsigned int bar_index)
     {
         return 0x10 + 4 * bar_index;
     }
 
-    WithError<uint64_t> ReadBar(Device &device, unsigned int bar_index);
+    /** @brief BAR の値を返す（ScanAllBus() 時点のキャッシュ）
+     *
+     * 64 ビット BAR は上位 32 ビットも合わせた値を返す．
+     */
+    WithError<uint64_t> ReadBar(const Device &device, unsigned int bar_index);
+
+    enum class BarType
+    {
+        kNone,
+        kIO,
+        kMemory32,
+        kMemory64,
+    };
+
+    /** @brief BAR の種類と割り当てられた領域 */
+    struct BarInfo
+    {
+        BarType type;
+        bool prefetchable;
+        uint64_t base;
+        uint64_t size;
+    };
+
+    /** @brief BAR の種類，プリフェッチ可否，ベースアドレス，大きさを返す */
+    BarInfo GetBarInfo(const Device &device, unsigned int bar_index);
+
+    /** @brief メモリ BAR の領域を使えるようにし，先頭アドレスを返す
+     *
+     * プリフェッチ可能な BAR は Write Combining，それ以外は Uncached でマップする．
+     */
+    WithError<uintptr_t> MapBar(const Device &device, unsigned int bar_index);
+
+    /** @brief 全デバイスの BAR の配置をログに出力する */
+    void LogResources(LogLevel level);
 
     /** @brief PCI ケーパビリティレジスタの共通ヘッダ */
     union CapabilityHeader
@@ -115,6 +242,19 @@ namespace pci
 
     const uint8_t kCapabilityMSI = 0x05;
     const uint8_t kCapabilityMSIX = 0x11;
+    const uint8_t kCapabilityPCIExpress = 0x10;
+
+    /** @brief PCI Express 拡張ケーパビリティの共通ヘッダ（オフセット 0x100 から始まるリスト） */
+    union ExtendedCapabilityHeader
+    {
+        uint32_t data;
+        struct
+        {
+            uint32_t cap_id : 16;
+            uint32_t version : 4;
+            uint32_t next_ptr : 12;
+        } __attribute__((packed)) bits;
+    } __attribute__((packed));
 
     /** @brief 指定された PCI デバイスの指定されたケーパビリティレジスタを読み込む
    *
@@ -123,6 +263,17 @@ namespace pci
    */
     CapabilityHeader ReadCapabilityHeader(const Device &dev, uint8_t addr);
 
+    /** @brief 指定された ID のケーパビリティを探す．見つからなければ 0 を返す． */
+    uint8_t FindCapability(const Device &dev, uint8_t cap_id);
+
+    /** @brief 指定された ID の拡張ケーパビリティを探す
+     *
+     * 拡張コンフィグレーション空間は ECAM 経由でしか読めない．
+     *
+     * @return 拡張ケーパビリティのオフセット．見つからなければ 0．
+     */
+    uint16_t FindExtendedCapability(const Device &dev, uint16_t cap_id);
+
     /** @brief MSI ケーパビリティ構造
    *
    * MSI ケーパビリティ構造は 64 ビットサポートの有無などで亜種が沢山ある．
@@ -183,4 +334,51 @@ namespace pci
         const Device &dev, uint8_t apic_id,
         MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
         uint8_t vector, unsigned int num_vector_exponent);
+
+    /** @brief MSI-X テーブルの 1 エントリ */
+    struct MSIXTableEntry
+    {
+        uint32_t msg_addr;
+        uint32_t msg_upper_addr;
+        uint32_t msg_data;
+        uint32_t vector_control; // bit 0: Mask
+    } __attribute__((packed));
+
+    /** @brief デバイスの MSI-X テーブルと PBA を操作するための情報
+     *
+     * テーブルと PBA は BAR が指す MMIO 領域に置かれている．
+     */
+    struct MSIX
+    {
+        Device dev;
+        uint8_t cap_addr;
+        uint16_t table_size; // エントリ数
+        volatile MSIXTableEntry *table;
+        volatile uint64_t *pba; // Pending Bit Array
+    };
+
+    /** @brief MSI-X ケーパビリティを読み，テーブルと PBA の位置を求める
+     *
+     * MSI-X は無効のまま，全エントリをマスクした状態にする．
+     *
+     * @return MSI-X ケーパビリティが無ければ kNoPCIMSI
+     */
+    Error InitializeMSIX(const Device &dev, MSIX &msix);
+
+    /** @brief エントリ index の宛先 APIC とベクタを設定する．マスク状態は変えない． */
+    Error SetMSIXVector(MSIX &msix, unsigned int index, uint8_t apic_id,
+                        MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
+                        uint8_t vector);
+
+    /** @brief エントリ index をマスクする．マスク中に起きた割り込みは PBA に記録される． */
+    void MaskMSIXVector(MSIX &msix, unsigned int index);
+    /** @brief エントリ index のマスクを解除する */
+    void UnmaskMSIXVector(MSIX &msix, unsigned int index);
+    /** @brief エントリ index の割り込みが保留されていれば真を返す */
+    bool IsMSIXVectorPending(const MSIX &msix, unsigned int index);
+
+    /** @brief MSI-X を有効にし，レガシーの INTx 割り込みを止める */
+    void EnableMSIX(MSIX &msix);
+    /** @brief MSI-X を無効にする */
+    void DisableMSIX(MSIX &msix);
 }
@@ -0,0 +1,264 @@
+/**
+ * @file smp.cpp
+ *
+ * マルチプロセッサ（Application Processor）の起動と CPU ごとのデータ．
+ */
+
+#include "smp.hpp"
+
+#include <array>
+#include <atomic>
+#include <cstring>
+
+#include "acpi.hpp"
+#include "asmfunc.h"
+#include "interrupt.hpp"
+#include "lock.hpp"
+#include "logger.hpp"
+#include "memstat.hpp"
+#include "paging.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+namespace
+{
+    using namespace smp;
+
+    const uint32_t kIA32GSBase = 0xc0000101;
+    const uint32_t kIA32EFER = 0xc0000080;
+
+    const uintptr_t kLocalAPICBase = 0xfee00000;
+    const uint32_t kLocalAPICID = 0x020;
+    const uint32_t kLocalAPICSVR = 0x0f0;
+    const uint32_t kLocalAPICICRLow = 0x300;
+    const uint32_t kLocalAPICICRHigh = 0x310;
+
+    volatile uint32_t &LocalAPICRegister(uint32_t offset)
+    {
+        return *reinterpret_cast<volatile uint32_t *>(kLocalAPICBase + offset);
+    }
+
+    /** @brief トランポリンに渡すパラメータ．asmfunc.asm の ap_params と一致させる． */
+    struct APBootParams
+    {
+        uint64_t cr0, cr3, cr4, efer;
+        uint64_t stack_top;
+        uint64_t per_cpu;
+        uint64_t entry;
+        uint16_t kernel_cs, kernel_ss;
+        uint16_t gdtr_limit;
+        uint64_t gdtr_base;
+        /** @brief プロテクトモードで使う CR3．32 ビットしか読めないので 4GiB 未満に置く． */
+        uint32_t boot_cr3;
+    } __attribute__((packed));
+    static_assert(sizeof(APBootParams) == 74);
+
+    /** @brief トランポリンに使う 1MiB 未満のページ数．0 ページ目にコード，1 ページ目に PML4 の複製を置く． */
+    const size_t kTrampolinePages = 2;
+
+    alignas(16) uint8_t ap_stacks[kMaxCPUs][kStackSize];
+    std::array<PerCPU, kMaxCPUs> cpus{};
+    int num_cpus = 0;
+
+    /** @brief ShootdownTLB() を 1 つずつ行うためのロック */
+    SpinLock shootdown_lock;
+    /** @brief TLB を捨て終えていない CPU の数 */
+    std::atomic<int> shootdown_pending{0};
+
+    /** @brief ICR に書き込んで IPI を送り，配送完了を待つ */
+    void SendIPI(uint8_t apic_id, uint32_t icr_low)
+    {
+        LocalAPICRegister(kLocalAPICICRHigh) = static_cast<uint32_t>(apic_id) << 24;
+        LocalAPICRegister(kLocalAPICICRLow) = icr_low;
+        while (LocalAPICRegister(kLocalAPICICRLow) & (1u << 12)) // Delivery Status
+        {
+            __asm__("pause");
+        }
+    }
+
+    /** @brief SIPI で指定できる 1MiB 未満の連続した空きページを探す．見つからなければ 0． */
+    uintptr_t FindTrampolinePages(const MemoryMap &memmap)
+    {
+        const uintptr_t trampoline_size = kTrampolinePages * 4096;
+        const auto buffer = reinterpret_cast<uintptr_t>(memmap.buffer);
+        for (uintptr_t iter = buffer;
+             iter < buffer + memmap.map_size;
+             iter += memmap.descriptor_size)
+        {
+            auto desc = reinterpret_cast<const MemoryDescriptor *>(iter);
+            if (!(desc->type == MemoryType::kEfiConventionalMemory))
+            {
+                continue;
+            }
+
+            // ページ 0 は実モードの IVT なので避ける
+            uintptr_t page = desc->physical_start < 0x1000 ? 0x1000 : desc->physical_start;
+            const uintptr_t end = desc->physical_start + desc->number_of_pages * 4096;
+            if (page + trampoline_size <= end && page + trampoline_size <= 0x100000)
+            {
+                return page;
+            }
+        }
+        return 0;
+    }
+
+    [[noreturn]] void ApMain(PerCPU *cpu)
+    {
+        LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
+        InitializePAT(); // PAT は CPU ごとに設定が必要
+
+        // Local APIC を有効化する（スプリアス割り込みベクタ 0xff）
+        LocalAPICRegister(kLocalAPICSVR) = LocalAPICRegister(kLocalAPICSVR) | 0x1ffu;
+
+        cpu->online = true;
+        task::WorkerLoop(*cpu);
+    }
+
+    /** @brief 1 つの AP を起動し，online になるのを待つ */
+    bool StartAP(PerCPU &cpu, APBootParams &params, uintptr_t trampoline)
+    {
+        params.stack_top = reinterpret_cast<uint64_t>(cpu.stack_top);
+        params.per_cpu = reinterpret_cast<uint64_t>(&cpu);
+
+        const uint32_t vector = trampoline >> 12;
+        SendIPI(cpu.apic_id, 0x00004500); // INIT, level assert
+        WaitMicroseconds(10000);
+
+        for (int sipi = 0; sipi < 2 && !cpu.online; ++sipi)
+        {
+            SendIPI(cpu.apic_id, 0x00004600 | vector); // Start-up
+            WaitMicroseconds(200);
+        }
+
+        for (int i = 0; i < 1000 && !cpu.online; ++i)
+        {
+            WaitMicroseconds(100);
+        }
+        return cpu.online;
+    }
+}
+
+namespace smp
+{
+    uint8_t LocalAPICID()
+    {
+        return LocalAPICRegister(kLocalAPICID) >> 24;
+    }
+
+    int NumCPUs()
+    {
+        return num_cpus;
+    }
+
+    PerCPU &CPU(int cpu_index)
+    {
+        return cpus[cpu_index];
+    }
+
+    void SendFixedIPI(uint8_t apic_id, uint8_t vector)
+    {
+        SendIPI(apic_id, 0x00004000 | vector); // Fixed, level assert
+    }
+
+    void ShootdownTLB()
+    {
+        LockGuard guard{shootdown_lock};
+        const int self = CurrentCPU()->cpu_index;
+        shootdown_pending.store(num_cpus - 1);
+        for (int i = 0; i < num_cpus; ++i)
+        {
+            if (i != self)
+            {
+                SendFixedIPI(cpus[i].apic_id, InterruptVector::kTLBShootdown);
+            }
+        }
+        while (shootdown_pending.load() > 0)
+        {
+            __asm__("pause");
+        }
+    }
+
+    void OnTLBShootdown()
+    {
+        SetCR3(GetCR3());
+        __asm__ volatile("wbinvd");
+        shootdown_pending.fetch_sub(1);
+    }
+
+    void InitializeBSP()
+    {
+        auto &bsp = cpus[0];
+        bsp.self = &bsp;
+        bsp.cpu_index = 0;
+        bsp.apic_id = LocalAPICID();
+        bsp.online = true;
+        bsp.stack_top = nullptr; // UEFI から引き継いだスタックを使う
+        num_cpus = 1;
+
+        WriteMSR(kIA32GSBase, reinterpret_cast<uint64_t>(&bsp));
+    }
+
+    Error StartApplicationProcessors(const MemoryMap &memmap)
+    {
+        const uintptr_t trampoline = FindTrampolinePages(memmap);
+        if (trampoline == 0)
+        {
+            return MAKE_ERROR(Error::kNoEnoughMemory);
+        }
+        // 物理ページのアロケータは無いので，以後も AP 起動用に確保したままにして使用量に計上する
+        memstat::OnAlloc(memstat::Tag::kSMP, reinterpret_cast<void *>(trampoline),
+                         kTrampolinePages * 4096, 0);
+
+        memcpy(reinterpret_cast<void *>(trampoline), ApTrampolineStart,
+               ApTrampolineEnd - ApTrampolineStart);
+        auto &params = *reinterpret_cast<APBootParams *>(
+            trampoline + (ApTrampolineParams - ApTrampolineStart));
+
+        params.cr0 = GetCR0();
+        params.cr3 = GetCR3();
+        // PML4 が 4GiB 以上にあってもプロテクトモードで CR3 に書けるよう，1MiB 未満に複製する．
+        // ロングモードに入った直後に本来の CR3 へ切り替えるので，PML4 以外は共有してよい．
+        const uintptr_t boot_pml4 = trampoline + 4096;
+        memcpy(reinterpret_cast<void *>(boot_pml4),
+               reinterpret_cast<const void *>(params.cr3 & ~uint64_t{0xfff}), 4096);
+        params.boot_cr3 = boot_pml4;
+        params.cr4 = GetCR4();
+        params.efer = ReadMSR(kIA32EFER);
+        params.entry = reinterpret_cast<uint64_t>(ApMain);
+        params.kernel_cs = GetCS();
+        params.kernel_ss = GetSS();
+        StoreGDTR(&params.gdtr_limit);
+
+        const uint8_t bsp_apic_id = cpus[0].apic_id;
+        for (int i = 0; i < acpi::num_local_apic; ++i)
+        {
+            const auto apic_id = acpi::local_apics[i].apic_id;
+            if (apic_id == bsp_apic_id)
+            {
+                continue;
+            }
+            if (num_cpus == kMaxCPUs)
+            {
+                Log(kWarn, "too many CPUs: ignoring APIC ID %d\n", apic_id);
+                continue;
+            }
+
+            auto &cpu = cpus[num_cpus];
+            cpu.self = &cpu;
+            cpu.cpu_index = num_cpus;
+            cpu.apic_id = apic_id;
+            cpu.online = false;
+            cpu.stack_top = ap_stacks[num_cpus] + kStackSize;
+
+            if (!StartAP(cpu, params, trampoline))
+            {
+                Log(kError, "AP (APIC ID %d) did not start\n", apic_id);
+                continue;
+            }
+            ++num_cpus;
+        }
+
+        Log(kInfo, "%d CPU(s) online\n", num_cpus);
+        return MAKE_ERROR(Error::kSuccess);
+    }
+}
@@ -0,0 +1,80 @@
+/**
+ * @file smp.hpp
+ *
+ * マルチプロセッサ（Application Processor）の起動と CPU ごとのデータ．
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+#include "memory_map.hpp"
+
+namespace smp
+{
+    /** @brief 扱える CPU の最大数（BSP を含む） */
+    const int kMaxCPUs = 16;
+    /** @brief 各 AP に割り当てるカーネルスタックのサイズ（バイト） */
+    const size_t kStackSize = 16 * 1024;
+
+    /** @brief CPU ごとのデータ領域
+     *
+     * 各 CPU の GS ベースはこの構造体を指す．
+     * self を先頭に置くことで gs:0 から自身のアドレスを得られる．
+     */
+    struct PerCPU
+    {
+        PerCPU *self;
+        int cpu_index;
+        uint8_t apic_id;
+        volatile bool online;
+        uint8_t *stack_top;
+    };
+
+    /** @brief 実行中の CPU の PerCPU を返す */
+    inline PerCPU *CurrentCPU()
+    {
+        PerCPU *cpu;
+        __asm__ volatile("mov %%gs:0, %0"
+                         : "=r"(cpu));
+        return cpu;
+    }
+
+    /** @brief 実行中の CPU の Local APIC ID を Local APIC レジスタから読む */
+    uint8_t LocalAPICID();
+
+    /** @brief 起動済み（online）の CPU の数 */
+    int NumCPUs();
+    /** @brief cpu_index 番目の CPU のデータ．0 は BSP． */
+    PerCPU &CPU(int cpu_index);
+
+    /** @brief 指定した CPU に Fixed 配送の IPI を送る */
+    void SendFixedIPI(uint8_t apic_id, uint8_t vector);
+
+    /** @brief 自分以外の online な CPU に TLB とキャッシュを捨てさせ，全員が終えるまで待つ
+     *
+     * ページテーブルを書き換えた後に呼ぶ．相手の CPU が割り込みを受けられないと終わらないので，
+     * 割り込みを禁止するロックを持たずに呼ぶこと．
+     */
+    void ShootdownTLB();
+    /** @brief InterruptVector::kTLBShootdown の割り込みハンドラから呼ぶ */
+    void OnTLBShootdown();
+
+    /** @brief BSP の PerCPU を設定し，GS ベースに登録する
+     *
+     * GS ベースを上書きするため，以降 GS セグメントレジスタを書き換えてはいけない．
+     */
+    void InitializeBSP();
+
+    /** @brief ACPI MADT に記載された AP を INIT-SIPI-SIPI で起動する
+     *
+     * acpi::Initialize() と InitializeBSP() の後に呼ぶこと．
+     * 起動した AP はそれぞれの PerCPU とスタックを使って task::WorkerLoop() に入る．
+     *
+     * @param memmap  トランポリンを配置する 1MiB 未満の空き領域を探すためのメモリマップ．
+     *                見つけた 2 ページは AP 起動用に確保したままにする．
+     */
+    Error StartApplicationProcessors(const MemoryMap &memmap);
+}
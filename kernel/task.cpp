@@ -0,0 +1,353 @@
+/**
+ * @file task.cpp
+ *
+ * CPU 間で短いジョブを分散する fork-join 型のタスクランタイム．
+ */
+
+#include "task.hpp"
+
+#include <array>
+
+#include "lock.hpp"
+#include "timer.hpp"
+
+namespace
+{
+    using namespace task;
+
+    /** @brief Chase-Lev の work-stealing deque
+     *
+     * 底（bottom）への Push / Pop は所有 CPU だけが行い，
+     * 頂上（top）からの Steal は任意の CPU が行う．
+     * 容量は固定で，満杯の Push は失敗する．
+     */
+    class Deque
+    {
+    public:
+        bool Push(Job *job)
+        {
+            const int64_t b = bottom_.load(std::memory_order_relaxed);
+            const int64_t t = top_.load(std::memory_order_acquire);
+            if (b - t >= static_cast<int64_t>(kDequeSize))
+            {
+                return false;
+            }
+            buffer_[b % kDequeSize].store(job, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            bottom_.store(b + 1, std::memory_order_relaxed);
+            return true;
+        }
+
+        Job *Pop()
+        {
+            const int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+            bottom_.store(b, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t t = top_.load(std::memory_order_relaxed);
+
+            if (t > b)
+            {
+                bottom_.store(b + 1, std::memory_order_relaxed);
+                return nullptr;
+            }
+
+            Job *job = buffer_[b % kDequeSize].load(std::memory_order_relaxed);
+            if (t == b)
+            {
+                // 最後の 1 つは Steal と取り合いになる
+                if (!top_.compare_exchange_strong(t, t + 1,
+                                                  std::memory_order_seq_cst,
+                                                  std::memory_order_relaxed))
+                {
+                    job = nullptr;
+                }
+                bottom_.store(b + 1, std::memory_order_relaxed);
+            }
+            return job;
+        }
+
+        Job *Steal()
+        {
+            int64_t t = top_.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            const int64_t b = bottom_.load(std::memory_order_acquire);
+            if (t >= b)
+            {
+                return nullptr;
+            }
+
+            Job *job = buffer_[t % kDequeSize].load(std::memory_order_relaxed);
+            if (!top_.compare_exchange_strong(t, t + 1,
+                                              std::memory_order_seq_cst,
+                                              std::memory_order_relaxed))
+            {
+                return nullptr;
+            }
+            return job;
+        }
+
+    private:
+        alignas(64) std::atomic<int64_t> top_{0};
+        alignas(64) std::atomic<int64_t> bottom_{0};
+        std::array<std::atomic<Job *>, kDequeSize> buffer_;
+    };
+
+    struct alignas(64) Worker
+    {
+        Deque deque;
+        std::atomic<bool> sleeping{false};
+        uint32_t rng;
+        WorkerStat stat;
+    };
+
+    /** @brief AP が hlt に入る前にジョブを探して回る回数 */
+    const int kSpinsBeforeSleep = 2000;
+
+    std::array<Worker, smp::kMaxCPUs> workers;
+    std::atomic<int> active_workers{smp::kMaxCPUs};
+    std::atomic<int> num_sleeping{0};
+    uint8_t wakeup_vector;
+    bool initialized = false;
+
+    int ActiveWorkers()
+    {
+        const int active = active_workers.load(std::memory_order_relaxed);
+        const int num_cpus = smp::NumCPUs();
+        return active < num_cpus ? active : num_cpus;
+    }
+
+    uint32_t NextRandom(uint32_t &state)
+    {
+        // xorshift32
+        uint32_t x = state ? state : 0x9e3779b9u;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        return state = x;
+    }
+
+    /** @brief 自 CPU の deque から取り出し，空なら他 CPU から盗む．割り込み禁止で呼ぶ． */
+    Job *FindWork(int self, bool &stolen)
+    {
+        auto &w = workers[self];
+        stolen = false;
+        if (auto job = w.deque.Pop())
+        {
+            return job;
+        }
+
+        const int num = ActiveWorkers();
+        if (num <= 1)
+        {
+            return nullptr;
+        }
+        const int start = NextRandom(w.rng) % num;
+        for (int i = 0; i < num; ++i)
+        {
+            const int victim = (start + i) % num;
+            if (victim == self)
+            {
+                continue;
+            }
+            if (auto job = workers[victim].deque.Steal())
+            {
+                stolen = true;
+                return job;
+            }
+        }
+        return nullptr;
+    }
+
+    void Execute(int self, Job *job, bool stolen)
+    {
+        // 完了を通知した時点で job の領域は解放され得るので，先に group を取り出しておく
+        Group *group = job->group;
+        job->func(job->arg);
+
+        auto &stat = workers[self].stat;
+        ++stat.executed;
+        if (stolen)
+        {
+            ++stat.stolen;
+        }
+        group->pending.fetch_sub(1, std::memory_order_release);
+    }
+
+    /** @brief 眠っているワーカを 1 つ起こす */
+    void WakeOne(int self)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!initialized || num_sleeping.load(std::memory_order_relaxed) == 0)
+        {
+            return;
+        }
+
+        const int num = ActiveWorkers();
+        for (int i = 0; i < num; ++i)
+        {
+            if (i == self)
+            {
+                continue;
+            }
+            if (workers[i].sleeping.exchange(false, std::memory_order_acq_rel))
+            {
+                smp::SendFixedIPI(smp::CPU(i).apic_id, wakeup_vector);
+                return;
+            }
+        }
+    }
+
+    struct RangeArgs
+    {
+        size_t begin, end, grain;
+        void (*body)(size_t b, size_t e, void *arg);
+        void *arg;
+    };
+
+    void ParallelForRange(const RangeArgs &r)
+    {
+        if (r.end - r.begin <= r.grain)
+        {
+            r.body(r.begin, r.end, r.arg);
+            return;
+        }
+
+        // 後半を他 CPU に盗ませ，前半は自分で再帰的に分割する
+        const size_t mid = r.begin + (r.end - r.begin) / 2;
+        RangeArgs right{mid, r.end, r.grain, r.body, r.arg};
+        Group group;
+        Job job;
+        Spawn(group, job, [](void *arg)
+              { ParallelForRange(*static_cast<RangeArgs *>(arg)); },
+              &right);
+
+        ParallelForRange(RangeArgs{r.begin, mid, r.grain, r.body, r.arg});
+        Sync(group);
+    }
+}
+
+namespace task
+{
+    void Initialize(uint8_t vector)
+    {
+        wakeup_vector = vector;
+        for (int i = 0; i < smp::kMaxCPUs; ++i)
+        {
+            workers[i].rng = 0x9e3779b9u * (i + 1);
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        initialized = true;
+    }
+
+    void Spawn(Group &group, Job &job)
+    {
+        job.group = &group;
+        group.pending.fetch_add(1, std::memory_order_relaxed);
+
+        // スレッドの切り替えで同じ CPU の deque を 2 者が所有者として触らないようにする
+        const auto rflags = SaveAndDisableInterrupts();
+        const int self = smp::CurrentCPU()->cpu_index;
+        const bool pushed = workers[self].deque.Push(&job);
+        if (pushed)
+        {
+            WakeOne(self);
+        }
+        RestoreInterrupts(rflags);
+
+        if (!pushed)
+        {
+            Execute(self, &job, false);
+        }
+    }
+
+    void Sync(Group &group)
+    {
+        while (group.pending.load(std::memory_order_acquire) > 0)
+        {
+            bool stolen;
+            const auto rflags = SaveAndDisableInterrupts();
+            const int self = smp::CurrentCPU()->cpu_index;
+            Job *job = FindWork(self, stolen);
+            RestoreInterrupts(rflags);
+
+            if (job)
+            {
+                Execute(self, job, stolen);
+            }
+            else
+            {
+                CPURelax();
+            }
+        }
+    }
+
+    void ParallelFor(size_t begin, size_t end, size_t grain,
+                     void (*body)(size_t b, size_t e, void *arg), void *arg)
+    {
+        if (begin >= end)
+        {
+            return;
+        }
+        ParallelForRange(RangeArgs{begin, end, grain ? grain : 1, body, arg});
+    }
+
+    void SetActiveWorkers(int n)
+    {
+        active_workers.store(n < 1 ? 1 : n, std::memory_order_relaxed);
+    }
+
+    [[noreturn]] void WorkerLoop(smp::PerCPU &cpu)
+    {
+        const int self = cpu.cpu_index;
+        auto &w = workers[self];
+        int spins = 0;
+
+        while (1)
+        {
+            bool stolen = false;
+            Job *job = nullptr;
+            if (self < ActiveWorkers())
+            {
+                job = FindWork(self, stolen);
+            }
+            if (job)
+            {
+                Execute(self, job, stolen);
+                spins = 0;
+                continue;
+            }
+            if (++spins < kSpinsBeforeSleep)
+            {
+                CPURelax();
+                continue;
+            }
+
+            // sleeping を立ててからもう一度探すことで，Spawn() 側の WakeOne() との行き違いを防ぐ
+            num_sleeping.fetch_add(1, std::memory_order_seq_cst);
+            w.sleeping.store(true, std::memory_order_seq_cst);
+            if (self < ActiveWorkers())
+            {
+                job = FindWork(self, stolen);
+            }
+            if (!job)
+            {
+                // sti 直後の 1 命令は割り込みが入らないため，IPI を取りこぼさない
+                __asm__ volatile("sti\n\thlt\n\tcli");
+                ++w.stat.wakeups;
+            }
+            w.sleeping.store(false, std::memory_order_relaxed);
+            num_sleeping.fetch_sub(1, std::memory_order_relaxed);
+            spins = 0;
+
+            if (job)
+            {
+                Execute(self, job, stolen);
+            }
+        }
+    }
+
+    const WorkerStat &Stat(int cpu_index)
+    {
+        return workers[cpu_index].stat;
+    }
+}
@@ -0,0 +1,92 @@
+/**
+ * @file task.hpp
+ *
+ * CPU 間で短いジョブを分散する fork-join 型のタスクランタイム．
+ *
+ * 各 CPU は Chase-Lev 方式の work-stealing deque を持つ．
+ * Spawn() したジョブは実行中 CPU の deque の底に積まれ，
+ * 手の空いた CPU が他 CPU の deque の頂上から盗んで実行する．
+ * Sync() で待つ CPU も待っている間は自らジョブを実行する．
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "logger.hpp"
+#include "smp.hpp"
+
+namespace task
+{
+    /** @brief Sync() で完了をまとめて待つジョブの集合 */
+    struct Group
+    {
+        std::atomic<int> pending{0};
+    };
+
+    /** @brief 1 つのジョブ
+     *
+     * Job の領域は呼び出し側が用意し，対応する Sync() が返るまで生存させる．
+     * fork-join では通常スタック上に置けばよい．
+     */
+    struct Job
+    {
+        void (*func)(void *arg);
+        void *arg;
+        Group *group;
+    };
+
+    /** @brief 各 CPU の deque に積めるジョブ数 */
+    const size_t kDequeSize = 1024;
+
+    /** @brief ランタイムを初期化する．AP を起こすための IPI ベクタを登録する． */
+    void Initialize(uint8_t wakeup_vector);
+
+    /** @brief ジョブを実行中 CPU の deque に積む
+     *
+     * deque が満杯ならその場で実行する．
+     */
+    void Spawn(Group &group, Job &job);
+
+    inline void Spawn(Group &group, Job &job, void (*func)(void *arg), void *arg)
+    {
+        job.func = func;
+        job.arg = arg;
+        Spawn(group, job);
+    }
+
+    /** @brief group のジョブがすべて終わるまで，他のジョブを実行しながら待つ */
+    void Sync(Group &group);
+
+    /** @brief [begin, end) を grain 以下の区間に分割して並列に body を実行する
+     *
+     * body(b, e, arg) は重ならない区間 [b, e) ごとに 1 回ずつ呼ばれる．
+     * すべての呼び出しが終わってから返る．
+     */
+    void ParallelFor(size_t begin, size_t end, size_t grain,
+                     void (*body)(size_t b, size_t e, void *arg), void *arg);
+
+    /** @brief ジョブを盗みに行く CPU を cpu_index < n のものに制限する
+     *
+     * スケーリング測定用．n が CPU 数を超える場合は全 CPU が参加する．
+     */
+    void SetActiveWorkers(int n);
+
+    /** @brief AP のアイドルループ．ジョブを探して実行し，無ければ IPI まで hlt する． */
+    [[noreturn]] void WorkerLoop(smp::PerCPU &cpu);
+
+    /** @brief CPU ごとのジョブ実行統計 */
+    struct WorkerStat
+    {
+        uint64_t executed; // 実行したジョブ数
+        uint64_t stolen;   // そのうち他 CPU から盗んだ数
+        uint64_t wakeups;  // IPI で起こされた回数
+    };
+
+    const WorkerStat &Stat(int cpu_index);
+
+    /** @brief spawn のオーバーヘッドと 1..N CPU でのスケーリングを測定してログに出す */
+    void RunBenchmark(LogLevel level);
+}
@@ -0,0 +1,127 @@
+/**
+ * @file task_bench.cpp
+ *
+ * タスクランタイムのマイクロベンチマーク．
+ *
+ * spawn + sync 1 回あたりのコストと，計算負荷の高い ParallelFor を
+ * 参加 CPU 数 1..N で実行したときの所要時間を測る．
+ */
+
+#include "task.hpp"
+
+#include <atomic>
+
+#include "timer.hpp"
+
+namespace
+{
+    using namespace task;
+
+    uint64_t ReadTSC()
+    {
+        uint32_t lo, hi;
+        __asm__ volatile("rdtsc"
+                         : "=a"(lo), "=d"(hi));
+        return (static_cast<uint64_t>(hi) << 32) | lo;
+    }
+
+    const int kSpawnJobs = kDequeSize / 2;
+    const int kSpawnRounds = 64;
+
+    const size_t kWorkItems = 1 << 16;
+    const size_t kWorkGrain = 256;
+    const int kWorkRounds = 64;
+
+    struct WorkArgs
+    {
+        std::atomic<uint64_t> sum{0};
+    };
+
+    /** @brief 1 要素あたり kWorkRounds 回の xorshift を回す計算負荷 */
+    void WorkBody(size_t begin, size_t end, void *arg)
+    {
+        uint64_t local = 0;
+        for (size_t i = begin; i < end; ++i)
+        {
+            uint64_t x = i * 0x9e3779b97f4a7c15ull + 1;
+            for (int r = 0; r < kWorkRounds; ++r)
+            {
+                x ^= x << 13;
+                x ^= x >> 7;
+                x ^= x << 17;
+            }
+            local += x;
+        }
+        static_cast<WorkArgs *>(arg)->sum.fetch_add(local, std::memory_order_relaxed);
+    }
+
+    /** @brief 空ジョブの spawn + sync 1 回あたりのサイクル数（BSP のみで実行） */
+    uint64_t MeasureSpawnCycles()
+    {
+        static Job jobs[kSpawnJobs];
+        SetActiveWorkers(1);
+
+        const uint64_t start = ReadTSC();
+        for (int round = 0; round < kSpawnRounds; ++round)
+        {
+            Group group;
+            for (auto &job : jobs)
+            {
+                Spawn(group, job, [](void *) {}, nullptr);
+            }
+            Sync(group);
+        }
+        return (ReadTSC() - start) / (kSpawnRounds * kSpawnJobs);
+    }
+
+    uint64_t MeasureParallelFor(int num_workers, uint64_t &sum)
+    {
+        SetActiveWorkers(num_workers);
+        WorkArgs args;
+
+        const uint64_t start = ReadTSC();
+        ParallelFor(0, kWorkItems, kWorkGrain, WorkBody, &args);
+        const uint64_t cycles = ReadTSC() - start;
+
+        sum = args.sum.load(std::memory_order_relaxed);
+        return cycles;
+    }
+}
+
+namespace task
+{
+    void RunBenchmark(LogLevel level)
+    {
+        const uint64_t tsc_per_us = TSCPerMicrosecond();
+        const int num_cpus = smp::NumCPUs();
+
+        const uint64_t spawn_cycles = MeasureSpawnCycles();
+        Log(level, "task: spawn+sync %lu cycles/job (%lu ns)\n",
+            spawn_cycles, spawn_cycles * 1000 / tsc_per_us);
+
+        uint64_t expected_sum;
+        MeasureParallelFor(num_cpus, expected_sum); // ウォームアップ
+        uint64_t base_cycles = 0;
+        for (int n = 1; n <= num_cpus; ++n)
+        {
+            uint64_t sum;
+            const uint64_t cycles = MeasureParallelFor(n, sum);
+            if (n == 1)
+            {
+                base_cycles = cycles;
+            }
+            const uint64_t speedup_x100 = base_cycles * 100 / (cycles ? cycles : 1);
+            Log(level, "task: parallel_for cpus=%d %lu us speedup %lu.%02lu%s\n",
+                n, cycles / tsc_per_us, speedup_x100 / 100, speedup_x100 % 100,
+                sum == expected_sum ? "" : " (WRONG RESULT)");
+        }
+        SetActiveWorkers(smp::kMaxCPUs);
+
+        for (int i = 0; i < num_cpus; ++i)
+        {
+            const auto &stat = Stat(i);
+            Log(level, "task: cpu %d executed %lu stolen %lu wakeups %lu\n",
+                i, stat.executed, stat.stolen, stat.wakeups);
+        }
+    }
+}
@@ -0,0 +1,217 @@
+/**
+ * @file thread.cpp
+ *
+ * プリエンプティブなカーネルスレッド．
+ */
+
+#include "thread.hpp"
+
+#include <new>
+
+#include "asmfunc.h"
+
+namespace
+{
+    void ExitCurrentThread()
+    {
+        thread_manager->Exit();
+    }
+}
+
+ThreadManager::ThreadManager(int main_priority)
+{
+    auto &main = threads_[0];
+    main.id_ = next_id_++;
+    main.priority_ = main_priority;
+    main.state_ = Thread::State::kRunning;
+    main.slice_left_ = kTimeSlice;
+    main.stack_ = nullptr; // KernelMain のスタックをそのまま使う
+    current_ = &main;
+}
+
+Thread *ThreadManager::Create(Thread::EntryType *entry, uint64_t arg, int priority)
+{
+    if (priority < 0 || kNumPriorities <= priority)
+    {
+        return nullptr;
+    }
+
+    IRQSaveLockGuard guard{lock_};
+
+    Thread *thread = nullptr;
+    size_t index = 0;
+    for (size_t i = 1; i < threads_.size(); ++i)
+    {
+        auto s = threads_[i].state_;
+        // 終了したスレッドのスタックは，そのスレッド自身が走っていなければ再利用できる
+        if (s == Thread::State::kUnused ||
+            (s == Thread::State::kDead && &threads_[i] != current_))
+        {
+            thread = &threads_[i];
+            index = i;
+            break;
+        }
+    }
+    if (thread == nullptr)
+    {
+        return nullptr;
+    }
+
+    thread->id_ = next_id_++;
+    thread->priority_ = priority;
+    thread->slice_left_ = kTimeSlice;
+    thread->stack_ = stacks_[index];
+    thread->next_ = nullptr;
+
+    // SwitchContext が pop r15..rbx して ThreadEntry へ ret するスタックを作る
+    auto stack_top = reinterpret_cast<uint64_t *>(thread->stack_ + kStackSize);
+    stack_top[-1] = reinterpret_cast<uint64_t>(ThreadEntry);
+    stack_top[-2] = 0;                                              // rbx
+    stack_top[-3] = 0;                                              // rbp
+    stack_top[-4] = reinterpret_cast<uint64_t>(entry);              // r12
+    stack_top[-5] = arg;                                            // r13
+    stack_top[-6] = reinterpret_cast<uint64_t>(ExitCurrentThread); // r14
+    stack_top[-7] = 0;                                              // r15
+    thread->rsp_ = reinterpret_cast<uint64_t>(&stack_top[-7]);
+
+    thread->state_ = Thread::State::kReady;
+    Enqueue(thread);
+    return thread;
+}
+
+void ThreadManager::Yield()
+{
+    const auto rflags = lock_.LockIRQSave();
+    Schedule(rflags);
+}
+
+void ThreadManager::Sleep()
+{
+    const auto rflags = lock_.LockIRQSave();
+    current_->state_ = Thread::State::kSleeping;
+    Schedule(rflags);
+}
+
+void ThreadManager::Wakeup(Thread *thread)
+{
+    IRQSaveLockGuard guard{lock_};
+    if (thread->state_ != Thread::State::kSleeping)
+    {
+        return;
+    }
+    thread->state_ = Thread::State::kReady;
+    Enqueue(thread);
+}
+
+void ThreadManager::Exit()
+{
+    const auto rflags = lock_.LockIRQSave();
+    current_->state_ = Thread::State::kDead;
+    Schedule(rflags);
+    while (1)
+        __asm__("hlt");
+}
+
+void ThreadManager::OnTimerInterrupt()
+{
+    lock_.Lock();
+    if (idling_)
+    {
+        // Schedule() の待機ループが割り込まれた．切り替えはループ側に任せる．
+        lock_.Unlock();
+        return;
+    }
+    if (--current_->slice_left_ > 0)
+    {
+        // より優先度の高いスレッドが起きていればすぐに譲る
+        bool higher_ready = false;
+        for (int p = current_->priority_ + 1; p < kNumPriorities; ++p)
+        {
+            higher_ready |= ready_head_[p] != nullptr;
+        }
+        if (!higher_ready)
+        {
+            lock_.Unlock();
+            return;
+        }
+    }
+    Schedule(0);
+}
+
+void ThreadManager::Enqueue(Thread *thread)
+{
+    const int p = thread->priority_;
+    thread->next_ = nullptr;
+    if (ready_tail_[p])
+    {
+        ready_tail_[p]->next_ = thread;
+    }
+    else
+    {
+        ready_head_[p] = thread;
+    }
+    ready_tail_[p] = thread;
+}
+
+Thread *ThreadManager::Dequeue()
+{
+    for (int p = kNumPriorities - 1; p >= 0; --p)
+    {
+        if (auto thread = ready_head_[p])
+        {
+            ready_head_[p] = thread->next_;
+            if (ready_head_[p] == nullptr)
+            {
+                ready_tail_[p] = nullptr;
+            }
+            thread->next_ = nullptr;
+            return thread;
+        }
+    }
+    return nullptr;
+}
+
+void ThreadManager::Schedule(uint64_t rflags)
+{
+    Thread *prev = current_;
+    if (prev->state_ == Thread::State::kRunning)
+    {
+        prev->state_ = Thread::State::kReady;
+        Enqueue(prev);
+    }
+
+    Thread *next = Dequeue();
+    while (next == nullptr)
+    {
+        // 実行可能なスレッドが無い．割り込みで誰かが起きるまで待つ．
+        idling_ = true;
+        lock_.Unlock();
+        __asm__("sti\n\thlt\n\tcli");
+        lock_.Lock();
+        idling_ = false;
+        next = Dequeue();
+    }
+
+    next->state_ = Thread::State::kRunning;
+    next->slice_left_ = kTimeSlice;
+    current_ = next;
+    lock_.Unlock();
+
+    if (next != prev)
+    {
+        SwitchContext(&prev->rsp_, next->rsp_);
+    }
+    RestoreInterrupts(rflags);
+}
+
+namespace
+{
+    alignas(ThreadManager) char thread_manager_buf[sizeof(ThreadManager)];
+}
+
+ThreadManager *thread_manager;
+
+void InitializeThread(int main_priority)
+{
+    thread_manager = new (thread_manager_buf) ThreadManager(main_priority);
+}
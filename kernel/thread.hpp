@@ -0,0 +1,115 @@
+/**
+ * @file thread.hpp
+ *
+ * プリエンプティブなカーネルスレッド．
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+#include "lock.hpp"
+
+/** @brief カーネルスレッド
+ *
+ * スタックは ThreadManager が静的に確保した領域から割り当てる．
+ */
+class Thread
+{
+public:
+    using EntryType = void(uint64_t arg);
+
+    enum class State
+    {
+        kUnused,
+        kReady,
+        kRunning,
+        kSleeping,
+        kDead,
+    };
+
+    uint64_t ID() const { return id_; }
+    int Priority() const { return priority_; }
+    State State() const { return state_; }
+
+private:
+    friend class ThreadManager;
+
+    uint64_t id_;
+    /** SwitchContext で退避したスタックポインタ */
+    uint64_t rsp_;
+    int priority_;
+    enum State state_ = State::kUnused;
+    /** 実行可能キューで次に並ぶスレッド */
+    Thread *next_ = nullptr;
+    /** このタイムスライスの残り tick 数 */
+    int slice_left_;
+    uint8_t *stack_;
+};
+
+/** @brief カーネルスレッドの生成とスケジューリング
+ *
+ * 優先度ごとの実行可能キューを持ち，最も優先度の高い空でないキューの先頭から
+ * 実行する．同じ優先度のスレッドは Local APIC タイマによるタイムスライスで
+ * ラウンドロビンする．
+ */
+class ThreadManager
+{
+public:
+    /** @brief 優先度の段階数．数値が大きいほど優先される． */
+    static const int kNumPriorities = 4;
+    static const int kMaxThreads = 32;
+    static const size_t kStackSize = 16 * 1024;
+    /** @brief タイムスライスの長さ（タイマ tick 数） */
+    static const int kTimeSlice = 2;
+
+    /** @brief 呼び出し元の実行コンテキストを最初のスレッドとして登録する */
+    ThreadManager(int main_priority);
+
+    /** @brief スレッドを生成して実行可能キューに入れる
+     *
+     * @return 空きスロットが無ければ nullptr
+     */
+    Thread *Create(Thread::EntryType *entry, uint64_t arg, int priority);
+
+    /** @brief 実行中のスレッド */
+    Thread *Current() const { return current_; }
+
+    /** @brief 同じ優先度以上の他スレッドに CPU を譲る */
+    void Yield();
+    /** @brief 実行中のスレッドを Wakeup() されるまで休止させる */
+    void Sleep();
+    /** @brief 休止中のスレッドを実行可能にする */
+    void Wakeup(Thread *thread);
+    /** @brief 実行中のスレッドを終了する */
+    [[noreturn]] void Exit();
+
+    /** @brief タイマ割り込みから呼ぶ．タイムスライスを使い切っていれば切り替える．
+     *
+     * 割り込み禁止状態かつ EOI 送信後に呼ぶこと．
+     */
+    void OnTimerInterrupt();
+
+private:
+    std::array<Thread, kMaxThreads> threads_{};
+    alignas(16) uint8_t stacks_[kMaxThreads][kStackSize];
+    std::array<Thread *, kNumPriorities> ready_head_{}, ready_tail_{};
+    Thread *current_;
+    uint64_t next_id_ = 0;
+    /** 実行可能なスレッドが無く，Schedule() が hlt で待っている間 true */
+    bool idling_ = false;
+    SpinLock lock_;
+
+    void Enqueue(Thread *thread);
+    Thread *Dequeue();
+    /** lock_ を保持し割り込み禁止の状態で呼ぶ．次のスレッドへ切り替える． */
+    void Schedule(uint64_t rflags);
+};
+
+extern ThreadManager *thread_manager;
+
+/** @brief ThreadManager を生成し，KernelMain を main_priority のスレッドにする */
+void InitializeThread(int main_priority);
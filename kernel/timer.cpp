@@ -0,0 +1,123 @@
+/**
+ * @file timer.cpp
+ *
+ * 時間待ちに関するプログラムを集めたファイル．
+ */
+
+#include "timer.hpp"
+
+#include "acpi.hpp"
+#include "asmfunc.h"
+
+namespace
+{
+    const uint16_t kPITChannel2 = 0x42;
+    const uint16_t kPITCommand = 0x43;
+    /** @brief NMI Status and Control レジスタ．bit 0 が チャネル 2 の GATE，bit 5 が OUT． */
+    const uint16_t kNMISC = 0x61;
+
+    /** @brief 1 回のワンショットで待つ最大時間（16 ビットカウンタに収まる値） */
+    const unsigned long kMaxChunkUsec = 50000;
+
+    void WaitPITOneShot(uint16_t count)
+    {
+        // GATE を下ろし，スピーカー出力は止めたままにする
+        uint8_t nmisc = IoIn8(kNMISC) & 0x0cu;
+        IoOut8(kNMISC, nmisc);
+
+        // チャネル 2，下位・上位バイト順，モード 0（カウント終了で OUT が立つ）
+        IoOut8(kPITCommand, 0xb0);
+        IoOut8(kPITChannel2, count & 0xffu);
+        IoOut8(kPITChannel2, count >> 8);
+
+        IoOut8(kNMISC, nmisc | 0x01u);
+        while ((IoIn8(kNMISC) & 0x20u) == 0)
+        {
+            __asm__("pause");
+        }
+        IoOut8(kNMISC, nmisc);
+    }
+}
+
+namespace
+{
+    volatile uint32_t &lvt_timer = *reinterpret_cast<uint32_t *>(0xfee00320);
+    volatile uint32_t &initial_count = *reinterpret_cast<uint32_t *>(0xfee00380);
+    volatile uint32_t &current_count = *reinterpret_cast<uint32_t *>(0xfee00390);
+    volatile uint32_t &divide_config = *reinterpret_cast<uint32_t *>(0xfee003e0);
+
+    const uint32_t kCountMax = 0xffffffffu;
+    const uint32_t kLVTMasked = 1u << 16;
+    const uint32_t kLVTPeriodic = 1u << 17;
+
+    volatile uint64_t tick = 0;
+    uint64_t tsc_per_us = 1;
+}
+
+void WaitMicroseconds(unsigned long usec)
+{
+    while (usec > 0)
+    {
+        const unsigned long chunk = usec < kMaxChunkUsec ? usec : kMaxChunkUsec;
+        uint64_t count = static_cast<uint64_t>(kPITFrequency) * chunk / 1000000;
+        if (count == 0)
+        {
+            count = 1;
+        }
+        WaitPITOneShot(count);
+        usec -= chunk;
+    }
+}
+
+void InitializeLAPICTimer(uint8_t vector)
+{
+    divide_config = 0b1011; // divide 1:1
+    lvt_timer = kLVTMasked;
+
+    // 10ms の間に減ったカウントから周波数を求める．
+    // ACPI PM タイマがあればそちらの方が PIT より正確に測れる．
+    initial_count = kCountMax;
+    const uint64_t tsc_start = __builtin_ia32_rdtsc();
+    if (acpi::HasPMTimer())
+    {
+        acpi::WaitMilliseconds(10);
+    }
+    else
+    {
+        WaitMicroseconds(10000);
+    }
+    const uint32_t elapsed = kCountMax - current_count;
+    const uint64_t tsc_elapsed = __builtin_ia32_rdtsc() - tsc_start;
+    initial_count = 0;
+
+    tsc_per_us = tsc_elapsed / 10000;
+    if (tsc_per_us == 0)
+    {
+        tsc_per_us = 1;
+    }
+
+    const uint64_t lapic_timer_freq = static_cast<uint64_t>(elapsed) * 100;
+    lvt_timer = kLVTPeriodic | vector;
+    initial_count = lapic_timer_freq / kTimerFrequency;
+}
+
+void StopLAPICTimer()
+{
+    lvt_timer = kLVTMasked;
+    initial_count = 0;
+}
+
+uint64_t TSCPerMicrosecond()
+{
+    return tsc_per_us;
+}
+
+uint64_t CurrentTick()
+{
+    return tick;
+}
+
+void LAPICTimerOnInterrupt()
+{
+    tick = tick + 1;
+}
@@ -0,0 +1,42 @@
+/**
+ * @file timer.hpp
+ *
+ * 時間待ちに関するプログラムを集めたファイル．
+ */
+
+#pragma once
+
+#include <cstdint>
+
+/** @brief PIT (8254) の入力クロック周波数 (Hz) */
+const uint32_t kPITFrequency = 1193182;
+
+/** @brief 指定された時間だけビジーウェイトする
+ *
+ * PIT のチャネル 2 をワンショットで動かし，カウント終了を待つ．
+ * 割り込みを使わないため，割り込みの設定前や割り込み禁止中でも使える．
+ *
+ * @param usec  待ち時間（マイクロ秒）
+ */
+void WaitMicroseconds(unsigned long usec);
+
+/** @brief Local APIC タイマの割り込み周波数 (Hz) */
+const unsigned long kTimerFrequency = 100;
+
+/** @brief Local APIC タイマと TSC を ACPI PM タイマ（無ければ PIT）で較正し，kTimerFrequency の周期割り込みを開始する
+ *
+ * @param vector  タイマ割り込みのベクタ番号
+ */
+void InitializeLAPICTimer(uint8_t vector);
+
+/** @brief 1 マイクロ秒あたりの TSC のカウント数．InitializeLAPICTimer() で較正する． */
+uint64_t TSCPerMicrosecond();
+
+/** @brief Local APIC タイマの周期割り込みを止める */
+void StopLAPICTimer();
+
+/** @brief Local APIC タイマ割り込みの累積回数 */
+uint64_t CurrentTick();
+
+/** @brief Local APIC タイマ割り込みから呼ぶ．tick を進める． */
+void LAPICTimerOnInterrupt();
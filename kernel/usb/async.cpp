@@ -0,0 +1,96 @@
+#include "usb/async.hpp"
+
+#include <cstdint>
+
+#include "lock.hpp"
+#include "logger.hpp"
+#include "memstat.hpp"
+#include "usb/memory.hpp"
+
+namespace {
+  static_assert(usb::kNumCoroutineFrames <= 32);
+
+  alignas(16) uint8_t frame_pool[usb::kNumCoroutineFrames][usb::kCoroutineFrameSize];
+  /** frame_pool の使用中ビットマップ */
+  uint32_t frame_used = 0;
+  SpinLock frame_lock;
+
+  bool InPool(const void* p) {
+    const auto addr = reinterpret_cast<uintptr_t>(p);
+    const auto begin = reinterpret_cast<uintptr_t>(frame_pool);
+    return begin <= addr && addr < begin + sizeof(frame_pool);
+  }
+}
+
+namespace usb {
+  __attribute__((noinline))
+  void* AllocCoroutineFrame(size_t size) {
+    const auto rip = reinterpret_cast<uintptr_t>(__builtin_return_address(0));
+    if (size > kCoroutineFrameSize) {
+      return AllocMem(size, 16, 0, memstat::Tag::kUSBCoroutine);
+    }
+
+    IRQSaveLockGuard guard{frame_lock};
+    const uint32_t free_bits = ~frame_used;
+    if (free_bits == 0) {
+      return AllocMem(size, 16, 0, memstat::Tag::kUSBCoroutine);
+    }
+    const int i = __builtin_ctz(free_bits);
+    frame_used |= 1u << i;
+    memstat::OnAlloc(memstat::Tag::kUSBCoroutine, frame_pool[i], kCoroutineFrameSize, rip);
+    return frame_pool[i];
+  }
+
+  __attribute__((noinline))
+  void FreeCoroutineFrame(void* frame) {
+    const auto rip = reinterpret_cast<uintptr_t>(__builtin_return_address(0));
+    if (!InPool(frame)) {
+      FreeMem(frame);
+      return;
+    }
+
+    IRQSaveLockGuard guard{frame_lock};
+    const auto i = (reinterpret_cast<uintptr_t>(frame) -
+                    reinterpret_cast<uintptr_t>(frame_pool)) / kCoroutineFrameSize;
+    frame_used &= ~(1u << i);
+    memstat::OnFree(memstat::Tag::kUSBCoroutine, frame, kCoroutineFrameSize, rip);
+  }
+
+  void Task::promise_type::return_value(Error err) {
+    if (result_out) {
+      *result_out = err;
+      *finished_out = true;
+    } else if (err) {
+      Log(kWarn, "async task failed: %s at %s:%d\n", err.Name(), err.File(), err.Line());
+    }
+  }
+
+  Task::~Task() {
+    // 開始されなかった Task はここで破棄する．開始後は co_return 時に自動で破棄される．
+    if (handle_) {
+      handle_.destroy();
+    }
+  }
+
+  Error Task::Start() {
+    if (!handle_) {
+      return MAKE_ERROR(Error::kNoEnoughMemory);
+    }
+
+    auto handle = handle_;
+    handle_ = nullptr;
+
+    Error result = MAKE_ERROR(Error::kSuccess);
+    bool finished = false;
+    handle.promise().result_out = &result;
+    handle.promise().finished_out = &finished;
+    handle.resume();
+
+    if (!finished) {
+      // 中断中．以降の結果はこのスタックフレームに書き込ませない．
+      handle.promise().result_out = nullptr;
+      handle.promise().finished_out = nullptr;
+    }
+    return result;
+  }
+}
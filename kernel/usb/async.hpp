@@ -0,0 +1,85 @@
+/**
+ * @file usb/async.hpp
+ *
+ * USB ドライバ内の非同期処理を C++20 コルーチンで書くための型．
+ *
+ * 転送の完了を待つ処理は co_await で中断し，完了イベントの受信時に再開する．
+ * コルーチンフレームは専用の固定長プールから確保する．
+ */
+
+#pragma once
+
+#include <cstddef>
+
+#if __has_include(<coroutine>)
+#include <coroutine>
+namespace usb::coro {
+  using std::coroutine_handle;
+  using std::suspend_always;
+  using std::suspend_never;
+}
+#else
+#include <experimental/coroutine>
+namespace usb::coro {
+  using std::experimental::coroutine_handle;
+  using std::experimental::suspend_always;
+  using std::experimental::suspend_never;
+}
+#endif
+
+#include "error.hpp"
+
+namespace usb {
+  /** @brief プールの 1 フレームの大きさ（バイト）．これを超えるフレームは AllocMem から確保する． */
+  const size_t kCoroutineFrameSize = 512;
+  /** @brief プールのフレーム数 */
+  const int kNumCoroutineFrames = 32;
+
+  /** @brief コルーチンフレームを確保する．確保できなければ nullptr． */
+  void* AllocCoroutineFrame(size_t size);
+  /** @brief AllocCoroutineFrame で確保したフレームを解放する． */
+  void FreeCoroutineFrame(void* frame);
+
+  /** @brief 結果として Error を返す非同期処理
+   *
+   * 生成時点では実行されず，Start() で最初の co_await まで同期的に進む．
+   * 以降は待っている転送の完了イベントから再開され，co_return で自動的に破棄される．
+   */
+  class Task {
+   public:
+    struct promise_type {
+      Error* result_out = nullptr;
+      bool* finished_out = nullptr;
+
+      Task get_return_object() {
+        return Task{coro::coroutine_handle<promise_type>::from_promise(*this)};
+      }
+      static Task get_return_object_on_allocation_failure() { return Task{nullptr}; }
+
+      coro::suspend_always initial_suspend() noexcept { return {}; }
+      coro::suspend_never final_suspend() noexcept { return {}; }
+      void return_value(Error err);
+      void unhandled_exception() {}
+
+      static void* operator new(size_t size) noexcept { return AllocCoroutineFrame(size); }
+      static void operator delete(void* frame) { FreeCoroutineFrame(frame); }
+    };
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    Task(Task&& rhs) : handle_{rhs.handle_} { rhs.handle_ = nullptr; }
+    ~Task();
+
+    /** @brief 処理を開始する
+     *
+     * 最初の中断までに co_return した場合はその結果を，
+     * 中断した場合は kSuccess を返す．中断後に失敗した結果はログに出力される．
+     * フレームを確保できなかった場合は kNoEnoughMemory を返す．
+     */
+    Error Start();
+
+   private:
+    explicit Task(coro::coroutine_handle<promise_type> handle) : handle_{handle} {}
+    coro::coroutine_handle<promise_type> handle_;
+  };
+}
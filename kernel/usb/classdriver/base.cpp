@@ -6,4 +6,14 @@ namespace usb {
 
   ClassDriver::~ClassDriver() {
   }
+
+  Error ClassDriver::OnBulkCompleted(EndpointID ep_id, uintptr_t cookie, int len, Error err) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  void ClassDriver::OnEndpointReset(EndpointID ep_id, uint16_t stream_id) {
+  }
+
+  void ClassDriver::OnRemoved() {
+  }
 }
@@ -6,6 +6,8 @@
 
 #pragma once
 
+#include <cstdint>
+
 #include "error.hpp"
 #include "usb/endpoint.hpp"
 #include "usb/setupdata.hpp"
@@ -26,6 +28,23 @@ namespace usb
         virtual Error OnControlCompleted(EndpointID ep_id, SetupData setup_data,
                                          const void *buf, int len) = 0;
         virtual Error OnInterruptCompleted(EndpointID ep_id, const void *buf, int len) = 0;
+        /** @brief Device::BulkIn()/BulkOut() の完了時に呼ばれる．バルク転送を使うドライバが実装する．
+         *
+         * @param len  転送できたバイト数
+         * @param err  転送が失敗したならそのエラー
+         */
+        virtual Error OnBulkCompleted(EndpointID ep_id, uintptr_t cookie, int len, Error err);
+        /** @brief Device::ResetEndpoint() やエラーによるエンドポイントの復旧が終わると呼ばれる
+         *
+         * 取り消された転送の OnBulkCompleted() はすべて先に呼ばれている．
+         * 転送エラーの後はホスト側のリセットだけが済んだ状態なので，デバイス側の復旧はドライバが行う．
+         */
+        virtual void OnEndpointReset(EndpointID ep_id, uint16_t stream_id);
+        /** @brief デバイスが外れてスロットが解放される直前に呼ばれる．
+         *
+         * 完了しなくなった要求を失敗させ，利用者に知らせる．以後は転送を積まないこと．
+         */
+        virtual void OnRemoved();
 
         /** このクラスドライバを保持する USB デバイスを返す． */
         Device *ParentDevice() const { return dev_; }
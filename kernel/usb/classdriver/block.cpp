@@ -0,0 +1,178 @@
+#include "usb/classdriver/block.hpp"
+
+#include <algorithm>
+
+#include "timer.hpp"
+#include "usb/memory.hpp"
+
+namespace usb {
+  void (*BlockDevice::default_ready_handler)(BlockDevice& dev) = nullptr;
+  void (*BlockDevice::default_removed_handler)(BlockDevice& dev) = nullptr;
+}
+
+namespace {
+  using namespace usb;
+
+  /** 逐次読み出しの 1 要求の大きさと，読む総量の上限 */
+  const size_t kSequentialRequestBytes = 64 * 1024;
+  const size_t kSequentialTotalBytes = 64 * 1024 * 1024;
+  /** ランダム読み出しの 1 要求の大きさと要求数 */
+  const size_t kRandomRequestBytes = 4096;
+  const size_t kRandomRequests = 4096;
+
+  enum class Phase {
+    kIdle,
+    kSequential,
+    kRandom,
+  };
+
+  struct BenchState {
+    Phase phase = Phase::kIdle;
+    /** 測定中のデバイス */
+    BlockDevice* dev = nullptr;
+    LogLevel level;
+    /** 読み出し先．内容は使わないので全要求で共有する． */
+    void* buf = nullptr;
+    uint32_t blocks_per_request;
+    size_t num_requests;
+    size_t submitted;
+    size_t completed;
+    size_t failed;
+    uint64_t next_lba;
+    uint64_t random_state;
+    uint64_t start_tsc;
+  } bench;
+
+  uint64_t NextRandom() {
+    // xorshift64
+    auto& x = bench.random_state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x;
+  }
+
+  void OnCompleted(BlockDevice& dev, Error err, uintptr_t arg);
+
+  Error SubmitOne(BlockDevice& dev) {
+    uint64_t lba;
+    if (bench.phase == Phase::kSequential) {
+      lba = bench.next_lba;
+      bench.next_lba += bench.blocks_per_request;
+    } else {
+      const uint64_t slots = dev.NumBlocks() / bench.blocks_per_request;
+      lba = NextRandom() % slots * bench.blocks_per_request;
+    }
+    if (auto err = dev.Read(lba, bench.blocks_per_request, bench.buf, OnCompleted, 0)) {
+      return err;
+    }
+    ++bench.submitted;
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error StartPhase(BlockDevice& dev, Phase phase) {
+    const size_t request_bytes = phase == Phase::kSequential
+                                     ? kSequentialRequestBytes : kRandomRequestBytes;
+    const uint64_t capacity = dev.NumBlocks() * dev.BlockSize();
+
+    bench.phase = phase;
+    bench.blocks_per_request = std::min<uint64_t>(
+        std::max<size_t>(request_bytes / dev.BlockSize(), 1), dev.MaxBlocksPerRequest());
+    const uint64_t bytes_per_request = uint64_t{bench.blocks_per_request} * dev.BlockSize();
+    bench.num_requests = phase == Phase::kSequential
+        ? std::min<uint64_t>(kSequentialTotalBytes, capacity) / bytes_per_request
+        : kRandomRequests;
+    if (capacity < bytes_per_request) {
+      bench.phase = Phase::kIdle;
+      return MAKE_ERROR(Error::kBufferTooSmall);
+    }
+    bench.submitted = bench.completed = bench.failed = 0;
+    bench.next_lba = 0;
+    bench.start_tsc = __builtin_ia32_rdtsc();
+
+    // キューを埋める要求のドアベルは最後にまとめて鳴らす
+    Error err = MAKE_ERROR(Error::kSuccess);
+    dev.BeginBatch();
+    while (!err && bench.submitted < bench.num_requests && dev.InFlight() < dev.QueueDepth()) {
+      err = SubmitOne(dev);
+    }
+    dev.EndBatch();
+    return err;
+  }
+
+  void Report(BlockDevice& dev) {
+    const uint64_t us = std::max<uint64_t>(
+        (__builtin_ia32_rdtsc() - bench.start_tsc) / std::max<uint64_t>(TSCPerMicrosecond(), 1), 1);
+    const uint64_t bytes = uint64_t{bench.completed} * bench.blocks_per_request * dev.BlockSize();
+    // バイト/us はそのまま MB/s
+    Log(bench.level,
+        "block bench %s: %lu x %lu bytes, qd %d, %lu us, %lu.%lu MB/s, %lu IOPS, %lu failed\n",
+        bench.phase == Phase::kSequential ? "seq read" : "rand read",
+        bench.completed, bytes / std::max<size_t>(bench.completed, 1), dev.QueueDepth(), us,
+        bytes / us, bytes * 10 / us % 10, bench.completed * 1000000 / us, bench.failed);
+  }
+
+  void OnCompleted(BlockDevice& dev, Error err, uintptr_t arg) {
+    if (bench.phase == Phase::kIdle || bench.dev != &dev) {
+      return;  // StopBlockBenchmark() で止めた後の完了
+    }
+    ++bench.completed;
+    if (err) {
+      ++bench.failed;
+    }
+
+    if (bench.submitted < bench.num_requests) {
+      if (auto err = SubmitOne(dev)) {
+        Log(kError, "block bench: failed to submit: %s\n", err.Name());
+        bench.num_requests = bench.submitted;
+      }
+    }
+    if (bench.completed < bench.num_requests) {
+      return;
+    }
+
+    Report(dev);
+    if (bench.phase == Phase::kSequential) {
+      if (auto err = StartPhase(dev, Phase::kRandom)) {
+        Log(kError, "block bench: failed to start random read: %s\n", err.Name());
+        bench.phase = Phase::kIdle;
+      }
+    } else {
+      bench.phase = Phase::kIdle;
+    }
+  }
+}
+
+namespace usb {
+  Error StartBlockBenchmark(BlockDevice& dev, LogLevel level) {
+    if (bench.phase != Phase::kIdle) {
+      return MAKE_ERROR(Error::kAlreadyAllocated);
+    }
+    if (!dev.IsReady() || dev.BlockSize() == 0 || dev.BlockSize() > kSequentialRequestBytes) {
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
+    if (bench.buf == nullptr) {
+      bench.buf = AllocMem(kSequentialRequestBytes, 4096, 0, memstat::Tag::kUSBMisc);
+      if (bench.buf == nullptr) {
+        return MAKE_ERROR(Error::kNoEnoughMemory);
+      }
+    }
+    bench.dev = &dev;
+    bench.level = level;
+    bench.random_state = 88172645463325252ull;
+    Log(level, "block bench: %lu blocks x %u bytes\n", dev.NumBlocks(), dev.BlockSize());
+    return StartPhase(dev, Phase::kSequential);
+  }
+
+  void StopBlockBenchmark(BlockDevice& dev) {
+    if (bench.dev != &dev) {
+      return;
+    }
+    if (bench.phase != Phase::kIdle) {
+      Log(bench.level, "block bench: device removed after %lu of %lu requests\n",
+          bench.completed, bench.num_requests);
+    }
+    bench.phase = Phase::kIdle;
+    bench.dev = nullptr;
+  }
+}
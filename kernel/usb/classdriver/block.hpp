@@ -0,0 +1,63 @@
+/**
+ * @file usb/classdriver/block.hpp
+ *
+ * USB ストレージのクラスドライバが提供する非同期ブロックデバイスの API と，
+ * その転送速度を測るベンチマーク．
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "error.hpp"
+#include "logger.hpp"
+
+namespace usb {
+  class BlockDevice {
+   public:
+    /** @brief 読み書きの完了（失敗を含む）時に呼ばれる関数．xhci::Controller::StateLock() を持った状態で呼ばれる． */
+    using Callback = void (BlockDevice& dev, Error err, uintptr_t arg);
+
+    virtual ~BlockDevice() = default;
+
+    /** @brief lba から num_blocks ブロックを読む要求を発行する
+     *
+     * 完了を待たずに戻る．同時に QueueDepth() 個まで発行でき，それを超えると kFull．
+     * xHC のイベント処理と排他するため，xhci::Controller::StateLock() を持って呼ぶこと．
+     */
+    virtual Error Read(uint64_t lba, uint32_t num_blocks, void* buf,
+                       Callback* callback, uintptr_t arg) = 0;
+    virtual Error Write(uint64_t lba, uint32_t num_blocks, const void* buf,
+                        Callback* callback, uintptr_t arg) = 0;
+
+    /** @brief 容量の取得などが終わり，Read()/Write() を受け付けられる */
+    virtual bool IsReady() const = 0;
+    virtual uint64_t NumBlocks() const = 0;
+    virtual uint32_t BlockSize() const = 0;
+    /** @brief 1 回の要求で読み書きできる最大のブロック数 */
+    virtual uint32_t MaxBlocksPerRequest() const = 0;
+    virtual int QueueDepth() const = 0;
+    virtual int InFlight() const = 0;
+
+    /** @brief 続けて発行する要求のドアベルを，EndBatch() でまとめて鳴らす（usb::TransferBatch と同じ） */
+    virtual void BeginBatch() {}
+    virtual void EndBatch() {}
+
+    /** @brief デバイスが使えるようになったときに呼ばれる関数（nullptr なら何もしない） */
+    static void (*default_ready_handler)(BlockDevice& dev);
+    /** @brief 使えるようになっていたデバイスが外れるときに呼ばれる関数（nullptr なら何もしない）
+     *
+     * 呼ばれた後，未完了の要求はエラーで完了し，dev は破棄される．以後 dev に触れないこと．
+     */
+    static void (*default_removed_handler)(BlockDevice& dev);
+  };
+
+  /** @brief 逐次読み出しの MB/s とランダム読み出しの IOPS を測り，終わったらログに出す
+   *
+   * 常に QueueDepth() 個の要求を発行した状態を保つ．完了を待たずに戻る．
+   * xhci::Controller::StateLock() を持って呼ぶこと（default_ready_handler から呼ぶならそのままでよい）．
+   */
+  Error StartBlockBenchmark(BlockDevice& dev, LogLevel level);
+  /** @brief dev で測定中なら止める．残りの要求の完了は無視する．default_removed_handler から呼ぶ． */
+  void StopBlockBenchmark(BlockDevice& dev);
+}
@@ -25,6 +25,10 @@ namespace usb {
   }
 
   Error HIDBaseDriver::OnEndpointsConfigured() {
+    return StartReceiving().Start();
+  }
+
+  Task HIDBaseDriver::StartReceiving() {
     SetupData setup_data{};
     setup_data.request_type.bits.direction = request_type::kOut;
     setup_data.request_type.bits.type = request_type::kClass;
@@ -34,19 +38,19 @@ namespace usb {
     setup_data.index = interface_index_;
     setup_data.length = 0;
 
-    initialize_phase_ = 1;
-    return ParentDevice()->ControlOut(kDefaultControlPipeID, setup_data, nullptr, 0, this);
+    auto set_protocol = co_await ParentDevice()->ControlOut(
+        kDefaultControlPipeID, setup_data, nullptr, 0);
+    Log(kDebug, "HIDBaseDriver: SetProtocol completed: dev %08x, %s\n",
+        this, set_protocol.error.Name());
+    if (set_protocol.error) {
+      co_return set_protocol.error;
+    }
+    co_return ParentDevice()->InterruptIn(ep_interrupt_in_, buf_.data(), in_packet_size_);
   }
 
   Error HIDBaseDriver::OnControlCompleted(EndpointID ep_id, SetupData setup_data,
                                           const void* buf, int len) {
-    Log(kDebug, "HIDBaseDriver::OnControlCompleted: dev %08x, phase = %d, len = %d\n",
-        this, initialize_phase_, len);
-    if (initialize_phase_ == 1) {
-      initialize_phase_ = 2;
-      return ParentDevice()->InterruptIn(ep_interrupt_in_, buf_.data(), in_packet_size_);
-    }
-
+    // コントロール転送はすべて StartReceiving() の中で co_await している
     return MAKE_ERROR(Error::kNotImplemented);
   }
 
@@ -6,6 +6,7 @@
 
 #pragma once
 
+#include "usb/async.hpp"
 #include "usb/classdriver/base.hpp"
 
 namespace usb {
@@ -29,7 +30,9 @@ namespace usb {
     EndpointID ep_interrupt_out_;
     const int interface_index_;
     int in_packet_size_;
-    int initialize_phase_{0};
+
+    /** @brief boot protocol に切り替えてから割り込み転送の受信を始めるコルーチン */
+    Task StartReceiving();
 
     std::array<uint8_t, kBufferSize> buf_{}, previous_buf_{};
   };
@@ -0,0 +1,367 @@
+#include "usb/classdriver/hub.hpp"
+
+#include <algorithm>
+
+#include "logger.hpp"
+#include "timer.hpp"
+#include "usb/descriptor.hpp"
+#include "usb/memory.hpp"
+
+namespace {
+  // ハブクラスのリクエスト
+  const int kSetHubDepth = 12;
+
+  // 機能セレクタ
+  const int kCHubLocalPower = 0;
+  const int kCHubOverCurrent = 1;
+  const int kPortReset = 4;
+  const int kPortPower = 8;
+  const int kCPortConnection = 16;
+  const int kCPortEnable = 17;
+  const int kCPortSuspend = 18;
+  const int kCPortOverCurrent = 19;
+  const int kCPortReset = 20;
+  const int kCPortLinkState = 25;  // SuperSpeed
+  const int kCPortConfigError = 26;  // SuperSpeed
+  const int kCBHPortReset = 29;  // SuperSpeed
+
+  // wPortStatus のビット
+  const uint16_t kStatusConnection = 1u << 0;
+  const uint16_t kStatusEnable = 1u << 1;
+  const uint16_t kStatusLowSpeed = 1u << 9;  // USB 2.0
+  const uint16_t kStatusHighSpeed = 1u << 10;  // USB 2.0
+
+  // wPortChange のビット．USB 2.0 と SuperSpeed で一部が異なる．
+  const uint16_t kChangeConnection = 1u << 0;
+  const uint16_t kChangeEnable = 1u << 1;  // USB 2.0
+  const uint16_t kChangeSuspend = 1u << 2;  // USB 2.0
+  const uint16_t kChangeOverCurrent = 1u << 3;
+  const uint16_t kChangeReset = 1u << 4;
+  const uint16_t kChangeBHReset = 1u << 5;  // SuperSpeed
+  const uint16_t kChangeLinkState = 1u << 6;  // SuperSpeed
+  const uint16_t kChangeConfigError = 1u << 7;  // SuperSpeed
+}
+
+namespace usb {
+  HubDriver::HubDriver(Device* dev, int interface_index, bool super_speed)
+      : ClassDriver{dev}, interface_index_{interface_index}, super_speed_{super_speed} {
+  }
+
+  std::atomic<int> HubDriver::num_waiting_power_good_{0};
+
+  HubDriver::~HubDriver() {
+    // 電源の安定を待っている Start() は再開できないので破棄する
+    if (power_good_waiter_) {
+      power_good_waiter_.destroy();
+      num_waiting_power_good_.fetch_sub(1, std::memory_order_relaxed);
+    }
+  }
+
+  void* HubDriver::operator new(size_t size) {
+    return AllocMem(sizeof(HubDriver), 0, 0, memstat::Tag::kUSBDriver);
+  }
+
+  void HubDriver::operator delete(void* ptr) noexcept {
+    FreeMem(ptr);
+  }
+
+  Error HubDriver::Initialize() {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error HubDriver::SetEndpoint(const EndpointConfig& config) {
+    if (config.ep_type == EndpointType::kInterrupt && config.ep_id.IsIn()) {
+      ep_interrupt_in_ = config.ep_id;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error HubDriver::OnEndpointsConfigured() {
+    return Start().Start();
+  }
+
+  Task HubDriver::Start() {
+    if (depth_ > kMaxDepth) {
+      Log(kError, "HubDriver: hub at depth %d is too deep\n", depth_);
+      co_return MAKE_ERROR(Error::kNotImplemented);
+    }
+
+    auto dev = ParentDevice();
+    if (super_speed_) {
+      SetupData setup_data{};
+      setup_data.request_type.bits.direction = request_type::kOut;
+      setup_data.request_type.bits.type = request_type::kClass;
+      setup_data.request_type.bits.recipient = request_type::kDevice;
+      setup_data.request = kSetHubDepth;
+      setup_data.value = depth_;
+      setup_data.index = 0;
+      setup_data.length = 0;
+      auto set_depth = co_await dev->ControlOut(kDefaultControlPipeID, setup_data, nullptr, 0);
+      if (set_depth.error) {
+        co_return set_depth.error;
+      }
+    }
+
+    const uint8_t desc_type =
+      super_speed_ ? HubDescriptor::kSuperSpeedType : HubDescriptor::kType;
+    SetupData setup_data{};
+    setup_data.request_type.bits.direction = request_type::kIn;
+    setup_data.request_type.bits.type = request_type::kClass;
+    setup_data.request_type.bits.recipient = request_type::kDevice;
+    setup_data.request = request::kGetDescriptor;
+    setup_data.value = desc_type << 8;
+    setup_data.index = 0;
+    setup_data.length = hub_desc_buf_.size();
+    auto get_desc = co_await dev->ControlIn(kDefaultControlPipeID, setup_data,
+                                            hub_desc_buf_.data(), hub_desc_buf_.size());
+    if (get_desc.error) {
+      co_return get_desc.error;
+    }
+    const auto hub_desc = reinterpret_cast<const HubDescriptor*>(hub_desc_buf_.data());
+    if (get_desc.value < static_cast<int>(sizeof(HubDescriptor)) ||
+        hub_desc->descriptor_type != desc_type) {
+      co_return MAKE_ERROR(Error::kInvalidDescriptor);
+    }
+
+    if (hub_desc->num_ports > kMaxPorts) {
+      Log(kWarn, "HubDriver: only %d of %d ports are usable\n",
+          kMaxPorts, hub_desc->num_ports);
+    }
+    num_ports_ = std::min<int>(hub_desc->num_ports, kMaxPorts);
+    think_time_ = super_speed_ ? 0 : hub_desc->characteristics.bits.tt_think_time;
+    Log(kInfo, "HubDriver: interface %d, %d ports, %s, depth %d\n",
+        interface_index_, num_ports_, super_speed_ ? "SuperSpeed" : "USB 2.0", depth_);
+    PushEvent(HubEvent::kHubReady, 0);
+
+    // 電源が入ってデバイスが見えたポートは，ステータス変化エンドポイントで報告される
+    for (int port = 1; port <= num_ports_; ++port) {
+      auto power = co_await PortFeature(true, kPortPower, port);
+      if (power.error) {
+        co_return power.error;
+      }
+    }
+    // 電源が安定する bPwrOn2PwrGood（2 ms 単位）の間はポートの状態を信じない（USB 2.0 11.23.2.1）．
+    // 最長 510 ms なので，イベント処理を止めずに LAPIC タイマの tick で再開する．
+    co_await WaitPowerGood(hub_desc->power_on_to_good * 2);
+    co_return ReceiveChanges();
+  }
+
+  HubDriver::PowerGoodAwaiter HubDriver::WaitPowerGood(int ms) {
+    if (ms > 0) {
+      // 今の tick はすでに進みかけているので，1 tick 余分に待つ
+      const uint64_t ticks = (ms * kTimerFrequency + 999) / 1000 + 1;
+      power_good_tick_ = CurrentTick() + ticks;
+    }
+    return {*this};
+  }
+
+  void HubDriver::PowerGoodAwaiter::await_suspend(coro::coroutine_handle<> handle) {
+    hub_.power_good_waiter_ = handle;
+    num_waiting_power_good_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void HubDriver::OnTick(uint64_t now_tick) {
+    if (!power_good_waiter_ || now_tick < power_good_tick_) {
+      return;
+    }
+    auto waiter = power_good_waiter_;
+    power_good_waiter_ = nullptr;
+    power_good_tick_ = 0;
+    num_waiting_power_good_.fetch_sub(1, std::memory_order_relaxed);
+    waiter.resume();
+  }
+
+  Error HubDriver::OnControlCompleted(EndpointID ep_id, SetupData setup_data,
+                                      const void* buf, int len) {
+    // コントロール転送はすべてコルーチンの中で co_await している
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error HubDriver::OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) {
+    if (!ep_id.IsIn()) {
+      return MAKE_ERROR(Error::kNotImplemented);
+    }
+    for (int i = 0; i < len && i < static_cast<int>(change_buf_.size()); ++i) {
+      changed_ |= uint32_t{change_buf_[i]} << (8 * i);
+    }
+    // 次の受信は HandleChanges() が処理を終えてから始めるので，同時に 2 つは走らない
+    return HandleChanges().Start();
+  }
+
+  Error HubDriver::ReceiveChanges() {
+    const int len = (num_ports_ + 1 + 7) / 8;
+    return ParentDevice()->InterruptIn(ep_interrupt_in_, change_buf_.data(), len);
+  }
+
+  Task HubDriver::HandleChanges() {
+    while (changed_) {
+      const int port = __builtin_ctz(changed_);
+      changed_ &= changed_ - 1;
+      if (port > num_ports_) {
+        continue;
+      }
+
+      auto get_status = co_await GetStatus(port);
+      if (get_status.error) {
+        // このポートは飛ばす．変化が残っていれば次の通知でまた報告される．
+        Log(kError, "HubDriver: failed to get status of port %d: %s\n",
+            port, get_status.error.Name());
+        continue;
+      }
+      const uint16_t status = status_buf_[0];
+      const uint16_t change = status_buf_[1];
+
+      if (port == 0) {
+        // ハブ自身の電源と過電流の変化．確認して消すだけ．
+        if (change & 1) {
+          co_await PortFeature(false, kCHubLocalPower, 0);
+        }
+        if (change & 2) {
+          Log(kWarn, "HubDriver: hub over-current changed: status %04x\n", status);
+          co_await PortFeature(false, kCHubOverCurrent, 0);
+        }
+        continue;
+      }
+      Log(kDebug, "HubDriver: port %d: status %04x, change %04x\n", port, status, change);
+
+      if (change & kChangeConnection) {
+        co_await PortFeature(false, kCPortConnection, port);
+        if (ports_[port] != PortState::kDisconnected) {
+          ports_[port] = PortState::kDisconnected;
+          PushEvent(HubEvent::kPortDisconnected, port);
+        }
+        if (status & kStatusConnection) {
+          ports_[port] = PortState::kWaitingReset;
+          PushEvent(HubEvent::kPortConnected, port);
+        }
+      }
+
+      if (change & (kChangeReset | (super_speed_ ? kChangeBHReset : 0))) {
+        co_await PortFeature(false, kCPortReset, port);
+        if (super_speed_ && (change & kChangeBHReset)) {
+          co_await PortFeature(false, kCBHPortReset, port);
+        }
+        if (ports_[port] == PortState::kResetting) {
+          if ((status & kStatusConnection) && (status & kStatusEnable)) {
+            PortSpeed speed = PortSpeed::kSuper;
+            if (!super_speed_) {
+              speed = (status & kStatusLowSpeed) ? PortSpeed::kLow
+                    : (status & kStatusHighSpeed) ? PortSpeed::kHigh
+                    : PortSpeed::kFull;
+            }
+            ports_[port] = PortState::kEnabled;
+            PushEvent(HubEvent::kPortEnabled, port, speed);
+          } else {
+            // つなぎ直されるまで再試行しない
+            ports_[port] = PortState::kDisconnected;
+            PushEvent(HubEvent::kPortResetFailed, port);
+          }
+        }
+      }
+
+      if (change & kChangeOverCurrent) {
+        Log(kWarn, "HubDriver: port %d over-current changed: status %04x\n", port, status);
+        co_await PortFeature(false, kCPortOverCurrent, port);
+      }
+      if (super_speed_) {
+        if (change & kChangeLinkState) {
+          co_await PortFeature(false, kCPortLinkState, port);
+        }
+        if (change & kChangeConfigError) {
+          Log(kWarn, "HubDriver: port %d link configuration failed\n", port);
+          co_await PortFeature(false, kCPortConfigError, port);
+        }
+      } else {
+        if (change & kChangeEnable) {
+          // エラーでポートが無効になった．デバイスはつなぎ直すまで使えない．
+          Log(kWarn, "HubDriver: port %d disabled: status %04x\n", port, status);
+          co_await PortFeature(false, kCPortEnable, port);
+        }
+        if (change & kChangeSuspend) {
+          co_await PortFeature(false, kCPortSuspend, port);
+        }
+      }
+    }
+    co_return ReceiveChanges();
+  }
+
+  int HubDriver::NextWaitingPort() const {
+    for (int port = 1; port <= num_ports_; ++port) {
+      if (ports_[port] == PortState::kWaitingReset) {
+        return port;
+      }
+    }
+    return 0;
+  }
+
+  Error HubDriver::ResetPort(int port) {
+    if (port < 1 || port > num_ports_ || ports_[port] != PortState::kWaitingReset) {
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
+    ports_[port] = PortState::kResetting;
+    if (auto err = SetPortReset(port).Start(); err && ports_[port] == PortState::kResetting) {
+      // コルーチンを作れなかった
+      ports_[port] = PortState::kDisconnected;
+      PushEvent(HubEvent::kPortResetFailed, port);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Task HubDriver::SetPortReset(int port) {
+    // 完了はステータス変化エンドポイントに C_PORT_RESET として報告される
+    auto reset = co_await PortFeature(true, kPortReset, port);
+    if (reset.error && ports_[port] == PortState::kResetting) {
+      ports_[port] = PortState::kDisconnected;
+      PushEvent(HubEvent::kPortResetFailed, port);
+    }
+    co_return reset.error;
+  }
+
+  ControlAwaiter HubDriver::PortFeature(bool set, int feature, int port) {
+    SetupData setup_data{};
+    setup_data.request_type.bits.direction = request_type::kOut;
+    setup_data.request_type.bits.type = request_type::kClass;
+    setup_data.request_type.bits.recipient =
+      port == 0 ? request_type::kDevice : request_type::kOther;
+    setup_data.request = set ? request::kSetFeature : request::kClearFeature;
+    setup_data.value = feature;
+    setup_data.index = port;
+    setup_data.length = 0;
+    return ParentDevice()->ControlOut(kDefaultControlPipeID, setup_data, nullptr, 0);
+  }
+
+  ControlAwaiter HubDriver::GetStatus(int port) {
+    SetupData setup_data{};
+    setup_data.request_type.bits.direction = request_type::kIn;
+    setup_data.request_type.bits.type = request_type::kClass;
+    setup_data.request_type.bits.recipient =
+      port == 0 ? request_type::kDevice : request_type::kOther;
+    setup_data.request = request::kGetStatus;
+    setup_data.value = 0;
+    setup_data.index = port;
+    setup_data.length = sizeof(status_buf_);
+    return ParentDevice()->ControlIn(kDefaultControlPipeID, setup_data,
+                                     status_buf_.data(), sizeof(status_buf_));
+  }
+
+  void HubDriver::PushEvent(HubEvent::Type type, int port, PortSpeed speed) {
+    if (num_events_ == static_cast<int>(events_.size())) {
+      Log(kWarn, "HubDriver: event queue is full, dropping event %d for port %d\n",
+          type, port);
+      return;
+    }
+    const int tail = (event_head_ + num_events_) % events_.size();
+    events_[tail] = HubEvent{type, static_cast<uint8_t>(port), speed};
+    ++num_events_;
+  }
+
+  bool HubDriver::PopEvent(HubEvent& event) {
+    if (num_events_ == 0) {
+      return false;
+    }
+    event = events_[event_head_];
+    event_head_ = (event_head_ + 1) % events_.size();
+    --num_events_;
+    return true;
+  }
+}
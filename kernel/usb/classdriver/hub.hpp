@@ -0,0 +1,158 @@
+/**
+ * @file usb/classdriver/hub.hpp
+ *
+ * USB ハブのクラスドライバ．
+ *
+ * ハブ自身の設定とポートの状態変化の処理だけを行い，下流のデバイスへのアドレス割り当ては
+ * ホストコントローラのドライバが PopEvent() で受け取って行う．
+ * QEMU では -device usb-hub,bus=xhci.0,port=1 -device usb-kbd,bus=xhci.0,port=1.1 で試せる．
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+#include "usb/async.hpp"
+#include "usb/classdriver/base.hpp"
+#include "usb/device.hpp"
+
+namespace usb {
+  /** @brief ハブのポートにつながったデバイスの速度 */
+  enum class PortSpeed : uint8_t {
+    kLow,
+    kFull,
+    kHigh,
+    kSuper,
+  };
+
+  /** @brief ハブからホストコントローラのドライバへの通知 */
+  struct HubEvent {
+    enum Type : uint8_t {
+      /** @brief ハブディスクリプタを読んだ．スロットをハブとして設定する． */
+      kHubReady,
+      /** @brief デバイスがつながった．順番が来たら ResetPort() を呼ぶ． */
+      kPortConnected,
+      /** @brief リセットが終わり，デバイスがアドレス 0 で応答できる */
+      kPortEnabled,
+      /** @brief リセットに失敗した．アドレス割り当ての順番を次に回す． */
+      kPortResetFailed,
+      /** @brief デバイスが外れた */
+      kPortDisconnected,
+    } type;
+    uint8_t port;
+    PortSpeed speed;
+  };
+
+  class HubDriver : public ClassDriver {
+   public:
+    /** @brief 扱うポート数の上限．Route String の 1 段は 4 ビットなので 15 まで． */
+    static const int kMaxPorts = 15;
+    /** @brief 下流にデバイスをつなげるハブの段数の上限．Route String は 5 段まで． */
+    static const int kMaxDepth = 4;
+
+    HubDriver(Device* dev, int interface_index, bool super_speed);
+    ~HubDriver() override;
+
+    void* operator new(size_t size);
+    void operator delete(void* ptr) noexcept;
+
+    Error Initialize() override;
+    Error SetEndpoint(const EndpointConfig& config) override;
+    Error OnEndpointsConfigured() override;
+    Error OnControlCompleted(EndpointID ep_id, SetupData setup_data,
+                             const void* buf, int len) override;
+    Error OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) override;
+
+    /** @brief ルートハブから数えたハブの段数（ルートポート直下なら 0）．
+     *
+     * SuperSpeed ハブには SET_HUB_DEPTH で伝える必要がある．OnEndpointsConfigured() より前に設定する．
+     */
+    void SetDepth(int depth) { depth_ = depth; }
+    bool IsSuperSpeed() const { return super_speed_; }
+    int NumPorts() const { return num_ports_; }
+    /** @brief TT Think Time（xHCI の Slot Context の TTT と同じ符号化） */
+    int ThinkTime() const { return think_time_; }
+
+    /** @brief 未処理の通知を 1 つ取り出す．無ければ false． */
+    bool PopEvent(HubEvent& event);
+    /** @brief つながっていてリセットを待っているポートの番号．無ければ 0． */
+    int NextWaitingPort() const;
+    /** @brief ポートのリセットを始める．
+     *
+     * 結果は失敗も含めて kPortEnabled または kPortResetFailed で通知する．
+     * 要求を発行できなければ戻る前に通知を積むので，呼んだ後は PopEvent() を確認すること．
+     */
+    Error ResetPort(int port);
+
+    /** @brief ポートの電源が安定するのを待っているか */
+    bool IsWaitingPowerGood() const { return power_good_waiter_ != nullptr; }
+    /** @brief 電源の安定を待っていれば，期限の tick を過ぎたところで Start() を再開する
+     *
+     * ホストコントローラのドライバが状態のロックを取って呼ぶ．それまでは状態変化の受信を始めない．
+     */
+    void OnTick(uint64_t now_tick);
+    /** @brief 電源の安定を待っているハブの数．タイマ割り込みから読んでよい． */
+    static int NumWaitingPowerGood() { return num_waiting_power_good_.load(std::memory_order_relaxed); }
+
+   private:
+    enum class PortState : uint8_t {
+      kDisconnected,
+      kWaitingReset,
+      kResetting,
+      kEnabled,
+    };
+
+    const int interface_index_;
+    const bool super_speed_;
+    EndpointID ep_interrupt_in_;
+    int depth_ = 0;
+    int num_ports_ = 0;
+    int think_time_ = 0;
+
+    std::array<PortState, kMaxPorts + 1> ports_{}; // index = port number
+    /** @brief ステータス変化エンドポイントの受信バッファ．ビット 0 はハブ，ビット n はポート n． */
+    std::array<uint8_t, 4> change_buf_{};
+    /** @brief 処理を待っている状態変化のビットマップ */
+    uint32_t changed_ = 0;
+    std::array<uint8_t, 16> hub_desc_buf_{};
+    /** @brief GET_STATUS の応答（wPortStatus, wPortChange） */
+    std::array<uint16_t, 2> status_buf_{};
+
+    std::array<HubEvent, 2 * kMaxPorts + 2> events_{};
+    int event_head_ = 0;
+    int num_events_ = 0;
+    void PushEvent(HubEvent::Type type, int port, PortSpeed speed = PortSpeed::kFull);
+
+    /** @brief 電源の安定を待つ Start() を OnTick() で再開するための awaiter */
+    class PowerGoodAwaiter {
+     public:
+      PowerGoodAwaiter(HubDriver& hub) : hub_{hub} {}
+      bool await_ready() const noexcept { return hub_.power_good_tick_ == 0; }
+      void await_suspend(coro::coroutine_handle<> handle);
+      void await_resume() const noexcept {}
+
+     private:
+      HubDriver& hub_;
+    };
+
+    /** @brief 電源が安定したとみなす tick．待っていなければ 0． */
+    uint64_t power_good_tick_ = 0;
+    coro::coroutine_handle<> power_good_waiter_;
+    static std::atomic<int> num_waiting_power_good_;
+    /** @brief bPwrOn2PwrGood の間，コルーチンを中断させる */
+    PowerGoodAwaiter WaitPowerGood(int ms);
+
+    /** @brief ハブディスクリプタを読み，全ポートの電源を入れてから状態変化の受信を始める */
+    Task Start();
+    /** @brief changed_ に溜まった状態変化を順に処理し，終わったら次の受信を始める */
+    Task HandleChanges();
+    Task SetPortReset(int port);
+    /** @brief SET_FEATURE／CLEAR_FEATURE．port が 0 ならハブ自身の機能． */
+    ControlAwaiter PortFeature(bool set, int feature, int port);
+    /** @brief GET_STATUS の結果を status_buf_ に受け取る．port が 0 ならハブ自身． */
+    ControlAwaiter GetStatus(int port);
+    Error ReceiveChanges();
+  };
+}
@@ -25,7 +25,8 @@ namespace usb {
   }
 
   void* HIDKeyboardDriver::operator new(size_t size) {
-    return AllocMem(sizeof(HIDKeyboardDriver), 0, 0);
+    return AllocMem(sizeof(HIDKeyboardDriver), 0, 0,
+                    memstat::Tag::kUSBDriver);
   }
 
   void HIDKeyboardDriver::operator delete(void* ptr) noexcept {
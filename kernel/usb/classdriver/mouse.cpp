@@ -19,7 +19,8 @@ namespace usb {
   }
 
   void* HIDMouseDriver::operator new(size_t size) {
-    return AllocMem(sizeof(HIDMouseDriver), 0, 0);
+    return AllocMem(sizeof(HIDMouseDriver), 0, 0,
+                    memstat::Tag::kUSBDriver);
   }
 
   void HIDMouseDriver::operator delete(void* ptr) noexcept {
@@ -0,0 +1,406 @@
+#include "usb/classdriver/msc.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "logger.hpp"
+#include "usb/device.hpp"
+#include "usb/memory.hpp"
+
+namespace usb {
+  namespace {
+    /** Bulk-Only Mass Storage Reset（BOT 3.1）の bRequest */
+    const int kBulkOnlyMassStorageReset = 0xff;
+    /** CLEAR_FEATURE の wValue に使う ENDPOINT_HALT */
+    const int kEndpointHalt = 0;
+  }
+
+  MassStorageDriver::MassStorageDriver(Device* dev, int interface_index)
+      : ClassDriver{dev}, interface_index_{interface_index} {
+  }
+
+  void* MassStorageDriver::operator new(size_t size) {
+    return AllocMem(sizeof(MassStorageDriver), 64, 0,
+                    memstat::Tag::kUSBDriver);
+  }
+
+  void MassStorageDriver::operator delete(void* ptr) noexcept {
+    FreeMem(ptr);
+  }
+
+  Error MassStorageDriver::Initialize() {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error MassStorageDriver::SetEndpoint(const EndpointConfig& config) {
+    if (config.ep_type == EndpointType::kBulk && config.ep_id.IsIn()) {
+      ep_bulk_in_ = config.ep_id;
+    } else if (config.ep_type == EndpointType::kBulk && !config.ep_id.IsIn()) {
+      ep_bulk_out_ = config.ep_id;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error MassStorageDriver::OnEndpointsConfigured() {
+    // LUN 0 だけを使う．リセット直後の UNIT ATTENTION を TEST UNIT READY で受け流してから容量を読む．
+    unit_ready_tries_ = 1;
+    return Submit(scsi::MakeTestUnitReady(), nullptr, 0, false, OnUnitReady, 0);
+  }
+
+  void MassStorageDriver::OnUnitReady(BlockDevice& dev, Error err, uintptr_t arg) {
+    auto& msc = static_cast<MassStorageDriver&>(dev);
+    // CHECK CONDITION（NOT READY など）ならしばらく繰り返す．転送の失敗はやり直しても仕方がない．
+    if (err.Cause() == Error::kCommandFailed && msc.unit_ready_tries_ < kMaxUnitReadyTries) {
+      ++msc.unit_ready_tries_;
+      err = msc.Submit(scsi::MakeTestUnitReady(), nullptr, 0, false, OnUnitReady, 0);
+    } else if (err) {
+      Log(kError, "MassStorageDriver: TEST UNIT READY failed %d times: %s\n",
+          msc.unit_ready_tries_, err.Name());
+      return;
+    } else {
+      err = msc.Submit(scsi::MakeReadCapacity10(), &msc.capacity_, sizeof(msc.capacity_),
+                       true, OnCapacityRead, 0);
+    }
+    if (err) {
+      Log(kError, "MassStorageDriver: failed to submit a command: %s\n", err.Name());
+    }
+  }
+
+  void MassStorageDriver::OnCapacityRead(BlockDevice& dev, Error err, uintptr_t arg) {
+    auto& msc = static_cast<MassStorageDriver&>(dev);
+    if (err) {
+      Log(kError, "MassStorageDriver: READ CAPACITY failed: %s\n", err.Name());
+      return;
+    }
+    msc.num_blocks_ = uint64_t{scsi::GetBE32(msc.capacity_.last_lba)} + 1;
+    msc.block_size_ = scsi::GetBE32(msc.capacity_.block_length);
+    msc.ready_ = true;
+    Log(kInfo, "MassStorageDriver: interface %d, %lu blocks x %u bytes\n",
+        msc.interface_index_, msc.num_blocks_, msc.block_size_);
+
+    if (default_ready_handler) {
+      default_ready_handler(msc);
+    }
+  }
+
+  Error MassStorageDriver::OnControlCompleted(EndpointID ep_id, SetupData setup_data,
+                                              const void* buf, int len) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error MassStorageDriver::OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  void MassStorageDriver::OnRemoved() {
+    if (ready_ && default_removed_handler) {
+      default_removed_handler(*this);
+    }
+    ready_ = false;
+    Halt(MAKE_ERROR(Error::kUnknownDevice));
+  }
+
+  Error MassStorageDriver::Read(uint64_t lba, uint32_t num_blocks, void* buf,
+                                Callback* callback, uintptr_t arg) {
+    return ReadWrite(false, lba, num_blocks, buf, callback, arg);
+  }
+
+  Error MassStorageDriver::Write(uint64_t lba, uint32_t num_blocks, const void* buf,
+                                 Callback* callback, uintptr_t arg) {
+    return ReadWrite(true, lba, num_blocks, const_cast<void*>(buf), callback, arg);
+  }
+
+  void MassStorageDriver::BeginBatch() {
+    ParentDevice()->BeginTransferBatch();
+  }
+
+  void MassStorageDriver::EndBatch() {
+    ParentDevice()->EndTransferBatch();
+  }
+
+  Error MassStorageDriver::ReadWrite(bool write, uint64_t lba, uint32_t num_blocks, void* buf,
+                                     Callback* callback, uintptr_t arg) {
+    if (!ready_) {
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
+    if (num_blocks == 0 || num_blocks > scsi::kMaxBlocks10 ||
+        lba + num_blocks > num_blocks_ || lba + num_blocks > (uint64_t{1} << 32)) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    return Submit(scsi::MakeReadWrite10(write, lba, num_blocks),
+                  buf, num_blocks * block_size_, !write, callback, arg);
+  }
+
+  Error MassStorageDriver::Submit(const scsi::CommandBlock& cb, void* buf, uint32_t len,
+                                  bool dir_in, Callback* callback, uintptr_t arg) {
+    if (halted_) {
+      return MAKE_ERROR(Error::kTransferFailed);
+    }
+
+    int slot = 0;
+    while (slot < kQueueDepth && commands_[slot].busy) {
+      ++slot;
+    }
+    if (slot == kQueueDepth) {
+      return MAKE_ERROR(Error::kFull);
+    }
+
+    auto& cmd = commands_[slot];
+    cmd.cb = cb;
+    cmd.buf = buf;
+    cmd.len = len;
+    cmd.dir_in = dir_in;
+    cmd.retries = 1;
+    cmd.sensing = false;
+    cmd.callback = callback;
+    cmd.arg = arg;
+    cmd.busy = true;
+    ++num_in_flight_;
+
+    waiting_[(waiting_head_ + num_waiting_) % kQueueDepth] = slot;
+    ++num_waiting_;
+    StartNext();
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  void MassStorageDriver::StartNext() {
+    if (active_ >= 0 || num_waiting_ == 0 || halted_ || resetting_) {
+      return;
+    }
+    active_ = waiting_[waiting_head_];
+    waiting_head_ = (waiting_head_ + 1) % kQueueDepth;
+    --num_waiting_;
+    Issue(active_);
+  }
+
+  void MassStorageDriver::Issue(int slot) {
+    auto& cmd = commands_[slot];
+    const auto cb = cmd.sensing ? scsi::MakeRequestSense(sense_.size()) : cmd.cb;
+    void* const buf = cmd.sensing ? sense_.data() : cmd.buf;
+    const uint32_t len = cmd.sensing ? sense_.size() : cmd.len;
+    const bool dir_in = cmd.sensing || cmd.dir_in;
+
+    cmd.cbw = CommandBlockWrapper{};
+    cmd.cbw.signature = CommandBlockWrapper::kSignature;
+    // 下位 8 ビットでスロットを，上位で発行順を表す
+    cmd.cbw.tag = next_tag_++ << 8 | slot;
+    cmd.cbw.data_transfer_length = len;
+    cmd.cbw.flags = dir_in ? CommandBlockWrapper::kDirectionIn : 0;
+    cmd.cbw.lun = 0;
+    cmd.cbw.cb_length = cb.length;
+    memcpy(cmd.cbw.cb, cb.bytes.data(), cb.length);
+    cmd.csw = CommandStatusWrapper{};
+    cmd.transferred = 0;
+
+    // デバイスに送るのはこのコマンドだけなので，各エンドポイントのリング上の転送は 1 組だけになる
+    const uintptr_t cookie = slot << 2;
+    auto dev = ParentDevice();
+    TransferBatch batch{*dev};
+    Error err = dev->BulkOut(ep_bulk_out_, &cmd.cbw, sizeof(cmd.cbw), cookie | kPhaseCommand);
+    if (!err && len > 0) {
+      err = dir_in ? dev->BulkIn(ep_bulk_in_, buf, len, cookie | kPhaseData)
+                   : dev->BulkOut(ep_bulk_out_, buf, len, cookie | kPhaseData);
+    }
+    if (!err) {
+      err = dev->BulkIn(ep_bulk_in_, &cmd.csw, sizeof(cmd.csw), cookie | kPhaseStatus);
+    }
+    if (err) {
+      // 一部の転送を積んでしまったかもしれず，デバイスとの対応が崩れる
+      Log(kError, "MassStorageDriver: failed to queue transfers: %s\n", err.Name());
+      Recover(err);
+    }
+  }
+
+  Error MassStorageDriver::OnBulkCompleted(EndpointID ep_id, uintptr_t cookie,
+                                           int len, Error err) {
+    const int slot = cookie >> 2;
+    const int phase = cookie & 3;
+    if (resetting_) {
+      // Reset Recovery で取り消した転送
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    if (slot != active_) {
+      return MAKE_ERROR(Error::kNoWaiter);
+    }
+
+    if (err) {
+      // STALL もここに来る．後に積んだ CSW は受け取れないので Reset Recovery で揃え直す．
+      Recover(err);
+      return err;
+    }
+    if (phase == kPhaseData) {
+      commands_[slot].transferred = len;
+    } else if (phase == kPhaseStatus) {
+      OnStatus(slot, len);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  void MassStorageDriver::OnStatus(int slot, int len) {
+    auto& cmd = commands_[slot];
+    if (len != sizeof(CommandStatusWrapper) ||
+        cmd.csw.signature != CommandStatusWrapper::kSignature ||
+        cmd.csw.tag != cmd.cbw.tag) {
+      Log(kError, "MassStorageDriver: invalid CSW (len %d, tag %08x, expected %08x)\n",
+          len, cmd.csw.tag, cmd.cbw.tag);
+      Recover(MAKE_ERROR(Error::kTransferFailed));
+      return;
+    }
+    if (cmd.csw.status >= 2) {
+      // Phase Error は Reset Recovery でしか復旧できない
+      Log(kError, "MassStorageDriver: phase error on command %02x\n", cmd.cbw.cb[0]);
+      Recover(MAKE_ERROR(Error::kTransferFailed));
+      return;
+    }
+
+    if (cmd.sensing) {
+      cmd.sensing = false;
+      const uint8_t key = scsi::SenseKey(sense_.data(), cmd.transferred);
+      const uint8_t asc = scsi::SenseASC(sense_.data(), cmd.transferred);
+      if (cmd.csw.status == 0 && key == scsi::kSenseKeyUnitAttention && cmd.retries > 0) {
+        --cmd.retries;
+        Log(kDebug, "MassStorageDriver: unit attention (ASC %02x), retrying command %02x\n",
+            asc, cmd.cb.bytes[0]);
+        Issue(slot);
+        return;
+      }
+      Log(kWarn, "MassStorageDriver: command %02x failed: sense key %x, ASC %02x\n",
+          cmd.cb.bytes[0], key, asc);
+      Finish(slot, MAKE_ERROR(Error::kCommandFailed));
+      return;
+    }
+
+    if (cmd.csw.status == 1) {
+      // CHECK CONDITION．何が起きたかは REQUEST SENSE で読み出す．
+      cmd.sensing = true;
+      Issue(slot);
+      return;
+    }
+
+    // デバイスが送受信しなかった分（dCSWDataResidue）があれば，要求した全体は読み書きできていない
+    const uint32_t data_residue = cmd.csw.data_residue;
+    const uint32_t residue = std::max(data_residue, cmd.len - cmd.transferred);
+    if (residue > 0) {
+      Log(kWarn, "MassStorageDriver: command %02x transferred %u of %u bytes\n",
+          cmd.cb.bytes[0], cmd.len - residue, cmd.len);
+      Finish(slot, MAKE_ERROR(Error::kTransferFailed));
+      return;
+    }
+    Finish(slot, MAKE_ERROR(Error::kSuccess));
+  }
+
+  void MassStorageDriver::Finish(int slot, Error err) {
+    active_ = -1;
+    Complete(commands_[slot], err);
+    StartNext();
+  }
+
+  void MassStorageDriver::Complete(Command& cmd, Error err) {
+    const auto callback = cmd.callback;
+    const auto arg = cmd.arg;
+    cmd.busy = false;
+    --num_in_flight_;
+    // コールバックの中から次のコマンドを発行できるよう，スロットを空けてから呼ぶ
+    if (callback) {
+      callback(*this, err, arg);
+    }
+  }
+
+  void MassStorageDriver::Recover(Error err) {
+    if (halted_ || resetting_) {
+      return;
+    }
+    Log(kWarn, "MassStorageDriver: starting reset recovery: %s\n", err.Name());
+    resetting_ = true;
+    reset_requests_pending_ = true;
+    if (active_ >= 0) {
+      const int slot = active_;
+      active_ = -1;
+      Complete(commands_[slot], err);
+    }
+
+    // ホスト側では積んである転送を取り消し，データトグルを戻す．完了は OnEndpointReset() で受ける．
+    auto dev = ParentDevice();
+    endpoints_resetting_ = 0;
+    if (!dev->ResetEndpoint(ep_bulk_in_)) {
+      endpoints_resetting_ |= 1u;
+    }
+    if (!dev->ResetEndpoint(ep_bulk_out_)) {
+      endpoints_resetting_ |= 2u;
+    }
+    if (auto reset_err = ResetRecovery().Start()) {
+      Log(kError, "MassStorageDriver: failed to start reset recovery: %s\n", reset_err.Name());
+      Halt(reset_err);
+    }
+  }
+
+  Task MassStorageDriver::ResetRecovery() {
+    auto dev = ParentDevice();
+    SetupData setup_data{};
+    setup_data.request_type.bits.direction = request_type::kOut;
+    setup_data.request_type.bits.type = request_type::kClass;
+    setup_data.request_type.bits.recipient = request_type::kInterface;
+    setup_data.request = kBulkOnlyMassStorageReset;
+    setup_data.value = 0;
+    setup_data.index = interface_index_;
+    setup_data.length = 0;
+    auto reset = co_await dev->ControlOut(kDefaultControlPipeID, setup_data, nullptr, 0);
+    if (reset.error) {
+      Log(kError, "MassStorageDriver: Bulk-Only Mass Storage Reset failed: %s\n",
+          reset.error.Name());
+      Halt(reset.error);
+      co_return reset.error;
+    }
+
+    // デバイス側のデータトグルも戻す．Halt していないエンドポイントにも送ってよい．
+    const EndpointID eps[] = {ep_bulk_in_, ep_bulk_out_};
+    for (auto ep_id : eps) {
+      setup_data.request_type.bits.type = request_type::kStandard;
+      setup_data.request_type.bits.recipient = request_type::kEndpoint;
+      setup_data.request = request::kClearFeature;
+      setup_data.value = kEndpointHalt;
+      setup_data.index = ep_id.Number() | (ep_id.IsIn() ? 0x80 : 0);
+      auto clear = co_await dev->ControlOut(kDefaultControlPipeID, setup_data, nullptr, 0);
+      if (clear.error) {
+        Log(kError, "MassStorageDriver: CLEAR_FEATURE(ENDPOINT_HALT) for ep %d failed: %s\n",
+            ep_id.Address(), clear.error.Name());
+        Halt(clear.error);
+        co_return clear.error;
+      }
+    }
+
+    reset_requests_pending_ = false;
+    ResumeAfterReset();
+    co_return MAKE_ERROR(Error::kSuccess);
+  }
+
+  void MassStorageDriver::OnEndpointReset(EndpointID ep_id, uint16_t stream_id) {
+    if (!resetting_) {
+      return;
+    }
+    endpoints_resetting_ &= ep_id.IsIn() ? ~1u : ~2u;
+    ResumeAfterReset();
+  }
+
+  void MassStorageDriver::ResumeAfterReset() {
+    if (!resetting_ || reset_requests_pending_ || endpoints_resetting_ != 0) {
+      return;
+    }
+    resetting_ = false;
+    Log(kInfo, "MassStorageDriver: reset recovery done, %d commands waiting\n", num_waiting_);
+    StartNext();
+  }
+
+  void MassStorageDriver::Halt(Error err) {
+    // 外れたデバイスやリセットできなかったデバイスの転送は完了しない
+    halted_ = true;
+    resetting_ = false;
+    active_ = -1;
+    num_waiting_ = 0;
+    for (auto& cmd : commands_) {
+      if (cmd.busy) {
+        Complete(cmd, err);
+      }
+    }
+  }
+}
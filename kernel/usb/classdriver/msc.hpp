@@ -0,0 +1,175 @@
+/**
+ * @file usb/classdriver/msc.hpp
+ *
+ * USB Mass Storage Class の Bulk-Only Transport（BOT）ドライバ．
+ *
+ * QEMU では -drive if=none,id=stick,format=raw,file=disk.img
+ * -device usb-storage,drive=stick で試せる．
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#include "usb/async.hpp"
+#include "usb/classdriver/base.hpp"
+#include "usb/classdriver/block.hpp"
+#include "usb/classdriver/scsi.hpp"
+
+namespace usb {
+  /** @brief Command Block Wrapper（31 バイト） */
+  struct CommandBlockWrapper {
+    static const uint32_t kSignature = 0x43425355; // "USBC"
+    static const uint8_t kDirectionIn = 0x80;
+
+    uint32_t signature;
+    uint32_t tag;
+    uint32_t data_transfer_length;
+    uint8_t flags;
+    uint8_t lun;
+    uint8_t cb_length;
+    uint8_t cb[16];
+  } __attribute__((packed));
+
+  /** @brief Command Status Wrapper（13 バイト） */
+  struct CommandStatusWrapper {
+    static const uint32_t kSignature = 0x53425355; // "USBS"
+
+    uint32_t signature;
+    uint32_t tag;
+    uint32_t data_residue;
+    uint8_t status;
+  } __attribute__((packed));
+
+  /** @brief BOT の大容量記憶装置（interface class 8, subclass 6 (SCSI), protocol 0x50）
+   *
+   * BOT では前のコマンドの CSW を受け取るまで次の CBW を送ってはならない（BOT 6.2.1）．
+   * Read()/Write() は kQueueDepth 個までソフトウェアのキューに受け付け，デバイスへは
+   * CBW，データ，CSW を 1 組ずつ送って，CSW の完了から次のコマンドを始める．
+   *
+   * CHECK CONDITION を受けたら REQUEST SENSE でセンスデータを読み，UNIT ATTENTION
+   * （リセット直後など）なら同じコマンドを 1 回だけやり直す．
+   *
+   * STALL などの転送エラーや不正な CSW，Phase Error では送っていたコマンドを失敗させ，
+   * Reset Recovery（BOT 5.3.4）でデバイスとエンドポイントを戻してからキューの残りを送る．
+   */
+  class MassStorageDriver : public ClassDriver, public BlockDevice {
+   public:
+    /** @brief 受け付けておける SCSI コマンドの数（デバイスには 1 つずつ送る） */
+    static const int kQueueDepth = 8;
+    /** @brief 初期化時に TEST UNIT READY を繰り返す上限（NOT READY の間） */
+    static const int kMaxUnitReadyTries = 10;
+
+    MassStorageDriver(Device* dev, int interface_index);
+
+    void* operator new(size_t size);
+    void operator delete(void* ptr) noexcept;
+
+    Error Initialize() override;
+    Error SetEndpoint(const EndpointConfig& config) override;
+    Error OnEndpointsConfigured() override;
+    Error OnControlCompleted(EndpointID ep_id, SetupData setup_data,
+                             const void* buf, int len) override;
+    Error OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) override;
+    Error OnBulkCompleted(EndpointID ep_id, uintptr_t cookie, int len, Error err) override;
+    void OnEndpointReset(EndpointID ep_id, uint16_t stream_id) override;
+    void OnRemoved() override;
+
+    Error Read(uint64_t lba, uint32_t num_blocks, void* buf,
+               Callback* callback, uintptr_t arg) override;
+    Error Write(uint64_t lba, uint32_t num_blocks, const void* buf,
+                Callback* callback, uintptr_t arg) override;
+    bool IsReady() const override { return ready_; }
+    uint64_t NumBlocks() const override { return num_blocks_; }
+    uint32_t BlockSize() const override { return block_size_; }
+    uint32_t MaxBlocksPerRequest() const override { return scsi::kMaxBlocks10; }
+    int QueueDepth() const override { return kQueueDepth; }
+    int InFlight() const override { return num_in_flight_; }
+    void BeginBatch() override;
+    void EndBatch() override;
+
+   private:
+    /** @brief cookie の下位 2 ビットで表す，コマンドのどの転送が完了したか */
+    enum Phase {
+      kPhaseCommand = 0,
+      kPhaseData = 1,
+      kPhaseStatus = 2,
+    };
+
+    struct Command {
+      scsi::CommandBlock cb;
+      void* buf;
+      uint32_t len;
+      bool dir_in;
+      /** @brief UNIT ATTENTION でやり直せる残り回数 */
+      uint8_t retries;
+      /** @brief このコマンドのセンスデータを REQUEST SENSE で読んでいる */
+      bool sensing;
+      /** @brief データ転送で実際に送受信したバイト数 */
+      uint32_t transferred;
+      CommandBlockWrapper cbw;
+      CommandStatusWrapper csw;
+      bool busy;
+      Callback* callback;
+      uintptr_t arg;
+    };
+
+    const int interface_index_;
+    EndpointID ep_bulk_in_;
+    EndpointID ep_bulk_out_;
+
+    std::array<Command, kQueueDepth> commands_{};
+    int num_in_flight_ = 0;
+    /** @brief デバイスに送るのを待っているコマンドのスロット番号（受け付け順） */
+    std::array<uint8_t, kQueueDepth> waiting_{};
+    int waiting_head_ = 0;
+    int num_waiting_ = 0;
+    /** @brief デバイスに送っているコマンドのスロット番号．無ければ -1． */
+    int active_ = -1;
+    uint32_t next_tag_ = 0;
+    /** @brief デバイスが外れたか，Reset Recovery に失敗した．以後コマンドを受け付けない． */
+    bool halted_ = false;
+    /** @brief Reset Recovery の途中．終わるまで次のコマンドを送らない． */
+    bool resetting_ = false;
+    /** @brief Reset Recovery のコントロール転送をまだ終えていない */
+    bool reset_requests_pending_ = false;
+    /** @brief ホスト側のリセットを待っているバルクエンドポイント（ビット 0 が IN，1 が OUT） */
+    uint8_t endpoints_resetting_ = 0;
+
+    /** @brief REQUEST SENSE の応答．センスを読むのは送っている 1 コマンドだけなので 1 つで足りる． */
+    std::array<uint8_t, scsi::kFixedSenseLength> sense_{};
+
+    bool ready_ = false;
+    uint64_t num_blocks_ = 0;
+    uint32_t block_size_ = 0;
+    scsi::ReadCapacity10Data capacity_{};
+    int unit_ready_tries_ = 0;
+
+    /** @brief コマンドをキューに入れ，デバイスが空いていれば送る */
+    Error Submit(const scsi::CommandBlock& cb, void* buf, uint32_t len, bool dir_in,
+                 Callback* callback, uintptr_t arg);
+    Error ReadWrite(bool write, uint64_t lba, uint32_t num_blocks, void* buf,
+                    Callback* callback, uintptr_t arg);
+    /** @brief デバイスが空いていれば，キューの先頭のコマンドを送る */
+    void StartNext();
+    /** @brief スロットのコマンド（sensing なら REQUEST SENSE）の CBW，データ，CSW を積む */
+    void Issue(int slot);
+    /** @brief CSW を受け取ったコマンドの結果を決める */
+    void OnStatus(int slot, int len);
+    /** @brief 送っていたコマンドを完了させ，次のコマンドを送る */
+    void Finish(int slot, Error err);
+    void Complete(Command& cmd, Error err);
+    /** @brief 送っていたコマンドを err で失敗させ，Reset Recovery を始める */
+    void Recover(Error err);
+    /** @brief Bulk-Only Mass Storage Reset と，両方のバルクエンドポイントの CLEAR_FEATURE(ENDPOINT_HALT) */
+    Task ResetRecovery();
+    /** @brief Reset Recovery のすべての手順が終わっていれば，キューの残りのコマンドを送る */
+    void ResumeAfterReset();
+    /** @brief 復旧できないので，受け付けたコマンドをすべて失敗させる */
+    void Halt(Error err);
+
+    static void OnUnitReady(BlockDevice& dev, Error err, uintptr_t arg);
+    static void OnCapacityRead(BlockDevice& dev, Error err, uintptr_t arg);
+  };
+}
@@ -0,0 +1,116 @@
+/**
+ * @file usb/classdriver/scsi.hpp
+ *
+ * USB ストレージが運ぶ SCSI コマンド（CDB）の組み立て．
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+namespace usb::scsi {
+  const uint8_t kTestUnitReady = 0x00;
+  const uint8_t kRequestSense = 0x03;
+  const uint8_t kInquiry = 0x12;
+  const uint8_t kReadCapacity10 = 0x25;
+  const uint8_t kRead10 = 0x28;
+  const uint8_t kWrite10 = 0x2a;
+
+  /** @brief センスキー（REQUEST SENSE の応答に含まれるエラーの分類） */
+  const uint8_t kSenseKeyNotReady = 0x02;
+  const uint8_t kSenseKeyUnitAttention = 0x06;
+
+  /** @brief 固定形式のセンスデータの長さ（追加情報を除く） */
+  const uint8_t kFixedSenseLength = 18;
+
+  /** @brief READ/WRITE(10) の転送ブロック数の上限 */
+  const uint32_t kMaxBlocks10 = 0xffff;
+
+  /** @brief CDB．未使用部分は 0． */
+  struct CommandBlock {
+    std::array<uint8_t, 16> bytes{};
+    uint8_t length;
+  };
+
+  inline void PutBE16(uint8_t* p, uint16_t value) {
+    p[0] = value >> 8;
+    p[1] = value;
+  }
+
+  inline void PutBE32(uint8_t* p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+  }
+
+  inline uint16_t GetBE16(const uint8_t* p) {
+    return uint16_t{p[0]} << 8 | p[1];
+  }
+
+  inline uint32_t GetBE32(const uint8_t* p) {
+    return uint32_t{p[0]} << 24 | uint32_t{p[1]} << 16 | uint32_t{p[2]} << 8 | p[3];
+  }
+
+  inline CommandBlock MakeReadWrite10(bool write, uint32_t lba, uint16_t num_blocks) {
+    CommandBlock cb{};
+    cb.length = 10;
+    cb.bytes[0] = write ? kWrite10 : kRead10;
+    PutBE32(&cb.bytes[2], lba);
+    PutBE16(&cb.bytes[7], num_blocks);
+    return cb;
+  }
+
+  inline CommandBlock MakeTestUnitReady() {
+    CommandBlock cb{};
+    cb.length = 6;
+    cb.bytes[0] = kTestUnitReady;
+    return cb;
+  }
+
+  inline CommandBlock MakeRequestSense(uint8_t alloc_length) {
+    CommandBlock cb{};
+    cb.length = 6;
+    cb.bytes[0] = kRequestSense;
+    cb.bytes[4] = alloc_length;
+    return cb;
+  }
+
+  /** @brief センスデータ（固定形式 0x70/0x71 と記述子形式 0x72/0x73）のセンスキー．len が足りなければ 0． */
+  inline uint8_t SenseKey(const uint8_t* sense, int len) {
+    const uint8_t response_code = len > 0 ? sense[0] & 0x7f : 0;
+    if ((response_code == 0x70 || response_code == 0x71) && len > 2) {
+      return sense[2] & 0x0f;
+    }
+    if ((response_code == 0x72 || response_code == 0x73) && len > 1) {
+      return sense[1] & 0x0f;
+    }
+    return 0;
+  }
+
+  /** @brief センスデータの Additional Sense Code．len が足りなければ 0． */
+  inline uint8_t SenseASC(const uint8_t* sense, int len) {
+    const uint8_t response_code = len > 0 ? sense[0] & 0x7f : 0;
+    if ((response_code == 0x70 || response_code == 0x71) && len > 12) {
+      return sense[12];
+    }
+    if ((response_code == 0x72 || response_code == 0x73) && len > 2) {
+      return sense[2];
+    }
+    return 0;
+  }
+
+  inline CommandBlock MakeReadCapacity10() {
+    CommandBlock cb{};
+    cb.length = 10;
+    cb.bytes[0] = kReadCapacity10;
+    return cb;
+  }
+
+  /** @brief READ CAPACITY(10) の応答（8 バイト） */
+  struct ReadCapacity10Data {
+    uint8_t last_lba[4];
+    uint8_t block_length[4];
+  } __attribute__((packed));
+}
@@ -0,0 +1,474 @@
+#include "usb/classdriver/uas.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "logger.hpp"
+#include "usb/device.hpp"
+#include "usb/memory.hpp"
+
+namespace usb {
+  namespace {
+    /** CLEAR_FEATURE の wValue に使う ENDPOINT_HALT */
+    const int kEndpointHalt = 0;
+  }
+
+  UASDriver::UASDriver(Device* dev, int interface_index)
+      : ClassDriver{dev}, interface_index_{interface_index} {
+  }
+
+  void* UASDriver::operator new(size_t size) {
+    return AllocMem(sizeof(UASDriver), 64, 0, memstat::Tag::kUSBDriver);
+  }
+
+  void UASDriver::operator delete(void* ptr) noexcept {
+    FreeMem(ptr);
+  }
+
+  Error UASDriver::Initialize() {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error UASDriver::SetEndpoint(const EndpointConfig& config) {
+    if (config.ep_type != EndpointType::kBulk) {
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    switch (config.pipe_id) {
+    case uas::kCommandPipe: ep_command_ = config.ep_id; break;
+    case uas::kStatusPipe: ep_status_ = config.ep_id; break;
+    case uas::kDataInPipe: ep_data_in_ = config.ep_id; break;
+    case uas::kDataOutPipe: ep_data_out_ = config.ep_id; break;
+    default:
+      Log(kWarn, "UASDriver: endpoint %d without a known pipe usage (%d)\n",
+          config.ep_id.Address(), config.pipe_id);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error UASDriver::OnEndpointsConfigured() {
+    auto dev = ParentDevice();
+    // ストリーム 0 は使えないので，タグ（= ストリーム ID）は 1 から NumStreams() - 1
+    const size_t num_streams = std::min({dev->NumStreams(ep_status_),
+                                         dev->NumStreams(ep_data_in_),
+                                         dev->NumStreams(ep_data_out_)});
+    if (num_streams < 2) {
+      Log(kError, "UASDriver: bulk streams are not available\n");
+      return MAKE_ERROR(Error::kNotImplemented);
+    }
+    queue_depth_ = std::min<int>(num_streams - 1, kMaxQueueDepth);
+    Log(kDebug, "UASDriver: %lu streams, queue depth %d\n", num_streams, queue_depth_);
+
+    // LUN 0 だけを使う
+    return Submit(scsi::MakeReadCapacity10(), &capacity_, sizeof(capacity_), true,
+                  OnCapacityRead, 0);
+  }
+
+  void UASDriver::OnCapacityRead(BlockDevice& dev, Error err, uintptr_t arg) {
+    auto& uas = static_cast<UASDriver&>(dev);
+    if (err) {
+      Log(kError, "UASDriver: READ CAPACITY failed: %s\n", err.Name());
+      return;
+    }
+    uas.num_blocks_ = uint64_t{scsi::GetBE32(uas.capacity_.last_lba)} + 1;
+    uas.block_size_ = scsi::GetBE32(uas.capacity_.block_length);
+    uas.ready_ = true;
+    Log(kInfo, "UASDriver: interface %d, %lu blocks x %u bytes, queue depth %d\n",
+        uas.interface_index_, uas.num_blocks_, uas.block_size_, uas.queue_depth_);
+
+    if (default_ready_handler) {
+      default_ready_handler(uas);
+    }
+  }
+
+  Error UASDriver::OnControlCompleted(EndpointID ep_id, SetupData setup_data,
+                                      const void* buf, int len) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error UASDriver::OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  void UASDriver::OnRemoved() {
+    if (ready_ && default_removed_handler) {
+      default_removed_handler(*this);
+    }
+    ready_ = false;
+    Halt(MAKE_ERROR(Error::kUnknownDevice));
+  }
+
+  Error UASDriver::Read(uint64_t lba, uint32_t num_blocks, void* buf,
+                        Callback* callback, uintptr_t arg) {
+    return ReadWrite(false, lba, num_blocks, buf, callback, arg);
+  }
+
+  Error UASDriver::Write(uint64_t lba, uint32_t num_blocks, const void* buf,
+                         Callback* callback, uintptr_t arg) {
+    return ReadWrite(true, lba, num_blocks, const_cast<void*>(buf), callback, arg);
+  }
+
+  void UASDriver::BeginBatch() {
+    ParentDevice()->BeginTransferBatch();
+  }
+
+  void UASDriver::EndBatch() {
+    ParentDevice()->EndTransferBatch();
+  }
+
+  Error UASDriver::ReadWrite(bool write, uint64_t lba, uint32_t num_blocks, void* buf,
+                             Callback* callback, uintptr_t arg) {
+    if (!ready_) {
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
+    if (num_blocks == 0 || num_blocks > scsi::kMaxBlocks10 ||
+        lba + num_blocks > num_blocks_ || lba + num_blocks > (uint64_t{1} << 32)) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    return Submit(scsi::MakeReadWrite10(write, lba, num_blocks),
+                  buf, num_blocks * block_size_, !write, callback, arg);
+  }
+
+  Error UASDriver::Submit(const scsi::CommandBlock& cb, void* buf, uint32_t len,
+                          bool dir_in, Callback* callback, uintptr_t arg) {
+    if (halted_) {
+      return MAKE_ERROR(Error::kTransferFailed);
+    }
+    if (resetting_) {
+      return MAKE_ERROR(Error::kFull);
+    }
+
+    int slot = 0;
+    while (slot < queue_depth_ && commands_[slot].busy) {
+      ++slot;
+    }
+    if (slot == queue_depth_) {
+      return MAKE_ERROR(Error::kFull);
+    }
+
+    auto& cmd = commands_[slot];
+    const uint16_t tag = slot + 1;
+    cmd.iu = uas::CommandIU{};
+    cmd.iu.iu_id = uas::kCommandIU;
+    scsi::PutBE16(cmd.iu.tag, tag);
+    cmd.iu.task_attribute = 0;  // SIMPLE
+    memcpy(cmd.iu.cdb, cb.bytes.data(), cb.length);
+    cmd.buf = buf;
+    cmd.len = len;
+    cmd.dir_in = dir_in;
+    cmd.retries = 1;
+    cmd.reported = false;
+    cmd.data_pending = false;
+    cmd.cancelling = false;
+    cmd.pending = 0;
+    cmd.callback = callback;
+    cmd.arg = arg;
+
+    cmd.busy = true;
+    ++num_in_flight_;
+    if (auto err = Issue(slot, len > 0)) {
+      cmd.busy = false;
+      --num_in_flight_;
+      return err;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error UASDriver::Issue(int slot, bool with_data) {
+    auto& cmd = commands_[slot];
+    const uint16_t tag = slot + 1;
+    cmd.sense = uas::SenseIU{};
+    cmd.status_len = 0;
+
+    // デバイスはタグのストリームでデータとステータスを返すので，Command IU より先に積む
+    const uintptr_t cookie = slot << 2;
+    auto dev = ParentDevice();
+    // ステータス，データ，Command IU のドアベルは積み終えてからまとめて鳴らす
+    TransferBatch batch{*dev};
+    if (auto err = dev->BulkIn(ep_status_, &cmd.sense, sizeof(cmd.sense),
+                               cookie | kPhaseStatus, tag)) {
+      return err;
+    }
+    ++cmd.pending;
+
+    Error err = MAKE_ERROR(Error::kSuccess);
+    if (with_data) {
+      err = cmd.dir_in
+        ? dev->BulkIn(ep_data_in_, cmd.buf, cmd.len, cookie | kPhaseData, tag)
+        : dev->BulkOut(ep_data_out_, cmd.buf, cmd.len, cookie | kPhaseData, tag);
+      if (!err) {
+        ++cmd.pending;
+        cmd.data_pending = true;
+      }
+    }
+    if (!err) {
+      err = dev->BulkOut(ep_command_, &cmd.iu, sizeof(cmd.iu), cookie | kPhaseCommand);
+      cmd.pending += !err;
+    }
+    if (err) {
+      // 積んだ転送とデバイスに届いたかもしれないコマンドを Reset Recovery で片付ける
+      Log(kError, "UASDriver: failed to queue transfers: %s\n", err.Name());
+      Recover(EndpointID{}, err);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error UASDriver::OnBulkCompleted(EndpointID ep_id, uintptr_t cookie,
+                                   int len, Error err) {
+    const int slot = cookie >> 2;
+    const int phase = cookie & 3;
+    if (slot == kTaskSlot) {
+      if (err) {
+        Log(kError, "UASDriver: LOGICAL UNIT RESET failed: %s\n", err.Name());
+        Halt(err);
+      } else if (phase == kPhaseStatus) {
+        OnTaskResponse(len);
+      }
+      return err;
+    }
+    if (slot >= queue_depth_ || !commands_[slot].busy) {
+      return MAKE_ERROR(Error::kNoWaiter);
+    }
+    auto& cmd = commands_[slot];
+
+    if (err && cmd.reported) {
+      // 完了を返したコマンドの，取り消した転送
+      if (--cmd.pending == 0 && !cmd.cancelling) {
+        Release(cmd);
+      }
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    if (err) {
+      Recover(ep_id, err);
+      return err;
+    }
+    if (phase == kPhaseStatus) {
+      cmd.status_len = len;
+    } else if (phase == kPhaseData) {
+      cmd.data_pending = false;
+    }
+    --cmd.pending;
+
+    if (cmd.reported) {
+      // 失敗を返した後に残っていたデータ転送が終わった
+      if (cmd.pending == 0 && !cmd.cancelling) {
+        Release(cmd);
+      }
+    } else if (cmd.pending == 0) {
+      Finish(slot);
+    } else if (phase == kPhaseStatus && cmd.data_pending &&
+               (cmd.sense.iu_id != uas::kSenseIU || cmd.sense.status != 0)) {
+      // 失敗したコマンドのデータ転送は完了しないまま，タグのストリームに残る．
+      // ステータスはそろったので，データを待たずにこのタグだけ結果を決める．
+      Finish(slot);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  void UASDriver::Finish(int slot) {
+    auto& cmd = commands_[slot];
+    const auto& sense = cmd.sense;
+    const bool tag_matches =
+      sense.tag[0] == cmd.iu.tag[0] && sense.tag[1] == cmd.iu.tag[1];
+    if (cmd.status_len < 4 || !tag_matches) {
+      Log(kError, "UASDriver: invalid status IU (len %d, id %02x, tag %02x%02x)\n",
+          cmd.status_len, sense.iu_id, sense.tag[0], sense.tag[1]);
+      Complete(cmd, MAKE_ERROR(Error::kTransferFailed));
+      return;
+    }
+    if (sense.iu_id == uas::kResponseIU) {
+      // Response IU ではバイト 7 が Response Code
+      Log(kWarn, "UASDriver: command %02x rejected: response code %d\n",
+          cmd.iu.cdb[0], cmd.status_len >= 8 ? sense.reserved7[0] : -1);
+      Complete(cmd, MAKE_ERROR(Error::kTransferFailed));
+      return;
+    }
+    if (sense.iu_id == uas::kSenseIU && sense.status == 0) {
+      Complete(cmd, MAKE_ERROR(Error::kSuccess));
+      return;
+    }
+
+    const int sense_len =
+      std::min<int>(scsi::GetBE16(sense.sense_length),
+                    cmd.status_len - static_cast<int>(offsetof(uas::SenseIU, sense_data)));
+    const uint8_t key = scsi::SenseKey(sense.sense_data, sense_len);
+    const uint8_t asc = scsi::SenseASC(sense.sense_data, sense_len);
+    if (sense.iu_id == uas::kSenseIU && key == scsi::kSenseKeyUnitAttention &&
+        cmd.retries > 0) {
+      // データ転送がまだストリームに残っていれば，やり直すコマンドのデータ転送としてそのまま使う
+      --cmd.retries;
+      Log(kDebug, "UASDriver: unit attention (ASC %02x), retrying command %02x on tag %d\n",
+          asc, cmd.iu.cdb[0], slot + 1);
+      if (auto err = Issue(slot, !cmd.data_pending && cmd.len > 0)) {
+        Complete(cmd, err);
+      }
+      return;
+    }
+    Log(kWarn, "UASDriver: command %02x failed: iu %02x, status %d, sense key %x, ASC %02x\n",
+        cmd.iu.cdb[0], sense.iu_id, sense.status, key, asc);
+    Complete(cmd, MAKE_ERROR(Error::kCommandFailed));
+  }
+
+  void UASDriver::Complete(Command& cmd, Error err) {
+    const auto callback = cmd.callback;
+    const auto arg = cmd.arg;
+    cmd.reported = true;
+    if (cmd.pending == 0) {
+      Release(cmd);
+    } else if (cmd.data_pending && !halted_ && !resetting_) {
+      // 失敗したコマンドのデータ転送はいつまでも完了しない．同じタグ（ストリーム）で
+      // 次のコマンドを送れるよう，そのストリームの転送だけを取り消す．
+      const uint16_t tag = scsi::GetBE16(cmd.iu.tag);
+      const auto ep_id = cmd.dir_in ? ep_data_in_ : ep_data_out_;
+      if (auto cancel_err = ParentDevice()->ResetEndpoint(ep_id, tag)) {
+        Log(kWarn, "UASDriver: tag %d is held, failed to cancel its data transfer: %s\n",
+            tag, cancel_err.Name());
+      } else {
+        cmd.cancelling = true;
+      }
+    }
+    // コールバックの中から次のコマンドを発行できるよう，タグを空けてから呼ぶ
+    if (callback) {
+      callback(*this, err, arg);
+    }
+  }
+
+  void UASDriver::Release(Command& cmd) {
+    cmd.busy = false;
+    --num_in_flight_;
+  }
+
+  void UASDriver::OnEndpointReset(EndpointID ep_id, uint16_t stream_id) {
+    if (stream_id == 0) {
+      pipes_resetting_ &= ~(uint32_t{1} << ep_id.Address());
+      ResumeAfterReset();
+      return;
+    }
+    // データ転送を取り消したタグ．取り消した転送の完了はすべて先に届いている．
+    const int slot = stream_id - 1;
+    if (slot >= queue_depth_) {
+      return;
+    }
+    auto& cmd = commands_[slot];
+    if (cmd.busy && cmd.cancelling) {
+      cmd.cancelling = false;
+      if (cmd.reported && cmd.pending == 0) {
+        Release(cmd);
+      }
+    }
+  }
+
+  void UASDriver::Recover(EndpointID ep_id, Error err) {
+    if (halted_ || resetting_) {
+      return;
+    }
+    Log(kWarn, "UASDriver: starting reset recovery: %s\n", err.Name());
+    resetting_ = true;
+    reset_requests_pending_ = true;
+    failed_pipe_ = ep_id;
+
+    // ホスト側ではすべてのパイプ（とそのストリーム）の転送を取り消す．
+    // タグは取り消した転送の完了で空き，ホスト側のリセットの完了は OnEndpointReset() で受ける．
+    auto dev = ParentDevice();
+    pipes_resetting_ = 0;
+    const EndpointID pipes[] = {ep_command_, ep_status_, ep_data_in_, ep_data_out_};
+    for (auto pipe : pipes) {
+      if (!dev->ResetEndpoint(pipe)) {
+        pipes_resetting_ |= uint32_t{1} << pipe.Address();
+      }
+    }
+    for (auto& cmd : commands_) {
+      if (cmd.busy && !cmd.reported) {
+        Complete(cmd, err);
+      }
+    }
+    if (auto clear_err = ClearHalt().Start()) {
+      Log(kError, "UASDriver: failed to start reset recovery: %s\n", clear_err.Name());
+      Halt(clear_err);
+    }
+  }
+
+  Task UASDriver::ClearHalt() {
+    // Halt するのはエラーになったパイプだけ．他のパイプのシーケンス番号には触れない．
+    if (failed_pipe_.Address() != 0) {
+      SetupData setup_data{};
+      setup_data.request_type.bits.direction = request_type::kOut;
+      setup_data.request_type.bits.type = request_type::kStandard;
+      setup_data.request_type.bits.recipient = request_type::kEndpoint;
+      setup_data.request = request::kClearFeature;
+      setup_data.value = kEndpointHalt;
+      setup_data.index = failed_pipe_.Number() | (failed_pipe_.IsIn() ? 0x80 : 0);
+      setup_data.length = 0;
+      auto clear = co_await ParentDevice()->ControlOut(kDefaultControlPipeID, setup_data,
+                                                       nullptr, 0);
+      if (clear.error) {
+        Log(kError, "UASDriver: CLEAR_FEATURE(ENDPOINT_HALT) for ep %d failed: %s\n",
+            failed_pipe_.Address(), clear.error.Name());
+        Halt(clear.error);
+        co_return clear.error;
+      }
+    }
+    reset_requests_pending_ = false;
+    ResumeAfterReset();
+    co_return MAKE_ERROR(Error::kSuccess);
+  }
+
+  void UASDriver::ResumeAfterReset() {
+    if (!resetting_ || halted_ || reset_requests_pending_ || pipes_resetting_ != 0) {
+      return;
+    }
+    // 取り消しはエンドポイント全体で終わったので，ストリームごとの取り消しを待つタグも空ける
+    for (auto& cmd : commands_) {
+      cmd.cancelling = false;
+      if (cmd.busy && cmd.reported && cmd.pending == 0) {
+        Release(cmd);
+      }
+    }
+
+    // デバイスが抱えているかもしれないコマンドを捨てさせる
+    task_iu_ = uas::TaskManagementIU{};
+    task_iu_.iu_id = uas::kTaskManagementIU;
+    scsi::PutBE16(task_iu_.tag, kTaskTag);
+    task_iu_.function = uas::kLogicalUnitReset;
+    task_response_ = uas::SenseIU{};
+
+    const uintptr_t cookie = kTaskSlot << 2;
+    auto dev = ParentDevice();
+    TransferBatch batch{*dev};
+    Error err = dev->BulkIn(ep_status_, &task_response_, sizeof(task_response_),
+                            cookie | kPhaseStatus, kTaskTag);
+    if (!err) {
+      err = dev->BulkOut(ep_command_, &task_iu_, sizeof(task_iu_), cookie | kPhaseCommand);
+    }
+    if (err) {
+      Log(kError, "UASDriver: failed to queue LOGICAL UNIT RESET: %s\n", err.Name());
+      Halt(err);
+    }
+  }
+
+  void UASDriver::OnTaskResponse(int len) {
+    const uint8_t code = task_response_.reserved7[0];
+    if (len < 8 || task_response_.iu_id != uas::kResponseIU ||
+        scsi::GetBE16(task_response_.tag) != kTaskTag) {
+      Log(kError, "UASDriver: invalid response IU for LOGICAL UNIT RESET (len %d, id %02x)\n",
+          len, task_response_.iu_id);
+      Halt(MAKE_ERROR(Error::kTransferFailed));
+      return;
+    }
+    if (code != uas::kTMFunctionComplete && code != uas::kTMFunctionSucceeded) {
+      Log(kWarn, "UASDriver: LOGICAL UNIT RESET: response code %d\n", code);
+    }
+    resetting_ = false;
+    Log(kInfo, "UASDriver: reset recovery done\n");
+  }
+
+  void UASDriver::Halt(Error err) {
+    // 外れたデバイスやリセットできなかったデバイスの転送は完了しない
+    halted_ = true;
+    resetting_ = false;
+    for (auto& cmd : commands_) {
+      if (cmd.busy && !cmd.reported) {
+        Complete(cmd, err);
+      }
+    }
+  }
+}
@@ -0,0 +1,218 @@
+/**
+ * @file usb/classdriver/uas.hpp
+ *
+ * USB Attached SCSI（UAS）ドライバ．SuperSpeed のバルクストリームを使う．
+ *
+ * QEMU では -device qemu-xhci -device usb-uas,id=uas
+ * -drive if=none,id=uasdisk,format=raw,file=disk.img
+ * -device scsi-hd,bus=uas.0,scsi-id=0,lun=0,drive=uasdisk で試せる．
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#include "usb/async.hpp"
+#include "usb/classdriver/base.hpp"
+#include "usb/classdriver/block.hpp"
+#include "usb/classdriver/scsi.hpp"
+
+namespace usb {
+  namespace uas {
+    const uint8_t kCommandIU = 0x01;
+    const uint8_t kSenseIU = 0x03;
+    const uint8_t kResponseIU = 0x04;
+    const uint8_t kTaskManagementIU = 0x05;
+
+    /** @brief Task Management IU の Task Management Function */
+    const uint8_t kLogicalUnitReset = 0x08;
+    /** @brief Response IU の Response Code */
+    const uint8_t kTMFunctionComplete = 0x00;
+    const uint8_t kTMFunctionSucceeded = 0x08;
+
+    /** @brief Pipe Usage ディスクリプタの Pipe ID */
+    const int kCommandPipe = 1;
+    const int kStatusPipe = 2;
+    const int kDataInPipe = 3;
+    const int kDataOutPipe = 4;
+
+    /** @brief Command IU（CDB が 16 バイト以下なら 32 バイト） */
+    struct CommandIU {
+      uint8_t iu_id;
+      uint8_t reserved1;
+      uint8_t tag[2];       // ビッグエンディアン
+      uint8_t task_attribute;
+      uint8_t reserved5;
+      uint8_t additional_cdb_length;
+      uint8_t reserved7;
+      uint8_t lun[8];
+      uint8_t cdb[16];
+    } __attribute__((packed));
+
+    /** @brief Task Management IU（16 バイト） */
+    struct TaskManagementIU {
+      uint8_t iu_id;
+      uint8_t reserved1;
+      uint8_t tag[2];       // ビッグエンディアン
+      uint8_t function;
+      uint8_t reserved5;
+      uint8_t task_tag[2];
+      uint8_t lun[8];
+    } __attribute__((packed));
+
+    /** @brief Sense IU．Response IU（8 バイト）もこの先頭に受ける． */
+    struct SenseIU {
+      uint8_t iu_id;
+      uint8_t reserved1;
+      uint8_t tag[2];
+      uint8_t status_qualifier[2];
+      uint8_t status;
+      uint8_t reserved7[7];
+      uint8_t sense_length[2];
+      uint8_t sense_data[96];
+    } __attribute__((packed));
+  }
+
+  /** @brief UAS の大容量記憶装置（interface class 8, subclass 6 (SCSI), protocol 0x62）
+   *
+   * コマンドのタグをそのままストリーム ID に使う．コマンドごとに，ステータスと
+   * データの転送をタグのストリームに積んでから Command IU を送るので，デバイスは
+   * 受け取ったコマンドを好きな順に処理し，完了した順に返せる．
+   *
+   * CHECK CONDITION などで失敗したコマンドは，そのタグだけをエラーで完了させ，
+   * 他のタグのコマンドはそのまま続ける．UNIT ATTENTION なら 1 回だけやり直す．
+   * ストリームに残ったデータ転送はそのストリームだけ取り消して，タグを空ける．
+   *
+   * 転送エラーでは発行済みのコマンドをすべて失敗させ，4 つのパイプの転送を取り消して，
+   * エラーになったパイプの Halt を解き，LOGICAL UNIT RESET の後に受け付けを再開する．
+   */
+  class UASDriver : public ClassDriver, public BlockDevice {
+   public:
+    /** @brief 同時に発行しておく SCSI コマンドの数の上限 */
+    static const int kMaxQueueDepth = 16;
+
+    UASDriver(Device* dev, int interface_index);
+
+    void* operator new(size_t size);
+    void operator delete(void* ptr) noexcept;
+
+    Error Initialize() override;
+    Error SetEndpoint(const EndpointConfig& config) override;
+    Error OnEndpointsConfigured() override;
+    Error OnControlCompleted(EndpointID ep_id, SetupData setup_data,
+                             const void* buf, int len) override;
+    Error OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) override;
+    Error OnBulkCompleted(EndpointID ep_id, uintptr_t cookie, int len, Error err) override;
+    void OnEndpointReset(EndpointID ep_id, uint16_t stream_id) override;
+    void OnRemoved() override;
+
+    Error Read(uint64_t lba, uint32_t num_blocks, void* buf,
+               Callback* callback, uintptr_t arg) override;
+    Error Write(uint64_t lba, uint32_t num_blocks, const void* buf,
+                Callback* callback, uintptr_t arg) override;
+    bool IsReady() const override { return ready_; }
+    uint64_t NumBlocks() const override { return num_blocks_; }
+    uint32_t BlockSize() const override { return block_size_; }
+    uint32_t MaxBlocksPerRequest() const override { return scsi::kMaxBlocks10; }
+    int QueueDepth() const override { return queue_depth_; }
+    int InFlight() const override { return num_in_flight_; }
+    void BeginBatch() override;
+    void EndBatch() override;
+
+   private:
+    /** @brief cookie の下位 2 ビットで表す，コマンドのどの転送が完了したか */
+    enum Phase {
+      kPhaseCommand = 0,
+      kPhaseData = 1,
+      kPhaseStatus = 2,
+    };
+    /** @brief cookie で Task Management IU の転送を表すスロット番号 */
+    static const int kTaskSlot = kMaxQueueDepth;
+    /** @brief Task Management IU に使うタグ．Reset Recovery 中はコマンドのタグがすべて空いている． */
+    static const uint16_t kTaskTag = 1;
+
+    struct Command {
+      uas::CommandIU iu;
+      uas::SenseIU sense;
+      void* buf;
+      uint32_t len;
+      bool dir_in;
+      /** @brief UNIT ATTENTION でやり直せる残り回数 */
+      uint8_t retries;
+      /** @brief タグが使用中（呼び出し元へ完了を返した後も，転送が残っていれば使用中のまま） */
+      bool busy;
+      /** @brief 呼び出し元へ完了を返した */
+      bool reported;
+      /** @brief タグのストリームに積んだデータ転送がまだ完了していない */
+      bool data_pending;
+      /** @brief 残ったデータ転送をストリームごと取り消している．終わるまでタグを空けない． */
+      bool cancelling;
+      /** @brief 完了を待っている転送の数 */
+      int pending;
+      int status_len;
+      Callback* callback;
+      uintptr_t arg;
+    };
+
+    const int interface_index_;
+    EndpointID ep_command_;
+    EndpointID ep_status_;
+    EndpointID ep_data_in_;
+    EndpointID ep_data_out_;
+
+    std::array<Command, kMaxQueueDepth> commands_{};
+    int queue_depth_ = 0;
+    /** @brief 使用中のタグの数 */
+    int num_in_flight_ = 0;
+    /** @brief デバイスが外れたか，Reset Recovery に失敗した．以後コマンドを受け付けない． */
+    bool halted_ = false;
+    /** @brief Reset Recovery の途中．終わるまで Submit() は kFull を返す． */
+    bool resetting_ = false;
+    /** @brief Reset Recovery の CLEAR_FEATURE をまだ終えていない */
+    bool reset_requests_pending_ = false;
+    /** @brief ホスト側のリセットを待っているパイプ（ビット位置 = エンドポイントアドレス） */
+    uint32_t pipes_resetting_ = 0;
+    /** @brief Reset Recovery のきっかけになった転送エラーのパイプ．Halt していれば解く． */
+    EndpointID failed_pipe_;
+    uas::TaskManagementIU task_iu_{};
+    uas::SenseIU task_response_{};
+
+    bool ready_ = false;
+    uint64_t num_blocks_ = 0;
+    uint32_t block_size_ = 0;
+    scsi::ReadCapacity10Data capacity_{};
+
+    /** @brief ステータスとデータの転送をストリームに積み，Command IU を送る */
+    Error Submit(const scsi::CommandBlock& cb, void* buf, uint32_t len, bool dir_in,
+                 Callback* callback, uintptr_t arg);
+    Error ReadWrite(bool write, uint64_t lba, uint32_t num_blocks, void* buf,
+                    Callback* callback, uintptr_t arg);
+    /** @brief ステータスの転送（with_data ならデータの転送も）をストリームに積み，Command IU を送る
+     *
+     * 何も積めなかったときだけエラーを返す．途中で失敗したら Recover() する．
+     */
+    Error Issue(int slot, bool with_data);
+    /** @brief Sense IU を受け取ったコマンドの結果を判定し，完了させるかやり直す */
+    void Finish(int slot);
+    /** @brief 呼び出し元へ完了を返す．転送が残っていなければタグを空ける． */
+    void Complete(Command& cmd, Error err);
+    /** @brief 完了を返した後に残っていた転送がすべて終わったので，タグを空ける */
+    void Release(Command& cmd);
+    /** @brief 発行済みのコマンドをすべて失敗させ，Reset Recovery を始める
+     *
+     * @param ep_id  転送エラーになったパイプ．特定できなければアドレス 0．
+     */
+    void Recover(EndpointID ep_id, Error err);
+    /** @brief 転送エラーになったパイプに CLEAR_FEATURE(ENDPOINT_HALT) を送る */
+    Task ClearHalt();
+    /** @brief 取り消しと CLEAR_FEATURE が終わっていれば LOGICAL UNIT RESET を送る */
+    void ResumeAfterReset();
+    /** @brief LOGICAL UNIT RESET の Response IU を受け取り，受け付けを再開する */
+    void OnTaskResponse(int len);
+    /** @brief 復旧できないので，発行済みのコマンドをすべて失敗させる */
+    void Halt(Error err);
+
+    static void OnCapacityRead(BlockDevice& dev, Error err, uintptr_t arg);
+  };
+}
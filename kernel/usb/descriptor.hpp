@@ -82,6 +82,55 @@ namespace usb {
     uint8_t interval;           // offset 6
   } __attribute__((packed));
 
+  struct SuperSpeedEndpointCompanionDescriptor {
+    static const uint8_t kType = 48;
+
+    uint8_t length;             // offset 0
+    uint8_t descriptor_type;    // offset 1
+    uint8_t max_burst;          // offset 2
+    union {
+      uint8_t data;
+      struct {
+        uint8_t max_streams : 5; // バルク: 扱えるストリーム数の log2
+        uint8_t : 3;
+      } __attribute__((packed)) bulk;
+    } attributes;               // offset 3
+    uint16_t bytes_per_interval;// offset 4
+  } __attribute__((packed));
+
+  /** @brief UAS のエンドポイントの役割を示す Pipe Usage ディスクリプタ */
+  struct PipeUsageDescriptor {
+    static const uint8_t kType = 0x24;
+
+    uint8_t length;             // offset 0
+    uint8_t descriptor_type;    // offset 1
+    uint8_t pipe_id;            // offset 2
+    uint8_t reserved;           // offset 3
+  } __attribute__((packed));
+
+  /** @brief ハブディスクリプタ．USB 2.0 と SuperSpeed で共通の先頭部分． */
+  struct HubDescriptor {
+    static const uint8_t kType = 0x29;
+    static const uint8_t kSuperSpeedType = 0x2a;
+
+    uint8_t length;             // offset 0
+    uint8_t descriptor_type;    // offset 1
+    uint8_t num_ports;          // offset 2
+    union {
+      uint16_t data;
+      struct {
+        uint16_t power_switching : 2;
+        uint16_t compound_device : 1;
+        uint16_t over_current_protection : 2;
+        uint16_t tt_think_time : 2;   // USB 2.0 のみ．(値 + 1) * 8 FS ビット時間
+        uint16_t port_indicators : 1;
+        uint16_t : 8;
+      } __attribute__((packed)) bits;
+    } characteristics;          // offset 3
+    uint8_t power_on_to_good;   // offset 5, 2 ms 単位
+    uint8_t control_current;    // offset 6
+  } __attribute__((packed));
+
   struct HIDDescriptor {
     static const uint8_t kType = 33;
 
@@ -1,10 +1,15 @@
 #include "usb/device.hpp"
 
+#include <algorithm>
+
 #include "usb/descriptor.hpp"
 #include "usb/setupdata.hpp"
 #include "usb/classdriver/base.hpp"
 #include "usb/classdriver/keyboard.hpp"
 #include "usb/classdriver/mouse.hpp"
+#include "usb/classdriver/msc.hpp"
+#include "usb/classdriver/uas.hpp"
+#include "usb/classdriver/hub.hpp"
 
 #include "logger.hpp"
 
@@ -50,9 +55,21 @@ namespace {
     conf.ep_type = static_cast<usb::EndpointType>(ep_desc.attributes.bits.transfer_type);
     conf.max_packet_size = ep_desc.max_packet_size;
     conf.interval = ep_desc.interval;
+    conf.max_streams = 0;
+    conf.pipe_id = 0;
     return conf;
   }
 
+  bool IsUAS(const usb::InterfaceDescriptor& if_desc) {
+    return if_desc.interface_class == 8 &&
+           if_desc.interface_sub_class == 6 &&
+           if_desc.interface_protocol == 0x62;
+  }
+
+  bool IsHub(const usb::InterfaceDescriptor& if_desc) {
+    return if_desc.interface_class == 9;
+  }
+
   usb::ClassDriver* NewClassDriver(usb::Device* dev, const usb::InterfaceDescriptor& if_desc) {
     if (if_desc.interface_class == 3 &&
         if_desc.interface_sub_class == 1) {  // HID boot interface
@@ -69,6 +86,15 @@ namespace {
         }
         return mouse_driver;
       }
+    } else if (if_desc.interface_class == 8 &&
+               if_desc.interface_sub_class == 6 &&  // SCSI transparent command set
+               if_desc.interface_protocol == 0x50) {  // Bulk-Only Transport
+      return new usb::MassStorageDriver{dev, if_desc.interface_number};
+    } else if (IsUAS(if_desc)) {
+      return new usb::UASDriver{dev, if_desc.interface_number};
+    } else if (IsHub(if_desc)) {
+      const bool super_speed = if_desc.interface_protocol == 3;
+      return new usb::HubDriver{dev, if_desc.interface_number, super_speed};
     }
     return nullptr;
   }
@@ -102,6 +128,25 @@ namespace {
 
 namespace usb {
   Device::~Device() {
+    // 完了を待っているコルーチンは再開できないので破棄する
+    while (auto waiter = control_waiters_head_) {
+      control_waiters_head_ = waiter->next_;
+      waiter->handle_.destroy();
+    }
+
+    // 1 つのクラスドライバが複数のエンドポイントを受け持つことがある
+    for (size_t i = 0; i < class_drivers_.size(); ++i) {
+      auto class_driver = class_drivers_[i];
+      if (class_driver == nullptr) {
+        continue;
+      }
+      for (size_t j = i; j < class_drivers_.size(); ++j) {
+        if (class_drivers_[j] == class_driver) {
+          class_drivers_[j] = nullptr;
+        }
+      }
+      delete class_driver;
+    }
   }
 
   Error Device::ControlIn(EndpointID ep_id, SetupData setup_data,
@@ -128,11 +173,37 @@ namespace usb {
     return MAKE_ERROR(Error::kSuccess);
   }
 
+  Error Device::BulkIn(EndpointID ep_id, const TransferBuffer* bufs, int num_bufs,
+                       uintptr_t cookie, uint16_t stream_id) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error Device::BulkOut(EndpointID ep_id, const TransferBuffer* bufs, int num_bufs,
+                        uintptr_t cookie, uint16_t stream_id) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  size_t Device::NumStreams(EndpointID ep_id) const {
+    return 0;
+  }
+
+  size_t Device::StreamsFor(int max_streams) const {
+    return 0;
+  }
+
+  Error Device::ResetEndpoint(EndpointID ep_id, uint16_t stream_id) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  void Device::BeginTransferBatch() {
+  }
+
+  void Device::EndTransferBatch() {
+  }
+
   Error Device::StartInitialize() {
     is_initialized_ = false;
-    initialize_phase_ = 1;
-    return GetDescriptor(*this, kDefaultControlPipeID, DeviceDescriptor::kType, 0,
-                         buf_.data(), buf_.size(), true);
+    return Enumerate().Start();
   }
 
   Error Device::OnEndpointsConfigured() {
@@ -146,38 +217,42 @@ namespace usb {
     return MAKE_ERROR(Error::kSuccess);
   }
 
+  void Device::OnRemoved() {
+    for (size_t i = 0; i < class_drivers_.size(); ++i) {
+      auto class_driver = class_drivers_[i];
+      // 1 つのクラスドライバが複数のエンドポイントを受け持つことがある
+      const auto seen_end = class_drivers_.begin() + i;
+      if (class_driver != nullptr &&
+          std::find(class_drivers_.begin(), seen_end, class_driver) == seen_end) {
+        class_driver->OnRemoved();
+      }
+    }
+  }
+
   Error Device::OnControlCompleted(EndpointID ep_id, SetupData setup_data,
                                    const void* buf, int len) {
     Log(kDebug, "Device::OnControlCompleted: buf 0x%08x, len %d, dir %d\n",
         buf, len, setup_data.request_type.bits.direction);
+    if (auto waiter = PopControlWaiter(setup_data)) {
+      waiter->transferred_ = len;
+      waiter->handle_.resume();
+      return MAKE_ERROR(Error::kSuccess);
+    }
+
     if (is_initialized_) {
       if (auto w = event_waiters_.Get(setup_data)) {
         return w.value()->OnControlCompleted(ep_id, setup_data, buf, len);
       }
-      return MAKE_ERROR(Error::kNoWaiter);
     }
+    return MAKE_ERROR(Error::kNoWaiter);
+  }
 
-    const uint8_t* buf8 = reinterpret_cast<const uint8_t*>(buf);
-    if (initialize_phase_ == 1) {
-      if (setup_data.request == request::kGetDescriptor &&
-          DescriptorDynamicCast<DeviceDescriptor>(buf8)) {
-        return InitializePhase1(buf8, len);
-      }
-      return MAKE_ERROR(Error::kInvalidPhase);
-    } else if (initialize_phase_ == 2) {
-      if (setup_data.request == request::kGetDescriptor &&
-          DescriptorDynamicCast<ConfigurationDescriptor>(buf8)) {
-        return InitializePhase2(buf8, len);
-      }
-      return MAKE_ERROR(Error::kInvalidPhase);
-    } else if (initialize_phase_ == 3) {
-      if (setup_data.request == request::kSetConfiguration) {
-        return InitializePhase3(setup_data.value & 0xffu);
-      }
-      return MAKE_ERROR(Error::kInvalidPhase);
+  Error Device::OnControlFailed(EndpointID ep_id, SetupData setup_data, Error err) {
+    if (auto waiter = PopControlWaiter(setup_data)) {
+      waiter->error_ = err;
+      waiter->handle_.resume();
     }
-
-    return MAKE_ERROR(Error::kNotImplemented);
+    return err;
   }
 
   Error Device::OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) {
@@ -188,75 +263,226 @@ namespace usb {
     return MAKE_ERROR(Error::kNoWaiter);
   }
 
-  Error Device::InitializePhase1(const uint8_t* buf, int len) {
-    const auto device_desc = DescriptorDynamicCast<DeviceDescriptor>(buf);
+  Error Device::OnBulkCompleted(EndpointID ep_id, uintptr_t cookie, int len, Error err) {
+    if (auto w = class_drivers_[ep_id.Number()]) {
+      return w->OnBulkCompleted(ep_id, cookie, len, err);
+    }
+    return MAKE_ERROR(Error::kNoWaiter);
+  }
+
+  void Device::OnEndpointReset(EndpointID ep_id, uint16_t stream_id) {
+    if (auto w = class_drivers_[ep_id.Number()]) {
+      w->OnEndpointReset(ep_id, stream_id);
+    }
+  }
+
+  Task Device::Enumerate() {
+    auto dev_desc = co_await GetDescriptor(*this, kDefaultControlPipeID,
+                                           DeviceDescriptor::kType, 0,
+                                           buf_.data(), buf_.size(), true);
+    if (dev_desc.error) {
+      co_return dev_desc.error;
+    }
+    const auto device_desc = DescriptorDynamicCast<DeviceDescriptor>(buf_.data());
+    if (device_desc == nullptr) {
+      co_return MAKE_ERROR(Error::kInvalidDescriptor);
+    }
     num_configurations_ = device_desc->num_configurations;
     config_index_ = 0;
-    initialize_phase_ = 2;
+
     Log(kDebug, "issuing GetDesc(Config): index=%d)\n", config_index_);
-    return GetDescriptor(*this, kDefaultControlPipeID,
-                         ConfigurationDescriptor::kType, config_index_,
-                         buf_.data(), buf_.size(), true);
+    auto conf = co_await GetDescriptor(*this, kDefaultControlPipeID,
+                                       ConfigurationDescriptor::kType, config_index_,
+                                       buf_.data(), buf_.size(), true);
+    if (conf.error) {
+      co_return conf.error;
+    }
+    const auto conf_desc = DescriptorDynamicCast<ConfigurationDescriptor>(buf_.data());
+    if (conf_desc == nullptr) {
+      co_return MAKE_ERROR(Error::kInvalidDescriptor);
+    }
+    if (SetupClassDriver(buf_.data(), conf.value) == nullptr) {
+      // 非対応デバイス
+      co_return MAKE_ERROR(Error::kSuccess);
+    }
+
+    const auto config_value = conf_desc->configuration_value;
+    Log(kDebug, "issuing SetConfiguration: conf_val=%d\n", config_value);
+    auto set_conf = co_await SetConfiguration(*this, kDefaultControlPipeID,
+                                              config_value, true);
+    if (set_conf.error) {
+      co_return set_conf.error;
+    }
+
+    if (alternate_setting_ != 0) {
+      SetupData setup_data{};
+      setup_data.request_type.bits.direction = request_type::kOut;
+      setup_data.request_type.bits.type = request_type::kStandard;
+      setup_data.request_type.bits.recipient = request_type::kInterface;
+      setup_data.request = request::kSetInterface;
+      setup_data.value = alternate_setting_;
+      setup_data.index = interface_number_;
+      setup_data.length = 0;
+      Log(kDebug, "issuing SetInterface: if=%d, alt=%d\n",
+          interface_number_, alternate_setting_);
+      auto set_if = co_await ControlOut(kDefaultControlPipeID, setup_data, nullptr, 0);
+      if (set_if.error) {
+        co_return set_if.error;
+      }
+    }
+
+    for (int i = 0; i < num_ep_configs_; ++i) {
+      class_drivers_[ep_configs_[i].ep_id.Number()]->SetEndpoint(ep_configs_[i]);
+    }
+    is_initialized_ = true;
+    co_return MAKE_ERROR(Error::kSuccess);
   }
 
-  Error Device::InitializePhase2(const uint8_t* buf, int len) {
-    auto conf_desc = DescriptorDynamicCast<ConfigurationDescriptor>(buf);
-    if (conf_desc == nullptr) {
-      return MAKE_ERROR(Error::kInvalidDescriptor);
+  ClassDriver* Device::SetupClassDriver(const uint8_t* buf, int len) {
+    // ストリームを使える（SuperSpeed で，ホストも十分なストリームを用意できる）UAS の代替設定があれば，
+    // 同じインタフェースの BOT より優先する
+    int uas_interface = -1;
+    const InterfaceDescriptor* cur_if = nullptr;
+    ConfigurationDescriptorReader uas_reader{buf, len};
+    while (auto desc = uas_reader.Next()) {
+      if (auto if_desc = DescriptorDynamicCast<InterfaceDescriptor>(desc)) {
+        cur_if = if_desc;
+      } else if (auto comp_desc =
+                   DescriptorDynamicCast<SuperSpeedEndpointCompanionDescriptor>(desc)) {
+        if (cur_if && IsUAS(*cur_if) && comp_desc->attributes.bulk.max_streams > 0) {
+          if (StreamsFor(comp_desc->attributes.bulk.max_streams) > 0) {
+            uas_interface = cur_if->interface_number;
+          }
+          break;
+        }
+      }
     }
+
     ConfigurationDescriptorReader config_reader{buf, len};
 
-    ClassDriver* class_driver = nullptr;
     while (auto if_desc = config_reader.Next<InterfaceDescriptor>()) {
       Log(kDebug, *if_desc);
 
-      class_driver = NewClassDriver(this, *if_desc);
+      if (IsUAS(*if_desc) ? if_desc->interface_number != uas_interface
+                          : if_desc->interface_number == uas_interface) {
+        continue;
+      }
+      auto class_driver = NewClassDriver(this, *if_desc);
       if (class_driver == nullptr) {
         // 非対応デバイス．次の interface を調べる．
         continue;
       }
 
+      if (IsHub(*if_desc)) {
+        hub_driver_ = static_cast<HubDriver*>(class_driver);
+      }
       num_ep_configs_ = 0;
+      interface_number_ = if_desc->interface_number;
+      alternate_setting_ = if_desc->alternate_setting;
 
-      while (num_ep_configs_ < if_desc->num_endpoints) {
-        auto desc = config_reader.Next();
+      // エンドポイントディスクリプタの後ろに付くディスクリプタも読むため，次のインタフェースまで進む
+      while (auto desc = config_reader.Next()) {
+        if (DescriptorDynamicCast<InterfaceDescriptor>(desc)) {
+          break;
+        }
+        EndpointConfig* last_conf =
+          num_ep_configs_ > 0 ? &ep_configs_[num_ep_configs_ - 1] : nullptr;
         if (auto ep_desc = DescriptorDynamicCast<EndpointDescriptor>(desc)) {
+          if (num_ep_configs_ == static_cast<int>(ep_configs_.size())) {
+            break;
+          }
           auto conf = MakeEPConfig(*ep_desc);
           Log(kDebug, conf);
 
           ep_configs_[num_ep_configs_] = conf;
           ++num_ep_configs_;
           class_drivers_[conf.ep_id.Number()] = class_driver;
+        } else if (auto comp_desc =
+                     DescriptorDynamicCast<SuperSpeedEndpointCompanionDescriptor>(desc)) {
+          if (last_conf && last_conf->ep_type == EndpointType::kBulk) {
+            last_conf->max_streams = comp_desc->attributes.bulk.max_streams;
+          }
+        } else if (auto pipe_desc = DescriptorDynamicCast<PipeUsageDescriptor>(desc)) {
+          if (last_conf) {
+            last_conf->pipe_id = pipe_desc->pipe_id;
+          }
         } else if (auto hid_desc = DescriptorDynamicCast<HIDDescriptor>(desc)) {
           Log(kDebug, *hid_desc);
         }
       }
 
-      break;
+      return class_driver;
     }
+    return nullptr;
+  }
 
-    if (!class_driver) {
-      return MAKE_ERROR(Error::kSuccess);
+  void Device::PushControlWaiter(ControlAwaiter* waiter) {
+    waiter->next_ = nullptr;
+    if (control_waiters_tail_) {
+      control_waiters_tail_->next_ = waiter;
+    } else {
+      control_waiters_head_ = waiter;
     }
-    initialize_phase_ = 3;
-    Log(kDebug, "issuing SetConfiguration: conf_val=%d\n",
-        conf_desc->configuration_value);
-    return SetConfiguration(*this, kDefaultControlPipeID,
-                            conf_desc->configuration_value, true);
+    control_waiters_tail_ = waiter;
   }
 
-  Error Device::InitializePhase3(uint8_t config_value) {
-    for (int i = 0; i < num_ep_configs_; ++i) {
-      class_drivers_[ep_configs_[i].ep_id.Number()]->SetEndpoint(ep_configs_[i]);
+  ControlAwaiter* Device::PopControlWaiter(SetupData setup_data) {
+    ControlAwaiter* prev = nullptr;
+    for (auto w = control_waiters_head_; w; prev = w, w = w->next_) {
+      if (w->setup_data_ == setup_data) {
+        UnlinkControlWaiter(prev, w);
+        return w;
+      }
     }
-    initialize_phase_ = 4;
-    is_initialized_ = true;
-    return MAKE_ERROR(Error::kSuccess);
+    return nullptr;
+  }
+
+  void Device::RemoveControlWaiter(ControlAwaiter* waiter) {
+    ControlAwaiter* prev = nullptr;
+    for (auto w = control_waiters_head_; w; prev = w, w = w->next_) {
+      if (w == waiter) {
+        UnlinkControlWaiter(prev, w);
+        return;
+      }
+    }
+  }
+
+  void Device::UnlinkControlWaiter(ControlAwaiter* prev, ControlAwaiter* waiter) {
+    if (prev) {
+      prev->next_ = waiter->next_;
+    } else {
+      control_waiters_head_ = waiter->next_;
+    }
+    if (control_waiters_tail_ == waiter) {
+      control_waiters_tail_ = prev;
+    }
+  }
+
+  ControlAwaiter::ControlAwaiter(Device& dev, EndpointID ep_id, SetupData setup_data,
+                                 void* buf, int len, bool dir_in)
+      : dev_{dev}, ep_id_{ep_id}, setup_data_{setup_data},
+        buf_{buf}, len_{len}, dir_in_{dir_in} {
+  }
+
+  bool ControlAwaiter::await_suspend(coro::coroutine_handle<> handle) {
+    handle_ = handle;
+    dev_.PushControlWaiter(this);
+
+    auto err = dir_in_
+      ? dev_.ControlIn(ep_id_, setup_data_, buf_, len_, nullptr)
+      : dev_.ControlOut(ep_id_, setup_data_, buf_, len_, nullptr);
+    if (err) {
+      // 発行できなかったので中断せずにそのまま再開する
+      dev_.RemoveControlWaiter(this);
+      error_ = err;
+      return false;
+    }
+    return true;
   }
 
-  Error GetDescriptor(Device& dev, EndpointID ep_id,
-                      uint8_t desc_type, uint8_t desc_index,
-                      void* buf, int len, bool debug) {
+  ControlAwaiter GetDescriptor(Device& dev, EndpointID ep_id,
+                               uint8_t desc_type, uint8_t desc_index,
+                               void* buf, int len, bool debug) {
     SetupData setup_data{};
     setup_data.request_type.bits.direction = request_type::kIn;
     setup_data.request_type.bits.type = request_type::kStandard;
@@ -265,11 +491,11 @@ namespace usb {
     setup_data.value = (static_cast<uint16_t>(desc_type) << 8) | desc_index;
     setup_data.index = 0;
     setup_data.length = len;
-    return dev.ControlIn(ep_id, setup_data, buf, len, nullptr);
+    return dev.ControlIn(ep_id, setup_data, buf, len);
   }
 
-  Error SetConfiguration(Device& dev, EndpointID ep_id,
-                         uint8_t config_value, bool debug) {
+  ControlAwaiter SetConfiguration(Device& dev, EndpointID ep_id,
+                                  uint8_t config_value, bool debug) {
     SetupData setup_data{};
     setup_data.request_type.bits.direction = request_type::kOut;
     setup_data.request_type.bits.type = request_type::kStandard;
@@ -278,6 +504,6 @@ namespace usb {
     setup_data.value = config_value;
     setup_data.index = 0;
     setup_data.length = 0;
-    return dev.ControlOut(ep_id, setup_data, nullptr, 0, nullptr);
+    return dev.ControlOut(ep_id, setup_data, nullptr, 0);
   }
 }
@@ -7,8 +7,10 @@
 #pragma once
 
 #include <array>
+#include <cstdint>
 
 #include "error.hpp"
+#include "usb/async.hpp"
 #include "usb/setupdata.hpp"
 #include "usb/endpoint.hpp"
 #include "usb/arraymap.hpp"
@@ -16,6 +18,45 @@
 namespace usb
 {
     class ClassDriver;
+    class Device;
+    class HubDriver;
+
+    /** @brief スキャッタ・ギャザー転送のバッファリストの 1 要素 */
+    struct TransferBuffer
+    {
+        void *buf;
+        int len;
+    };
+
+    /** @brief co_await でコントロール転送の完了を待つための awaiter
+     *
+     * 結果は転送できたバイト数とエラーの組．
+     */
+    class ControlAwaiter
+    {
+    public:
+        ControlAwaiter(Device &dev, EndpointID ep_id, SetupData setup_data,
+                       void *buf, int len, bool dir_in);
+
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(coro::coroutine_handle<> handle);
+        WithError<int> await_resume() const noexcept { return {transferred_, error_}; }
+
+    private:
+        friend class Device;
+
+        Device &dev_;
+        EndpointID ep_id_;
+        SetupData setup_data_;
+        void *buf_;
+        int len_;
+        bool dir_in_;
+
+        coro::coroutine_handle<> handle_;
+        int transferred_ = 0;
+        Error error_ = MAKE_ERROR(Error::kSuccess);
+        ControlAwaiter *next_ = nullptr;
+    };
 
     class Device
     {
@@ -26,13 +67,76 @@ namespace usb
         virtual Error ControlOut(EndpointID ep_id, SetupData setup_data,
                                  const void *buf, int len, ClassDriver *issuer);
         virtual Error InterruptIn(EndpointID ep_id, void *buf, int len);
+
+        /** @brief コントロール転送を発行し，co_await で完了を待てる awaiter を返す
+         *
+         * 同じエンドポイントへの要求は発行順に完了するため，
+         * 複数の要求を同時に待たせることができる．
+         */
+        ControlAwaiter ControlIn(EndpointID ep_id, SetupData setup_data, void *buf, int len)
+        {
+            return {*this, ep_id, setup_data, buf, len, true};
+        }
+        ControlAwaiter ControlOut(EndpointID ep_id, SetupData setup_data, const void *buf, int len)
+        {
+            return {*this, ep_id, setup_data, const_cast<void *>(buf), len, false};
+        }
         virtual Error InterruptOut(EndpointID ep_id, void *buf, int len);
 
+        /** @brief バルク転送を発行する
+         *
+         * bufs の num_bufs 個のバッファを先頭から順につないだものを 1 回の転送として扱う．
+         * 完了するとクラスドライバの OnBulkCompleted() が cookie とともに呼ばれる．
+         * 同じエンドポイント（ストリームを使うなら同じストリーム）への転送は発行順に完了する．
+         * stream_id はストリームを使うエンドポイントでのみ 1 以上にする．
+         */
+        virtual Error BulkIn(EndpointID ep_id, const TransferBuffer *bufs, int num_bufs,
+                             uintptr_t cookie, uint16_t stream_id);
+        virtual Error BulkOut(EndpointID ep_id, const TransferBuffer *bufs, int num_bufs,
+                              uintptr_t cookie, uint16_t stream_id);
+        Error BulkIn(EndpointID ep_id, void *buf, int len, uintptr_t cookie,
+                     uint16_t stream_id = 0)
+        {
+            const TransferBuffer tb{buf, len};
+            return BulkIn(ep_id, &tb, 1, cookie, stream_id);
+        }
+        Error BulkOut(EndpointID ep_id, const void *buf, int len, uintptr_t cookie,
+                      uint16_t stream_id = 0)
+        {
+            const TransferBuffer tb{const_cast<void *>(buf), len};
+            return BulkOut(ep_id, &tb, 1, cookie, stream_id);
+        }
+        /** @brief エンドポイントに用意したストリームの数．0 ならストリームを使えない．
+         *
+         * 有効なストリーム ID は 1 から NumStreams() - 1 まで．
+         */
+        virtual size_t NumStreams(EndpointID ep_id) const;
+        /** @brief SuperSpeed Endpoint Companion の MaxStreams が max_streams のバルクエンドポイントに
+         * 用意できるストリームの数．0 ならホストの制限でストリームを使えない．
+         */
+        virtual size_t StreamsFor(int max_streams) const;
+        /** @brief エンドポイントに積んだバルク転送を取り消し，再び転送できる状態に戻す
+         *
+         * 未完了の転送は kTransferFailed で OnBulkCompleted() に渡り，終わるとクラスドライバの
+         * OnEndpointReset() が呼ばれる．その間に積んだ転送は取り消さず，終わってから実行する．
+         * stream_id が 0 でなければそのストリームの転送だけを取り消す．
+         * ホスト側で Halted になっていればそれも解くが，デバイス側の Halt は CLEAR_FEATURE で解くこと．
+         */
+        virtual Error ResetEndpoint(EndpointID ep_id, uint16_t stream_id = 0);
+
+        /** @brief 以後に積む転送のドアベルをまとめる区間の開始と終了．TransferBatch から使う． */
+        virtual void BeginTransferBatch();
+        virtual void EndTransferBatch();
+
         Error StartInitialize();
         bool IsInitialized() { return is_initialized_; }
         EndpointConfig *EndpointConfigs() { return ep_configs_.data(); }
         int NumEndpointConfigs() { return num_ep_configs_; }
         Error OnEndpointsConfigured();
+        /** @brief デバイスを破棄する前に，各クラスドライバに取り外しを知らせる */
+        void OnRemoved();
+        /** @brief ハブならそのクラスドライバ．ハブでなければ nullptr． */
+        HubDriver *Hub() const { return hub_driver_; }
 
         uint8_t *Buffer() { return buf_.data(); }
 
@@ -40,33 +144,49 @@ namespace usb
         Error OnControlCompleted(EndpointID ep_id, SetupData setup_data,
                                  const void *buf, int len);
         Error OnInterruptCompleted(EndpointID ep_id, const void *buf, int len);
+        /** @brief バルク転送の完了（失敗を含む）をクラスドライバに伝える */
+        Error OnBulkCompleted(EndpointID ep_id, uintptr_t cookie, int len, Error err);
+        /** @brief コントロール転送が失敗したことを，完了を待っているコルーチンに伝える */
+        Error OnControlFailed(EndpointID ep_id, SetupData setup_data, Error err);
+        /** @brief ResetEndpoint() やエラーによるエンドポイントの復旧が終わったことをクラスドライバに伝える */
+        void OnEndpointReset(EndpointID ep_id, uint16_t stream_id);
 
     private:
+        friend class ControlAwaiter;
         /** @brief エンドポイントに割り当て済みのクラスドライバ．
      *
      * 添字はエンドポイント番号（0 - 15）．
      * 添字 0 はどのクラスドライバからも使われないため，常に未使用．
      */
         std::array<ClassDriver *, 16> class_drivers_{};
+        /** @brief class_drivers_ のうちハブのクラスドライバ（所有はしない） */
+        HubDriver *hub_driver_ = nullptr;
 
         std::array<uint8_t, 256> buf_{};
 
         // following fields are used during initialization
         uint8_t num_configurations_;
         uint8_t config_index_;
-
-        Error OnDeviceDescriptorReceived(const uint8_t *buf, int len);
-        Error OnConfigurationDescriptorReceived(const uint8_t *buf, int len);
-        Error OnSetConfigurationCompleted(uint8_t config_value);
+        /** @brief クラスドライバを割り当てたインタフェースと，その代替設定 */
+        uint8_t interface_number_ = 0;
+        uint8_t alternate_setting_ = 0;
 
         bool is_initialized_ = false;
-        int initialize_phase_ = 0;
         std::array<EndpointConfig, 16> ep_configs_;
         int num_ep_configs_;
-        Error InitializePhase1(const uint8_t *buf, int len);
-        Error InitializePhase2(const uint8_t *buf, int len);
-        Error InitializePhase3(uint8_t config_value);
-        Error InitializePhase4();
+        /** @brief ディスクリプタの取得から SetConfiguration までを順に行うコルーチン */
+        Task Enumerate();
+        /** @brief コンフィグレーションディスクリプタから対応するクラスドライバを作る */
+        ClassDriver *SetupClassDriver(const uint8_t *buf, int len);
+
+        /** 完了を待っているコントロール転送の FIFO．発行順に並ぶ． */
+        ControlAwaiter *control_waiters_head_ = nullptr;
+        ControlAwaiter *control_waiters_tail_ = nullptr;
+        void PushControlWaiter(ControlAwaiter *waiter);
+        /** setup_data が一致する最も古い要素を取り出す */
+        ControlAwaiter *PopControlWaiter(SetupData setup_data);
+        void RemoveControlWaiter(ControlAwaiter *waiter);
+        void UnlinkControlWaiter(ControlAwaiter *prev, ControlAwaiter *waiter);
 
         /** OnControlCompleted の中で要求の発行元を特定するためのマップ構造．
      * ControlOut または ControlIn を発行したときに発行元が登録される．
@@ -74,9 +194,27 @@ namespace usb
         ArrayMap<SetupData, ClassDriver *, 4> event_waiters_{};
     };
 
-    Error GetDescriptor(Device &dev, EndpointID ep_id,
-                        uint8_t desc_type, uint8_t desc_index,
-                        void *buf, int len, bool debug = false);
-    Error SetConfiguration(Device &dev, EndpointID ep_id,
-                           uint8_t config_value, bool debug = false);
+    /** @brief 生存中に積んだ転送のドアベルを，破棄時にエンドポイント（ストリーム）ごとに
+     * 1 回ずつまとめて鳴らす
+     *
+     * コマンドごとに複数の転送を積むクラスドライバや，続けて要求を発行する呼び出し元が
+     * スタックに置いて使う．イベント処理の中ではそのバッチに合流する．入れ子にできる．
+     */
+    class TransferBatch
+    {
+    public:
+        explicit TransferBatch(Device &dev) : dev_{dev} { dev_.BeginTransferBatch(); }
+        ~TransferBatch() { dev_.EndTransferBatch(); }
+        TransferBatch(const TransferBatch &) = delete;
+        TransferBatch &operator=(const TransferBatch &) = delete;
+
+    private:
+        Device &dev_;
+    };
+
+    ControlAwaiter GetDescriptor(Device &dev, EndpointID ep_id,
+                                 uint8_t desc_type, uint8_t desc_index,
+                                 void *buf, int len, bool debug = false);
+    ControlAwaiter SetConfiguration(Device &dev, EndpointID ep_id,
+                                    uint8_t config_value, bool debug = false);
 }
@@ -66,5 +66,11 @@ namespace usb
 
         /** このエンドポイントの制御周期（125*2^(interval-1) マイクロ秒） */
         int interval;
+
+        /** 扱えるストリーム数の log2（SuperSpeed のバルクのみ．0 ならストリームを使わない） */
+        int max_streams;
+
+        /** UAS の Pipe ID（1: Command, 2: Status, 3: Data-in, 4: Data-out．0 なら指定なし） */
+        int pipe_id;
     };
 }
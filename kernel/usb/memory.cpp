@@ -1,6 +1,9 @@
 #include "usb/memory.hpp"
 
 #include <cstdint>
+#include <cstring>
+
+#include "lock.hpp"
 
 namespace {
   template <class T>
@@ -12,32 +15,221 @@ namespace {
   T MaskBits(T value, U mask) {
     return value & ~static_cast<T>(mask - 1);
   }
+
+  const size_t kNumPages = usb::kMemoryPoolSize / usb::kMemoryPageSize;
+
+  /** @brief 各ページの用途 */
+  enum class PageKind : uint8_t {
+    kFree,
+    kBlock64,  // 64 バイトブロック × 64
+    kBlock1K,  // 1KiB ブロック × 4
+    kRunHead,  // 連続ページ割り当ての先頭
+    kRunTail,  // 連続ページ割り当ての 2 ページ目以降
+  };
+
+  const size_t kMaxBlocksPerPage = 64;
+
+  struct PageInfo {
+    PageKind kind;
+    /** kRunHead の場合，連続して割り当てたページ数 */
+    uint32_t num_pages;
+    /** kBlock64, kBlock1K の場合，使用中ブロックのビットマップ */
+    uint64_t used_blocks;
+  };
+
+  /** 各ブロックの割り当て元タグ．kRunHead のページは先頭要素を使う． */
+  memstat::Tag block_tags[kNumPages][kMaxBlocksPerPage];
+
+  struct SizeClass {
+    PageKind kind;
+    size_t block_size;
+    uint64_t full_mask;
+  };
+
+  constexpr SizeClass kSizeClasses[] = {
+    {PageKind::kBlock64, 64, ~uint64_t{0}},
+    {PageKind::kBlock1K, 1024, 0xfu},
+  };
+
+  alignas(4096) uint8_t memory_pool[usb::kMemoryPoolSize];
+  PageInfo page_infos[kNumPages];
+  usb::MemoryStat stat{kNumPages, 0, 0};
+  /** memory_pool, page_infos, block_tags, stat を保護する */
+  SpinLock pool_lock;
+
+  uint8_t* PageAddr(size_t page) {
+    return &memory_pool[page * usb::kMemoryPageSize];
+  }
+
+  void MarkUsed(size_t bytes) {
+    stat.used_bytes += bytes;
+    if (stat.peak_bytes < stat.used_bytes) {
+      stat.peak_bytes = stat.used_bytes;
+    }
+  }
+
+  /** @brief num_pages 個の連続する空きページを探して割り当てる．
+   *
+   * 先頭アドレスは alignment に揃え，size <= boundary なら
+   * [先頭, 先頭 + size) が boundary を跨がないようにする．
+   */
+  void* AllocPages(size_t num_pages, size_t size,
+                   size_t alignment, size_t boundary, memstat::Tag tag) {
+    const auto base = reinterpret_cast<uintptr_t>(memory_pool);
+    uintptr_t addr = Ceil(base, alignment);
+    for (; addr + num_pages * usb::kMemoryPageSize <= base + usb::kMemoryPoolSize;
+         addr += alignment) {
+      if (boundary > 0 && size <= boundary &&
+          MaskBits(addr, boundary) != MaskBits(addr + size - 1, boundary)) {
+        continue;
+      }
+
+      const size_t first = (addr - base) / usb::kMemoryPageSize;
+      size_t n = 0;
+      while (n < num_pages && page_infos[first + n].kind == PageKind::kFree) {
+        ++n;
+      }
+      if (n < num_pages) {
+        continue;
+      }
+
+      page_infos[first] = {PageKind::kRunHead,
+                           static_cast<uint32_t>(num_pages), 0};
+      block_tags[first][0] = tag;
+      for (size_t i = 1; i < num_pages; ++i) {
+        page_infos[first + i] = {PageKind::kRunTail, 0, 0};
+      }
+      stat.free_pages -= num_pages;
+      MarkUsed(num_pages * usb::kMemoryPageSize);
+      return reinterpret_cast<void*>(addr);
+    }
+    return nullptr;
+  }
+
+  /** @brief サイズクラス sc のブロックを 1 つ割り当てる．
+   *
+   * 空きブロックを持つページが無ければ空きページを 1 つ sc 用に切り出す．
+   */
+  void* AllocBlock(const SizeClass& sc, memstat::Tag tag) {
+    const size_t blocks_per_page = usb::kMemoryPageSize / sc.block_size;
+
+    size_t page = kNumPages;
+    for (size_t i = 0; i < kNumPages; ++i) {
+      if (page_infos[i].kind == sc.kind &&
+          page_infos[i].used_blocks != sc.full_mask) {
+        page = i;
+        break;
+      }
+    }
+
+    if (page == kNumPages) {
+      for (size_t i = 0; i < kNumPages; ++i) {
+        if (page_infos[i].kind == PageKind::kFree) {
+          page = i;
+          break;
+        }
+      }
+      if (page == kNumPages) {
+        return nullptr;
+      }
+      page_infos[page] = {sc.kind, 0, 0};
+      --stat.free_pages;
+    }
+
+    auto& info = page_infos[page];
+    for (size_t b = 0; b < blocks_per_page; ++b) {
+      if ((info.used_blocks & (uint64_t{1} << b)) == 0) {
+        info.used_blocks |= uint64_t{1} << b;
+        block_tags[page][b] = tag;
+        MarkUsed(sc.block_size);
+        return PageAddr(page) + b * sc.block_size;
+      }
+    }
+    return nullptr;
+  }
 }
 
 namespace usb {
-  alignas(64) uint8_t memory_pool[kMemoryPoolSize];
-  uintptr_t alloc_ptr = reinterpret_cast<uintptr_t>(memory_pool);
-
-  void* AllocMem(size_t size, unsigned int alignment, unsigned int boundary) {
-    if (alignment > 0) {
-      alloc_ptr = Ceil(alloc_ptr, alignment);
+  __attribute__((noinline))
+  void* AllocMem(size_t size, unsigned int alignment, unsigned int boundary,
+                 memstat::Tag tag) {
+    const auto rip = reinterpret_cast<uintptr_t>(__builtin_return_address(0));
+    if (size == 0) {
+      size = 1;
     }
-    if (boundary > 0) {
-      auto next_boundary = Ceil(alloc_ptr, boundary);
-      if (next_boundary < alloc_ptr + size) {
-        alloc_ptr = next_boundary;
+
+    IRQSaveLockGuard guard{pool_lock};
+    const size_t need = size < alignment ? alignment : size;
+    for (const auto& sc : kSizeClasses) {
+      if (need <= sc.block_size) {
+        // ブロックはサイズに自然に整列しているので boundary を跨がない
+        auto p = AllocBlock(sc, tag);
+        if (p != nullptr) {
+          memset(p, 0, sc.block_size);
+          memstat::OnAlloc(tag, p, sc.block_size, rip);
+        }
+        return p;
       }
     }
 
-    if (reinterpret_cast<uintptr_t>(memory_pool) + kMemoryPoolSize
-        < alloc_ptr + size) {
-      return nullptr;
+    const size_t num_pages = Ceil(size, kMemoryPageSize) / kMemoryPageSize;
+    const size_t page_alignment = alignment > kMemoryPageSize
+      ? alignment : kMemoryPageSize;
+    auto p = AllocPages(num_pages, size, page_alignment, boundary, tag);
+    if (p != nullptr) {
+      memset(p, 0, num_pages * kMemoryPageSize);
+      memstat::OnAlloc(tag, p, num_pages * kMemoryPageSize, rip);
+    }
+    return p;
+  }
+
+  __attribute__((noinline))
+  void FreeMem(void* p) {
+    const auto rip = reinterpret_cast<uintptr_t>(__builtin_return_address(0));
+    const auto base = reinterpret_cast<uintptr_t>(memory_pool);
+    const auto addr = reinterpret_cast<uintptr_t>(p);
+    if (p == nullptr || addr < base || base + kMemoryPoolSize <= addr) {
+      return;
+    }
+
+    IRQSaveLockGuard guard{pool_lock};
+    const size_t page = (addr - base) / kMemoryPageSize;
+    auto& info = page_infos[page];
+
+    if (info.kind == PageKind::kRunHead) {
+      const size_t num_pages = info.num_pages;
+      memstat::OnFree(block_tags[page][0], p, num_pages * kMemoryPageSize, rip);
+      for (size_t i = 0; i < num_pages; ++i) {
+        page_infos[page + i] = {PageKind::kFree, 0, 0};
+      }
+      stat.free_pages += num_pages;
+      stat.used_bytes -= num_pages * kMemoryPageSize;
+      return;
     }
 
-    auto p = alloc_ptr;
-    alloc_ptr += size;
-    return reinterpret_cast<void*>(p);
+    for (const auto& sc : kSizeClasses) {
+      if (info.kind != sc.kind) {
+        continue;
+      }
+      const size_t b = (addr - reinterpret_cast<uintptr_t>(PageAddr(page)))
+        / sc.block_size;
+      const uint64_t bit = uint64_t{1} << b;
+      if ((info.used_blocks & bit) == 0) {
+        return;  // 二重解放
+      }
+      info.used_blocks &= ~bit;
+      stat.used_bytes -= sc.block_size;
+      memstat::OnFree(block_tags[page][b], p, sc.block_size, rip);
+      if (info.used_blocks == 0) {
+        info = {PageKind::kFree, 0, 0};
+        ++stat.free_pages;
+      }
+      return;
+    }
   }
 
-  void FreeMem(void* p) {}
+  MemoryStat GetMemoryStat() {
+    IRQSaveLockGuard guard{pool_lock};
+    return stat;
+  }
 }
@@ -2,58 +2,101 @@
  * @file usb/memory.hpp
  *
  * USB ドライバ用の動的メモリ管理機能
+ *
+ * メモリプールは 4KiB ページの集まりとして管理される．
+ * 小さな要求は 64 バイト（TRB 向け），1KiB（コンテキスト向け）の
+ * サイズクラスに切り出したページから，それ以上の要求はページ単位で割り当てる．
+ * 各ブロックは自身のサイズに自然に整列されるため，
+ * 1 ページ以下の領域が 64KiB 境界を跨ぐことはない．
  */
 
 #pragma once
 
 #include <cstddef>
 
+#include "memstat.hpp"
+
 namespace usb {
   /** @brief 動的メモリ確保のためのメモリプールの最大容量（バイト） */
-  static const size_t kMemoryPoolSize = 4096 * 32;
+  static const size_t kMemoryPoolSize = 4096 * 256;
+
+  /** @brief メモリプールのページサイズ（バイト） */
+  static const size_t kMemoryPageSize = 4096;
 
   /** @brief 指定されたバイト数のメモリ領域を確保して先頭ポインタを返す．
    *
    * 先頭アドレスが alignment に揃ったメモリ領域を確保する．
    * size <= boundary ならメモリ領域が boundary を跨がないことを保証する．
    * boundary は典型的にはページ境界を跨がないように 4096 を指定する．
+   * 確保した領域は 0 で初期化される．
+   * 確保したバイト数は tag ごとに memstat に記録される．
    *
    * @param size        確保するメモリ領域のサイズ（バイト単位）
    * @param alignment   メモリ領域のアライメント制約．0 なら制約しない．
    * @param boundary    確保したメモリ領域が跨いではいけない境界．0 なら制約しない．
+   * @param tag         割り当て元のサブシステム
    * @return 確保できなかった場合は nullptr
    */
-  void* AllocMem(size_t size, unsigned int alignment, unsigned int boundary);
+  void* AllocMem(size_t size, unsigned int alignment, unsigned int boundary,
+                 memstat::Tag tag = memstat::Tag::kUSBMisc);
 
   template <class T>
-  T* AllocArray(size_t num_obj, unsigned int alignment, unsigned int boundary) {
+  T* AllocArray(size_t num_obj, unsigned int alignment, unsigned int boundary,
+                memstat::Tag tag = memstat::Tag::kUSBMisc) {
     return reinterpret_cast<T*>(
-        AllocMem(sizeof(T) * num_obj, alignment, boundary));
+        AllocMem(sizeof(T) * num_obj, alignment, boundary, tag));
   }
 
-  /** @brief 指定されたメモリ領域を解放する．本当に解放することは保証されない． */
+  /** @brief AllocMem で確保したメモリ領域を解放する．nullptr は無視する． */
   void FreeMem(void* p);
 
+  /** @brief メモリプールの使用状況 */
+  struct MemoryStat {
+    size_t free_pages;   //!< どのサイズクラスにも属さない空きページ数
+    size_t used_bytes;   //!< 割り当て済みのバイト数（サイズクラス単位で切り上げ）
+    size_t peak_bytes;   //!< used_bytes の最大値
+  };
+
+  /** @brief メモリプールの使用状況を返す． */
+  MemoryStat GetMemoryStat();
+
   /** @brief 標準コンテナ用のメモリアロケータ */
-  template <class T, unsigned int Alignment = 64, unsigned int Boundary = 4096>
+  template <class T, unsigned int Alignment = 64, unsigned int Boundary = 4096,
+            memstat::Tag Tag = memstat::Tag::kUSBMisc>
   class Allocator {
    public:
     using size_type = size_t;
     using pointer = T*;
     using value_type = T;
 
+    template <class U>
+    struct rebind {
+      using other = Allocator<U, Alignment, Boundary, Tag>;
+    };
+
     Allocator() noexcept = default;
     Allocator(const Allocator&) noexcept = default;
-    template <class U> Allocator(const Allocator<U>&) noexcept {}
+    template <class U>
+    Allocator(const Allocator<U, Alignment, Boundary, Tag>&) noexcept {}
     ~Allocator() noexcept = default;
     Allocator& operator=(const Allocator&) = default;
 
     pointer allocate(size_type n) {
-      return AllocArray<T>(n, Alignment, Boundary);
+      return AllocArray<T>(n, Alignment, Boundary, Tag);
     }
 
     void deallocate(pointer p, size_type num) {
       FreeMem(p);
     }
+
+    template <class U>
+    bool operator==(const Allocator<U, Alignment, Boundary, Tag>&) const noexcept {
+      return true;
+    }
+
+    template <class U>
+    bool operator!=(const Allocator<U, Alignment, Boundary, Tag>&) const noexcept {
+      return false;
+    }
   };
 }
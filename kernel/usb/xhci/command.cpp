@@ -0,0 +1,157 @@
+#include "usb/xhci/command.hpp"
+
+#include "logger.hpp"
+#include "timer.hpp"
+
+namespace {
+  const unsigned int kCompletionSuccess = 1;
+  const unsigned int kCompletionCommandRingStopped = 24;
+  const unsigned int kCompletionCommandAborted = 25;
+}
+
+namespace usb::xhci {
+  Error CommandQueue::Initialize(MemMapRegister<CRCR_Bitmap>* crcr,
+                                 DoorbellRegister* doorbell) {
+    if (auto err = ring_.Initialize(kRingSize)) {
+      return err;
+    }
+    crcr_ = crcr;
+    doorbell_ = doorbell;
+    pending_.fill(Pending{});
+    num_pending_ = 0;
+    num_unflushed_ = 0;
+    aborting_ = false;
+
+    CRCR_Bitmap value = crcr_->Read();
+    value.bits.ring_cycle_state = true;
+    value.bits.command_stop = false;
+    value.bits.command_abort = false;
+    value.SetPointer(reinterpret_cast<uint64_t>(ring_.Buffer()));
+    crcr_->Write(value);
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  WithError<TRB*> CommandQueue::Submit(const std::array<uint32_t, 4>& data,
+                                       CommandCallback callback, uintptr_t arg,
+                                       uint64_t timeout_ticks) {
+    // 実行中のコマンド数を抑えておけば，リングの未処理部分を上書きすることはない
+    auto slot = Find(nullptr);
+    if (slot == nullptr) {
+      return {nullptr, MAKE_ERROR(Error::kFull)};
+    }
+
+    TRB trb;
+    trb.data = data;
+    auto trb_ptr = ring_.Push(trb);
+    if (trb_ptr == nullptr) {
+      return {nullptr, MAKE_ERROR(Error::kFull)};
+    }
+    *slot = Pending{trb_ptr, callback, arg, CurrentTick() + timeout_ticks};
+    ++num_pending_;
+    ++num_unflushed_;
+    ++stat_.submitted;
+    return {trb_ptr, MAKE_ERROR(Error::kSuccess)};
+  }
+
+  void CommandQueue::Flush() {
+    // 中止中は Command Ring Stopped を受けてから再開する
+    if (num_unflushed_ == 0 || aborting_) {
+      return;
+    }
+    doorbell_->Ring(0);
+    ++stat_.doorbells;
+    num_unflushed_ = 0;
+  }
+
+  Error CommandQueue::OnCompletion(Controller& xhc,
+                                   const CommandCompletionEventTRB& trb) {
+    if (trb.bits.completion_code == kCompletionCommandRingStopped) {
+      // ポインタは次に実行されるはずだった TRB を指しており，そのコマンドは未完了
+      aborting_ = false;
+      if (num_pending_ > 0) {
+        doorbell_->Ring(0);
+        ++stat_.doorbells;
+        num_unflushed_ = 0;
+      }
+      return MAKE_ERROR(Error::kSuccess);
+    }
+
+    auto pending = Find(trb.Pointer());
+    if (pending == nullptr) {
+      return MAKE_ERROR(Error::kUnknownCommand);
+    }
+    ring_.OnCompleted(trb.Pointer());
+    const Pending done = *pending;
+    *pending = Pending{};
+    --num_pending_;
+    ++stat_.completed;
+
+    if (trb.bits.completion_code != kCompletionSuccess) {
+      Log(kWarn, "xHC command %s completed with code %u\n",
+          kTRBTypeToName[done.trb->bits.trb_type],
+          static_cast<unsigned int>(trb.bits.completion_code));
+    }
+    return done.callback(xhc, trb, done.arg);
+  }
+
+  bool CommandQueue::CheckTimeouts(uint64_t now_tick) {
+    if (aborting_) {
+      if (now_tick < abort_deadline_) {
+        return true;
+      }
+      Log(kError, "xHC command ring did not stop (CRR = %d)\n",
+          static_cast<int>(crcr_->Read().bits.command_ring_running));
+      return false;
+    }
+    if (num_pending_ == 0) {
+      return true;
+    }
+    for (auto& pending : pending_) {
+      if (pending.trb == nullptr || now_tick < pending.deadline) {
+        continue;
+      }
+
+      Log(kWarn, "xHC command %s timed out, aborting the command ring\n",
+          kTRBTypeToName[pending.trb->bits.trb_type]);
+      ++stat_.timeouts;
+      aborting_ = true;
+      abort_deadline_ = now_tick + kAbortTimeoutTicks;
+      // 実行中はポインタと RCS の書き込みは無視されるので，CA だけが効く
+      auto crcr = crcr_->Read();
+      crcr.bits.command_abort = true;
+      crcr_->Write(crcr);
+      return true;
+    }
+    return true;
+  }
+
+  void CommandQueue::FailAll(Controller& xhc) {
+    // コールバックの中で Submit() されたコマンドまで失敗させないよう，先に空にしておく
+    const auto failed = pending_;
+    pending_.fill(Pending{});
+    num_pending_ = 0;
+    num_unflushed_ = 0;
+
+    for (const auto& done : failed) {
+      if (done.trb == nullptr) {
+        continue;
+      }
+      Log(kWarn, "xHC command %s failed without completion\n",
+          kTRBTypeToName[done.trb->bits.trb_type]);
+      CommandCompletionEventTRB trb{};
+      trb.SetPointer(done.trb);
+      trb.bits.completion_code = kCompletionCommandAborted;
+      ++stat_.completed;
+      done.callback(xhc, trb, done.arg);
+    }
+  }
+
+  CommandQueue::Pending* CommandQueue::Find(const TRB* trb) {
+    for (auto& pending : pending_) {
+      if (pending.trb == trb) {
+        return &pending;
+      }
+    }
+    return nullptr;
+  }
+}
@@ -0,0 +1,130 @@
+/**
+ * @file usb/xhci/command.hpp
+ *
+ * コマンドリングへのコマンドの発行と，完了イベントとの対応付け．
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+#include "usb/xhci/registers.hpp"
+#include "usb/xhci/ring.hpp"
+#include "usb/xhci/trb.hpp"
+
+namespace usb::xhci
+{
+    class Controller;
+
+    /** @brief コマンドの完了（失敗，中止を含む）時に呼ばれる関数
+     *
+     * @param trb  コマンド完了イベント．completion_code で結果を確認すること．
+     * @param arg  Submit() に渡した値
+     */
+    using CommandCallback = Error (*)(Controller &xhc, const CommandCompletionEventTRB &trb,
+                                      uintptr_t arg);
+
+    struct CommandStat
+    {
+        uint64_t submitted;
+        uint64_t completed;
+        /** @brief 実際に鳴らしたドアベルの回数 */
+        uint64_t doorbells;
+        uint64_t timeouts;
+    };
+
+    /** @brief コマンドリングと実行中のコマンドを管理するクラス
+     *
+     * Submit() はコマンドをリングに積むだけでドアベルは鳴らさない．
+     * まとめて積んだ後に Flush() を 1 回呼ぶ．完了イベントはコマンド TRB の
+     * アドレスで実行中のコマンドと対応付け，登録されたコールバックを呼ぶ．
+     * 期限を過ぎたコマンドは CRCR の Command Abort で中止する．
+     *
+     * 自身ではロックを取らない．完了コールバックの中から Submit() できるよう，
+     * すべての操作は Controller::StateLock() を保持して呼ぶ．
+     */
+    class CommandQueue
+    {
+    public:
+        /** @brief 同時に実行中にできるコマンドの数 */
+        static const size_t kMaxInFlight = 16;
+        /** @brief コマンドリングの TRB 数（Link TRB を含む） */
+        static const size_t kRingSize = 32;
+        /** @brief 既定のタイムアウト（Local APIC タイマの tick 数） */
+        static const uint64_t kDefaultTimeoutTicks = 100;
+        /** @brief Command Abort から Command Ring Stopped までを待つ上限（tick 数） */
+        static const uint64_t kAbortTimeoutTicks = 50;
+
+        Error Initialize(MemMapRegister<CRCR_Bitmap> *crcr, DoorbellRegister *doorbell);
+
+        /** @brief コマンドをリングに積む
+         *
+         * @return リング上のコマンド TRB．完了イベントはこのアドレスで照合される．
+         */
+        template <typename TRBType>
+        WithError<TRB *> Submit(const TRBType &trb, CommandCallback callback, uintptr_t arg,
+                                uint64_t timeout_ticks = kDefaultTimeoutTicks)
+        {
+            return Submit(trb.data, callback, arg, timeout_ticks);
+        }
+
+        /** @brief 積んだままのコマンドがあればドアベルを 1 回だけ鳴らす */
+        void Flush();
+
+        /** @brief コマンド完了イベントを受け取り，対応するコマンドのコールバックを呼ぶ */
+        Error OnCompletion(Controller &xhc, const CommandCompletionEventTRB &trb);
+
+        /** @brief 期限を過ぎたコマンドがあればコマンドリングを中止する
+         *
+         * 実行中のコマンドは Command Aborted で完了し，続く Command Ring Stopped の
+         * イベントを受けたら残りのコマンドのためにリングを再開する．
+         *
+         * @return 中止してから kAbortTimeoutTicks 経っても Command Ring Stopped が来ない
+         *         （CRR が落ちない，またはイベントが失われた）なら false．呼び出し側は
+         *         FailAll() の後にコントローラをリセットすること．
+         */
+        bool CheckTimeouts(uint64_t now_tick);
+
+        /** @brief 実行中のコマンドをすべて Command Aborted として完了させる
+         *
+         * コマンドリングが止まったまま戻らないときに使う．リングは再開しないので，
+         * 後で Initialize() し直すこと．
+         */
+        void FailAll(Controller &xhc);
+
+        size_t InFlight() const { return num_pending_; }
+        /** @brief Command Abort を要求し，Command Ring Stopped を待っている */
+        bool IsAborting() const { return aborting_; }
+        const CommandStat &Stat() const { return stat_; }
+
+    private:
+        struct Pending
+        {
+            TRB *trb; // nullptr なら空き
+            CommandCallback callback;
+            uintptr_t arg;
+            uint64_t deadline;
+        };
+
+        Ring ring_;
+        MemMapRegister<CRCR_Bitmap> *crcr_ = nullptr;
+        DoorbellRegister *doorbell_ = nullptr;
+
+        std::array<Pending, kMaxInFlight> pending_{};
+        size_t num_pending_ = 0;
+        /** @brief 積んだがドアベルをまだ鳴らしていないコマンドの数 */
+        size_t num_unflushed_ = 0;
+        /** @brief Command Abort を要求し，Command Ring Stopped を待っている */
+        bool aborting_ = false;
+        /** @brief aborting_ の間，この tick を過ぎたらコマンドリングが止まらないとみなす */
+        uint64_t abort_deadline_ = 0;
+        CommandStat stat_{};
+
+        WithError<TRB *> Submit(const std::array<uint32_t, 4> &data, CommandCallback callback,
+                                uintptr_t arg, uint64_t timeout_ticks);
+        Pending *Find(const TRB *trb);
+    };
+}
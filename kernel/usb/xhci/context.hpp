@@ -69,6 +69,24 @@ namespace usb::xhci {
     }
   } __attribute__((packed));
 
+  /** @brief Stream Context．Primary Stream Array の要素で，ストリームごとの Transfer Ring を指す． */
+  union StreamContext {
+    uint32_t dwords[4];
+    struct {
+      uint32_t dequeue_cycle_state : 1;
+      uint32_t stream_context_type : 3;  // 1 = Primary Transfer Ring
+      uint64_t tr_dequeue_pointer : 60;
+
+      uint32_t stopped_edtla : 24;
+      uint32_t : 8;
+      uint32_t : 32;
+    } __attribute__((packed)) bits;
+
+    void SetTransferRingBuffer(TRB* buffer) {
+      bits.tr_dequeue_pointer = reinterpret_cast<uint64_t>(buffer) >> 4;
+    }
+  } __attribute__((packed));
+
   struct DeviceContextIndex {
     int value;
 
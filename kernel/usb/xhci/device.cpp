@@ -1,12 +1,60 @@
 #include "usb/xhci/device.hpp"
 
+#include <algorithm>
+
 #include "logger.hpp"
 #include "usb/memory.hpp"
 #include "usb/xhci/ring.hpp"
+#include "usb/xhci/devmgr.hpp"
 
 namespace {
   using namespace usb::xhci;
 
+  /** 1 つの TRB が指すバッファはこの境界をまたいではならない */
+  const uintptr_t kTRBBufferBoundary = 64 * 1024;
+
+  /** [p, p + len) を 64 KiB 境界で区切ったときの TRB 数 */
+  size_t CountTRBs(uintptr_t p, size_t len) {
+    if (len == 0) {
+      return 0;
+    }
+    return (p + len - 1) / kTRBBufferBoundary - p / kTRBBufferBoundary + 1;
+  }
+
+  /** total バイトの TD で，ある TRB までに transferred バイトを送ったときの TD Size．
+   *
+   * TD 全体のパケット数から，この TRB までに送り終わる完全なパケットの数を引いたもの（xHCI 4.11.2.4）．
+   * TRB の境界はパケットの境界と揃っているとは限らないので，残りバイト数から求めてはいけない．
+   * 最後の TRB では 0．
+   */
+  constexpr size_t TDSize(size_t total, size_t transferred, size_t max_packet_size) {
+    if (transferred >= total) {
+      return 0;
+    }
+    const size_t td_packets = (total + max_packet_size - 1) / max_packet_size;
+    return std::min<size_t>(td_packets - transferred / max_packet_size, 31);
+  }
+
+  // MPS = 512 で 100 + 700 + 500 バイトに分かれた TD：2 つ目の TRB でパケットの途中をまたぐ
+  static_assert(TDSize(1300, 100, 512) == 3);
+  static_assert(TDSize(1300, 800, 512) == 2);
+  static_assert(TDSize(1300, 1300, 512) == 0);
+  // パケット境界ちょうどで区切った場合
+  static_assert(TDSize(1024, 512, 512) == 1);
+  static_assert(TDSize(1024, 1024, 512) == 0);
+  // 64 KiB 境界で区切った大きな TD は 31 で頭打ちになる
+  static_assert(TDSize(3 * 65536, 65536, 1024) == 31);
+  static_assert(TDSize(65536 + 1000, 65536, 1024) == 1);
+
+  /** リング上の次の TRB．Link TRB は辿る． */
+  const TRB* NextTRB(const TRB* trb) {
+    ++trb;
+    if (auto link = TRBDynamicCast<const LinkTRB>(trb)) {
+      return link->Pointer();
+    }
+    return trb;
+  }
+
   SetupStageTRB MakeSetupStageTRB(usb::SetupData setup_data, int transfer_type) {
     SetupStageTRB setup{};
     setup.bits.request_type = setup_data.request_type.data;
@@ -77,8 +125,72 @@ namespace {
 }
 
 namespace usb::xhci {
-  Device::Device(uint8_t slot_id, DoorbellRegister* dbreg)
-      : slot_id_{slot_id}, dbreg_{dbreg} {
+  bool DoorbellBatch::Defer(uint8_t slot_id, uint8_t dci) {
+    for (size_t i = 0; i < num_entries_; ++i) {
+      if (entries_[i].slot_id == slot_id) {
+        entries_[i].dcis |= 1u << dci;
+        return true;
+      }
+    }
+    if (num_entries_ == kMaxEntries) {
+      return false;
+    }
+    entries_[num_entries_++] = {slot_id, 1u << dci};
+    return true;
+  }
+
+  bool DoorbellBatch::DeferStream(uint8_t slot_id, uint8_t dci, uint16_t stream_id) {
+    for (size_t i = 0; i < num_stream_entries_; ++i) {
+      const auto& e = stream_entries_[i];
+      if (e.slot_id == slot_id && e.dci == dci && e.stream_id == stream_id) {
+        return true;
+      }
+    }
+    if (num_stream_entries_ == kMaxStreamEntries) {
+      return false;
+    }
+    stream_entries_[num_stream_entries_++] = {slot_id, dci, stream_id};
+    return true;
+  }
+
+  uint32_t DoorbellBatch::Take(uint8_t slot_id) {
+    for (size_t i = 0; i < num_entries_; ++i) {
+      if (entries_[i].slot_id == slot_id) {
+        const uint32_t dcis = entries_[i].dcis;
+        entries_[i] = entries_[--num_entries_];
+        return dcis;
+      }
+    }
+    return 0;
+  }
+
+  bool DoorbellBatch::TakeStream(uint8_t slot_id, uint8_t& dci, uint16_t& stream_id) {
+    for (size_t i = 0; i < num_stream_entries_; ++i) {
+      if (stream_entries_[i].slot_id == slot_id) {
+        dci = stream_entries_[i].dci;
+        stream_id = stream_entries_[i].stream_id;
+        stream_entries_[i] = stream_entries_[--num_stream_entries_];
+        return true;
+      }
+    }
+    return false;
+  }
+
+  Device::Device(uint8_t slot_id, DoorbellRegister* dbreg, DeviceManager* devmgr)
+      : slot_id_{slot_id}, dbreg_{dbreg}, devmgr_{devmgr} {
+  }
+
+  Device::~Device() {
+    for (auto& tr : transfer_rings_) {
+      if (tr != nullptr) {
+        tr->~Ring();
+        FreeMem(tr);
+        tr = nullptr;
+      }
+    }
+    for (int dci = 1; dci <= 31; ++dci) {
+      FreeStreams(DeviceContextIndex{dci});
+    }
   }
 
   Error Device::Initialize() {
@@ -94,16 +206,127 @@ namespace usb::xhci {
     state_ = State::kSlotAssigning;
   }
 
-  Ring* Device::AllocTransferRing(DeviceContextIndex index, size_t buf_size) {
+  void Device::RingDoorbells(uint32_t dcis) {
+    for (; dcis; dcis &= dcis - 1) {
+      dbreg_->Ring(__builtin_ctz(dcis));
+      ++doorbell_stat_.writes;
+    }
+  }
+
+  void Device::RingStreamDoorbell(uint8_t dci, uint16_t stream_id) {
+    dbreg_->Ring(dci, stream_id);
+    ++doorbell_stat_.writes;
+  }
+
+  void Device::BeginTransferBatch() {
+    devmgr_->BeginBatch();
+  }
+
+  void Device::EndTransferBatch() {
+    devmgr_->EndBatch();
+  }
+
+  void Device::RingDoorbell(DeviceContextIndex dci, uint16_t stream_id) {
+    ++doorbell_stat_.requests;
+    if (auto batch = devmgr_->Batch()) {
+      const bool deferred = stream_id == 0
+        ? batch->Defer(slot_id_, dci.value)
+        : batch->DeferStream(slot_id_, dci.value, stream_id);
+      if (deferred) {
+        return;
+      }
+    }
+    dbreg_->Ring(dci.value, stream_id);
+    ++doorbell_stat_.writes;
+  }
+
+  Ring* Device::AllocTransferRing(DeviceContextIndex index, size_t segment_size,
+                                  size_t num_segments) {
     int i = index.value - 1;
-    auto tr = AllocArray<Ring>(1, 64, 4096);
+    if (auto old_tr = transfer_rings_[i]) {
+      old_tr->~Ring();
+      FreeMem(old_tr);
+    }
+
+    auto tr = AllocArray<Ring>(1, 64, 4096, memstat::Tag::kUSBRing);
     if (tr) {
-      tr->Initialize(buf_size);
+      new(tr) Ring;
+      if (tr->Initialize(segment_size, num_segments)) {
+        tr->~Ring();
+        FreeMem(tr);
+        tr = nullptr;
+      }
     }
     transfer_rings_[i] = tr;
     return tr;
   }
 
+  StreamContext* Device::AllocStreams(DeviceContextIndex index, size_t num_streams) {
+    FreeStreams(index);
+    if (auto old_tr = transfer_rings_[index.value - 1]) {
+      old_tr->~Ring();
+      FreeMem(old_tr);
+      transfer_rings_[index.value - 1] = nullptr;
+    }
+
+    auto& sa = streams_[index.value - 1];
+    sa.contexts = AllocArray<StreamContext>(num_streams, 64, 4096, memstat::Tag::kUSBRing);
+    sa.rings = AllocArray<Ring*>(num_streams, 8, 0, memstat::Tag::kUSBRing);
+    if (sa.contexts == nullptr || sa.rings == nullptr) {
+      FreeStreams(index);
+      return nullptr;
+    }
+    sa.num = num_streams;
+    memset(sa.contexts, 0, sizeof(StreamContext) * num_streams);
+    memset(sa.rings, 0, sizeof(Ring*) * num_streams);
+
+    // ストリーム 0 は予約されているので Stream Context を空のままにする
+    for (size_t i = 1; i < num_streams; ++i) {
+      auto tr = AllocArray<Ring>(1, 64, 4096, memstat::Tag::kUSBRing);
+      if (tr == nullptr) {
+        FreeStreams(index);
+        return nullptr;
+      }
+      new(tr) Ring;
+      sa.rings[i] = tr;
+      if (tr->Initialize(kStreamRingSegmentSize)) {
+        FreeStreams(index);
+        return nullptr;
+      }
+      sa.contexts[i].SetTransferRingBuffer(tr->Buffer());
+      sa.contexts[i].bits.stream_context_type = 1;
+      sa.contexts[i].bits.dequeue_cycle_state = 1;
+    }
+    return sa.contexts;
+  }
+
+  void Device::FreeStreams(DeviceContextIndex index) {
+    auto& sa = streams_[index.value - 1];
+    if (sa.rings) {
+      for (size_t i = 0; i < sa.num; ++i) {
+        if (auto tr = sa.rings[i]) {
+          tr->~Ring();
+          FreeMem(tr);
+        }
+      }
+    }
+    FreeMem(sa.rings);
+    FreeMem(sa.contexts);
+    sa = StreamArray{};
+  }
+
+  size_t Device::NumStreams(EndpointID ep_id) const {
+    return streams_[DeviceContextIndex{ep_id}.value - 1].num;
+  }
+
+  size_t Device::StreamsFor(int max_streams) const {
+    if (max_streams <= 0) {
+      return 0;
+    }
+    const size_t num = std::min({size_t{1} << max_streams, devmgr_->MaxStreams(), kMaxStreams});
+    return num >= kMinStreams ? num : 0;
+  }
+
   Error Device::ControlIn(EndpointID ep_id, SetupData setup_data,
                           void* buf, int len, ClassDriver* issuer) {
     if (auto err = usb::Device::ControlIn(ep_id, setup_data, buf, len, issuer)) {
@@ -124,6 +347,10 @@ namespace usb::xhci {
     if (tr == nullptr) {
       return MAKE_ERROR(Error::kTransferRingNotSet);
     }
+    // Setup, Data, Status の 3 つを途中で空きが尽きずに積めるようにしておく
+    if (auto err = tr->Reserve(buf ? 3 : 2)) {
+      return err;
+    }
 
     auto status = StatusStageTRB{};
 
@@ -146,7 +373,7 @@ namespace usb::xhci {
       setup_stage_map_.Put(status_trb_position, setup_trb_position);
     }
 
-    dbreg_->Ring(dci.value);
+    RingDoorbell(dci);
 
     return MAKE_ERROR(Error::kSuccess);
   }
@@ -171,6 +398,10 @@ namespace usb::xhci {
     if (tr == nullptr) {
       return MAKE_ERROR(Error::kTransferRingNotSet);
     }
+    // Setup, Data, Status の 3 つを途中で空きが尽きずに積めるようにしておく
+    if (auto err = tr->Reserve(buf ? 3 : 2)) {
+      return err;
+    }
 
     auto status = StatusStageTRB{};
     status.bits.direction = true;
@@ -193,7 +424,7 @@ namespace usb::xhci {
       setup_stage_map_.Put(status_trb_position, setup_trb_position);
     }
 
-    dbreg_->Ring(dci.value);
+    RingDoorbell(dci);
 
     return MAKE_ERROR(Error::kSuccess);
   }
@@ -210,15 +441,19 @@ namespace usb::xhci {
     if (tr == nullptr) {
       return MAKE_ERROR(Error::kTransferRingNotSet);
     }
+    if (auto err = tr->Reserve(1)) {
+      return err;
+    }
 
     NormalTRB normal{};
     normal.SetPointer(buf);
     normal.bits.trb_transfer_length = len;
     normal.bits.interrupt_on_short_packet = true;
     normal.bits.interrupt_on_completion = true;
+    normal.bits.interrupter_target = InterrupterTarget(dci);
 
     tr->Push(normal);
-    dbreg_->Ring(dci.value);
+    RingDoorbell(dci);
     return MAKE_ERROR(Error::kSuccess);
   }
 
@@ -234,16 +469,58 @@ namespace usb::xhci {
 
   Error Device::OnTransferEventReceived(const TransferEventTRB& trb) {
     const auto residual_length = trb.bits.trb_transfer_length;
-
-    if (trb.bits.completion_code != 1 /* Success */ &&
-        trb.bits.completion_code != 13 /* Short Packet */) {
-      Log(kDebug, trb);
-      return MAKE_ERROR(Error::kTransferFailed);
-    }
+    const bool failed = trb.bits.completion_code != 1 /* Success */ &&
+                        trb.bits.completion_code != 13 /* Short Packet */;
     Log(kDebug, trb);
 
+    const uint8_t dci = trb.bits.endpoint_id;
     TRB* issuer_trb = trb.Pointer();
+    if (!trb.bits.event_data && issuer_trb != nullptr && dci > 0) {
+      if (auto tr = FindLateEventRing(dci, issuer_trb)) {
+        Log(kDebug, "Ignoring a late transfer event for a short TD (dci %d)\n", dci);
+        tr->ExpectLateEvent(nullptr);
+        return MAKE_ERROR(Error::kSuccess);
+      }
+      if (auto tr = transfer_rings_[dci - 1]) {
+        tr->ExpectLateEvent(nullptr);
+      }
+    }
+
+    const auto code = trb.bits.completion_code;
+    if (code == 26 /* Stopped */ || code == 27 /* Stopped - Length Invalid */ ||
+        code == 28 /* Stopped - Short Packet */) {
+      // Stop Endpoint で止めた TD．取り消さなければ再開後に続きから転送される．
+      return MAKE_ERROR(Error::kSuccess);
+    }
+
+    // Event Data でなければ TRB Pointer はリング上の TRB を指すので，そこまでの空きを回収する
+    if (!trb.bits.event_data && issuer_trb != nullptr && dci > 0) {
+      if (auto tr = transfer_rings_[dci - 1]) {
+        if (auto err = tr->OnCompleted(trb.Pointer())) {
+          Log(kWarn, "Transfer event for a TRB %p not on the ring of dci %d\n",
+              issuer_trb, dci);
+        }
+      }
+    }
+
+    if (!trb.bits.event_data && issuer_trb != nullptr && TRBDynamicCast<NormalTRB>(issuer_trb)) {
+      if (auto td = FindBulkTD(dci, issuer_trb)) {
+        // このリングの次のイベントが来たので，もう遅れたイベントは来ない
+        td->ring->ExpectLateEvent(nullptr);
+        return OnBulkTransferEvent(trb, *td);
+      } else if (streams_[dci - 1].num > 0 ||
+                 ctx_.ep_contexts[dci - 1].bits.ep_type == 2 ||
+                 ctx_.ep_contexts[dci - 1].bits.ep_type == 6) {
+        // エンドポイントの復旧で取り消した TD のイベント
+        Log(kDebug, "Ignoring transfer event for a cancelled bulk TD (dci %d)\n", dci);
+        return MAKE_ERROR(Error::kSuccess);
+      }
+    }
+
     if (auto normal_trb = TRBDynamicCast<NormalTRB>(issuer_trb)) {
+      if (failed) {
+        return MAKE_ERROR(Error::kTransferFailed);
+      }
       const auto transfer_length =
         normal_trb->bits.trb_transfer_length - residual_length;
       return this->OnInterruptCompleted(
@@ -252,6 +529,9 @@ namespace usb::xhci {
 
     auto opt_setup_stage_trb = setup_stage_map_.Get(issuer_trb);
     if (!opt_setup_stage_trb) {
+      if (failed) {
+        return MAKE_ERROR(Error::kTransferFailed);
+      }
       Log(kDebug, "No Corresponding Setup Stage for issuer %s\n",
           kTRBTypeToName[issuer_trb->bits.trb_type]);
       if (auto data_trb = TRBDynamicCast<DataStageTRB>(issuer_trb)) {
@@ -269,6 +549,12 @@ namespace usb::xhci {
     setup_data.index = setup_stage_trb->bits.index;
     setup_data.length = setup_stage_trb->bits.length;
 
+    if (failed) {
+      // 完了を待っているコルーチンにも失敗を伝える
+      return this->OnControlFailed(
+          trb.EndpointID(), setup_data, MAKE_ERROR(Error::kTransferFailed));
+    }
+
     void* data_stage_buffer{nullptr};
     int transfer_length{0};
     if (auto data_stage_trb = TRBDynamicCast<DataStageTRB>(issuer_trb)) {
@@ -283,4 +569,292 @@ namespace usb::xhci {
     return this->OnControlCompleted(
         trb.EndpointID(), setup_data, data_stage_buffer, transfer_length);
   }
+
+  Error Device::BulkIn(EndpointID ep_id, const TransferBuffer* bufs, int num_bufs,
+                       uintptr_t cookie, uint16_t stream_id) {
+    if (!ep_id.IsIn()) {
+      return MAKE_ERROR(Error::kInvalidEndpointNumber);
+    }
+    return PushBulkTD(ep_id, bufs, num_bufs, cookie, stream_id);
+  }
+
+  Error Device::BulkOut(EndpointID ep_id, const TransferBuffer* bufs, int num_bufs,
+                        uintptr_t cookie, uint16_t stream_id) {
+    if (ep_id.IsIn()) {
+      return MAKE_ERROR(Error::kInvalidEndpointNumber);
+    }
+    return PushBulkTD(ep_id, bufs, num_bufs, cookie, stream_id);
+  }
+
+  Error Device::PushBulkTD(EndpointID ep_id, const TransferBuffer* bufs, int num_bufs,
+                           uintptr_t cookie, uint16_t stream_id) {
+    const DeviceContextIndex dci{ep_id};
+    const auto& sa = streams_[dci.value - 1];
+    Ring* tr = nullptr;
+    if (sa.num > 0) {
+      if (stream_id == 0 || stream_id >= sa.num) {
+        return MAKE_ERROR(Error::kIndexOutOfRange);
+      }
+      tr = sa.rings[stream_id];
+    } else if (stream_id == 0) {
+      tr = transfer_rings_[dci.value - 1];
+    } else {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    if (tr == nullptr) {
+      return MAKE_ERROR(Error::kTransferRingNotSet);
+    }
+
+    BulkTD* td = nullptr;
+    for (auto& t : bulk_tds_) {
+      if (t.first == nullptr) {
+        td = &t;
+        break;
+      }
+    }
+    if (td == nullptr) {
+      return MAKE_ERROR(Error::kFull);
+    }
+
+    size_t total = 0, num_trbs = 0;
+    for (int i = 0; i < num_bufs; ++i) {
+      total += bufs[i].len;
+      num_trbs += CountTRBs(reinterpret_cast<uintptr_t>(bufs[i].buf), bufs[i].len);
+    }
+    // 長さ 0 の転送も長さ 0 の Normal TRB 1 つで表す
+    if (auto err = tr->Reserve(std::max<size_t>(num_trbs, 1))) {
+      return err;
+    }
+
+    size_t max_packet_size = ctx_.ep_contexts[dci.value - 1].bits.max_packet_size;
+    if (max_packet_size == 0) {
+      max_packet_size = 1;
+    }
+
+    NormalTRB normal{};
+    normal.bits.interrupt_on_short_packet = ep_id.IsIn();
+    normal.bits.interrupter_target = InterrupterTarget(dci);
+
+    TRB* first = nullptr;
+    TRB* last = nullptr;
+    size_t transferred = 0;
+    auto push = [&](uintptr_t p, size_t len) {
+      transferred += len;
+      normal.SetPointer(reinterpret_cast<const void*>(p));
+      normal.bits.trb_transfer_length = len;
+      normal.bits.td_size = TDSize(total, transferred, max_packet_size);
+      normal.bits.chain_bit = transferred < total;
+      normal.bits.interrupt_on_completion = transferred == total;
+      last = tr->Push(normal);
+      if (first == nullptr) {
+        first = last;
+      }
+    };
+
+    if (total == 0) {
+      push(0, 0);
+    }
+    for (int i = 0; i < num_bufs; ++i) {
+      auto p = reinterpret_cast<uintptr_t>(bufs[i].buf);
+      size_t len = bufs[i].len;
+      while (len > 0) {
+        const size_t chunk = std::min<size_t>(
+            len, kTRBBufferBoundary - (p & (kTRBBufferBoundary - 1)));
+        push(p, chunk);
+        p += chunk;
+        len -= chunk;
+      }
+    }
+
+    *td = BulkTD{first, last, tr, bulk_seq_++, cookie, static_cast<int>(total),
+                 static_cast<uint8_t>(dci.value)};
+    // 復旧中はデキューポインタを移し終えてからまとめて鳴らす
+    if (!IsRecovering(dci.value)) {
+      RingDoorbell(dci, stream_id);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Device::BulkTD* Device::FindBulkTD(uint8_t dci, const TRB* issuer_trb) {
+    for (auto& td : bulk_tds_) {
+      if (td.first != nullptr && td.dci == dci && td.last == issuer_trb) {
+        return &td;
+      }
+    }
+    // Short Packet は TD の途中の TRB で報告される
+    for (auto& td : bulk_tds_) {
+      if (td.first == nullptr || td.dci != dci) {
+        continue;
+      }
+      for (auto p = static_cast<const TRB*>(td.first); p != td.last; p = NextTRB(p)) {
+        if (p == issuer_trb) {
+          return &td;
+        }
+      }
+    }
+    return nullptr;
+  }
+
+  Error Device::OnBulkTransferEvent(const TransferEventTRB& trb, BulkTD& td) {
+    const auto code = trb.bits.completion_code;
+    const TRB* issuer_trb = trb.Pointer();
+    const int residual_length = trb.bits.trb_transfer_length;
+
+    int transferred = 0;
+    Error err = MAKE_ERROR(Error::kSuccess);
+    if (code != 1 /* Success */ && code != 13 /* Short Packet */) {
+      // エンドポイントは Halted になっている．リセットして，積んである TD はすべて取り消す．
+      // リングの空きもそのときに回収する．
+      err = MAKE_ERROR(Error::kTransferFailed);
+      RequestRecovery(td.dci, 1u);
+    } else if (issuer_trb == td.last) {
+      transferred = td.length - residual_length;
+    } else {
+      // TD の途中で短いパケットを受けた．xHC は TD の残りの TRB を飛ばして次の TD に進む．
+      for (auto p = static_cast<const TRB*>(td.first); p != issuer_trb; p = NextTRB(p)) {
+        transferred += TRBDynamicCast<const NormalTRB>(p)->bits.trb_transfer_length;
+      }
+      transferred += TRBDynamicCast<const NormalTRB>(issuer_trb)->bits.trb_transfer_length
+                     - residual_length;
+    }
+
+    // TD の途中で完了したときとストリームのリングは，呼び出し元では末尾まで回収されない
+    if (!err && (issuer_trb != td.last || td.ring != transfer_rings_[td.dci - 1])) {
+      td.ring->OnCompleted(td.last);
+    }
+    if (!err && issuer_trb != td.last) {
+      td.ring->ExpectLateEvent(td.last);
+    }
+
+    const BulkTD done = td;
+    td = BulkTD{};
+    return this->OnBulkCompleted(trb.EndpointID(), done.cookie, transferred, err);
+  }
+
+  void Device::FailBulkTDs(const Ring* ring) {
+    // 完了を伝えた先で同じリングに積み直すことがあるので，取り消す TD を先に決めておく
+    const uint64_t end_seq = bulk_seq_;
+    for (auto& td : bulk_tds_) {
+      if (td.first == nullptr || td.ring != ring || td.seq >= end_seq) {
+        continue;
+      }
+      const BulkTD done = td;
+      td = BulkTD{};
+      this->OnBulkCompleted(EndpointID{done.dci}, done.cookie, 0,
+                            MAKE_ERROR(Error::kTransferFailed));
+    }
+  }
+
+  Ring* Device::FindLateEventRing(uint8_t dci, const TRB* trb) {
+    const auto& sa = streams_[dci - 1];
+    if (sa.num == 0) {
+      auto tr = transfer_rings_[dci - 1];
+      return tr != nullptr && tr->LateEvent() == trb ? tr : nullptr;
+    }
+    for (size_t i = 1; i < sa.num; ++i) {
+      if (sa.rings[i] != nullptr && sa.rings[i]->LateEvent() == trb) {
+        return sa.rings[i];
+      }
+    }
+    return nullptr;
+  }
+
+  void Device::RequestRecovery(uint8_t dci, uint32_t streams) {
+    recovery_[dci - 1].requested |= streams;
+  }
+
+  Error Device::ResetEndpoint(EndpointID ep_id, uint16_t stream_id) {
+    const DeviceContextIndex dci{ep_id};
+    if (dci.value < 2 || 31 < dci.value || stream_id >= 32) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    const auto& sa = streams_[dci.value - 1];
+    if (sa.num > 0 ? stream_id >= sa.num : stream_id != 0) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    RequestRecovery(dci.value, uint32_t{1} << stream_id);
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  uint8_t Device::StartRecovery() {
+    for (uint8_t dci = 2; dci <= 31; ++dci) {
+      auto& r = recovery_[dci - 1];
+      if (r.active || r.requested == 0) {
+        continue;
+      }
+      r.active = true;
+      r.halted = IsHalted(dci);
+      r.round = r.requested;
+      r.requested = 0;
+      r.streams = r.round;
+      // ストリームを使うエンドポイント全体なら，すべてのストリームを移す
+      if (const size_t num = streams_[dci - 1].num; num > 0 && (r.streams & 1u)) {
+        r.streams = (num >= 32 ? ~uint32_t{0} : (uint32_t{1} << num) - 1) & ~1u;
+      }
+      return dci;
+    }
+    return 0;
+  }
+
+  bool Device::NextDequeue(uint8_t dci, uint16_t& stream_id, TRB*& dequeue, bool& cycle_state) {
+    auto& r = recovery_[dci - 1];
+    if (!r.active) {
+      return false;
+    }
+    const auto& sa = streams_[dci - 1];
+    while (r.streams != 0) {
+      const int id = __builtin_ctz(r.streams);
+      r.streams &= r.streams - 1;
+      Ring* tr = sa.num > 0 ? sa.rings[id] : transfer_rings_[dci - 1];
+      // 空のストリームでは xHC もすでに書き込み位置にいる．
+      // ストリームを使わないリングは，失敗した TRB の分を回収済みでも xHC が手前で止まっている．
+      if (tr == nullptr || (sa.num > 0 && tr->Used() == 0)) {
+        continue;
+      }
+      // 取り消した TD の完了を伝える前に決める．その先で積まれた転送は取り消さない．
+      tr->DiscardPending();
+      stream_id = id;
+      dequeue = r.dequeue = tr->EnqueuePointer();
+      cycle_state = r.cycle_state = tr->CycleBit();
+      FailBulkTDs(tr);
+      return true;
+    }
+    return false;
+  }
+
+  bool Device::NeedsToggleReset(uint8_t dci, TRB*& dequeue, bool& cycle_state) const {
+    const auto& r = recovery_[dci - 1];
+    if (!r.active || r.halted || streams_[dci - 1].num > 0 || r.dequeue == nullptr) {
+      return false;
+    }
+    dequeue = r.dequeue;
+    cycle_state = r.cycle_state;
+    return true;
+  }
+
+  void Device::FinishRecovery(uint8_t dci) {
+    auto& r = recovery_[dci - 1];
+    if (!r.active) {
+      return;
+    }
+    const auto& sa = streams_[dci - 1];
+    r.active = false;
+    r.dequeue = nullptr;
+    if (sa.num > 0) {
+      for (size_t i = 1; i < sa.num; ++i) {
+        if (sa.rings[i] != nullptr && sa.rings[i]->Used() > 0) {
+          RingDoorbell(DeviceContextIndex{dci}, i);
+        }
+      }
+    } else if (auto tr = transfer_rings_[dci - 1]; tr != nullptr && tr->Used() > 0) {
+      RingDoorbell(DeviceContextIndex{dci});
+    }
+    for (uint32_t round = r.round; round != 0; round &= round - 1) {
+      this->OnEndpointReset(EndpointID{dci}, __builtin_ctz(round));
+    }
+  }
+
+  void Device::AbortRecovery(uint8_t dci) {
+    recovery_[dci - 1] = Recovery{};
+  }
 }
@@ -18,9 +18,75 @@
 
 namespace usb::xhci
 {
+    struct DoorbellStat
+    {
+        /** @brief 転送を積んでドアベルを要求した回数 */
+        uint64_t requests;
+        /** @brief 実際にドアベルレジスタに書いた回数 */
+        uint64_t writes;
+    };
+
+    class DeviceManager;
+
+    /** @brief 呼び出し元が持つ，鳴らすのを遅らせたドアベルの集合
+     *
+     * DrainEvents() のようにイベントをまとめて処理する呼び出し元が 1 つずつ持ち，
+     * DeviceManager::SetBatch() で処理中だけ登録して，最後に DeviceManager::Flush() で鳴らす．
+     * イベント処理の外で転送を続けて積むクラスドライバは usb::TransferBatch を使う．
+     * 他の CPU の処理とは共有しないので，互いのドアベルを遅らせたり先に鳴らしたりしない．
+     */
+    class DoorbellBatch
+    {
+    public:
+        /** @brief スロット slot_id の dci のドアベルを遅らせる．記録できなければ false． */
+        bool Defer(uint8_t slot_id, uint8_t dci);
+        /** @brief ストリームを使うエンドポイントのドアベルを遅らせる．記録できなければ false．
+         *
+         * ドアベルはストリームごとに書く必要があるので，同じストリームへの要求だけを 1 回にまとめる．
+         */
+        bool DeferStream(uint8_t slot_id, uint8_t dci, uint16_t stream_id);
+        /** @brief slot_id に遅らせたドアベル（ビット位置 = dci）を取り出し，記録から消す */
+        uint32_t Take(uint8_t slot_id);
+        /** @brief slot_id に遅らせたストリームのドアベルを 1 つ取り出す．無ければ false． */
+        bool TakeStream(uint8_t slot_id, uint8_t &dci, uint16_t &stream_id);
+
+    private:
+        static const size_t kMaxEntries = 16;
+        /** @brief UAS のキューの深さ分のコマンドのステータスとデータを 1 度に積めるだけ */
+        static const size_t kMaxStreamEntries = 64;
+        struct Entry
+        {
+            uint8_t slot_id;
+            uint32_t dcis;
+        };
+        std::array<Entry, kMaxEntries> entries_{};
+        size_t num_entries_ = 0;
+
+        struct StreamEntry
+        {
+            uint8_t slot_id;
+            uint8_t dci;
+            uint16_t stream_id;
+        };
+        std::array<StreamEntry, kMaxStreamEntries> stream_entries_{};
+        size_t num_stream_entries_ = 0;
+    };
+
     class Device : public usb::Device
     {
     public:
+        /** @brief 同時に発行しておけるバルク転送の TD の数（全エンドポイントの合計） */
+        static const size_t kMaxBulkTDs = 64;
+        /** @brief ストリームごとの Transfer Ring の 1 セグメントの TRB 数 */
+        static const size_t kStreamRingSegmentSize = 16;
+        /** @brief バルクエンドポイントに用意する Primary Stream Array の最大要素数（予約済みのストリーム 0 を含む）．
+         *
+         * UAS ではコマンドのタグ 1 つにストリーム 1 つを使うので，キューの深さの上限になる．
+         */
+        static const size_t kMaxStreams = 32;
+        /** @brief これより少なければストリームを使わない（xHC が受け付ける Primary Stream Array の最小の大きさ） */
+        static const size_t kMinStreams = 4;
+
         enum class State
         {
             kInvalid,
@@ -36,7 +102,8 @@ namespace usb::xhci
             int trb_transfer_length,
             TRB *issue_trb);
 
-        Device(uint8_t slot_id, DoorbellRegister *dbreg);
+        Device(uint8_t slot_id, DoorbellRegister *dbreg, DeviceManager *devmgr);
+        ~Device() override;
 
         Error Initialize();
 
@@ -49,8 +116,39 @@ namespace usb::xhci
         uint8_t SlotID() const { return slot_id_; }
 
         void SelectForSlotAssignment();
-        Ring *AllocTransferRing(DeviceContextIndex index, size_t buf_size);
+        /** @brief Transfer Ring を割り当てる．リングは転送を積むときに必要に応じて伸びる． */
+        Ring *AllocTransferRing(DeviceContextIndex index, size_t segment_size,
+                                size_t num_segments = 1);
+        /** @brief エンドポイントに num_streams 要素の Primary Stream Array と各ストリームのリングを割り当てる
+         *
+         * @return Stream Context の配列（Endpoint Context の TR Dequeue Pointer に設定する）．
+         *         メモリ不足なら nullptr．
+         */
+        StreamContext *AllocStreams(DeviceContextIndex index, size_t num_streams);
+
+        /** @brief エンドポイントの転送イベントを受け取るインタラプタを設定する
+         *
+         * 以降このエンドポイントに積む TRB の Interrupter Target に使われる．
+         */
+        void SetInterrupterTarget(DeviceContextIndex index, uint16_t interrupter)
+        {
+            interrupter_targets_[index.value - 1] = interrupter;
+        }
+        uint16_t InterrupterTarget(DeviceContextIndex index) const
+        {
+            return interrupter_targets_[index.value - 1];
+        }
+
+        /** @brief dcis（ビット位置 = dci）のドアベルを 1 回ずつ鳴らす．DeviceManager::Flush() が使う． */
+        void RingDoorbells(uint32_t dcis);
+        /** @brief ストリームのドアベルを鳴らす．DeviceManager::Flush() が使う． */
+        void RingStreamDoorbell(uint8_t dci, uint16_t stream_id);
+        void BeginTransferBatch() override;
+        void EndTransferBatch() override;
+        const DoorbellStat &Doorbells() const { return doorbell_stat_; }
 
+        using usb::Device::ControlIn;
+        using usb::Device::ControlOut;
         Error ControlIn(EndpointID ep_id, SetupData setup_data,
                         void *buf, int len, ClassDriver *issuer) override;
         Error ControlOut(EndpointID ep_id, SetupData setup_data,
@@ -58,8 +156,45 @@ namespace usb::xhci
         Error InterruptIn(EndpointID ep_id, void *buf, int len) override;
         Error InterruptOut(EndpointID ep_id, void *buf, int len) override;
 
+        using usb::Device::BulkIn;
+        using usb::Device::BulkOut;
+        Error BulkIn(EndpointID ep_id, const TransferBuffer *bufs, int num_bufs,
+                     uintptr_t cookie, uint16_t stream_id) override;
+        Error BulkOut(EndpointID ep_id, const TransferBuffer *bufs, int num_bufs,
+                      uintptr_t cookie, uint16_t stream_id) override;
+        size_t NumStreams(EndpointID ep_id) const override;
+        size_t StreamsFor(int max_streams) const override;
+        Error ResetEndpoint(EndpointID ep_id, uint16_t stream_id) override;
+
         Error OnTransferEventReceived(const TransferEventTRB &trb);
 
+        /** @brief 復旧を要求されていて，まだ始めていないエンドポイントの DCI．無ければ 0．
+         *
+         * 返したエンドポイントは復旧中になり，ドアベルを鳴らさなくなる．呼び出し元は
+         * Halted なら Reset Endpoint，そうでなければ Stop Endpoint を発行し，
+         * 完了したら NextDequeue() で残りの手順を進める．
+         */
+        uint8_t StartRecovery();
+        /** @brief 復旧中のエンドポイントで，次に xHC のデキューポインタを移すリング
+         *
+         * リングに残った TD を kTransferFailed で完了させ，Set TR Dequeue Pointer に渡す値を返す．
+         * 移すリングが残っていなければ false．
+         */
+        bool NextDequeue(uint8_t dci, uint16_t &stream_id, TRB *&dequeue, bool &cycle_state);
+        /** @brief Halted でないまま止めたので，データトグルを戻すためにエンドポイントを入れ直す必要がある
+         *
+         * Reset Endpoint は Halted のエンドポイントにしか使えないので，Configure Endpoint で
+         * 一旦外して加え直す．dequeue と cycle_state にはそのときの TR Dequeue Pointer を返す．
+         * ストリームを使うエンドポイントは対象にしない．
+         */
+        bool NeedsToggleReset(uint8_t dci, TRB *&dequeue, bool &cycle_state) const;
+        /** @brief 復旧を終え，その間に積まれた転送のドアベルを鳴らしてクラスドライバに知らせる */
+        void FinishRecovery(uint8_t dci);
+        /** @brief コマンドを発行できなかったときに，TD を取り消さずに復旧をやめる */
+        void AbortRecovery(uint8_t dci);
+        /** @brief xHC がエンドポイントを Halted にしているか */
+        bool IsHalted(uint8_t dci) const { return ctx_.ep_contexts[dci - 1].bits.ep_state == 2; }
+
     private:
         alignas(64) struct DeviceContext ctx_;
         alignas(64) struct InputContext input_ctx_;
@@ -68,7 +203,77 @@ namespace usb::xhci
         DoorbellRegister *const dbreg_;
 
         enum State state_;
-        std::array<Ring *, 31> transfer_rings_; // index = dci - 1
+        std::array<Ring *, 31> transfer_rings_{}; // index = dci - 1
+        std::array<uint16_t, 31> interrupter_targets_{}; // index = dci - 1
+
+        /** @brief ストリームを使うエンドポイントの Stream Context 配列とストリームごとのリング */
+        struct StreamArray
+        {
+            StreamContext *contexts;
+            Ring **rings; // index = stream ID（rings[0] は使わない）
+            size_t num;
+        };
+        std::array<StreamArray, 31> streams_{}; // index = dci - 1
+        void FreeStreams(DeviceContextIndex index);
+
+        /** @brief 発行済みで完了していないバルク転送の TD */
+        struct BulkTD
+        {
+            TRB *first; // nullptr なら空き
+            TRB *last;  // IOC を立てた TD 末尾の TRB
+            Ring *ring; // TD を積んだリング（ストリームを使うならストリームのリング）
+            uint64_t seq;
+            uintptr_t cookie;
+            int length;
+            uint8_t dci;
+        };
+        std::array<BulkTD, kMaxBulkTDs> bulk_tds_{};
+        uint64_t bulk_seq_ = 0;
+
+        Error PushBulkTD(EndpointID ep_id, const TransferBuffer *bufs, int num_bufs,
+                         uintptr_t cookie, uint16_t stream_id);
+        /** @brief issuer_trb を含むバルク転送の TD．無ければ nullptr．
+         *
+         * ストリームを使うとエンドポイント内の完了順は発行順にならないので，TRB の位置で探す．
+         * エンドポイントの復旧で取り消した TD のイベントが後から来た場合は nullptr になる．
+         * Short Packet で完了させた TD の末尾のイベントは，先に Ring::LateEvent() で読み捨てる．
+         */
+        BulkTD *FindBulkTD(uint8_t dci, const TRB *issuer_trb);
+        Error OnBulkTransferEvent(const TransferEventTRB &trb, BulkTD &td);
+        /** @brief ring に積んだ TD をすべて kTransferFailed で完了させる */
+        void FailBulkTDs(const Ring *ring);
+        /** @brief dci のリングのうち，trb のイベントを ExpectLateEvent() で待っているもの */
+        Ring *FindLateEventRing(uint8_t dci, const TRB *trb);
+
+        /** @brief 転送エラーや ResetEndpoint() によるエンドポイントの復旧の状態 */
+        struct Recovery
+        {
+            /** @brief 次に復旧するストリーム（ビット位置 = ストリーム ID．ビット 0 はエンドポイント全体） */
+            uint32_t requested;
+            /** @brief 復旧中のストリームと，そのうちデキューポインタをまだ移していないもの */
+            uint32_t round;
+            uint32_t streams;
+            bool active;
+            /** @brief 復旧を始めたときに Halted だった（Reset Endpoint でデータトグルも戻る） */
+            bool halted;
+            /** @brief ストリームを使わないリングで，xHC のデキューポインタを移した位置 */
+            TRB *dequeue;
+            bool cycle_state;
+        };
+        std::array<Recovery, 31> recovery_{}; // index = dci - 1
+        void RequestRecovery(uint8_t dci, uint32_t streams);
+        /** @brief 復旧を待つか復旧中で，ドアベルを鳴らしてはいけない */
+        bool IsRecovering(uint8_t dci) const
+        {
+            return recovery_[dci - 1].requested != 0 || recovery_[dci - 1].active;
+        }
+
+        /** @brief ドアベルを遅らせるバッチを登録している DeviceManager */
+        DeviceManager *const devmgr_;
+        DoorbellStat doorbell_stat_{};
+
+        /** @brief バッチの登録中ならそこへ遅らせ，それ以外は直ちにドアベルを鳴らす */
+        void RingDoorbell(DeviceContextIndex dci, uint16_t stream_id = 0);
 
         /** コントロール転送が完了した際に DataStageTRB や StatusStageTRB
      * から対応する SetupStageTRB を検索するためのマップ．
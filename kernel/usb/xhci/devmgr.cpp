@@ -11,15 +11,34 @@ namespace usb::xhci {
       return MAKE_ERROR(Error::kNoEnoughMemory);
     }
 
-    device_context_pointers_ = AllocArray<DeviceContext*>(max_slots_ + 1, 64, 4096);
+    device_context_pointers_ = AllocArray<DeviceContext*>(
+        max_slots_ + 1, 64, 4096, memstat::Tag::kUSBContext);
     if (device_context_pointers_ == nullptr) {
       FreeMem(devices_);
       return MAKE_ERROR(Error::kNoEnoughMemory);
     }
 
+    num_locations_ = 1;
+    while (num_locations_ < 2 * max_slots_) {
+      num_locations_ <<= 1;
+    }
+    locations_ = AllocArray<LocationEntry>(num_locations_, 0, 0);
+    slot_locations_ = AllocArray<uint32_t>(max_slots_ + 1, 0, 0);
+    if (locations_ == nullptr || slot_locations_ == nullptr) {
+      FreeMem(locations_);
+      FreeMem(slot_locations_);
+      FreeMem(device_context_pointers_);
+      FreeMem(devices_);
+      return MAKE_ERROR(Error::kNoEnoughMemory);
+    }
+
     for (size_t i = 0; i <= max_slots_; ++i) {
       devices_[i] = nullptr;
       device_context_pointers_[i] = nullptr;
+      slot_locations_[i] = 0;
+    }
+    for (size_t i = 0; i < num_locations_; ++i) {
+      locations_[i] = LocationEntry{0, 0};
     }
 
     return MAKE_ERROR(Error::kSuccess);
@@ -30,16 +49,48 @@ namespace usb::xhci {
   }
 
   Device* DeviceManager::FindByPort(uint8_t port_num, uint32_t route_string) const {
-    for (size_t i = 1; i <= max_slots_; ++i) {
-      auto dev = devices_[i];
-      if (dev == nullptr) continue;
-      if (dev->DeviceContext()->slot_context.bits.root_hub_port_num == port_num) {
-        return dev;
+    const uint32_t key = LocationKey(port_num, route_string);
+    // 表の半分以上は空いているので，探索は空きに当たってすぐ終わる
+    for (size_t i = LocationIndex(key); locations_[i].key != 0;
+         i = (i + 1) & (num_locations_ - 1)) {
+      if (locations_[i].key == key) {
+        return devices_[locations_[i].slot_id];
       }
     }
     return nullptr;
   }
 
+  void DeviceManager::AddLocation(uint32_t key, uint8_t slot_id) {
+    size_t i = LocationIndex(key);
+    while (locations_[i].key != 0 && locations_[i].key != key) {
+      i = (i + 1) & (num_locations_ - 1);
+    }
+    locations_[i] = LocationEntry{key, slot_id};
+  }
+
+  void DeviceManager::RemoveLocation(uint32_t key) {
+    size_t i = LocationIndex(key);
+    while (locations_[i].key != key) {
+      if (locations_[i].key == 0) {
+        return;
+      }
+      i = (i + 1) & (num_locations_ - 1);
+    }
+
+    // 墓標を残さないよう，後ろに続く要素のうち i より前に置けるものを詰める
+    for (size_t j = (i + 1) & (num_locations_ - 1); locations_[j].key != 0;
+         j = (j + 1) & (num_locations_ - 1)) {
+      const size_t home = LocationIndex(locations_[j].key);
+      // home が (i, j] の外（巡回）なら j の要素を i に移せる
+      const bool movable = i <= j ? (home <= i || j < home) : (home <= i && j < home);
+      if (movable) {
+        locations_[i] = locations_[j];
+        i = j;
+      }
+    }
+    locations_[i] = LocationEntry{0, 0};
+  }
+
   Device* DeviceManager::FindByState(enum Device::State state) const {
     for (size_t i = 1; i <= max_slots_; ++i) {
       auto dev = devices_[i];
@@ -67,7 +118,8 @@ namespace usb::xhci {
   }
   */
 
-  Error DeviceManager::AllocDevice(uint8_t slot_id, DoorbellRegister* dbreg) {
+  Error DeviceManager::AllocDevice(uint8_t slot_id, DoorbellRegister* dbreg,
+                                   uint8_t port_num, uint32_t route_string) {
     if (slot_id > max_slots_) {
       return MAKE_ERROR(Error::kInvalidSlotID);
     }
@@ -76,8 +128,17 @@ namespace usb::xhci {
       return MAKE_ERROR(Error::kAlreadyAllocated);
     }
 
-    devices_[slot_id] = AllocArray<Device>(1, 64, 4096);
-    new(devices_[slot_id]) Device(slot_id, dbreg);
+    devices_[slot_id] = AllocArray<Device>(1, 64, 4096,
+                                          memstat::Tag::kUSBDevice);
+    if (devices_[slot_id] == nullptr) {
+      return MAKE_ERROR(Error::kNoEnoughMemory);
+    }
+    new(devices_[slot_id]) Device(slot_id, dbreg, this);
+
+    // 同じ位置に古いデバイスが残っていたら，新しいデバイスで上書きする
+    const uint32_t key = LocationKey(port_num, route_string);
+    AddLocation(key, slot_id);
+    slot_locations_[slot_id] = key;
     return MAKE_ERROR(Error::kSuccess);
   }
 
@@ -92,9 +153,71 @@ namespace usb::xhci {
   }
 
   Error DeviceManager::Remove(uint8_t slot_id) {
+    if (slot_id > max_slots_) {
+      return MAKE_ERROR(Error::kInvalidSlotID);
+    }
+
     device_context_pointers_[slot_id] = nullptr;
-    FreeMem(devices_[slot_id]);
+    if (slot_locations_[slot_id] != 0) {
+      // 上書き済みなら別のスロットを指しているので消さない
+      if (FindByPort(slot_locations_[slot_id] >> 20, slot_locations_[slot_id] & 0xfffffu)
+          == devices_[slot_id]) {
+        RemoveLocation(slot_locations_[slot_id]);
+      }
+      slot_locations_[slot_id] = 0;
+    }
+    if (auto dev = devices_[slot_id]) {
+      // クラスドライバの利用者が Device を指したまま残らないよう，破棄する前に知らせる
+      dev->OnRemoved();
+      dev->~Device();
+      FreeMem(dev);
+    }
     devices_[slot_id] = nullptr;
     return MAKE_ERROR(Error::kSuccess);
   }
+
+  void DeviceManager::Flush(DoorbellBatch& batch) {
+    // 遅らせた後に取り外されたスロットの分は捨てる
+    for (size_t i = 1; i <= max_slots_; ++i) {
+      // UAS はストリームにステータスとデータを積んでからコマンドを送るので，ストリームを先に鳴らす
+      uint8_t dci;
+      uint16_t stream_id;
+      while (batch.TakeStream(i, dci, stream_id)) {
+        if (auto dev = devices_[i]) {
+          dev->RingStreamDoorbell(dci, stream_id);
+        }
+      }
+      const uint32_t dcis = batch.Take(i);
+      if (auto dev = devices_[i]; dev && dcis) {
+        dev->RingDoorbells(dcis);
+      }
+    }
+  }
+
+  void DeviceManager::BeginBatch() {
+    if (batch_depth_++ == 0 && batch_ == nullptr) {
+      batch_ = &scoped_batch_;
+      owns_batch_ = true;
+    }
+  }
+
+  void DeviceManager::EndBatch() {
+    if (--batch_depth_ > 0 || !owns_batch_) {
+      return;
+    }
+    batch_ = nullptr;
+    owns_batch_ = false;
+    Flush(scoped_batch_);
+  }
+
+  DoorbellStat DeviceManager::Doorbells() const {
+    DoorbellStat sum{};
+    for (size_t i = 1; i <= max_slots_; ++i) {
+      if (auto dev = devices_[i]) {
+        sum.requests += dev->Doorbells().requests;
+        sum.writes += dev->Doorbells().writes;
+      }
+    }
+    return sum;
+  }
 }
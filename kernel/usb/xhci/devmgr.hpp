@@ -15,20 +15,52 @@
 
 namespace usb::xhci
 {
+    /** @brief スロットとデバイスの対応を管理するクラス
+     *
+     * 複数の CPU のイベント処理から参照されるので，Controller::StateLock() を保持して使う．
+     */
     class DeviceManager
     {
 
     public:
         Error Initialize(size_t max_slots);
         DeviceContext **DeviceContexts() const;
+        size_t MaxSlots() const { return max_slots_; }
+        /** @brief 接続位置（ルートハブのポート番号と Route String）からデバイスを引く．O(1)． */
         Device *FindByPort(uint8_t port_num, uint32_t route_string) const;
         Device *FindByState(enum Device::State state) const;
         Device *FindBySlot(uint8_t slot_id) const;
         //WithError<Device*> Get(uint8_t device_id) const;
-        Error AllocDevice(uint8_t slot_id, DoorbellRegister *dbreg);
+        /** @brief スロットにデバイスを確保し，接続位置を登録する */
+        Error AllocDevice(uint8_t slot_id, DoorbellRegister *dbreg,
+                          uint8_t port_num, uint32_t route_string);
         Error LoadDCBAA(uint8_t slot_id);
+        /** @brief スロットのデバイスを破棄する．先にクラスドライバへ取り外しを知らせる． */
         Error Remove(uint8_t slot_id);
 
+        /** @brief 以後のドアベルを batch に遅らせる．nullptr で登録をやめる．
+         *
+         * 登録は Controller::StateLock() を持っている間だけ有効にし，ロックを手放す前に nullptr に戻すこと．
+         */
+        void SetBatch(DoorbellBatch *batch) { batch_ = batch; }
+        /** @brief batch に遅らせたドアベルを，エンドポイント（ストリーム）ごとに 1 回ずつ鳴らす */
+        void Flush(DoorbellBatch &batch);
+        /** @brief 登録中のバッチ．無ければ nullptr． */
+        DoorbellBatch *Batch() const { return batch_; }
+        /** @brief イベント処理の外でドアベルをまとめる区間を始める．入れ子にできる．
+         *
+         * バッチが登録されていなければ自前のバッチを登録し，対応する EndBatch() で鳴らす．
+         * DrainEvents() の中（既に登録済み）なら何もせず，そのバッチに任せる．
+         * 区間の全体で Controller::StateLock() を持っていること．
+         */
+        void BeginBatch();
+        void EndBatch();
+        /** @brief xHC が 1 つのエンドポイントに持てる Primary Stream Array の要素数（0 ならストリームを使えない） */
+        void SetMaxStreams(size_t max_streams) { max_streams_ = max_streams; }
+        size_t MaxStreams() const { return max_streams_; }
+        /** @brief 接続中の全デバイスのドアベル統計の合計 */
+        DoorbellStat Doorbells() const;
+
     private:
         // device_context_pointers_ can be used as DCBAAP's value.
         // The number of elements is max_slots_ + 1.
@@ -37,5 +69,37 @@ namespace usb::xhci
 
         // The number of elements is max_slots_ + 1.
         Device **devices_;
+
+        size_t max_streams_ = 0;
+
+        DoorbellBatch *batch_ = nullptr;
+        /** @brief BeginBatch() で登録する自前のバッチと，区間の入れ子の深さ */
+        DoorbellBatch scoped_batch_;
+        int batch_depth_ = 0;
+        bool owns_batch_ = false;
+
+        /** @brief 接続位置からスロット番号を引くハッシュ表（線形探索法）．key が 0 なら空き． */
+        struct LocationEntry
+        {
+            uint32_t key;
+            uint8_t slot_id;
+        };
+        LocationEntry *locations_;
+        /** @brief locations_ の要素数．2 の冪で，max_slots_ の 2 倍以上． */
+        size_t num_locations_;
+        /** @brief スロットごとに登録した key．要素数は max_slots_ + 1． */
+        uint32_t *slot_locations_;
+
+        static uint32_t LocationKey(uint8_t port_num, uint32_t route_string)
+        {
+            // ポート番号は 1 以上なので key は 0 にならない
+            return static_cast<uint32_t>(port_num) << 20 | (route_string & 0xfffffu);
+        }
+        size_t LocationIndex(uint32_t key) const
+        {
+            return (key * 2654435761u) & (num_locations_ - 1);
+        }
+        void AddLocation(uint32_t key, uint8_t slot_id);
+        void RemoveLocation(uint32_t key);
     };
 }
@@ -0,0 +1,54 @@
+#include "usb/xhci/latency.hpp"
+
+namespace {
+  int BucketIndex(uint64_t cycles) {
+    if (cycles < usb::xhci::LatencyHistogram::kSubBuckets) {
+      return cycles;
+    }
+    const int msb = 63 - __builtin_clzll(cycles);
+    const int sub = (cycles >> (msb - 2)) & 3u;
+    return msb * usb::xhci::LatencyHistogram::kSubBuckets + sub;
+  }
+
+  uint64_t BucketUpperBound(int index) {
+    if (index < usb::xhci::LatencyHistogram::kSubBuckets) {
+      return index;
+    }
+    const int msb = index / usb::xhci::LatencyHistogram::kSubBuckets;
+    const uint64_t sub = index % usb::xhci::LatencyHistogram::kSubBuckets;
+    return (((uint64_t{4} | sub) + 1) << (msb - 2)) - 1;
+  }
+}
+
+namespace usb::xhci {
+  void LatencyHistogram::Record(uint64_t cycles) {
+    ++buckets_[BucketIndex(cycles)];
+    ++count_;
+    if (cycles > max_) {
+      max_ = cycles;
+    }
+  }
+
+  void LatencyHistogram::Reset() {
+    buckets_.fill(0);
+    count_ = 0;
+    max_ = 0;
+  }
+
+  uint64_t LatencyHistogram::Percentile(unsigned int permille) const {
+    if (count_ == 0) {
+      return 0;
+    }
+    // 切り上げで順位を求める（p100 は最大値のバケット）
+    const uint64_t rank = (count_ * permille + 999) / 1000;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets_.size(); ++i) {
+      seen += buckets_[i];
+      if (seen >= rank && seen > 0) {
+        const uint64_t upper = BucketUpperBound(i);
+        return upper < max_ ? upper : max_;
+      }
+    }
+    return max_;
+  }
+}
@@ -0,0 +1,37 @@
+/**
+ * @file usb/xhci/latency.hpp
+ *
+ * イベント処理の遅延を記録するヒストグラム．
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+namespace usb::xhci
+{
+    /** @brief TSC のカウント数で表した遅延の分布
+     *
+     * 2 の冪ごとの区間をさらに 4 等分したバケットに数える．
+     * 百分位数の誤差は 25% 以内．記録は 1 つの CPU からのみ行うこと．
+     */
+    class LatencyHistogram
+    {
+    public:
+        static const int kSubBuckets = 4;
+
+        void Record(uint64_t cycles);
+        void Reset();
+
+        uint64_t Count() const { return count_; }
+        uint64_t Max() const { return max_; }
+        /** @brief 下から permille / 1000 の位置にある値（が属するバケットの上端） */
+        uint64_t Percentile(unsigned int permille) const;
+
+    private:
+        std::array<uint64_t, 64 * kSubBuckets> buckets_{};
+        uint64_t count_ = 0;
+        uint64_t max_ = 0;
+    };
+}
@@ -0,0 +1,88 @@
+#include "usb/xhci/moderation.hpp"
+
+#include <algorithm>
+
+#include "timer.hpp"
+
+namespace usb::xhci {
+  void Moderator::Initialize(InterrupterRegisterSet* interrupter,
+                             const ModerationConfig& config) {
+    interrupter_ = interrupter;
+    stat_ = ModerationStat{};
+    Configure(config);
+  }
+
+  void Moderator::Configure(const ModerationConfig& config) {
+    config_ = config;
+    if (config_.max_interval < config_.min_interval) {
+      config_.max_interval = config_.min_interval;
+    }
+    uint16_t interval = config_.interval;
+    if (config_.adaptive) {
+      interval = std::clamp(interval, config_.min_interval, config_.max_interval);
+    }
+    window_tick_ = CurrentTick();
+    window_events_ = 0;
+    WriteInterval(interval);
+  }
+
+  void Moderator::OnEventsProcessed(uint64_t num_events) {
+    ++stat_.interrupts;
+    stat_.events += num_events;
+    if (num_events == 0) {
+      ++stat_.empty_interrupts;
+    }
+    if (!config_.adaptive) {
+      return;
+    }
+
+    const uint64_t now = CurrentTick();
+    if (now == window_tick_) {
+      window_events_ += num_events;
+      return;
+    }
+
+    uint16_t interval = stat_.interval;
+    if (now - window_tick_ > 1) {
+      // 1 tick 以上イベントが無かった．次の入力をすぐ届けられるよう間隔を戻す
+      interval = config_.min_interval;
+    } else if (window_events_ > kHighEventsPerTick) {
+      interval = interval == 0 ? kFirstStep : std::min<uint32_t>(interval * 2u, 0xffffu);
+    } else if (window_events_ < kLowEventsPerTick) {
+      interval = interval <= kFirstStep ? 0 : interval / 2;
+    }
+    interval = std::clamp(interval, config_.min_interval, config_.max_interval);
+
+    if (interval != stat_.interval) {
+      ++stat_.interval_changes;
+      WriteInterval(interval);
+    }
+    window_tick_ = now;
+    window_events_ = num_events;
+  }
+
+  void Moderator::WriteInterval(uint16_t interval) {
+    stat_.interval = interval;
+    if (interrupter_ == nullptr) {
+      return;
+    }
+    auto imod = interrupter_->IMOD.Read();
+    imod.bits.interrupt_moderation_interval = interval;
+    imod.bits.interrupt_moderation_counter = 0;
+    interrupter_->IMOD.Write(imod);
+  }
+
+  void LogModerationStat(LogLevel level, uint16_t interrupter,
+                         const Moderator& moderator) {
+    const auto& stat = moderator.Stat();
+    // 割り込み 1 回あたりのイベント数を 1/100 単位で出す
+    const uint64_t events_per_100 =
+      stat.interrupts ? stat.events * 100 / stat.interrupts : 0;
+    Log(level, "interrupter %u: %lu interrupts, %lu events (%lu.%02lu/irq), "
+        "%lu empty, IMOD %u x 250ns (%s, %lu changes)\n",
+        interrupter, stat.interrupts, stat.events,
+        events_per_100 / 100, events_per_100 % 100, stat.empty_interrupts,
+        stat.interval, moderator.Config().adaptive ? "adaptive" : "fixed",
+        stat.interval_changes);
+  }
+}
@@ -0,0 +1,83 @@
+/**
+ * @file usb/xhci/moderation.hpp
+ *
+ * インタラプタの割り込みモデレーション（IMOD）の制御と統計．
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "logger.hpp"
+#include "usb/xhci/registers.hpp"
+
+namespace usb::xhci
+{
+    /** @brief IMOD の設定．間隔の単位は 250 ns． */
+    struct ModerationConfig
+    {
+        /** @brief 真ならイベントの頻度に応じて間隔を min_interval と max_interval の間で変える */
+        bool adaptive;
+        /** @brief 固定モードの間隔，および適応モードの初期値 */
+        uint16_t interval;
+        uint16_t min_interval;
+        uint16_t max_interval;
+    };
+
+    /** @brief 既定値．アイドル時はモデレーションなし，高負荷時は最大 1 ms（IMOD のリセット値）． */
+    const ModerationConfig kDefaultModerationConfig{true, 0, 0, 4000};
+
+    /** @brief インタラプタごとの割り込みとイベントの数 */
+    struct ModerationStat
+    {
+        /** @brief イベント処理の呼び出し回数（割り込み 1 回につき 1 回） */
+        uint64_t interrupts;
+        uint64_t events;
+        /** @brief イベントが 1 つも無かった割り込みの数 */
+        uint64_t empty_interrupts;
+        /** @brief 適応モードで間隔を変えた回数 */
+        uint64_t interval_changes;
+        /** @brief 現在 IMOD に設定している間隔 */
+        uint16_t interval;
+    };
+
+    /** @brief 1 つのインタラプタの IMOD を管理するクラス
+     *
+     * 適応モードでは Local APIC タイマの 1 tick（10 ms）ごとにイベント数を数え，
+     * 多ければ間隔を倍に，少なければ半分にする．1 tick 以上イベントが途絶えたら
+     * 入力の遅延を抑えるため直ちに min_interval に戻す．
+     */
+    class Moderator
+    {
+    public:
+        /** @brief 1 tick あたりのイベント数がこれを超えたら間隔を広げる */
+        static const uint64_t kHighEventsPerTick = 64;
+        /** @brief 1 tick あたりのイベント数がこれを下回ったら間隔を狭める */
+        static const uint64_t kLowEventsPerTick = 16;
+        /** @brief 間隔 0 から広げるときの最初の値（62.5 us） */
+        static const uint16_t kFirstStep = 250;
+
+        void Initialize(InterrupterRegisterSet *interrupter, const ModerationConfig &config);
+        void Configure(const ModerationConfig &config);
+
+        /** @brief 1 回の割り込みで num_events 個のイベントを処理したことを記録する */
+        void OnEventsProcessed(uint64_t num_events);
+
+        const ModerationStat &Stat() const { return stat_; }
+        const ModerationConfig &Config() const { return config_; }
+
+    private:
+        InterrupterRegisterSet *interrupter_ = nullptr;
+        ModerationConfig config_ = kDefaultModerationConfig;
+        ModerationStat stat_{};
+
+        /** @brief 現在数えている tick と，その間のイベント数 */
+        uint64_t window_tick_ = 0;
+        uint64_t window_events_ = 0;
+
+        void WriteInterval(uint16_t interval);
+    };
+
+    /** @brief 統計を 1 行でログに出す */
+    void LogModerationStat(LogLevel level, uint16_t interrupter, const Moderator &moderator);
+}
@@ -0,0 +1,146 @@
+#include "usb/xhci/poller.hpp"
+
+#include "timer.hpp"
+#include "usb/xhci/xhci.hpp"
+
+namespace {
+  uint64_t CyclesToNanoseconds(uint64_t cycles) {
+    return cycles * 1000 / TSCPerMicrosecond();
+  }
+}
+
+namespace usb::xhci {
+  const char* PolicyName(EventPolicy policy) {
+    switch (policy) {
+    case EventPolicy::kInterrupt: return "interrupt";
+    case EventPolicy::kHybrid:    return "hybrid";
+    case EventPolicy::kBusyPoll:  return "busy-poll";
+    }
+    return "unknown";
+  }
+
+  void EventPoller::Initialize(Controller& xhc, uint16_t interrupter,
+                               const PollerConfig& config) {
+    xhc_ = &xhc;
+    interrupter_ = interrupter;
+    config_ = config;
+    if (config_.budget == 0) {
+      config_.budget = 1;
+    }
+    polling_ = false;
+    ResetLatency();
+    SetPolicy(config_.policy);
+  }
+
+  void EventPoller::SetPolicy(EventPolicy policy) {
+    config_.policy = policy;
+    polling_ = false;
+    last_check_tsc_ = __builtin_ia32_rdtsc();
+    xhc_->SetInterrupterEnabled(interrupter_, policy != EventPolicy::kBusyPoll);
+  }
+
+  bool EventPoller::OnInterrupt(uint64_t irq_tsc) {
+    switch (config_.policy) {
+    case EventPolicy::kInterrupt: {
+      last_check_tsc_ = irq_tsc;
+      const size_t n = PollOnce(SIZE_MAX);
+      xhc_->ModeratorAt(interrupter_).OnEventsProcessed(n);
+      return false;
+    }
+    case EventPolicy::kHybrid: {
+      if (polling_) {
+        return Poll();
+      }
+      // 以降のイベントはポーリングで拾うので割り込みを止める
+      xhc_->SetInterrupterEnabled(interrupter_, false);
+      polling_ = true;
+      last_check_tsc_ = irq_tsc;
+      const uint64_t handled = handled_events_;
+      const bool more = Poll();
+      xhc_->ModeratorAt(interrupter_).OnEventsProcessed(handled_events_ - handled);
+      return more;
+    }
+    case EventPolicy::kBusyPoll:
+      return false; // 専用 CPU が処理する
+    }
+    return false;
+  }
+
+  bool EventPoller::Poll() {
+    if (!polling_) {
+      return false;
+    }
+
+    const uint64_t idle_cycles = config_.idle_timeout_us * TSCPerMicrosecond();
+    size_t budget = config_.budget;
+    uint64_t idle_since = __builtin_ia32_rdtsc();
+    while (budget > 0) {
+      const size_t n = PollOnce(budget);
+      budget -= n;
+      if (n > 0) {
+        idle_since = last_check_tsc_;
+        continue;
+      }
+      if (last_check_tsc_ - idle_since >= idle_cycles) {
+        xhc_->SetInterrupterEnabled(interrupter_, true);
+        polling_ = false;
+        // マスクを解除する直前に届いたイベントを取りこぼさないよう，もう 1 度見る
+        PollOnce(config_.budget);
+        return false;
+      }
+      __asm__("pause");
+    }
+    return true;
+  }
+
+  void EventPoller::DeferInterrupt(uint64_t irq_tsc) {
+    if (config_.policy != EventPolicy::kHybrid || polling_) {
+      return;
+    }
+    xhc_->SetInterrupterEnabled(interrupter_, false);
+    polling_ = true;
+    last_check_tsc_ = irq_tsc;
+  }
+
+  void EventPoller::RunPolling() {
+    const uint64_t handled = handled_events_;
+    while (Poll());
+    xhc_->ModeratorAt(interrupter_).OnEventsProcessed(handled_events_ - handled);
+  }
+
+  size_t EventPoller::BusyPoll() {
+    return PollOnce(config_.budget);
+  }
+
+  size_t EventPoller::PollOnce(size_t max_events) {
+    auto& latency = latency_[static_cast<int>(config_.policy)];
+    const uint64_t origin = last_check_tsc_;
+    last_check_tsc_ = __builtin_ia32_rdtsc();
+    const size_t n = DrainEvents(*xhc_, interrupter_, max_events, &latency, origin);
+    handled_events_ += n;
+    return n;
+  }
+
+  void EventPoller::ResetLatency() {
+    for (auto& histogram : latency_) {
+      histogram.Reset();
+    }
+  }
+
+  void EventPoller::LogLatency(LogLevel level) const {
+    for (int i = 0; i < static_cast<int>(latency_.size()); ++i) {
+      const auto& histogram = latency_[i];
+      if (histogram.Count() == 0) {
+        continue;
+      }
+      Log(level, "interrupter %u %s: %lu events, latency ns p50 %lu p90 %lu "
+          "p99 %lu p99.9 %lu max %lu\n",
+          interrupter_, PolicyName(static_cast<EventPolicy>(i)), histogram.Count(),
+          CyclesToNanoseconds(histogram.Percentile(500)),
+          CyclesToNanoseconds(histogram.Percentile(900)),
+          CyclesToNanoseconds(histogram.Percentile(990)),
+          CyclesToNanoseconds(histogram.Percentile(999)),
+          CyclesToNanoseconds(histogram.Max()));
+    }
+  }
+}
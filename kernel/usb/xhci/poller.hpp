@@ -0,0 +1,108 @@
+/**
+ * @file usb/xhci/poller.hpp
+ *
+ * イベントリングを割り込み，割り込み＋ポーリング，専用コアでのビジーポーリングの
+ * いずれかの方針で処理する仕組み．
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "logger.hpp"
+#include "usb/xhci/latency.hpp"
+
+namespace usb::xhci
+{
+    class Controller;
+
+    enum class EventPolicy
+    {
+        /** @brief 割り込みごとに溜まったイベントを処理する */
+        kInterrupt,
+        /** @brief 割り込みを受けたらインタラプタをマスクし，イベントが途絶えるまでポーリングする */
+        kHybrid,
+        /** @brief インタラプタを常にマスクし，専用の CPU がポーリングし続ける */
+        kBusyPoll,
+    };
+
+    const char *PolicyName(EventPolicy policy);
+
+    struct PollerConfig
+    {
+        EventPolicy policy;
+        /** @brief kHybrid で 1 回の呼び出しで処理するイベント数の上限．使い切ったら呼び出し側に戻る． */
+        size_t budget;
+        /** @brief kHybrid でイベントが途絶えてから割り込みに戻るまでの時間 */
+        uint64_t idle_timeout_us;
+    };
+
+    const PollerConfig kDefaultPollerConfig{EventPolicy::kInterrupt, 64, 50};
+
+    /** @brief 1 つのインタラプタのイベントリングを方針に従って処理するクラス
+     *
+     * 遅延はイベントに最初に気付けた時刻（割り込みの受信，またはリングを前回確認した時刻）から
+     * そのイベントのハンドラを呼ぶまでの時間として，方針ごとのヒストグラムに記録する．
+     */
+    class EventPoller
+    {
+    public:
+        void Initialize(Controller &xhc, uint16_t interrupter, const PollerConfig &config);
+
+        /** @brief 方針を変える．kBusyPoll への切り替えは，専用 CPU で BusyPoll() を
+         * 呼び続ける準備ができてから行うこと．
+         */
+        void SetPolicy(EventPolicy policy);
+        EventPolicy Policy() const { return config_.policy; }
+
+        /** @brief インタラプタの割り込みを受けたら呼ぶ
+         *
+         * @param irq_tsc  割り込みを受けた時刻（TSC）
+         * @return 予算を使い切ってまだポーリングを続けるなら true．
+         *         割り込みはマスクしたままなので，後で Poll() を呼ぶこと．
+         */
+        bool OnInterrupt(uint64_t irq_tsc);
+
+        /** @brief kHybrid のポーリングを続ける．戻り値は OnInterrupt() と同じ． */
+        bool Poll();
+
+        /** @brief kHybrid の割り込みを，イベントを処理せずにインタラプタをマスクして受け付ける
+         *
+         * 割り込みハンドラの中でポーリングしないためのもの．この後，割り込みの外で
+         * RunPolling() を呼ぶこと．
+         */
+        void DeferInterrupt(uint64_t irq_tsc);
+        /** @brief DeferInterrupt() の後，イベントが途絶えて割り込みに戻るまでポーリングする */
+        void RunPolling();
+        bool IsPolling() const { return polling_; }
+
+        /** @brief kBusyPoll のとき専用 CPU から繰り返し呼ぶ．イベントを 1 バッチ処理する． */
+        size_t BusyPoll();
+
+        const LatencyHistogram &Latency(EventPolicy policy) const
+        {
+            return latency_[static_cast<int>(policy)];
+        }
+        void ResetLatency();
+
+        /** @brief 方針ごとの遅延の百分位数（ナノ秒）をログに出す */
+        void LogLatency(LogLevel level) const;
+
+    private:
+        Controller *xhc_ = nullptr;
+        uint16_t interrupter_ = 0;
+        PollerConfig config_ = kDefaultPollerConfig;
+        std::array<LatencyHistogram, 3> latency_;
+
+        bool polling_ = false;
+        /** @brief リングを最後に確認した時刻．次に見つけたイベントの遅延の起点になる． */
+        uint64_t last_check_tsc_ = 0;
+        /** @brief これまでに処理したイベントの総数 */
+        uint64_t handled_events_ = 0;
+
+        /** @brief 高々 max_events 個のイベントを処理し，last_check_tsc_ を更新する */
+        size_t PollOnce(size_t max_events);
+    };
+}
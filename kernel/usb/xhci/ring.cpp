@@ -1,90 +1,234 @@
 #include "usb/xhci/ring.hpp"
 
+#include "logger.hpp"
 #include "usb/memory.hpp"
 
 namespace usb::xhci {
   Ring::~Ring() {
-    if (buf_ != nullptr) {
-      FreeMem(buf_);
+    FreeSegments();
+  }
+
+  void Ring::FreeSegments() {
+    for (auto& segment : segments_) {
+      FreeMem(segment);
+      segment = nullptr;
     }
+    num_segments_ = 0;
   }
 
-  Error Ring::Initialize(size_t buf_size) {
-    if (buf_ != nullptr) {
-      FreeMem(buf_);
+  Error Ring::Initialize(size_t segment_size, size_t num_segments) {
+    if (segment_size < 2 || num_segments == 0 || kMaxSegments < num_segments) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
     }
+    FreeSegments();
 
     cycle_bit_ = true;
+    segment_size_ = segment_size;
+    enqueue_segment_ = 0;
     write_index_ = 0;
-    buf_size_ = buf_size;
+    dequeue_segment_ = 0;
+    dequeue_index_ = 0;
+    used_ = 0;
+    late_event_ = nullptr;
 
-    buf_ = AllocArray<TRB>(buf_size_, 64, 64 * 1024);
-    if (buf_ == nullptr) {
-      return MAKE_ERROR(Error::kNoEnoughMemory);
+    return Grow(num_segments);
+  }
+
+  Error Ring::Grow(size_t num_segments) {
+    if (num_segments_ + num_segments > kMaxSegments) {
+      return MAKE_ERROR(Error::kFull);
     }
-    memset(buf_, 0, buf_size_ * sizeof(TRB));
 
+    // 書き込み中のセグメントの直後に挿入する．そのセグメントの Link TRB は
+    // 書き込みがセグメント末尾に達したときに初めて書くので，xHC はまだ新しい
+    // セグメントに到達できない．
+    const size_t base = num_segments_ == 0 ? 0 : enqueue_segment_ + 1;
+    for (size_t i = 0; i < num_segments; ++i) {
+      auto segment = AllocArray<TRB>(segment_size_, 64, 64 * 1024,
+                                     memstat::Tag::kUSBRing);
+      if (segment == nullptr) {
+        return MAKE_ERROR(Error::kNoEnoughMemory);
+      }
+      memset(segment, 0, segment_size_ * sizeof(TRB));
+      // プロデューサがここに来るまで xHC から未処理の TRB に見えないよう，
+      // cycle bit を現在のプロデューサ・サイクル・ステートと逆にしておく
+      if (!cycle_bit_) {
+        for (size_t j = 0; j < segment_size_; ++j) {
+          segment[j].bits.cycle_bit = 1;
+        }
+      }
+
+      const size_t pos = base + i;
+      for (size_t j = num_segments_; j > pos; --j) {
+        segments_[j] = segments_[j - 1];
+      }
+      segments_[pos] = segment;
+      if (num_segments_ > 0 && dequeue_segment_ >= pos) {
+        ++dequeue_segment_;
+      }
+      ++num_segments_;
+    }
+
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error Ring::Reserve(size_t num_trbs) {
+    while (FreeSlots() < num_trbs) {
+      const size_t free_slots = FreeSlots();
+      if (auto err = Grow(1)) {
+        return err;
+      }
+      if (FreeSlots() == free_slots) {
+        // xHC が書き込み中のセグメントの古い Link TRB の先にいる間は，
+        // 新しいセグメントはその Link TRB を書き直すまで使えない
+        return MAKE_ERROR(Error::kFull);
+      }
+      Log(kDebug, "Ring %p grew to %lu segments\n", Buffer(), num_segments_);
+    }
     return MAKE_ERROR(Error::kSuccess);
   }
 
+  size_t Ring::FreeSlots() const {
+    // xHC が書き込み中のセグメントの先の方にいるなら，そこまでしか書けない
+    if (dequeue_segment_ == enqueue_segment_ && dequeue_index_ > write_index_) {
+      return dequeue_index_ - write_index_;
+    }
+    return Capacity() - used_;
+  }
+
+  size_t Ring::NextSegment(size_t segment) const {
+    auto link = TRBDynamicCast<LinkTRB>(&segments_[segment][segment_size_ - 1]);
+    if (link != nullptr) {
+      for (size_t i = 0; i < num_segments_; ++i) {
+        if (segments_[i] == link->Pointer()) {
+          return i;
+        }
+      }
+    }
+    return (segment + 1) % num_segments_;
+  }
+
+  Error Ring::OnCompleted(const TRB* trb) {
+    // xHC が実際に辿った Link TRB に沿って進む．Grow() の直後でも正しく数えられる．
+    size_t segment = dequeue_segment_;
+    size_t index = dequeue_index_;
+    for (size_t n = 1; n <= used_; ++n) {
+      const bool found = &segments_[segment][index] == trb;
+      ++index;
+      if (index == segment_size_ - 1) {
+        segment = NextSegment(segment);
+        index = 0;
+      }
+      if (found) {
+        dequeue_segment_ = segment;
+        dequeue_index_ = index;
+        used_ -= n;
+        return MAKE_ERROR(Error::kSuccess);
+      }
+    }
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+
+  void Ring::DiscardPending() {
+    dequeue_segment_ = enqueue_segment_;
+    dequeue_index_ = write_index_;
+    used_ = 0;
+    late_event_ = nullptr;
+  }
+
   void Ring::CopyToLast(const std::array<uint32_t, 4>& data) {
+    auto& dst = segments_[enqueue_segment_][write_index_];
     for (int i = 0; i < 3; ++i) {
       // data[0..2] must be written prior to data[3].
-      buf_[write_index_].data[i] = data[i];
+      dst.data[i] = data[i];
     }
-    buf_[write_index_].data[3]
-      = (data[3] & 0xfffffffeu) | static_cast<uint32_t>(cycle_bit_);
+    dst.data[3] = (data[3] & 0xfffffffeu) | static_cast<uint32_t>(cycle_bit_);
   }
 
   TRB* Ring::Push(const std::array<uint32_t, 4>& data) {
-    auto trb_ptr = &buf_[write_index_];
+    if (FreeSlots() == 0) {
+      return nullptr;
+    }
+
+    auto trb_ptr = &segments_[enqueue_segment_][write_index_];
     CopyToLast(data);
+    ++used_;
 
     ++write_index_;
-    if (write_index_ == buf_size_ - 1) {
-      LinkTRB link{buf_};
-      link.bits.toggle_cycle = true;
+    if (write_index_ == segment_size_ - 1) {
+      const size_t next = (enqueue_segment_ + 1) % num_segments_;
+      LinkTRB link{segments_[next]};
+      link.bits.toggle_cycle = next == 0;
+      // TD の途中でセグメントをまたぐときは Link TRB にも Chain bit を立てる
+      link.bits.chain_bit = (data[3] >> 4) & 1u;
       CopyToLast(link.data);
 
+      enqueue_segment_ = next;
       write_index_ = 0;
-      cycle_bit_ = !cycle_bit_;
+      if (next == 0) {
+        cycle_bit_ = !cycle_bit_;
+      }
     }
 
     return trb_ptr;
   }
 
-  Error EventRing::Initialize(size_t buf_size,
+  EventRing::~EventRing() {
+    FreeSegments();
+  }
+
+  void EventRing::FreeSegments() {
+    for (size_t i = 0; i < num_segments_; ++i) {
+      FreeMem(Segment(i));
+    }
+    FreeMem(erst_);
+    erst_ = nullptr;
+    num_segments_ = 0;
+  }
+
+  Error EventRing::Initialize(size_t segment_size, size_t num_segments, size_t max_segments,
                               InterrupterRegisterSet* interrupter) {
-    if (buf_ != nullptr) {
-      FreeMem(buf_);
+    // ERST の Ring Segment Size は 16 以上 4096 以下，ERST の要素数は ERST Max 以下
+    if (segment_size < 16 || 4096 < segment_size ||
+        num_segments == 0 || max_segments < num_segments) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
     }
+    FreeSegments();
 
     cycle_bit_ = true;
-    buf_size_ = buf_size;
+    segment_size_ = segment_size;
+    segment_index_ = 0;
     interrupter_ = interrupter;
 
-    buf_ = AllocArray<TRB>(buf_size_, 64, 64 * 1024);
-    if (buf_ == nullptr) {
-      return MAKE_ERROR(Error::kNoEnoughMemory);
-    }
-    memset(buf_, 0, buf_size_ * sizeof(TRB));
-
-    erst_ = AllocArray<EventRingSegmentTableEntry>(1, 64, 64 * 1024);
+    erst_ = AllocArray<EventRingSegmentTableEntry>(
+        num_segments, 64, 64 * 1024, memstat::Tag::kUSBRing);
     if (erst_ == nullptr) {
-      FreeMem(buf_);
       return MAKE_ERROR(Error::kNoEnoughMemory);
     }
-    memset(erst_, 0, 1 * sizeof(EventRingSegmentTableEntry));
+    memset(erst_, 0, num_segments * sizeof(EventRingSegmentTableEntry));
 
-    erst_[0].bits.ring_segment_base_address = reinterpret_cast<uint64_t>(buf_);
-    erst_[0].bits.ring_segment_size = buf_size_;
+    // セグメントは 64 KiB 境界をまたいではならないので 1 つずつ確保する
+    for (size_t i = 0; i < num_segments; ++i) {
+      auto segment = AllocArray<TRB>(segment_size_, 64, 64 * 1024,
+                                     memstat::Tag::kUSBRing);
+      if (segment == nullptr) {
+        FreeSegments();
+        return MAKE_ERROR(Error::kNoEnoughMemory);
+      }
+      memset(segment, 0, segment_size_ * sizeof(TRB));
+      erst_[i].bits.ring_segment_base_address = reinterpret_cast<uint64_t>(segment);
+      erst_[i].bits.ring_segment_size = segment_size_;
+      num_segments_ = i + 1;
+    }
 
     ERSTSZ_Bitmap erstsz = interrupter_->ERSTSZ.Read();
-    erstsz.SetSize(1);
+    erstsz.SetSize(num_segments_);
     interrupter_->ERSTSZ.Write(erstsz);
 
-    WriteDequeuePointer(&buf_[0]);
+    dequeue_ = Segment(0);
+    WriteDequeuePointer(dequeue_);
 
+    // ERSTBA の書き込みで xHC がセグメントを読み込むので，最後に書く
     ERSTBA_Bitmap erstba = interrupter_->ERSTBA.Read();
     erstba.SetPointer(reinterpret_cast<uint64_t>(erst_));
     interrupter_->ERSTBA.Write(erstba);
@@ -93,23 +237,25 @@ namespace usb::xhci {
   }
 
   void EventRing::WriteDequeuePointer(TRB* p) {
-    auto erdp = interrupter_->ERDP.Read();
+    // ERDP は全フィールドを書き換えるので読み出さずに組み立てる
+    ERDP_Bitmap erdp{};
     erdp.SetPointer(reinterpret_cast<uint64_t>(p));
+    // DESI は xHC がデキュー位置のセグメントを探す手掛かりで，番号の下位 3 ビットだけを書く
+    erdp.bits.dequeue_erst_segment_index = segment_index_ & 0x7u;
+    erdp.bits.event_handler_busy = true; // RW1C
     interrupter_->ERDP.Write(erdp);
   }
 
   void EventRing::Pop() {
-    auto p = ReadDequeuePointer() + 1;
+    ++dequeue_;
 
-    TRB* segment_begin
-      = reinterpret_cast<TRB*>(erst_[0].bits.ring_segment_base_address);
-    TRB* segment_end = segment_begin + erst_[0].bits.ring_segment_size;
-
-    if (p == segment_end) {
-      p = segment_begin;
-      cycle_bit_ = !cycle_bit_;
+    if (dequeue_ == Segment(segment_index_) + segment_size_) {
+      ++segment_index_;
+      if (segment_index_ == num_segments_) {
+        segment_index_ = 0;
+        cycle_bit_ = !cycle_bit_;
+      }
+      dequeue_ = Segment(segment_index_);
     }
-
-    WriteDequeuePointer(p);
   }
 }
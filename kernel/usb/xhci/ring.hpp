@@ -6,6 +6,7 @@
 
 #pragma once
 
+#include <array>
 #include <cstdint>
 #include <vector>
 
@@ -16,53 +17,121 @@
 
 namespace usb::xhci
 {
-    /** @brief Command/Transfer Ring を表すクラス． */
+    /** @brief Command/Transfer Ring を表すクラス．
+     *
+     * 1 つ以上のセグメントを Link TRB でつないだ環状のリング．各セグメントの
+     * 末尾の TRB は Link TRB に使い，最後のセグメントの Link TRB で
+     * サイクルビットを反転する．xHC が処理済みの位置を OnCompleted() で
+     * 受け取り，未処理の TRB を上書きしないよう空きを管理する．
+     */
     class Ring
     {
     public:
+        /** @brief リングが持てるセグメント数の上限 */
+        static const size_t kMaxSegments = 16;
+
         Ring() = default;
         Ring(const Ring &) = delete;
         ~Ring();
         Ring &operator=(const Ring &) = delete;
 
-        /** @brief リングのメモリ領域を割り当て，メンバを初期化する． */
-        Error Initialize(size_t buf_size);
+        /** @brief リングのメモリ領域を割り当て，メンバを初期化する．
+         *
+         * @param segment_size  1 セグメントあたりの TRB 数（Link TRB を含む）
+         * @param num_segments  最初に確保するセグメント数
+         */
+        Error Initialize(size_t segment_size, size_t num_segments = 1);
 
         /** @brief TRB に cycle bit を設定した上でリング末尾に追加する．
-     *
-     * @return 追加された（リング上の）TRB を指すポインタ．
-     */
+         *
+         * @return 追加された（リング上の）TRB を指すポインタ．空きが無ければ nullptr．
+         */
         template <typename TRBType>
         TRB *Push(const TRBType &trb)
         {
             return Push(trb.data);
         }
 
-        TRB *Buffer() const { return buf_; }
+        /** @brief xHC が trb までを処理したことを記録し，その分の空きを回収する
+         *
+         * trb はイベントの TRB Pointer が指す，このリング上の TRB．
+         */
+        Error OnCompleted(const TRB *trb);
+
+        /** @brief xHC にまだ処理させていない TRB をすべて捨てる
+         *
+         * デキューの位置を次に書き込む位置に合わせる．止めたエンドポイントの xHC 側の位置を
+         * Set TR Dequeue Pointer で EnqueuePointer() に移すときに使う．
+         */
+        void DiscardPending();
+
+        /** @brief 次に TRB を書き込む位置と，そこで使うサイクルビット．Set TR Dequeue Pointer に渡す． */
+        TRB *EnqueuePointer() const { return &segments_[enqueue_segment_][write_index_]; }
+        bool CycleBit() const { return cycle_bit_; }
+
+        /** @brief trb の転送イベントが後から 1 つ届くかもしれないことを覚える
+         *
+         * TD の途中の Short Packet で完了させた TD の末尾の TRB．xHC によってはその TRB の
+         * イベントも送ってくるので，このリングの次のイベントまで覚えておいて読み捨てる．
+         */
+        void ExpectLateEvent(const TRB *trb) { late_event_ = trb; }
+        const TRB *LateEvent() const { return late_event_; }
+
+        /** @brief 新しいセグメントを num_segments 個つなぐ
+         *
+         * xHC の動作中でも呼べる．新しいセグメントは現在の書き込み位置を含む
+         * セグメントの直後に入るので，xHC がまだ読んでいない部分だけが変わる．
+         */
+        Error Grow(size_t num_segments);
+
+        /** @brief 少なくとも num_trbs 個の TRB を続けて積めるよう，必要ならセグメントを足す */
+        Error Reserve(size_t num_trbs);
+
+        /** @brief 今すぐ積める TRB 数 */
+        size_t FreeSlots() const;
+        /** @brief xHC がまだ処理していない TRB 数（Link TRB を除く） */
+        size_t Used() const { return used_; }
+        /** @brief 全セグメントで保持できる TRB 数（Link TRB を除く） */
+        size_t Capacity() const { return num_segments_ * (segment_size_ - 1); }
+        size_t NumSegments() const { return num_segments_; }
+
+        TRB *Buffer() const { return segments_[0]; }
 
     private:
-        TRB *buf_ = nullptr;
-        size_t buf_size_ = 0;
+        std::array<TRB *, kMaxSegments> segments_{};
+        size_t segment_size_ = 0;
+        size_t num_segments_ = 0;
 
         /** @brief プロデューサ・サイクル・ステートを表すビット */
         bool cycle_bit_;
-        /** @brief リング上で次に書き込む位置 */
+        /** @brief リング上で次に書き込む位置（セグメント番号とその中の添え字） */
+        size_t enqueue_segment_;
         size_t write_index_;
+        /** @brief xHC が次に処理する位置 */
+        size_t dequeue_segment_;
+        size_t dequeue_index_;
+        size_t used_;
+        const TRB *late_event_ = nullptr;
+
+        void FreeSegments();
+
+        /** @brief segment 番目のセグメントの Link TRB が指すセグメントの番号 */
+        size_t NextSegment(size_t segment) const;
 
         /** @brief TRB に cycle bit を設定した上でリング末尾に書き込む．
-     *
-     * write_index_ は変化させない．
-     */
+         *
+         * write_index_ は変化させない．
+         */
         void CopyToLast(const std::array<uint32_t, 4> &data);
 
         /** @brief TRB に cycle bit を設定した上でリング末尾に追加する．
-     *
-     * write_index_ をインクリメントする．その結果 write_index_ がリング末尾
-     * に達したら LinkTRB を適切に配置して write_index_ を 0 に戻し，
-     * cycle bit を反転させる．
-     *
-     * @return 追加された（リング上の）TRB を指すポインタ．
-     */
+         *
+         * write_index_ をインクリメントする．その結果 write_index_ がセグメント末尾
+         * に達したら次のセグメントへの LinkTRB を配置して write_index_ を 0 に戻す．
+         * 最後のセグメントから先頭に戻るときは cycle bit を反転させる．
+         *
+         * @return 追加された（リング上の）TRB を指すポインタ．
+         */
         TRB *Push(const std::array<uint32_t, 4> &data);
     };
 
@@ -80,16 +149,35 @@ namespace usb::xhci
         } __attribute__((packed)) bits;
     };
 
+    /** @brief 1 つ以上のセグメントからなる Event Ring を表すクラス．
+     *
+     * セグメントは ERST に並べた順に循環し，最後のセグメントの末尾から
+     * 先頭のセグメントに戻るときにコンシューマ・サイクル・ステートを反転する．
+     */
     class EventRing
     {
     public:
-        Error Initialize(size_t buf_size, InterrupterRegisterSet *interrupter);
-
+        EventRing() = default;
+        EventRing(const EventRing &) = delete;
+        ~EventRing();
+        EventRing &operator=(const EventRing &) = delete;
+
+        /** @brief セグメントと ERST を割り当て，インタラプタに登録する．
+         *
+         * @param segment_size  1 セグメントあたりの TRB 数（16 以上 4096 以下）
+         * @param num_segments  セグメント数（1 以上 max_segments 以下）
+         * @param max_segments  xHC が扱える ERST の要素数（HCSPARAMS2 の ERST Max から 2^ERSTMax）
+         */
+        Error Initialize(size_t segment_size, size_t num_segments, size_t max_segments,
+                         InterrupterRegisterSet *interrupter);
+
+        /** @brief xHC に通知済みのデキューポインタを ERDP から読む（MMIO アクセス） */
         TRB *ReadDequeuePointer() const
         {
             return reinterpret_cast<TRB *>(interrupter_->ERDP.Read().Pointer());
         }
 
+        /** @brief ERDP に p を書き込み，Event Handler Busy をクリアする */
         void WriteDequeuePointer(TRB *p);
 
         bool HasFront() const
@@ -97,19 +185,47 @@ namespace usb::xhci
             return Front()->bits.cycle_bit == cycle_bit_;
         }
 
+        /** @brief 次に処理するイベント．ERDP ではなくソフトウェア側の控えを返す． */
         TRB *Front() const
         {
-            return ReadDequeuePointer();
+            return dequeue_;
         }
 
+        /** @brief 先頭のイベントを捨てる．セグメントの末尾に達したら次のセグメントへ進む．
+         *
+         * 控えのデキューポインタを進めるだけで，xHC には UpdateDequeuePointer() で通知する．
+         */
         void Pop();
 
+        /** @brief 処理済みの位置を ERDP に書き，Event Handler Busy をクリアする
+         *
+         * イベントをまとめて Pop() した後に 1 度だけ呼ぶ．
+         */
+        void UpdateDequeuePointer()
+        {
+            WriteDequeuePointer(dequeue_);
+        }
+
+        /** @brief リング全体で保持できるイベント数 */
+        size_t Capacity() const { return segment_size_ * num_segments_; }
+        size_t NumSegments() const { return num_segments_; }
+
     private:
-        TRB *buf_;
-        size_t buf_size_;
+        size_t segment_size_ = 0;
+        size_t num_segments_ = 0;
+        /** @brief 次に処理するイベントの位置と，それが属するセグメントの番号 */
+        TRB *dequeue_ = nullptr;
+        size_t segment_index_ = 0;
 
         bool cycle_bit_;
-        EventRingSegmentTableEntry *erst_;
-        InterrupterRegisterSet *interrupter_;
+        EventRingSegmentTableEntry *erst_ = nullptr;
+        InterrupterRegisterSet *interrupter_ = nullptr;
+
+        /** @brief index 番目のセグメント．セグメントの一覧は ERST そのものを使う． */
+        TRB *Segment(size_t index) const
+        {
+            return reinterpret_cast<TRB *>(erst_[index].bits.ring_segment_base_address);
+        }
+        void FreeSegments();
     };
 }
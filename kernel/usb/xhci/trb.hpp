@@ -240,6 +240,29 @@ namespace usb::xhci {
     }
   };
 
+  union DisableSlotCommandTRB {
+    static const unsigned int Type = 10;
+    std::array<uint32_t, 4> data{};
+    struct {
+      uint32_t : 32;
+
+      uint32_t : 32;
+
+      uint32_t : 32;
+
+      uint32_t cycle_bit : 1;
+      uint32_t : 9;
+      uint32_t trb_type : 6;
+      uint32_t : 8;
+      uint32_t slot_id : 8;
+    } __attribute__((packed)) bits;
+
+    DisableSlotCommandTRB(uint8_t slot_id) {
+      bits.trb_type = Type;
+      bits.slot_id = slot_id;
+    }
+  };
+
   union AddressDeviceCommandTRB {
     static const unsigned int Type = 11;
     std::array<uint32_t, 4> data{};
@@ -334,6 +357,76 @@ namespace usb::xhci {
     }
   };
 
+  union ResetEndpointCommandTRB {
+    static const unsigned int Type = 14;
+    std::array<uint32_t, 4> data{};
+    struct {
+      uint32_t : 32;
+
+      uint32_t : 32;
+
+      uint32_t : 32;
+
+      uint32_t cycle_bit : 1;
+      uint32_t : 8;
+      uint32_t transfer_state_preserve : 1;
+      uint32_t trb_type : 6;
+      uint32_t endpoint_id : 5;
+      uint32_t : 3;
+      uint32_t slot_id : 8;
+    } __attribute__((packed)) bits;
+
+    ResetEndpointCommandTRB(EndpointID endpoint_id, uint8_t slot_id) {
+      bits.trb_type = Type;
+      bits.endpoint_id = endpoint_id.Address();
+      bits.slot_id = slot_id;
+    }
+
+    EndpointID EndpointID() const {
+      return usb::EndpointID{bits.endpoint_id};
+    }
+  };
+
+  union SetTRDequeuePointerCommandTRB {
+    static const unsigned int Type = 16;
+    std::array<uint32_t, 4> data{};
+    struct {
+      uint64_t dequeue_cycle_state : 1;
+      uint64_t stream_context_type : 3;
+      uint64_t dequeue_pointer : 60;
+
+      uint32_t : 16;
+      uint32_t stream_id : 16;
+
+      uint32_t cycle_bit : 1;
+      uint32_t : 9;
+      uint32_t trb_type : 6;
+      uint32_t endpoint_id : 5;
+      uint32_t : 3;
+      uint32_t slot_id : 8;
+    } __attribute__((packed)) bits;
+
+    SetTRDequeuePointerCommandTRB(EndpointID endpoint_id, uint8_t slot_id, uint16_t stream_id,
+                                  const TRB* dequeue, bool cycle_state) {
+      bits.trb_type = Type;
+      bits.endpoint_id = endpoint_id.Address();
+      bits.slot_id = slot_id;
+      bits.stream_id = stream_id;
+      // ストリームを使うなら Primary Stream Array の要素（SCT = 1）を書き換える
+      bits.stream_context_type = stream_id == 0 ? 0 : 1;
+      bits.dequeue_cycle_state = cycle_state;
+      SetPointer(dequeue);
+    }
+
+    TRB* Pointer() const {
+      return reinterpret_cast<TRB*>(bits.dequeue_pointer << 4);
+    }
+
+    void SetPointer(const TRB* p) {
+      bits.dequeue_pointer = reinterpret_cast<uint64_t>(p) >> 4;
+    }
+  };
+
   union NoOpCommandTRB {
     static const unsigned int Type = 23;
     std::array<uint32_t, 4> data{};
@@ -1,23 +1,29 @@
 #include "usb/xhci/xhci.hpp"
 
+#include <algorithm>
+#include <cstdint>
+
 #include "logger.hpp"
+#include "timer.hpp"
 #include "usb/setupdata.hpp"
 #include "usb/device.hpp"
 #include "usb/descriptor.hpp"
+#include "usb/classdriver/hub.hpp"
 #include "usb/xhci/speed.hpp"
 
 namespace {
   using namespace usb::xhci;
 
-  Error RegisterCommandRing(Ring* ring, MemMapRegister<CRCR_Bitmap>* crcr) {
-    CRCR_Bitmap value = crcr->Read();
-    value.bits.ring_cycle_state = true;
-    value.bits.command_stop = false;
-    value.bits.command_abort = false;
-    value.SetPointer(reinterpret_cast<uint64_t>(ring->Buffer()));
-    crcr->Write(value);
-    return MAKE_ERROR(Error::kSuccess);
-  }
+  const unsigned int kCompletionSuccess = 1;
+
+  /** コントロール／インタラプト転送の Transfer Ring の 1 セグメントの TRB 数．
+   * 同時に積む転送は少ないので小さくてよい．
+   */
+  const size_t kSmallRingSegmentSize = 32;
+  /** バルク／アイソクロナス転送の Transfer Ring の 1 セグメントの TRB 数（4 KiB）．
+   * 帯域を使い切るには数百の TRB を積んでおく必要があり，足りなければ Ring::Reserve() で伸ばす．
+   */
+  const size_t kStreamingRingSegmentSize = 256;
 
   enum class ConfigPhase {
     kNotConnected,
@@ -28,25 +34,88 @@ namespace {
     kInitializingDevice,
     kConfiguringEndpoints,
     kConfigured,
+    kDisablingSlot,
   };
   /* root hub port はリセット処理をしてからアドレスを割り当てるまでは
    * 他の処理を挟まず，そのポートについての処理だけをしなければならない．
    * kWaitingAddressed はリセット（kResettingPort）からアドレス割り当て
    * （kAddressingDevice）までの一連の処理の実行を待っている状態．
+   * ハブの下のポートも同じ区間を直列化するが，待ち状態はハブのクラスドライバが持つ．
    */
 
   std::array<volatile ConfigPhase, 256> port_config_phase{};  // index: port number
+  /** アドレス割り当て後（kInitializingDevice 以降）の段階．
+   * ハブの下のデバイスはルートハブのポートを共有するので，スロットごとに持つ．
+   */
+  std::array<volatile ConfigPhase, 256> slot_config_phase{};  // index: slot ID
+
+  /** アドレスを割り当てようとしているデバイスの接続位置 */
+  struct Attachment {
+    uint8_t root_port;      // 0 なら割り当て中のデバイスはない
+    uint32_t route_string;  // ルートポート直下なら 0
+    uint8_t parent_slot;    // 親ハブのスロット ID．ルートポート直下なら 0
+    uint8_t parent_port;    // 親ハブのポート番号
+    int speed;              // xHCI の Protocol Speed ID
+    ConfigPhase phase;
+  };
 
-  /** kResettingPort から kAddressingDevice までの処理を実行中のポート番号．
-   * 0 ならその状態のポートがないことを示す．
+  /** kResettingPort から kAddressingDevice までの処理を実行中のデバイス．
+   * アドレス 0 のデバイスは同時に 1 つしか存在できないため，この区間だけは
+   * ルートポートとハブのポートをまとめて直列化する．
+   * コマンドの完了は TRB のアドレスで照合するので，それ以外の処理には関係しない．
    */
-  uint8_t addressing_port{0};
+  Attachment addressing{};
+
+  Error OnSlotEnabled(Controller& xhc, const CommandCompletionEventTRB& trb, uintptr_t arg);
+  Error OnDeviceAddressed(Controller& xhc, const CommandCompletionEventTRB& trb, uintptr_t arg);
+  Error StartNextAddressing(Controller& xhc);
+  Error ProcessHubEvents(Controller& xhc, Device& hub_dev, usb::HubDriver& hub);
+
+  /** Route String が表すハブの段数．ルートポート直下のデバイスなら 0． */
+  int RouteDepth(uint32_t route_string) {
+    int depth = 0;
+    while (depth < 5 && ((route_string >> (4 * depth)) & 0xfu) != 0) {
+      ++depth;
+    }
+    return depth;
+  }
 
-  void InitializeSlotContext(SlotContext& ctx, Port& port) {
-    ctx.bits.route_string = 0;
-    ctx.bits.root_hub_port_num = port.Number();
+  /** Route String が route_string のハブの，port 番ポートにつながったデバイスの Route String */
+  uint32_t ChildRoute(uint32_t route_string, int port) {
+    return route_string | (static_cast<uint32_t>(port) << (4 * RouteDepth(route_string)));
+  }
+
+  int ToSpeedID(usb::PortSpeed speed) {
+    switch (speed) {
+    case usb::PortSpeed::kLow: return kLowSpeed;
+    case usb::PortSpeed::kHigh: return kHighSpeed;
+    case usb::PortSpeed::kSuper: return kSuperSpeed;
+    default: return kFullSpeed;
+    }
+  }
+
+  void InitializeSlotContext(SlotContext& ctx, DeviceManager& devmgr,
+                             const Attachment& at) {
+    ctx = SlotContext{};
+    ctx.bits.route_string = at.route_string;
+    ctx.bits.root_hub_port_num = at.root_port;
     ctx.bits.context_entries = 1;
-    ctx.bits.speed = port.Speed();
+    ctx.bits.speed = at.speed;
+
+    // HS ハブの下の LS/FS デバイスには，最も近い HS ハブの TT を使わせる
+    auto parent = devmgr.FindBySlot(at.parent_slot);
+    if (parent == nullptr || (at.speed != kLowSpeed && at.speed != kFullSpeed)) {
+      return;
+    }
+    const auto& parent_ctx = parent->DeviceContext()->slot_context;
+    if (parent_ctx.bits.speed == kHighSpeed) {
+      ctx.bits.tt_hub_slot_id = at.parent_slot;
+      ctx.bits.tt_port_num = at.parent_port;
+    } else {
+      ctx.bits.tt_hub_slot_id = parent_ctx.bits.tt_hub_slot_id;
+      ctx.bits.tt_port_num = parent_ctx.bits.tt_port_num;
+    }
+    ctx.bits.mtt = parent_ctx.bits.mtt;
   }
 
   unsigned int DetermineMaxPacketSizeForControlPipe(unsigned int slot_speed) {
@@ -94,7 +163,7 @@ namespace {
       return MAKE_ERROR(Error::kSuccess);
     }
 
-    if (addressing_port != 0) {
+    if (addressing.root_port != 0) {
       port_config_phase[port.Number()] = ConfigPhase::kWaitingAddressed;
     } else {
       const auto port_phase = port_config_phase[port.Number()];
@@ -102,13 +171,47 @@ namespace {
           port_phase != ConfigPhase::kWaitingAddressed) {
         return MAKE_ERROR(Error::kInvalidPhase);
       }
-      addressing_port = port.Number();
+      addressing = Attachment{port.Number(), 0, 0, 0, 0, ConfigPhase::kResettingPort};
       port_config_phase[port.Number()] = ConfigPhase::kResettingPort;
       port.Reset();
     }
     return MAKE_ERROR(Error::kSuccess);
   }
 
+  /** ハブの port 番ポートにつながったデバイスのアドレス割り当てを始める */
+  Error ResetHubPort(Controller& xhc, Device& hub_dev, usb::HubDriver& hub, int port) {
+    const auto& hub_ctx = hub_dev.DeviceContext()->slot_context;
+    Log(kDebug, "ResetHubPort: hub slot = %d, port = %d\n", hub_dev.SlotID(), port);
+
+    addressing = Attachment{
+      static_cast<uint8_t>(hub_ctx.bits.root_hub_port_num),
+      ChildRoute(hub_ctx.bits.route_string, port),
+      hub_dev.SlotID(), static_cast<uint8_t>(port), 0, ConfigPhase::kResettingPort};
+    return hub.ResetPort(port);
+  }
+
+  /** アドレス割り当てを諦め，順番を待っている次のデバイスに譲る */
+  Error AbortAddressing(Controller& xhc) {
+    Log(kWarn, "addressing aborted: port %d, route %05x\n",
+        addressing.root_port, addressing.route_string);
+    if (addressing.route_string == 0) {
+      port_config_phase[addressing.root_port] = ConfigPhase::kNotConnected;
+    }
+    addressing = Attachment{};
+    return StartNextAddressing(xhc);
+  }
+
+  Error SubmitEnableSlot(Controller& xhc) {
+    addressing.phase = ConfigPhase::kEnablingSlot;
+
+    EnableSlotCommandTRB cmd{};
+    if (auto [ trb, err ] = xhc.Commands()->Submit(cmd, OnSlotEnabled, addressing.root_port); err) {
+      AbortAddressing(xhc);
+      return err;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
   Error EnableSlot(Controller& xhc, Port& port) {
     const bool is_enabled = port.IsEnabled();
     const bool reset_completed = port.IsPortResetChanged();
@@ -120,21 +223,30 @@ namespace {
       port.ClearPortResetChange();
 
       port_config_phase[port.Number()] = ConfigPhase::kEnablingSlot;
-
-      EnableSlotCommandTRB cmd{};
-      xhc.CommandRing()->Push(cmd);
-      xhc.DoorbellRegisterAt(0)->Ring(0);
+      addressing.speed = port.Speed();
+      return SubmitEnableSlot(xhc);
+    } else if (reset_completed) {
+      // リセット中に外れたなど．待っている他のポートを止めない
+      port.ClearPortResetChange();
+      return AbortAddressing(xhc);
     }
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  Error AddressDevice(Controller& xhc, uint8_t port_id, uint8_t slot_id) {
-    Log(kDebug, "AddressDevice: port_id = %d, slot_id = %d\n", port_id, slot_id);
+  Error AddressDevice(Controller& xhc, uint8_t slot_id) {
+    Log(kDebug, "AddressDevice: port_id = %d, route = %05x, slot_id = %d\n",
+        addressing.root_port, addressing.route_string, slot_id);
 
-    xhc.DeviceManager()->AllocDevice(slot_id, xhc.DoorbellRegisterAt(slot_id));
+    auto devmgr = xhc.DeviceManager();
+    if (auto err = devmgr->AllocDevice(slot_id, xhc.DoorbellRegisterAt(slot_id),
+                                       addressing.root_port, addressing.route_string)) {
+      AbortAddressing(xhc);
+      return err;
+    }
 
-    Device* dev = xhc.DeviceManager()->FindBySlot(slot_id);
+    Device* dev = devmgr->FindBySlot(slot_id);
     if (dev == nullptr) {
+      AbortAddressing(xhc);
       return MAKE_ERROR(Error::kInvalidSlotID);
     }
 
@@ -145,49 +257,260 @@ namespace {
     auto slot_ctx = dev->InputContext()->EnableSlotContext();
     auto ep0_ctx = dev->InputContext()->EnableEndpoint(ep0_dci);
 
-    auto port = xhc.PortAt(port_id);
-    InitializeSlotContext(*slot_ctx, port);
+    InitializeSlotContext(*slot_ctx, *devmgr, addressing);
 
     InitializeEP0Context(
-        *ep0_ctx, dev->AllocTransferRing(ep0_dci, 32),
+        *ep0_ctx, dev->AllocTransferRing(ep0_dci, kSmallRingSegmentSize),
         DetermineMaxPacketSizeForControlPipe(slot_ctx->bits.speed));
 
-    xhc.DeviceManager()->LoadDCBAA(slot_id);
+    devmgr->LoadDCBAA(slot_id);
 
-    port_config_phase[port_id] = ConfigPhase::kAddressingDevice;
+    if (addressing.route_string == 0) {
+      port_config_phase[addressing.root_port] = ConfigPhase::kAddressingDevice;
+    }
+    addressing.phase = ConfigPhase::kAddressingDevice;
 
     AddressDeviceCommandTRB addr_dev_cmd{dev->InputContext(), slot_id};
-    xhc.CommandRing()->Push(addr_dev_cmd);
-    xhc.DoorbellRegisterAt(0)->Ring(0);
+    if (auto [ trb, err ] = xhc.Commands()->Submit(addr_dev_cmd, OnDeviceAddressed,
+                                                   addressing.root_port); err) {
+      AbortAddressing(xhc);
+      return err;
+    }
 
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  Error InitializeDevice(Controller& xhc, uint8_t port_id, uint8_t slot_id) {
-    Log(kDebug, "InitializeDevice: port_id = %d, slot_id = %d\n", port_id, slot_id);
+  Error InitializeDevice(Controller& xhc, uint8_t slot_id) {
+    Log(kDebug, "InitializeDevice: slot_id = %d\n", slot_id);
 
     auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
     if (dev == nullptr) {
       return MAKE_ERROR(Error::kInvalidSlotID);
     }
 
-    port_config_phase[port_id] = ConfigPhase::kInitializingDevice;
+    slot_config_phase[slot_id] = ConfigPhase::kInitializingDevice;
     dev->StartInitialize();
 
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  Error CompleteConfiguration(Controller& xhc, uint8_t port_id, uint8_t slot_id) {
-    Log(kDebug, "CompleteConfiguration: port_id = %d, slot_id = %d\n", port_id, slot_id);
+  Error CompleteConfiguration(Controller& xhc, uint8_t slot_id) {
+    Log(kDebug, "CompleteConfiguration: slot_id = %d\n", slot_id);
 
     auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
     if (dev == nullptr) {
       return MAKE_ERROR(Error::kInvalidSlotID);
     }
 
+    if (auto hub = dev->Hub()) {
+      hub->SetDepth(RouteDepth(dev->DeviceContext()->slot_context.bits.route_string));
+    }
     dev->OnEndpointsConfigured();
 
-    port_config_phase[port_id] = ConfigPhase::kConfigured;
+    slot_config_phase[slot_id] = ConfigPhase::kConfigured;
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error OnSlotEnabled(Controller& xhc, const CommandCompletionEventTRB& trb, uintptr_t arg) {
+    const uint8_t port_id = arg;
+    if (port_id != addressing.root_port ||
+        addressing.phase != ConfigPhase::kEnablingSlot) {
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
+    if (trb.bits.completion_code != kCompletionSuccess) {
+      // スロットが足りないときなど．待っている他のデバイスを止めない
+      AbortAddressing(xhc);
+      return MAKE_ERROR(Error::kCommandFailed);
+    }
+
+    return AddressDevice(xhc, trb.bits.slot_id);
+  }
+
+  Error OnDeviceAddressed(Controller& xhc, const CommandCompletionEventTRB& trb, uintptr_t arg) {
+    const uint8_t port_id = arg;
+    if (port_id != addressing.root_port ||
+        addressing.phase != ConfigPhase::kAddressingDevice) {
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
+    if (trb.bits.completion_code != kCompletionSuccess) {
+      AbortAddressing(xhc);
+      return MAKE_ERROR(Error::kCommandFailed);
+    }
+
+    // 以降の段階は slot_config_phase で進める．ルートポートは使用中であることだけを示す
+    if (addressing.route_string == 0) {
+      port_config_phase[port_id] = ConfigPhase::kConfigured;
+    }
+    addressing = Attachment{};
+    const auto next_err = StartNextAddressing(xhc);
+
+    if (auto err = InitializeDevice(xhc, trb.bits.slot_id)) {
+      return err;
+    }
+    return next_err;
+  }
+
+  Error OnEndpointsConfigured(Controller& xhc, const CommandCompletionEventTRB& trb,
+                              uintptr_t arg) {
+    const uint8_t slot_id = arg;
+    if (trb.bits.completion_code != kCompletionSuccess) {
+      return MAKE_ERROR(Error::kCommandFailed);
+    }
+    if (slot_config_phase[slot_id] != ConfigPhase::kConfiguringEndpoints) {
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
+
+    return CompleteConfiguration(xhc, slot_id);
+  }
+
+  Error OnHubConfigured(Controller& xhc, const CommandCompletionEventTRB& trb,
+                        uintptr_t arg) {
+    if (trb.bits.completion_code != kCompletionSuccess) {
+      Log(kError, "failed to configure slot %lu as a hub: completion code %d\n",
+          arg, trb.bits.completion_code);
+      return MAKE_ERROR(Error::kCommandFailed);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  /** スロットにハブであることを設定する．下流の LS/FS デバイスの TT の選択に使われる． */
+  Error ConfigureHub(Controller& xhc, Device& hub_dev, usb::HubDriver& hub) {
+    auto input = hub_dev.InputContext();
+    memset(&input->input_control_context, 0, sizeof(InputControlContext));
+    memcpy(&input->slot_context, &hub_dev.DeviceContext()->slot_context, sizeof(SlotContext));
+
+    auto slot_ctx = input->EnableSlotContext();
+    slot_ctx->bits.hub = 1;
+    slot_ctx->bits.num_ports = hub.NumPorts();
+    slot_ctx->bits.mtt = 0;  // 代替設定 0（Single TT）のまま使う
+    slot_ctx->bits.ttt = slot_ctx->bits.speed == kHighSpeed ? hub.ThinkTime() : 0;
+
+    ConfigureEndpointCommandTRB cmd{input, hub_dev.SlotID()};
+    if (auto [ trb, err ] = xhc.Commands()->Submit(cmd, OnHubConfigured, hub_dev.SlotID()); err) {
+      return err;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error OnSlotDisabled(Controller& xhc, const CommandCompletionEventTRB& trb,
+                       uintptr_t arg) {
+    const uint8_t slot_id = arg;
+    if (trb.bits.completion_code != kCompletionSuccess) {
+      return MAKE_ERROR(Error::kCommandFailed);
+    }
+    slot_config_phase[slot_id] = ConfigPhase::kNotConnected;
+    return xhc.DeviceManager()->Remove(slot_id);
+  }
+
+  /** ハブの下で外れたデバイスと，それがハブならその下のすべてのデバイスのスロットを無効にする */
+  Error DisconnectDevice(Controller& xhc, uint8_t root_port, uint32_t route_string) {
+    const uint32_t mask = (uint32_t{1} << (4 * RouteDepth(route_string))) - 1;
+    auto under = [&](const SlotContext& ctx) {
+      return ctx.bits.root_hub_port_num == root_port &&
+             (ctx.bits.route_string & mask) == route_string;
+    };
+
+    // リセット中のデバイスなら，ハブからの通知はもう来ない
+    if (addressing.root_port == root_port &&
+        (addressing.route_string & mask) == route_string &&
+        addressing.phase == ConfigPhase::kResettingPort) {
+      if (auto err = AbortAddressing(xhc)) {
+        return err;
+      }
+    }
+
+    auto devmgr = xhc.DeviceManager();
+    if (devmgr->FindByPort(root_port, route_string) == nullptr) {
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    for (size_t slot_id = 1; slot_id <= devmgr->MaxSlots(); ++slot_id) {
+      auto dev = devmgr->FindBySlot(slot_id);
+      if (dev == nullptr || slot_config_phase[slot_id] == ConfigPhase::kDisablingSlot ||
+          !under(dev->DeviceContext()->slot_context)) {
+        continue;
+      }
+      Log(kInfo, "DisconnectDevice: slot %lu (port %d, route %05x)\n", slot_id,
+          root_port, dev->DeviceContext()->slot_context.bits.route_string);
+
+      slot_config_phase[slot_id] = ConfigPhase::kDisablingSlot;
+      DisableSlotCommandTRB cmd{static_cast<uint8_t>(slot_id)};
+      if (auto [ trb, err ] = xhc.Commands()->Submit(cmd, OnSlotDisabled, slot_id); err) {
+        return err;
+      }
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  /** ハブのクラスドライバが積んだ通知を処理する */
+  Error ProcessHubEvents(Controller& xhc, Device& hub_dev, usb::HubDriver& hub) {
+    const uint8_t hub_slot = hub_dev.SlotID();
+    const auto& hub_ctx = hub_dev.DeviceContext()->slot_context;
+
+    Error result = MAKE_ERROR(Error::kSuccess);
+    usb::HubEvent event;
+    while (hub.PopEvent(event)) {
+      const bool addressing_port = addressing.root_port != 0 &&
+                                   addressing.parent_slot == hub_slot &&
+                                   addressing.parent_port == event.port;
+      Error err = MAKE_ERROR(Error::kSuccess);
+      switch (event.type) {
+      case usb::HubEvent::kHubReady:
+        err = ConfigureHub(xhc, hub_dev, hub);
+        break;
+      case usb::HubEvent::kPortConnected:
+        // 割り当て中のデバイスがあれば，それが終わったときに StartNextAddressing() が拾う
+        if (addressing.root_port == 0) {
+          err = ResetHubPort(xhc, hub_dev, hub, event.port);
+        }
+        break;
+      case usb::HubEvent::kPortEnabled:
+        if (addressing_port && addressing.phase == ConfigPhase::kResettingPort) {
+          addressing.speed = ToSpeedID(event.speed);
+          err = SubmitEnableSlot(xhc);
+        }
+        break;
+      case usb::HubEvent::kPortResetFailed:
+        if (addressing_port && addressing.phase == ConfigPhase::kResettingPort) {
+          err = AbortAddressing(xhc);
+        }
+        break;
+      case usb::HubEvent::kPortDisconnected:
+        err = DisconnectDevice(xhc, hub_ctx.bits.root_hub_port_num,
+                               ChildRoute(hub_ctx.bits.route_string, event.port));
+        break;
+      }
+      if (err && !result) {
+        result = err;
+      }
+    }
+    return result;
+  }
+
+  /** アドレス割り当ての順番を待っているデバイスがあれば，1 つ始める */
+  Error StartNextAddressing(Controller& xhc) {
+    for (int i = 1; i <= xhc.MaxPorts(); ++i) {
+      if (port_config_phase[i] == ConfigPhase::kWaitingAddressed) {
+        auto port = xhc.PortAt(i);
+        return ResetPort(xhc, port);
+      }
+    }
+
+    auto devmgr = xhc.DeviceManager();
+    for (size_t slot_id = 1; slot_id <= devmgr->MaxSlots(); ++slot_id) {
+      auto dev = devmgr->FindBySlot(slot_id);
+      if (dev == nullptr || dev->Hub() == nullptr ||
+          slot_config_phase[slot_id] != ConfigPhase::kConfigured) {
+        continue;
+      }
+      auto hub = dev->Hub();
+      if (const int port = hub->NextWaitingPort()) {
+        if (auto err = ResetHubPort(xhc, *dev, *hub, port)) {
+          return err;
+        }
+        // リセット要求を出せなかったときの通知は ResetPort() の中で積まれている
+        return ProcessHubEvents(xhc, *dev, *hub);
+      }
+    }
     return MAKE_ERROR(Error::kSuccess);
   }
 
@@ -206,78 +529,192 @@ namespace {
     }
   }
 
+  Error OnEndpointStopped(Controller& xhc, const CommandCompletionEventTRB& trb, uintptr_t arg);
+  Error OnDequeueMoved(Controller& xhc, const CommandCompletionEventTRB& trb, uintptr_t arg);
+  Error OnEndpointReadded(Controller& xhc, const CommandCompletionEventTRB& trb, uintptr_t arg);
+  Error StartEndpointRecovery(Controller& xhc, Device& dev);
+
+  /** 復旧中のエンドポイントを指すコマンドの引数．上位がスロット ID，下位 8 ビットが DCI． */
+  uintptr_t RecoveryArg(const Device& dev, uint8_t dci) {
+    return uintptr_t{dev.SlotID()} << 8 | dci;
+  }
+
+  /** Halted ならエンドポイントをリセットし，そうでなければ止める */
+  Error SubmitStopEndpoint(Controller& xhc, Device& dev, uint8_t dci) {
+    const usb::EndpointID ep_id{dci};
+    auto [ trb, err ] = dev.IsHalted(dci)
+      ? xhc.Commands()->Submit(ResetEndpointCommandTRB{ep_id, dev.SlotID()},
+                               OnEndpointStopped, RecoveryArg(dev, dci))
+      : xhc.Commands()->Submit(StopEndpointCommandTRB{ep_id, dev.SlotID()},
+                               OnEndpointStopped, RecoveryArg(dev, dci));
+    if (err) {
+      Log(kError, "failed to stop slot %d dci %d: %s\n", dev.SlotID(), dci, err.Name());
+      dev.AbortRecovery(dci);
+    }
+    return err;
+  }
+
+  /** Halted でないまま止めたエンドポイントを Configure Endpoint で外して加え直し，データトグルを戻す */
+  Error ReaddEndpoint(Controller& xhc, Device& dev, uint8_t dci,
+                      TRB* dequeue, bool cycle_state) {
+    auto input = dev.InputContext();
+    memset(&input->input_control_context, 0, sizeof(InputControlContext));
+    memcpy(&input->slot_context, &dev.DeviceContext()->slot_context, sizeof(SlotContext));
+    input->EnableSlotContext();
+    input->input_control_context.drop_context_flags = 1u << dci;
+
+    auto ep_ctx = input->EnableEndpoint(DeviceContextIndex{dci});
+    memcpy(ep_ctx, &dev.DeviceContext()->ep_contexts[dci - 1], sizeof(EndpointContext));
+    ep_ctx->bits.ep_state = 0;
+    ep_ctx->SetTransferRingBuffer(dequeue);
+    ep_ctx->bits.dequeue_cycle_state = cycle_state;
+
+    ConfigureEndpointCommandTRB cmd{input, dev.SlotID()};
+    if (auto [ trb, err ] = xhc.Commands()->Submit(cmd, OnEndpointReadded, RecoveryArg(dev, dci));
+        err) {
+      Log(kError, "failed to re-add slot %d dci %d: %s\n", dev.SlotID(), dci, err.Name());
+      dev.FinishRecovery(dci);
+      return err;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  /** 止めたエンドポイントの次のリングについて，xHC のデキューポインタを書き込み位置に移す */
+  Error MoveNextDequeue(Controller& xhc, Device& dev, uint8_t dci) {
+    uint16_t stream_id;
+    TRB* dequeue;
+    bool cycle_state;
+    if (!dev.NextDequeue(dci, stream_id, dequeue, cycle_state)) {
+      if (dev.NeedsToggleReset(dci, dequeue, cycle_state)) {
+        return ReaddEndpoint(xhc, dev, dci, dequeue, cycle_state);
+      }
+      // 復旧を終えた．その間や完了の通知の中で次の復旧を要求されていれば始める．
+      dev.FinishRecovery(dci);
+      return StartEndpointRecovery(xhc, dev);
+    }
+    SetTRDequeuePointerCommandTRB cmd{usb::EndpointID{dci}, dev.SlotID(), stream_id,
+                                      dequeue, cycle_state};
+    if (auto [ trb, err ] = xhc.Commands()->Submit(cmd, OnDequeueMoved, RecoveryArg(dev, dci));
+        err) {
+      Log(kError, "failed to set the dequeue pointer of slot %d dci %d: %s\n",
+          dev.SlotID(), dci, err.Name());
+      dev.AbortRecovery(dci);
+      return err;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error OnEndpointStopped(Controller& xhc, const CommandCompletionEventTRB& trb,
+                          uintptr_t arg) {
+    const uint8_t dci = arg & 0xffu;
+    auto dev = xhc.DeviceManager()->FindBySlot(arg >> 8);
+    if (dev == nullptr) {
+      // 復旧の途中でスロットを無効にした
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    if (trb.bits.completion_code != kCompletionSuccess) {
+      // 止めようとした間にエラーで Halted になったなら，リセットからやり直す
+      if (trb.Pointer()->bits.trb_type == StopEndpointCommandTRB::Type && dev->IsHalted(dci)) {
+        return SubmitStopEndpoint(xhc, *dev, dci);
+      }
+      Log(kWarn, "failed to stop slot %d dci %d: completion code %d\n",
+          dev->SlotID(), dci, trb.bits.completion_code);
+    }
+    return MoveNextDequeue(xhc, *dev, dci);
+  }
+
+  Error OnDequeueMoved(Controller& xhc, const CommandCompletionEventTRB& trb,
+                       uintptr_t arg) {
+    const uint8_t dci = arg & 0xffu;
+    auto dev = xhc.DeviceManager()->FindBySlot(arg >> 8);
+    if (dev == nullptr) {
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    if (trb.bits.completion_code != kCompletionSuccess) {
+      Log(kWarn, "failed to set the dequeue pointer of slot %d dci %d: completion code %d\n",
+          dev->SlotID(), dci, trb.bits.completion_code);
+    }
+    return MoveNextDequeue(xhc, *dev, dci);
+  }
+
+  Error OnEndpointReadded(Controller& xhc, const CommandCompletionEventTRB& trb,
+                          uintptr_t arg) {
+    const uint8_t dci = arg & 0xffu;
+    auto dev = xhc.DeviceManager()->FindBySlot(arg >> 8);
+    if (dev == nullptr) {
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    if (trb.bits.completion_code != kCompletionSuccess) {
+      Log(kWarn, "failed to re-add slot %d dci %d: completion code %d\n",
+          dev->SlotID(), dci, trb.bits.completion_code);
+    }
+    dev->FinishRecovery(dci);
+    return StartEndpointRecovery(xhc, *dev);
+  }
+
+  /** 転送エラーやクラスドライバの ResetEndpoint() で要求されたエンドポイントの復旧を始める
+   *
+   * Reset Endpoint（Halted でなければ Stop Endpoint）の後，TD が残っているリングごとに
+   * Set TR Dequeue Pointer で xHC の位置を書き込み位置に移し，残っていた TD を取り消す．
+   * Halted でなかったエンドポイントは，最後に Configure Endpoint で加え直してデータトグルを戻す．
+   */
+  Error StartEndpointRecovery(Controller& xhc, Device& dev) {
+    Error result = MAKE_ERROR(Error::kSuccess);
+    while (const uint8_t dci = dev.StartRecovery()) {
+      if (auto err = SubmitStopEndpoint(xhc, dev, dci); err && !result) {
+        result = err;
+      }
+    }
+    return result;
+  }
+
   Error OnEvent(Controller& xhc, TransferEventTRB& trb) {
     const uint8_t slot_id = trb.bits.slot_id;
     auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
     if (dev == nullptr) {
       return MAKE_ERROR(Error::kInvalidSlotID);
     }
-    if (auto err = dev->OnTransferEventReceived(trb)) {
+    auto err = dev->OnTransferEventReceived(trb);
+    if (auto recovery_err = StartEndpointRecovery(xhc, *dev); recovery_err && !err) {
+      err = recovery_err;
+    }
+    if (auto hub = dev->Hub()) {
+      // ポートの状態変化はハブのインタラプト転送とコントロール転送の完了で進む
+      if (auto hub_err = ProcessHubEvents(xhc, *dev, *hub); hub_err && !err) {
+        err = hub_err;
+      }
+    }
+    if (err) {
       return err;
     }
 
-    const auto port_id = dev->DeviceContext()->slot_context.bits.root_hub_port_num;
     if (dev->IsInitialized() &&
-        port_config_phase[port_id] == ConfigPhase::kInitializingDevice) {
+        slot_config_phase[slot_id] == ConfigPhase::kInitializingDevice) {
       return ConfigureEndpoints(xhc, *dev);
     }
     return MAKE_ERROR(Error::kSuccess);
   }
 
   Error OnEvent(Controller& xhc, CommandCompletionEventTRB& trb) {
-    const auto issuer_type = trb.Pointer()->bits.trb_type;
-    const auto slot_id = trb.bits.slot_id;
     Log(kDebug, "CommandCompletionEvent: slot_id = %d, issuer = %s\n",
-        trb.bits.slot_id, kTRBTypeToName[issuer_type]);
-
-    if (issuer_type == EnableSlotCommandTRB::Type) {
-      if (port_config_phase[addressing_port] != ConfigPhase::kEnablingSlot) {
-        return MAKE_ERROR(Error::kInvalidPhase);
-      }
-
-      return AddressDevice(xhc, addressing_port, slot_id);
-    } else if (issuer_type == AddressDeviceCommandTRB::Type) {
-      auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
-      if (dev == nullptr) {
-        return MAKE_ERROR(Error::kInvalidSlotID);
-      }
-
-      auto port_id = dev->DeviceContext()->slot_context.bits.root_hub_port_num;
-
-      if (port_id != addressing_port) {
-        return MAKE_ERROR(Error::kInvalidPhase);
-      }
-      if (port_config_phase[port_id] != ConfigPhase::kAddressingDevice) {
-        return MAKE_ERROR(Error::kInvalidPhase);
-      }
-
-      addressing_port = 0;
-      for (int i = 0; i < port_config_phase.size(); ++i) {
-        if (port_config_phase[i] == ConfigPhase::kWaitingAddressed) {
-          auto port = xhc.PortAt(i);
-          if (auto err = ResetPort(xhc, port); err) {
-            return err;
-          }
-          break;
-        }
-      }
+        trb.bits.slot_id, kTRBTypeToName[trb.Pointer()->bits.trb_type]);
+    return xhc.Commands()->OnCompletion(xhc, trb);
+  }
 
-      return InitializeDevice(xhc, port_id, slot_id);
-    } else if (issuer_type == ConfigureEndpointCommandTRB::Type) {
-      auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
-      if (dev == nullptr) {
-        return MAKE_ERROR(Error::kInvalidSlotID);
-      }
+  /** xHC のレジスタの変化を待つ上限．Halt は 16 ms 以内だが，リセットには余裕を持たせる． */
+  const uint64_t kHandshakeTimeoutUs = 1000000;
 
-      auto port_id = dev->DeviceContext()->slot_context.bits.root_hub_port_num;
-      if (port_config_phase[port_id] != ConfigPhase::kConfiguringEndpoints) {
-        return MAKE_ERROR(Error::kInvalidPhase);
+  /** cond() が真になるまで最大 timeout_us マイクロ秒待つ．割り込み禁止中でも使える． */
+  template <typename F>
+  bool WaitUntil(F cond, uint64_t timeout_us) {
+    const uint64_t deadline = __builtin_ia32_rdtsc() + timeout_us * TSCPerMicrosecond();
+    while (!cond()) {
+      if (__builtin_ia32_rdtsc() >= deadline) {
+        return false;
       }
-
-      return CompleteConfiguration(xhc, port_id, slot_id);
+      __asm__("pause");
     }
-
-    return MAKE_ERROR(Error::kInvalidPhase);
+    return true;
   }
 
   void RequestHCOwnership(uintptr_t mmio_base, HCCPARAMS1_Bitmap hccp) {
@@ -321,13 +758,30 @@ namespace usb::xhci {
             cap_->HCSPARAMS1.Read().bits.max_ports)} {
   }
 
-  Error Controller::Initialize() {
+  Error Controller::Initialize(size_t num_interrupters) {
     if (auto err = devmgr_.Initialize(kDeviceSize)) {
       return err;
     }
+    devmgr_.SetMaxStreams(MaxStreams());
 
     RequestHCOwnership(mmio_base_, cap_->HCCPARAMS1.Read());
 
+    if (auto err = Reset()) {
+      return err;
+    }
+
+    const size_t max_interrupters = cap_->HCSPARAMS1.Read().bits.max_interrupters;
+    num_interrupters_ = std::min({num_interrupters, max_interrupters, kMaxInterrupters});
+    if (num_interrupters_ == 0) {
+      num_interrupters_ = 1;
+    }
+    Log(kInfo, "xHC: %lu interrupters (Max Interrupters %lu)\n",
+        num_interrupters_, max_interrupters);
+
+    return Configure();
+  }
+
+  Error Controller::Reset() {
     auto usbcmd = op_->USBCMD.Read();
     usbcmd.bits.interrupter_enable = false;
     usbcmd.bits.host_system_error_enable = false;
@@ -338,29 +792,42 @@ namespace usb::xhci {
     }
 
     op_->USBCMD.Write(usbcmd);
-    while (!op_->USBSTS.Read().bits.host_controller_halted);
+    if (!WaitUntil([this]{ return op_->USBSTS.Read().bits.host_controller_halted; },
+                   kHandshakeTimeoutUs)) {
+      return MAKE_ERROR(Error::kHostControllerNotHalted);
+    }
 
     // Reset controller
     usbcmd = op_->USBCMD.Read();
     usbcmd.bits.host_controller_reset = true;
     op_->USBCMD.Write(usbcmd);
-    while (op_->USBCMD.Read().bits.host_controller_reset);
-    while (op_->USBSTS.Read().bits.controller_not_ready);
+    if (!WaitUntil([this]{ return !op_->USBCMD.Read().bits.host_controller_reset &&
+                                  !op_->USBSTS.Read().bits.controller_not_ready; },
+                   kHandshakeTimeoutUs)) {
+      return MAKE_ERROR(Error::kTimeout);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
 
-    Log(kDebug, "MaxSlots: %u\n", cap_->HCSPARAMS1.Read().bits.max_device_slots);
+  Error Controller::Configure() {
+    const size_t max_slots = cap_->HCSPARAMS1.Read().bits.max_device_slots;
+    Log(kDebug, "MaxSlots: %lu\n", max_slots);
     // Set "Max Slots Enabled" field in CONFIG.
     auto config = op_->CONFIG.Read();
-    config.bits.max_device_slots_enabled = kDeviceSize;
+    config.bits.max_device_slots_enabled = std::min(kDeviceSize, max_slots);
     op_->CONFIG.Write(config);
 
     auto hcsparams2 = cap_->HCSPARAMS2.Read();
     const uint16_t max_scratchpad_buffers =
       hcsparams2.bits.max_scratchpad_buffers_low
       | (hcsparams2.bits.max_scratchpad_buffers_high << 5);
-    if (max_scratchpad_buffers > 0) {
-      auto scratchpad_buf_arr = AllocArray<void*>(max_scratchpad_buffers, 64, 4096);
+    // スクラッチパッドはリセットをまたいで使い回す
+    if (max_scratchpad_buffers > 0 && devmgr_.DeviceContexts()[0] == nullptr) {
+      auto scratchpad_buf_arr = AllocArray<void*>(
+          max_scratchpad_buffers, 64, 4096, memstat::Tag::kUSBContext);
       for (int i = 0; i < max_scratchpad_buffers; ++i) {
-        scratchpad_buf_arr[i] = AllocMem(4096, 4096, 4096);
+        scratchpad_buf_arr[i] =
+          AllocMem(4096, 4096, 4096, memstat::Tag::kUSBContext);
         Log(kDebug, "scratchpad buffer array %d = %p\n",
             i, scratchpad_buf_arr[i]);
       }
@@ -373,30 +840,83 @@ namespace usb::xhci {
     dcbaap.SetPointer(reinterpret_cast<uint64_t>(devmgr_.DeviceContexts()));
     op_->DCBAAP.Write(dcbaap);
 
-    auto primary_interrupter = &InterrupterRegisterSets()[0];
-    if (auto err = cr_.Initialize(32)) {
-        return err;
+    if (auto err = commands_.Initialize(&op_->CRCR, DoorbellRegisterAt(0))) {
+      return err;
     }
-    if (auto err = RegisterCommandRing(&cr_, &op_->CRCR)) {
-        return err; }
-    if (auto err = er_.Initialize(32, primary_interrupter)) {
+
+    for (uint16_t i = 0; i < num_interrupters_; ++i) {
+      if (auto err = InitializeInterrupter(i)) {
         return err;
+      }
     }
 
-    // Enable interrupt for the primary interrupter
-    auto iman = primary_interrupter->IMAN.Read();
-    iman.bits.interrupt_pending = true;
-    iman.bits.interrupt_enable = true;
-    primary_interrupter->IMAN.Write(iman);
-
     // Enable interrupt for the controller
-    usbcmd = op_->USBCMD.Read();
+    auto usbcmd = op_->USBCMD.Read();
     usbcmd.bits.interrupter_enable = true;
     op_->USBCMD.Write(usbcmd);
 
     return MAKE_ERROR(Error::kSuccess);
   }
 
+  Error Controller::InitializeInterrupter(uint16_t index) {
+    auto interrupter = &InterrupterRegisterSets()[index];
+
+    // ERST Max は 2 の冪の指数で表される
+    const size_t erst_max =
+      size_t{1} << cap_->HCSPARAMS2.Read().bits.event_ring_segment_table_max;
+    size_t events_wanted;
+    if (index == kPrimaryInterrupter) {
+      events_wanted = (max_ports_ + kDeviceSize) * kEventsPerPort;
+    } else {
+      // 二次インタラプタには転送イベントしか来ない
+      events_wanted = kDeviceSize * kEventsPerPort;
+    }
+    size_t num_segments =
+      (events_wanted + kEventRingSegmentSize - 1) / kEventRingSegmentSize;
+    num_segments = std::min(num_segments, erst_max);
+    if (auto err = er_[index].Initialize(kEventRingSegmentSize, num_segments, erst_max,
+                                         interrupter)) {
+      return err;
+    }
+    Log(kInfo, "interrupter %u: %lu segments x %lu TRBs (ERST Max %lu)\n",
+        index, er_[index].NumSegments(), kEventRingSegmentSize, erst_max);
+
+    moderators_[index].Initialize(interrupter, kDefaultModerationConfig);
+
+    auto iman = interrupter->IMAN.Read();
+    iman.bits.interrupt_pending = true;
+    iman.bits.interrupt_enable = true;
+    interrupter->IMAN.Write(iman);
+
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  void Controller::SetInterrupterEnabled(uint16_t index, bool enable) {
+    auto interrupter = &InterrupterRegisterSets()[index];
+    auto iman = interrupter->IMAN.Read();
+    iman.bits.interrupt_pending = true; // RW1C．保留中の割り込みも取り下げる
+    iman.bits.interrupt_enable = enable;
+    interrupter->IMAN.Write(iman);
+  }
+
+  bool Controller::IsInterrupterEnabled(uint16_t index) const {
+    return InterrupterRegisterSets()[index].IMAN.Read().bits.interrupt_enable;
+  }
+
+  uint16_t Controller::InterrupterFor(EndpointType type) const {
+    switch (type) {
+    case EndpointType::kInterrupt:
+      // HID のオブザーバはマウスカーソルなどを直接描画する．描画は BSP だけが行う前提なので，
+      // 二次インタラプタ（AP で処理される）には載せない
+      return kPrimaryInterrupter;
+    case EndpointType::kBulk:
+      // 大量の完了イベントで周期転送とコマンドの処理を遅らせないよう，別のリングに載せる
+      return num_interrupters_ > kBulkInterrupter ? kBulkInterrupter : kPrimaryInterrupter;
+    default:
+      return kPrimaryInterrupter;
+    }
+  }
+
   Error Controller::Run() {
     // Run the controller
     auto usbcmd = op_->USBCMD.Read();
@@ -413,6 +933,11 @@ namespace usb::xhci {
     return &DoorbellRegisters()[index];
   }
 
+  size_t Controller::MaxStreams() const {
+    const auto max_psa_size = cap_->HCCPARAMS1.Read().bits.maximum_primary_stream_array_size;
+    return max_psa_size == 0 ? 0 : size_t{1} << (max_psa_size + 1);
+  }
+
   Error ConfigurePort(Controller& xhc, Port& port) {
     if (port_config_phase[port.Number()] == ConfigPhase::kNotConnected) {
       return ResetPort(xhc, port);
@@ -430,8 +955,8 @@ namespace usb::xhci {
 
     auto slot_ctx = dev.InputContext()->EnableSlotContext();
     slot_ctx->bits.context_entries = 31;
-    const auto port_id{dev.DeviceContext()->slot_context.bits.root_hub_port_num};
-    const int port_speed{xhc.PortAt(port_id).Speed()};
+    // ハブの下のデバイスもあるので，ルートポートではなくスロットの速度を見る
+    const int port_speed = dev.DeviceContext()->slot_context.bits.speed;
     if (port_speed == 0 || port_speed > kSuperSpeedPlus) {
       return MAKE_ERROR(Error::kUnknownXHCISpeedID);
     }
@@ -463,44 +988,257 @@ namespace usb::xhci {
         ep_ctx->bits.ep_type = configs[i].ep_id.IsIn() ? 7 : 3;
         break;
       }
+      dev.SetInterrupterTarget(ep_dci, xhc.InterrupterFor(configs[i].ep_type));
       ep_ctx->bits.max_packet_size = configs[i].max_packet_size;
       ep_ctx->bits.interval = convert_interval(configs[i].ep_type, configs[i].interval);
       ep_ctx->bits.average_trb_length = 1;
 
-      auto tr = dev.AllocTransferRing(ep_dci, 32);
-      ep_ctx->SetTransferRingBuffer(tr->Buffer());
+      const size_t num_streams = configs[i].ep_type == EndpointType::kBulk
+        ? dev.StreamsFor(configs[i].max_streams) : 0;
+
+      if (num_streams > 0) {
+        // ストリームを使うエンドポイントの TR Dequeue Pointer は Stream Context の配列を指す
+        auto stream_ctx = dev.AllocStreams(ep_dci, num_streams);
+        if (stream_ctx == nullptr) {
+          return MAKE_ERROR(Error::kNoEnoughMemory);
+        }
+        ep_ctx->bits.tr_dequeue_pointer = reinterpret_cast<uint64_t>(stream_ctx) >> 4;
+        ep_ctx->bits.dequeue_cycle_state = 0;
+        ep_ctx->bits.max_primary_streams = MostSignificantBit(num_streams) - 1;
+        ep_ctx->bits.linear_stream_array = 1;
+      } else {
+        const bool streaming = configs[i].ep_type == EndpointType::kBulk ||
+                               configs[i].ep_type == EndpointType::kIsochronous;
+        auto tr = dev.AllocTransferRing(
+            ep_dci, streaming ? kStreamingRingSegmentSize : kSmallRingSegmentSize);
+        if (tr == nullptr) {
+          return MAKE_ERROR(Error::kNoEnoughMemory);
+        }
+        ep_ctx->SetTransferRingBuffer(tr->Buffer());
 
-      ep_ctx->bits.dequeue_cycle_state = 1;
-      ep_ctx->bits.max_primary_streams = 0;
+        ep_ctx->bits.dequeue_cycle_state = 1;
+        ep_ctx->bits.max_primary_streams = 0;
+      }
       ep_ctx->bits.mult = 0;
       ep_ctx->bits.error_count = 3;
     }
 
-    port_config_phase[port_id] = ConfigPhase::kConfiguringEndpoints;
+    slot_config_phase[dev.SlotID()] = ConfigPhase::kConfiguringEndpoints;
 
     ConfigureEndpointCommandTRB cmd{dev.InputContext(), dev.SlotID()};
-    xhc.CommandRing()->Push(cmd);
-    xhc.DoorbellRegisterAt(0)->Ring(0);
+    if (auto [ trb, err ] = xhc.Commands()->Submit(cmd, OnEndpointsConfigured, dev.SlotID()); err) {
+      return err;
+    }
 
     return MAKE_ERROR(Error::kSuccess);
   }
 
+  namespace {
+    /** xHC をリセットし，接続中のデバイスをすべて捨ててからポートの列挙をやり直す */
+    Error ResetController(Controller& xhc) {
+      Log(kError, "xHC: resetting the controller\n");
+      if (auto err = xhc.Reset()) {
+        return err;
+      }
+
+      // リセットでスロットはすべて無効になった．状態を戻してから，完了しないコマンドを失敗させる
+      for (auto& phase : port_config_phase) {
+        phase = ConfigPhase::kNotConnected;
+      }
+      for (auto& phase : slot_config_phase) {
+        phase = ConfigPhase::kNotConnected;
+      }
+      addressing = Attachment{};
+      xhc.Commands()->FailAll(xhc);
+      auto devmgr = xhc.DeviceManager();
+      for (size_t slot_id = 1; slot_id <= devmgr->MaxSlots(); ++slot_id) {
+        devmgr->Remove(slot_id);
+      }
+
+      std::array<ModerationConfig, Controller::kMaxInterrupters> moderation;
+      for (uint16_t i = 0; i < xhc.NumInterrupters(); ++i) {
+        moderation[i] = xhc.ModeratorAt(i).Config();
+      }
+      if (auto err = xhc.Configure()) {
+        return err;
+      }
+      for (uint16_t i = 0; i < xhc.NumInterrupters(); ++i) {
+        xhc.ConfigureModeration(i, moderation[i]);
+      }
+      if (auto err = xhc.Run()) {
+        return err;
+      }
+
+      for (int i = 1; i <= xhc.MaxPorts(); ++i) {
+        auto port = xhc.PortAt(i);
+        if (port.IsConnected()) {
+          if (auto err = ConfigurePort(xhc, port)) {
+            Log(kError, "failed to configure port %d after reset: %s\n", i, err.Name());
+          }
+        }
+      }
+      return MAKE_ERROR(Error::kSuccess);
+    }
+
+    Error HandleEvent(Controller& xhc, TRB* event_trb) {
+      if (auto trb = TRBDynamicCast<TransferEventTRB>(event_trb)) {
+        return OnEvent(xhc, *trb);
+      } else if (auto trb = TRBDynamicCast<PortStatusChangeEventTRB>(event_trb)) {
+        return OnEvent(xhc, *trb);
+      } else if (auto trb = TRBDynamicCast<CommandCompletionEventTRB>(event_trb)) {
+        return OnEvent(xhc, *trb);
+      }
+      return MAKE_ERROR(Error::kNotImplemented);
+    }
+  }
+
+  Error CheckCommandTimeouts(Controller& xhc, uint64_t now_tick) {
+    {
+      IRQSaveLockGuard guard{xhc.StateLock()};
+      const bool alive = xhc.Commands()->CheckTimeouts(now_tick);
+      xhc.Commands()->Flush();
+      if (alive) {
+        return MAKE_ERROR(Error::kSuccess);
+      }
+    }
+
+    // リセットのハンドシェイクは秒単位かかり得るので，割り込みを禁止したままにはしない．
+    // 先に全インタラプタの割り込みを止め，他の CPU が読み出し中のリングを抜けてから作り直す．
+    // ここで取るロックは割り込みハンドラからは取られない（AP のハンドラは待つだけ）．
+    std::array<bool, Controller::kMaxInterrupters> enabled{};
+    for (uint16_t i = 0; i < xhc.NumInterrupters(); ++i) {
+      enabled[i] = xhc.IsInterrupterEnabled(i);
+      xhc.SetInterrupterEnabled(i, false);
+    }
+    for (uint16_t i = 0; i < xhc.NumInterrupters(); ++i) {
+      xhc.InterrupterLock(i).Lock();
+    }
+    xhc.StateLock().Lock();
+    auto err = ResetController(xhc);
+    xhc.Commands()->Flush();
+    xhc.StateLock().Unlock();
+    for (uint16_t i = xhc.NumInterrupters(); i > 0; --i) {
+      xhc.InterrupterLock(i - 1).Unlock();
+    }
+    // Configure() は全インタラプタの割り込みを許可するので，ポーリング中のものはマスクに戻す
+    for (uint16_t i = 0; i < xhc.NumInterrupters(); ++i) {
+      xhc.SetInterrupterEnabled(i, enabled[i]);
+    }
+    return err;
+  }
+
+  Error ProcessHubTimers(Controller& xhc, uint64_t now_tick) {
+    IRQSaveLockGuard guard{xhc.StateLock()};
+    Error result = MAKE_ERROR(Error::kSuccess);
+    auto devmgr = xhc.DeviceManager();
+    for (size_t slot_id = 1; slot_id <= devmgr->MaxSlots(); ++slot_id) {
+      auto dev = devmgr->FindBySlot(slot_id);
+      if (dev == nullptr || dev->Hub() == nullptr || !dev->Hub()->IsWaitingPowerGood()) {
+        continue;
+      }
+      auto hub = dev->Hub();
+      hub->OnTick(now_tick);
+      if (auto err = ProcessHubEvents(xhc, *dev, *hub); err && !result) {
+        result = err;
+      }
+    }
+    xhc.Commands()->Flush();
+    return result;
+  }
+
   Error ProcessEvent(Controller& xhc) {
-    if (!xhc.PrimaryEventRing()->HasFront()) {
+    auto er = xhc.PrimaryEventRing();
+    if (!er->HasFront()) {
       return MAKE_ERROR(Error::kSuccess);
     }
 
-    Error err = MAKE_ERROR(Error::kNotImplemented);
-    auto event_trb = xhc.PrimaryEventRing()->Front();
-    if (auto trb = TRBDynamicCast<TransferEventTRB>(event_trb)) {
-      err = OnEvent(xhc, *trb);
-    } else if (auto trb = TRBDynamicCast<PortStatusChangeEventTRB>(event_trb)) {
-      err = OnEvent(xhc, *trb);
-    } else if (auto trb = TRBDynamicCast<CommandCompletionEventTRB>(event_trb)) {
-      err = OnEvent(xhc, *trb);
+    IRQSaveLockGuard ring_guard{xhc.InterrupterLock(Controller::kPrimaryInterrupter)};
+    Error err = MAKE_ERROR(Error::kSuccess);
+    {
+      IRQSaveLockGuard guard{xhc.StateLock()};
+      err = HandleEvent(xhc, er->Front());
+      xhc.Commands()->Flush();
     }
-    xhc.PrimaryEventRing()->Pop();
+    er->Pop();
+    er->UpdateDequeuePointer();
 
     return err;
   }
+
+  size_t DrainEvents(Controller& xhc, uint16_t interrupter, size_t max_events,
+                     LatencyHistogram* latency, uint64_t origin_tsc) {
+    auto er = xhc.EventRingAt(interrupter);
+    // 長いバッチの途中でも xHC が空きを見失わないよう，リングの 1/4 ごとに ERDP を進める
+    const size_t update_interval = std::max<size_t>(er->Capacity() / 4, 1);
+
+    // 処理中に再投入される転送（インタラプト転送の再開など）のドアベルをバッチの最後までまとめる．
+    // batch はこの呼び出し専用で，登録するのは StateLock() を持って HandleEvent() する間だけ．
+    DoorbellBatch batch;
+
+    // リングの読み出しはこのインタラプタのロックだけで行い，他のインタラプタの処理を待たない．
+    // 共有するのはハンドラが触るコマンドとデバイスの状態（StateLock()）だけ．
+    auto& ring_lock = xhc.InterrupterLock(interrupter);
+    size_t num_events = 0;
+    while (num_events < max_events) {
+      Error err = MAKE_ERROR(Error::kSuccess);
+      {
+        IRQSaveLockGuard ring_guard{ring_lock};
+        // 待っている間に ResetController() がリングを作り直していることがある
+        if (!er->HasFront()) {
+          break;
+        }
+        if (latency) {
+          latency->Record(__builtin_ia32_rdtsc() - origin_tsc);
+        }
+        {
+          IRQSaveLockGuard guard{xhc.StateLock()};
+          xhc.DeviceManager()->SetBatch(&batch);
+          err = HandleEvent(xhc, er->Front());
+          xhc.DeviceManager()->SetBatch(nullptr);
+        }
+        er->Pop();
+
+        ++num_events;
+        if (num_events % update_interval == 0) {
+          er->UpdateDequeuePointer();
+        }
+      }
+      if (err) {
+        Log(kError, "Error while ProcessEvent: %s at %s:%d\n",
+            err.Name(), err.File(), err.Line());
+      }
+    }
+
+    // バッチ中に積まれた転送とコマンドのドアベルを，エンドポイントごとに 1 回ずつ鳴らす
+    {
+      IRQSaveLockGuard guard{xhc.StateLock()};
+      xhc.DeviceManager()->Flush(batch);
+      xhc.Commands()->Flush();
+    }
+
+    // イベントが無かった場合も Event Handler Busy を下ろすために書く
+    IRQSaveLockGuard ring_guard{ring_lock};
+    er->UpdateDequeuePointer();
+    return num_events;
+  }
+
+  size_t ProcessEvents(Controller& xhc, uint16_t interrupter) {
+    const size_t num_events = DrainEvents(xhc, interrupter, SIZE_MAX, nullptr, 0);
+    xhc.ModeratorAt(interrupter).OnEventsProcessed(num_events);
+    return num_events;
+  }
+
+  void LogInterrupterStats(Controller& xhc, LogLevel level) {
+    for (uint16_t i = 0; i < xhc.NumInterrupters(); ++i) {
+      LogModerationStat(level, i, xhc.ModeratorAt(i));
+    }
+  }
+
+  void LogDoorbellStats(Controller& xhc, LogLevel level) {
+    IRQSaveLockGuard guard{xhc.StateLock()};
+    const auto transfer = xhc.DeviceManager()->Doorbells();
+    const auto& command = xhc.Commands()->Stat();
+    Log(level, "doorbells: transfer %lu requests / %lu writes, command %lu submitted / %lu writes\n",
+        transfer.requests, transfer.writes, command.submitted, command.doorbells);
+  }
 }
@@ -6,10 +6,17 @@
 
 #pragma once
 
+#include <array>
+
 #include "error.hpp"
+#include "lock.hpp"
+#include "usb/endpoint.hpp"
 #include "usb/xhci/registers.hpp"
 #include "usb/xhci/context.hpp"
 #include "usb/xhci/ring.hpp"
+#include "usb/xhci/command.hpp"
+#include "usb/xhci/moderation.hpp"
+#include "usb/xhci/latency.hpp"
 #include "usb/xhci/port.hpp"
 #include "usb/xhci/devmgr.hpp"
 
@@ -18,21 +25,77 @@ namespace usb::xhci
     class Controller
     {
     public:
+        /** @brief 使うインタラプタの最大数 */
+        static const size_t kMaxInterrupters = 2;
+        /** @brief コマンド完了，ポート状態変化，コントロール／インタラプト転送を受け取るインタラプタ
+         *
+         * BSP のメインループで処理する．HID のように処理の中で画面を描くものはここに載せる．
+         */
+        static const uint16_t kPrimaryInterrupter = 0;
+        /** @brief バルク転送（ストレージなど）を受け取るインタラプタ */
+        static const uint16_t kBulkInterrupter = 1;
+
         Controller(uintptr_t mmio_base);
-        Error Initialize();
+        /** @brief xHC をリセットし，コマンドリングと各インタラプタのイベントリングを設定する
+         *
+         * @param num_interrupters  使いたいインタラプタ数．HCSPARAMS1 の Max Interrupters と
+         *                          kMaxInterrupters で切り詰められる．MSI-X のベクタを
+         *                          インタラプタごとに用意できないなら 1 にすること．
+         */
+        Error Initialize(size_t num_interrupters = 1);
+        /** @brief xHC を止めてリセットする．レジスタの設定はすべて失われる． */
+        Error Reset();
+        /** @brief リセット後の xHC にスロット数，DCBAA，コマンドリング，イベントリングを設定する */
+        Error Configure();
         Error Run();
-        Ring *CommandRing() { return &cr_; }
-        EventRing *PrimaryEventRing() { return &er_; }
+        /** @brief コマンドの発行．Submit() の後，DrainEvents() の最後にまとめてドアベルを鳴らす． */
+        CommandQueue *Commands() { return &commands_; }
+        EventRing *PrimaryEventRing() { return &er_[kPrimaryInterrupter]; }
+        EventRing *EventRingAt(size_t interrupter) { return &er_[interrupter]; }
+        size_t NumInterrupters() const { return num_interrupters_; }
+        /** @brief 指定の種類のエンドポイントの転送イベントを受け取るインタラプタ番号 */
+        uint16_t InterrupterFor(EndpointType type) const;
+        /** @brief インタラプタの割り込みを許可／禁止する．禁止中もイベントはリングに溜まる． */
+        void SetInterrupterEnabled(uint16_t interrupter, bool enable);
+        bool IsInterrupterEnabled(uint16_t interrupter) const;
+        /** @brief インタラプタの割り込みモデレーションの設定と統計 */
+        Moderator &ModeratorAt(uint16_t interrupter) { return moderators_[interrupter]; }
+        void ConfigureModeration(uint16_t interrupter, const ModerationConfig &config)
+        {
+            moderators_[interrupter].Configure(config);
+        }
+        /** @brief インタラプタのイベントリングの読み出しと ERDP の更新を排他するロック
+         *
+         * インタラプタごとに別なので，異なるインタラプタは別の CPU から同時に読み出せる．
+         */
+        SpinLock &InterrupterLock(uint16_t interrupter) { return interrupter_locks_[interrupter]; }
+        /** @brief コマンドキューとデバイス管理の状態を CPU 間で排他するロック
+         *
+         * イベントのハンドラはこれを持って呼ばれる．InterrupterLock() と両方持つときは
+         * InterrupterLock() を先に取る．
+         */
+        SpinLock &StateLock() { return state_lock_; }
         DoorbellRegister *DoorbellRegisterAt(uint8_t index);
         Port PortAt(uint8_t port_num)
         {
             return Port{port_num, PortRegisterSets()[port_num - 1]};
         }
         uint8_t MaxPorts() const { return max_ports_; }
+        /** @brief エンドポイントあたりに使える Primary Stream の数．0 ならストリーム非対応． */
+        size_t MaxStreams() const;
         DeviceManager *DeviceManager() { return &devmgr_; }
 
     private:
-        static const size_t kDeviceSize = 8;
+        /** @brief 有効にするスロット数の上限．ハブの下に多くのデバイスをつなげるよう多めにとる． */
+        static const size_t kDeviceSize = 32;
+        /** @brief Event Ring の 1 セグメントあたりの TRB 数（4 KiB） */
+        static const size_t kEventRingSegmentSize = 256;
+        /** @brief ポートごとに溜まり得るイベント数の見積もり
+         *
+         * ポート状態変化と，デバイスの全エンドポイントの転送完了が同時に来ても
+         * Event Ring が溢れない（xHC が止まらない）ようにセグメント数を決める．
+         */
+        static const size_t kEventsPerPort = 64;
 
         const uintptr_t mmio_base_;
         CapabilityRegisters *const cap_;
@@ -40,8 +103,15 @@ namespace usb::xhci
         const uint8_t max_ports_;
 
         class DeviceManager devmgr_;
-        Ring cr_;
-        EventRing er_;
+        CommandQueue commands_;
+        std::array<EventRing, kMaxInterrupters> er_;
+        std::array<Moderator, kMaxInterrupters> moderators_;
+        size_t num_interrupters_ = 1;
+        std::array<SpinLock, kMaxInterrupters> interrupter_locks_;
+        SpinLock state_lock_;
+
+        /** @brief インタラプタのイベントリングを確保し，割り込みを有効にする */
+        Error InitializeInterrupter(uint16_t index);
 
         InterrupterRegisterSetArray InterrupterRegisterSets() const
         {
@@ -62,6 +132,21 @@ namespace usb::xhci
     Error ConfigurePort(Controller &xhc, Port &port);
     Error ConfigureEndpoints(Controller &xhc, Device &dev);
 
+    /** @brief 期限を過ぎたコマンドを中止する．ロックは自身で取るので，何も持たずに呼ぶ．
+     *
+     * 中止してもコマンドリングが止まらなければ，実行中のコマンドをすべて失敗させ，
+     * xHC をリセットして接続中のデバイスを列挙し直す．リセットは割り込みを許可したまま
+     * 行うので，割り込みハンドラでロックを取らない CPU（BSP のメインループ）から呼ぶこと．
+     * 破棄するデバイスのクラスドライバには ClassDriver::OnRemoved() で知らせる．
+     */
+    Error CheckCommandTimeouts(Controller &xhc, uint64_t now_tick);
+
+    /** @brief 電源の安定を待っているハブのうち，期限を過ぎたものを再開する．ロックは自身で取る．
+     *
+     * usb::HubDriver::NumWaitingPowerGood() が 0 でない間，LAPIC タイマの tick ごとに呼ぶ．
+     */
+    Error ProcessHubTimers(Controller &xhc, uint64_t now_tick);
+
     /** @brief イベントリングに登録されたイベントを高々1つ処理する．
    *
    * xhc のプライマリイベントリングの先頭のイベントを処理する．
@@ -70,4 +155,31 @@ namespace usb::xhci
    * @return イベントを正常に処理できたら Error::kSuccess
    */
     Error ProcessEvent(Controller &xhc);
+
+    /** @brief インタラプタのイベントリングに溜まっているイベントをすべて処理する．
+     *
+     * 処理中の ERDP への書き込みはバッチの終わりにまとめて 1 回行う
+     * （リングが大きければ途中でも数回）．処理中に積まれた転送とコマンドの
+     * ドアベルも最後にまとめて鳴らす．個々のイベントのエラーはログに出す．
+     * 異なるインタラプタを別の CPU から同時に処理してよい．
+     * 1 回の割り込みにつき 1 回呼ぶこと（割り込みモデレーションの統計に使う）．
+     *
+     * @return 処理したイベントの数
+     */
+    size_t ProcessEvents(Controller &xhc, uint16_t interrupter = Controller::kPrimaryInterrupter);
+
+    /** @brief ProcessEvents() と同じくイベントを処理するが，処理するのは高々 max_events 個で，
+     * 割り込みモデレーションの統計には数えない．ポーリングで使う．
+     *
+     * @param latency     非 nullptr なら，各イベントの処理開始時刻と origin_tsc の差を記録する
+     * @param origin_tsc  イベントに最初に気付けた時刻（割り込みの受信や前回の確認の時刻）
+     */
+    size_t DrainEvents(Controller &xhc, uint16_t interrupter, size_t max_events,
+                       LatencyHistogram *latency, uint64_t origin_tsc);
+
+    /** @brief 全インタラプタの割り込み回数，イベント数，IMOD 間隔をログに出す */
+    void LogInterrupterStats(Controller &xhc, LogLevel level);
+
+    /** @brief 転送とコマンドについて，ドアベルの要求回数と実際の書き込み回数をログに出す */
+    void LogDoorbellStats(Controller &xhc, LogLevel level);
 }